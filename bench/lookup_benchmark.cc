@@ -0,0 +1,599 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Microbenchmarks of the lookup request path. Arguments are named after
+// the request and dataset shape they model:
+//
+//   keys      keys per request
+//   value     bytes of creative data per key
+//   hit_pct   percentage of requested keys present in the map
+//   map       number of keys in the map
+//   compressed  whether the map holds values compressed, as with
+//             --compress_values
+//   traced    whether every request is recorded by the flight recorder
+//   hot       whether the hottest creatives are laid out together, as
+//             refreshes do with --hot_creative_bytes
+//   replica   whether lookups read a copy of the snapshot in their own
+//             NUMA node's memory, as with --numa_replicas, or one in the
+//             memory of another node
+//
+// Emit JSON for regression tracking by passing
+//   --benchmark_out=/tmp/lookup.json --benchmark_out_format=json
+// to `bazel run -c opt //bench:lookup_benchmark --`.
+
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "absl/flags/declare.h"
+#include "absl/flags/flag.h"
+#include "absl/random/zipf_distribution.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "benchmark/benchmark.h"
+#include "data/creative_json.h"
+#include "data/creative_snapshot.h"
+#include "data/key_popularity.h"
+#include "data/mock_creative_map.h"
+#include "data/numa_topology.h"
+#include "data/synthetic_dataset.h"
+#include "google/protobuf/util/json_util.h"
+#include "proto/response.pb.h"
+#include "server/compression.h"
+#include "server/flight_recorder.h"
+#include "server/query_params.h"
+#include "server/request_handler.h"
+#include "server/response_body.h"
+#include "server/response_cache.h"
+
+ABSL_DECLARE_FLAG(bool, compress_values);
+
+namespace trusted_server {
+
+namespace {
+
+// Number of distinct requests cycled through by each benchmark, so
+// lookups are not all served from the same few cache lines.
+constexpr size_t kNumRequests = 1024;
+
+// Returns the i-th key of every map. Synthetic keys depend on neither
+// the size of the map nor its values.
+std::string Key(size_t index) {
+  static const auto* dataset =
+      new SyntheticDataset(SyntheticDataset::Options());
+  return dataset->Key(index);
+}
+
+// Returns a key that is not in a map of `map_size` keys.
+std::string MissingKey(size_t index, size_t map_size) {
+  return Key(map_size + index);
+}
+
+// Returns a map of the given shape, shared by all benchmarks using it.
+const CreativeMap& GetMap(size_t map_size, size_t value_size,
+                          bool compressed = false) {
+  static auto* maps =
+      new std::map<std::tuple<size_t, size_t, bool>,
+                   std::shared_ptr<MockCreativeMap>>();
+  auto& creative_map = (*maps)[{map_size, value_size, compressed}];
+  if (creative_map == nullptr) {
+    SyntheticDataset::Options options;
+    options.num_keys = map_size;
+    options.value_bytes = {SizeDistribution::Kind::kFixed,
+                           static_cast<double>(value_size)};
+    absl::SetFlag(&FLAGS_compress_values, compressed);
+    creative_map = MockCreativeMap::CreateSyntheticMap(options);
+    absl::SetFlag(&FLAGS_compress_values, false);
+  }
+  return *creative_map;
+}
+
+// Returns kNumRequests key lists of `num_keys` keys each, of which
+// `hit_pct` percent on average are in a map of `map_size` keys.
+std::vector<std::vector<std::string>> MakeRequests(size_t num_keys,
+                                                   int hit_pct,
+                                                   size_t map_size) {
+  std::mt19937_64 random(42);
+  std::uniform_int_distribution<size_t> key_index(0, map_size - 1);
+  std::uniform_int_distribution<int> percent(0, 99);
+  std::vector<std::vector<std::string>> requests(kNumRequests);
+  for (auto& keys : requests) {
+    for (size_t i = 0; i < num_keys; ++i) {
+      size_t index = key_index(random);
+      keys.push_back(percent(random) < hit_pct ? Key(index)
+                                               : MissingKey(index, map_size));
+    }
+  }
+  return requests;
+}
+
+// Returns `num_requests` key lists of `num_keys` keys each, drawn from
+// a map of `map_size` keys with the Zipfian popularity of ad traffic,
+// as tools/loadgen draws them by default.
+std::vector<std::vector<std::string>> MakeZipfRequests(size_t num_requests,
+                                                       size_t num_keys,
+                                                       size_t map_size) {
+  std::mt19937_64 random(42);
+  absl::zipf_distribution<size_t> key_index(map_size - 1, 1.1);
+  std::vector<std::vector<std::string>> requests(num_requests);
+  for (auto& keys : requests) {
+    for (size_t i = 0; i < num_keys; ++i) {
+      keys.push_back(Key(key_index(random)));
+    }
+  }
+  return requests;
+}
+
+std::vector<std::string> MakeTargets(
+    const std::vector<std::vector<std::string>>& requests) {
+  std::vector<std::string> targets;
+  for (const auto& keys : requests) {
+    targets.push_back("/?keys=" + absl::StrJoin(keys, ","));
+  }
+  return targets;
+}
+
+// Full argument product for benchmarks over the map.
+void MapArgs(benchmark::internal::Benchmark* benchmark) {
+  benchmark->ArgNames({"keys", "value", "hit_pct", "map"})
+      ->ArgsProduct({{1, 10, 100}, {64, 1024}, {50, 100}, {1000, 100000}});
+}
+
+// CreativeMap::Lookup, which builds the response proto.
+void BM_Lookup(benchmark::State& state) {
+  const CreativeMap& creative_map = GetMap(state.range(3), state.range(1));
+  auto requests = MakeRequests(state.range(0), state.range(2), state.range(3));
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(creative_map.Lookup(requests[i++ % kNumRequests]));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Lookup)->Apply(MapArgs);
+
+// Lookup followed by the proto JSON serialization it used to be served
+// with, as a baseline for the pre-rendered path below.
+void BM_LookupProtoJson(benchmark::State& state) {
+  const CreativeMap& creative_map = GetMap(state.range(3), state.range(1));
+  auto requests = MakeRequests(state.range(0), state.range(2), state.range(3));
+  size_t i = 0;
+  std::string json;
+  for (auto _ : state) {
+    json.clear();
+    google::protobuf::util::MessageToJsonString(
+        creative_map.Lookup(requests[i++ % kNumRequests]), &json);
+    benchmark::DoNotOptimize(json);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_LookupProtoJson)->Apply(MapArgs);
+
+// Arguments for the snapshot lookups below; the larger map does not
+// fit in the last level cache, so most probes miss it.
+void ProbeArgs(benchmark::internal::Benchmark* benchmark) {
+  benchmark->ArgNames({"keys", "value", "hit_pct", "map"})
+      ->ArgsProduct({{10, 50, 200}, {64}, {100}, {100000, 2000000}});
+}
+
+std::vector<std::vector<absl::string_view>> KeyViews(
+    const std::vector<std::vector<std::string>>& requests) {
+  std::vector<std::vector<absl::string_view>> views;
+  for (const auto& keys : requests) {
+    views.emplace_back(keys.begin(), keys.end());
+  }
+  return views;
+}
+
+// CreativeSnapshot::Find() on each key of a request in turn, as a
+// baseline for FindBatch().
+void BM_SnapshotFind(benchmark::State& state) {
+  auto snapshot = GetMap(state.range(3), state.range(1)).snapshot();
+  auto requests = MakeRequests(state.range(0), state.range(2), state.range(3));
+  size_t i = 0;
+  for (auto _ : state) {
+    for (const std::string& key : requests[i++ % kNumRequests]) {
+      benchmark::DoNotOptimize(snapshot->Find(key));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SnapshotFind)->Apply(ProbeArgs);
+
+// CreativeSnapshot::FindBatch() on all keys of a request.
+void BM_SnapshotFindBatch(benchmark::State& state) {
+  auto snapshot = GetMap(state.range(3), state.range(1)).snapshot();
+  auto requests = KeyViews(
+      MakeRequests(state.range(0), state.range(2), state.range(3)));
+  std::vector<absl::optional<CreativeView>> results(state.range(0));
+  size_t i = 0;
+  for (auto _ : state) {
+    snapshot->FindBatch(requests[i++ % kNumRequests], absl::MakeSpan(results));
+    benchmark::DoNotOptimize(results.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SnapshotFindBatch)->Apply(ProbeArgs);
+
+// Looking up the keys of Zipfian requests and copying out their JSON,
+// as writing the response does, with the hottest creatives laid out
+// together or left where they were loaded. Popularity is learnt from
+// the requests replayed. Requests are many more than kNumRequests, so
+// the tail of the distribution keeps missing the caches as it would
+// in production.
+void BM_ZipfSnapshotLookup(benchmark::State& state) {
+  constexpr size_t kNumZipfRequests = 1 << 14;
+  auto snapshot = GetMap(state.range(2), state.range(1)).snapshot();
+  auto requests =
+      MakeZipfRequests(kNumZipfRequests, state.range(0), state.range(2));
+  if (state.range(3)) {
+    KeyPopularity popularity((KeyPopularity::Options()));
+    for (const auto& keys : requests) {
+      for (const std::string& key : keys) popularity.Record(key);
+    }
+    std::vector<HotKey> hottest =
+        popularity.Hottest(popularity.options().tracked_keys);
+    std::vector<absl::string_view> hot_keys;
+    for (const HotKey& hot : hottest) hot_keys.push_back(hot.key);
+    snapshot = snapshot->WithHotKeys(hot_keys, size_t{32} << 20);
+  }
+  auto views = KeyViews(requests);
+  std::vector<absl::optional<CreativeView>> results(state.range(0));
+  std::string out;
+  size_t i = 0;
+  for (auto _ : state) {
+    snapshot->FindBatch(views[i++ % kNumZipfRequests],
+                        absl::MakeSpan(results));
+    out.clear();
+    for (const auto& creative : results) {
+      if (!creative.has_value()) continue;
+      out.append(creative->key_json.data(), creative->key_json.size());
+      out.append(creative->json.data(), creative->json.size());
+    }
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  state.counters["hot_keys"] = snapshot->hot_keys();
+}
+BENCHMARK(BM_ZipfSnapshotLookup)
+    ->ArgNames({"keys", "value", "map", "hot"})
+    ->ArgsProduct({{10, 50}, {256}, {1000000}, {0, 1}});
+
+// Counts the loads of the calling thread that another NUMA node's memory
+// serves, where the CPU and kernel let perf count them.
+class RemoteLoadCounter {
+ public:
+  RemoteLoadCounter() {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_NODE |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+  ~RemoteLoadCounter() {
+    if (fd_ >= 0) close(fd_);
+  }
+
+  bool available() const { return fd_ >= 0; }
+
+  void Start() {
+    ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  uint64_t Stop() {
+    ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t count = 0;
+    if (read(fd_, &count, sizeof(count)) != sizeof(count)) return 0;
+    return count;
+  }
+
+ private:
+  int fd_;
+};
+
+// Returns the share of the creatives `snapshot` returns for `requests`
+// whose JSON is in the memory of another node than `node`.
+double RemoteCreativeShare(
+    const CreativeSnapshot& snapshot,
+    const std::vector<std::vector<absl::string_view>>& requests, int node) {
+  std::vector<void*> pages;
+  for (const auto& keys : requests) {
+    std::vector<absl::optional<CreativeView>> results(keys.size());
+    snapshot.FindBatch(keys, absl::MakeSpan(results));
+    for (const auto& creative : results) {
+      if (creative.has_value()) {
+        pages.push_back(const_cast<char*>(creative->json.data()));
+      }
+    }
+  }
+  // With no target nodes, move_pages() only reports where pages are.
+  std::vector<int> nodes(pages.size());
+  if (pages.empty() || syscall(SYS_move_pages, 0, pages.size(), pages.data(),
+                               nullptr, nodes.data(), 0) != 0) {
+    return 0;
+  }
+  const int id = NumaTopology::Get().id(node);
+  size_t remote = 0;
+  for (int page_node : nodes) remote += page_node >= 0 && page_node != id;
+  return static_cast<double>(remote) / pages.size();
+}
+
+// Uniformly random lookups, copying out their JSON, from a thread bound
+// to the last NUMA node. They read either a copy of the snapshot made on
+// that node, as --numa_replicas keeps, or one made on the first node, as
+// the threads of every other node read without it. Requests are many
+// more than kNumRequests so the creatives do not fit in the caches.
+// `remote_loads` counts the loads per lookup the other node served, if
+// perf can count them, and `remote_pct` the creatives read from its
+// memory. On a machine with one node both copies are local.
+void BM_NumaSnapshotLookup(benchmark::State& state) {
+  constexpr size_t kNumNumaRequests = 1 << 15;
+  const NumaTopology& topology = NumaTopology::Get();
+  const int node = topology.num_nodes() - 1;
+  auto snapshot = GetMap(state.range(2), state.range(1)).snapshot();
+  std::shared_ptr<const CreativeSnapshot> copy;
+  std::thread([&] {
+    topology.BindToNode(state.range(3) ? node : 0);
+    copy = snapshot->Replicate(nullptr, nullptr);
+  }).join();
+
+  std::mt19937_64 random(42);
+  std::uniform_int_distribution<size_t> key_index(0, state.range(2) - 1);
+  std::vector<std::vector<std::string>> requests(kNumNumaRequests);
+  for (auto& keys : requests) {
+    for (int i = 0; i < state.range(0); ++i) {
+      keys.push_back(Key(key_index(random)));
+    }
+  }
+  auto views = KeyViews(requests);
+  std::vector<absl::optional<CreativeView>> results(state.range(0));
+
+  // The benchmark thread is bound to the node for the run only.
+  cpu_set_t cpus;
+  const bool bound = sched_getaffinity(0, sizeof(cpus), &cpus) == 0;
+  topology.BindToNode(node);
+  RemoteLoadCounter remote_loads;
+  if (remote_loads.available()) remote_loads.Start();
+  std::string out;
+  size_t i = 0;
+  for (auto _ : state) {
+    copy->FindBatch(views[i++ % kNumNumaRequests], absl::MakeSpan(results));
+    out.clear();
+    for (const auto& creative : results) {
+      if (!creative.has_value()) continue;
+      out.append(creative->key_json.data(), creative->key_json.size());
+      out.append(creative->json.data(), creative->json.size());
+    }
+    benchmark::DoNotOptimize(out.data());
+  }
+  const size_t lookups = state.iterations() * state.range(0);
+  if (remote_loads.available()) {
+    state.counters["remote_loads"] =
+        static_cast<double>(remote_loads.Stop()) / std::max<size_t>(lookups, 1);
+  }
+  state.counters["remote_pct"] =
+      100 * RemoteCreativeShare(
+                *copy, std::vector<std::vector<absl::string_view>>(
+                           views.begin(), views.begin() + 1024),
+                node);
+  syscall(SYS_set_mempolicy, MPOL_DEFAULT, nullptr, 0);
+  if (bound) sched_setaffinity(0, sizeof(cpus), &cpus);
+  state.SetItemsProcessed(lookups);
+  state.SetLabel(absl::StrCat(topology.num_nodes(), " NUMA node(s)"));
+}
+BENCHMARK(BM_NumaSnapshotLookup)
+    ->ArgNames({"keys", "value", "map", "replica"})
+    ->ArgsProduct({{10}, {256}, {1000000}, {0, 1}});
+
+// The request path of the server: parses the target, looks up the keys
+// and assembles the response body from the pre-rendered JSON.
+void BM_RenderLookupResponse(benchmark::State& state) {
+  const CreativeMap& creative_map = GetMap(state.range(3), state.range(1));
+  auto targets =
+      MakeTargets(MakeRequests(state.range(0), state.range(2), state.range(3)));
+  size_t i = 0;
+  ResponseBuffers body;
+  for (auto _ : state) {
+    body.Clear();
+    ContentEncoding encoding = ContentEncoding::kIdentity;
+    RenderLookupResponse(targets[i++ % kNumRequests], creative_map,
+                         /*cache=*/nullptr, &encoding, &body);
+    benchmark::DoNotOptimize(body.size());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_RenderLookupResponse)->Apply(MapArgs);
+
+// The request path with every request traced by the flight recorder or
+// none, which bounds its overhead at any sample rate.
+void BM_TracedRenderLookupResponse(benchmark::State& state) {
+  const CreativeMap& creative_map = GetMap(state.range(3), state.range(1));
+  auto targets =
+      MakeTargets(MakeRequests(state.range(0), state.range(2), state.range(3)));
+  FlightRecorder::Options options;
+  options.sample_rate = state.range(4) ? 1 : 0;
+  FlightRecorder recorder(options);
+  RequestTrace trace(&recorder);
+  size_t i = 0;
+  ResponseBuffers body;
+  for (auto _ : state) {
+    body.Clear();
+    trace.Start(absl::InfinitePast(), absl::Now());
+    {
+      RequestTrace::Scope scope(&trace);
+      ContentEncoding encoding = ContentEncoding::kIdentity;
+      RenderLookupResponse(targets[i++ % kNumRequests], creative_map,
+                           /*cache=*/nullptr, &encoding, &body);
+    }
+    trace.Mark(RequestStage::kEncoded);
+    trace.Finish(200, body.size(), absl::Now());
+    benchmark::DoNotOptimize(body.size());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_TracedRenderLookupResponse)
+    ->ArgNames({"keys", "value", "hit_pct", "map", "traced"})
+    ->ArgsProduct({{1, 10, 100}, {1024}, {100}, {100000}, {0, 1}});
+
+// The request path over a map holding its values compressed or not,
+// reporting the bytes the map holds per key.
+void BM_RenderCompressedLookupResponse(benchmark::State& state) {
+  const CreativeMap& creative_map =
+      GetMap(state.range(3), state.range(1), state.range(4));
+  auto targets =
+      MakeTargets(MakeRequests(state.range(0), state.range(2), state.range(3)));
+  size_t i = 0;
+  ResponseBuffers body;
+  for (auto _ : state) {
+    body.Clear();
+    ContentEncoding encoding = ContentEncoding::kIdentity;
+    RenderLookupResponse(targets[i++ % kNumRequests], creative_map,
+                         /*cache=*/nullptr, &encoding, &body);
+    benchmark::DoNotOptimize(body.size());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  auto snapshot = creative_map.snapshot();
+  state.counters["bytes_per_key"] =
+      static_cast<double>(snapshot->bytes()) / snapshot->size();
+}
+BENCHMARK(BM_RenderCompressedLookupResponse)
+    ->ArgNames({"keys", "value", "hit_pct", "map", "compressed"})
+    ->ArgsProduct({{1, 10, 100}, {64, 1024}, {100}, {100000}, {0, 1}});
+
+// The same requests answered from a warm response cache, in the
+// encoding given by the last argument (0 identity, 1 gzip, 2 br).
+void BM_RenderCachedLookupResponse(benchmark::State& state) {
+  const CreativeMap& creative_map = GetMap(state.range(3), state.range(1));
+  auto targets =
+      MakeTargets(MakeRequests(state.range(0), state.range(2), state.range(3)));
+  const auto accepted = static_cast<ContentEncoding>(state.range(4));
+  ResponseCache cache(size_t{1} << 30);
+  ResponseBuffers body;
+  for (const std::string& target : targets) {
+    body.Clear();
+    ContentEncoding encoding = accepted;
+    RenderLookupResponse(target, creative_map, &cache, &encoding, &body);
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    body.Clear();
+    ContentEncoding encoding = accepted;
+    RenderLookupResponse(targets[i++ % kNumRequests], creative_map, &cache,
+                         &encoding, &body);
+    benchmark::DoNotOptimize(body.size());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_RenderCachedLookupResponse)
+    ->ArgNames({"keys", "value", "hit_pct", "map", "encoding"})
+    ->ArgsProduct({{1, 10, 100}, {64, 1024}, {100}, {100000}, {0, 1, 2}});
+
+// Compressing a rendered response, by encoding as above.
+void BM_Compress(benchmark::State& state) {
+  const CreativeMap& creative_map = GetMap(100000, state.range(1));
+  auto targets = MakeTargets(MakeRequests(state.range(0), 100, 100000));
+  const auto encoding = static_cast<ContentEncoding>(state.range(2));
+  std::vector<std::string> bodies;
+  for (const std::string& target : targets) {
+    ResponseBuffers body;
+    ContentEncoding identity = ContentEncoding::kIdentity;
+    RenderLookupResponse(target, creative_map, /*cache=*/nullptr, &identity,
+                         &body);
+    bodies.push_back(body.ToString());
+  }
+  size_t i = 0;
+  size_t in_bytes = 0;
+  size_t out_bytes = 0;
+  std::string compressed;
+  for (auto _ : state) {
+    const std::string& body = bodies[i++ % kNumRequests];
+    compressed.clear();
+    Compress(encoding, body, &compressed);
+    in_bytes += body.size();
+    out_bytes += compressed.size();
+  }
+  state.SetBytesProcessed(in_bytes);
+  state.counters["ratio"] = static_cast<double>(out_bytes) / in_bytes;
+}
+BENCHMARK(BM_Compress)
+    ->ArgNames({"keys", "value", "encoding"})
+    ->ArgsProduct({{1, 10, 100}, {64, 1024}, {1, 2}});
+
+// Parsing the keys out of the query string, with keys sent as is or
+// percent-encoded (encoded:1) as render URLs are.
+void BM_QueryParams(benchmark::State& state) {
+  auto requests = MakeRequests(state.range(0), 100, 1000);
+  if (state.range(1)) {
+    for (auto& keys : requests) {
+      for (auto& key : keys) key = "https%3A%2F%2F" + key;
+    }
+  }
+  auto targets = MakeTargets(requests);
+  for (auto& target : targets) target += "&hostname=publisher.test";
+  LookupQuery lookup_query;
+  size_t i = 0;
+  for (auto _ : state) {
+    auto query = QueryString(targets[i++ % kNumRequests]);
+    lookup_query.Parse(*query, "keys");
+    benchmark::DoNotOptimize(lookup_query.keys().data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_QueryParams)
+    ->ArgNames({"keys", "encoded"})
+    ->ArgsProduct({{1, 10, 100}, {0, 1}});
+
+// Rendering a creative's JSON, as done once per row at ingest.
+void BM_AppendCreativeJson(benchmark::State& state) {
+  const std::string key = Key(0);
+  const std::string data(state.range(0), 'x');
+  std::string json;
+  for (auto _ : state) {
+    json.clear();
+    AppendCreativeJson(key, data, &json);
+    benchmark::DoNotOptimize(json);
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_AppendCreativeJson)->ArgName("value")->Arg(64)->Arg(1024);
+
+}  // namespace
+
+}  // namespace trusted_server
+
+BENCHMARK_MAIN();
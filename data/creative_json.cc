@@ -0,0 +1,179 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "data/creative_json.h"
+
+#include <cstdint>
+#include <string>
+
+#include "absl/strings/escaping.h"
+#include "absl/strings/match.h"
+#include "absl/strings/string_view.h"
+
+namespace trusted_server {
+
+namespace {
+
+constexpr char kHexDigits[] = "0123456789abcdef";
+
+// Code points protobuf's JSON printer emits as \uXXXX even though they
+// are valid UTF-8: C1 controls and invisible formatting characters.
+bool IsEscapedCodePoint(uint32_t cp) {
+  return (cp >= 0x80 && cp <= 0x9f) || cp == 0xad ||
+         (cp >= 0x600 && cp <= 0x603) || cp == 0x6dd || cp == 0x70f ||
+         cp == 0x17b4 || cp == 0x17b5 || (cp >= 0x200b && cp <= 0x200f) ||
+         (cp >= 0x2028 && cp <= 0x202e) || (cp >= 0x2060 && cp <= 0x2064) ||
+         (cp >= 0x206a && cp <= 0x206f) || cp == 0xfeff ||
+         (cp >= 0xfff9 && cp <= 0xfffb) || (cp >= 0x1d173 && cp <= 0x1d17a) ||
+         cp == 0xe0001 || (cp >= 0xe0020 && cp <= 0xe007f);
+}
+
+void AppendUnicodeEscape(uint32_t unit, std::string* out) {
+  char escape[6] = {'\\',
+                    'u',
+                    kHexDigits[(unit >> 12) & 0xf],
+                    kHexDigits[(unit >> 8) & 0xf],
+                    kHexDigits[(unit >> 4) & 0xf],
+                    kHexDigits[unit & 0xf]};
+  out->append(escape, sizeof(escape));
+}
+
+// Decodes the UTF-8 sequence starting at value[pos]. Returns its length
+// and stores the code point, or returns 0 if the sequence is invalid.
+size_t DecodeUtf8(absl::string_view value, size_t pos, uint32_t* cp) {
+  auto lead = static_cast<unsigned char>(value[pos]);
+  size_t length;
+  if (lead >= 0xc2 && lead <= 0xdf) {
+    length = 2;
+    *cp = lead & 0x1f;
+  } else if (lead >= 0xe0 && lead <= 0xef) {
+    length = 3;
+    *cp = lead & 0x0f;
+  } else if (lead >= 0xf0 && lead <= 0xf4) {
+    length = 4;
+    *cp = lead & 0x07;
+  } else {
+    return 0;
+  }
+  if (pos + length > value.size()) return 0;
+  for (size_t i = 1; i < length; ++i) {
+    auto next = static_cast<unsigned char>(value[pos + i]);
+    if ((next & 0xc0) != 0x80) return 0;
+    *cp = (*cp << 6) | (next & 0x3f);
+  }
+  return length;
+}
+
+}  // namespace
+
+void AppendJsonString(absl::string_view value, std::string* out) {
+  out->push_back('"');
+  size_t pos = 0;
+  while (pos < value.size()) {
+    auto c = static_cast<unsigned char>(value[pos]);
+    if (c < 0x80) {
+      switch (c) {
+        case '"':
+          out->append("\\\"");
+          break;
+        case '\\':
+          out->append("\\\\");
+          break;
+        case '\b':
+          out->append("\\b");
+          break;
+        case '\f':
+          out->append("\\f");
+          break;
+        case '\n':
+          out->append("\\n");
+          break;
+        case '\r':
+          out->append("\\r");
+          break;
+        case '\t':
+          out->append("\\t");
+          break;
+        case '<':
+        case '>':
+        case 0x7f:
+          AppendUnicodeEscape(c, out);
+          break;
+        default:
+          if (c < 0x20) {
+            AppendUnicodeEscape(c, out);
+          } else {
+            out->push_back(static_cast<char>(c));
+          }
+      }
+      ++pos;
+      continue;
+    }
+
+    uint32_t cp;
+    size_t length = DecodeUtf8(value, pos, &cp);
+    if (length == 0) {
+      // Like protobuf, drop bytes that are not valid UTF-8.
+      ++pos;
+      continue;
+    }
+    if (!IsEscapedCodePoint(cp)) {
+      out->append(value.data() + pos, length);
+    } else if (cp < 0x10000) {
+      AppendUnicodeEscape(cp, out);
+    } else {
+      cp -= 0x10000;
+      AppendUnicodeEscape(0xd800 + (cp >> 10), out);
+      AppendUnicodeEscape(0xdc00 + (cp & 0x3ff), out);
+    }
+    pos += length;
+  }
+  out->push_back('"');
+}
+
+void AppendCreativeJson(absl::string_view key, absl::string_view data,
+                        std::string* out) {
+  AppendCreativeKeyJson(key, out);
+  AppendCreativeDataJson(data, out);
+}
+
+void AppendCreativeKeyJson(absl::string_view key, std::string* out) {
+  out->append("{\"key\":");
+  AppendJsonString(key, out);
+  out->push_back(',');
+}
+
+void AppendCreativeDataJson(absl::string_view data, std::string* out) {
+  out->append("\"creativeData\":\"");
+  out->append(absl::Base64Escape(data));
+  out->append("\"}");
+}
+
+absl::string_view CreativeJsonData(absl::string_view json) {
+  // The data is the last member, and base64 has no quotes to escape.
+  constexpr absl::string_view kEnd = "\"}";
+  if (!absl::EndsWith(json, kEnd)) return absl::string_view();
+  json.remove_suffix(kEnd.size());
+  size_t quote = json.rfind('"');
+  if (quote == absl::string_view::npos) return absl::string_view();
+  return json.substr(quote + 1);
+}
+
+void AppendMissingCreativeJson(absl::string_view key, std::string* out) {
+  out->append("{\"key\":");
+  AppendJsonString(key, out);
+  out->push_back('}');
+}
+
+}  // namespace trusted_server
@@ -0,0 +1,57 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CREATIVE_JSON_H_
+#define CREATIVE_JSON_H_
+
+#include <string>
+
+#include "absl/strings/string_view.h"
+
+namespace trusted_server {
+
+// Hand-rolled JSON rendering of trusted_server::Response. The output is
+// byte-for-byte what MessageToJsonString produces for the same proto,
+// so fragments can be rendered once at ingest time and concatenated
+// per request instead of running reflection-based serialization.
+
+// Appends `value` as a quoted JSON string, escaped the way protobuf's
+// JSON printer escapes string fields.
+void AppendJsonString(absl::string_view value, std::string* out);
+
+// Appends the JSON object of a Creative with both key and data set.
+// `data` is base64 encoded.
+void AppendCreativeJson(absl::string_view key, absl::string_view data,
+                        std::string* out);
+
+// Append the two halves of what AppendCreativeJson() appends: the
+// object up to and including the key, and the rest, which only depends
+// on the data and so can be shared by creatives with the same data.
+void AppendCreativeKeyJson(absl::string_view key, std::string* out);
+void AppendCreativeDataJson(absl::string_view data, std::string* out);
+
+// Returns the base64 encoded data in a JSON object appended by
+// AppendCreativeJson(), or in its second half.
+absl::string_view CreativeJsonData(absl::string_view json);
+
+// Appends the JSON object of a Creative that has no data for `key`.
+void AppendMissingCreativeJson(absl::string_view key, std::string* out);
+
+// Separators that wrap the Creative objects of a Response.
+inline constexpr absl::string_view kResponseJsonPrefix = "{\"creatives\":[";
+inline constexpr absl::string_view kResponseJsonSeparator = ",";
+inline constexpr absl::string_view kResponseJsonSuffix = "]}";
+
+}  // namespace trusted_server
+#endif  // CREATIVE_JSON_H_
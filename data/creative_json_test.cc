@@ -0,0 +1,103 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "data/creative_json.h"
+
+#include <string>
+#include <vector>
+
+#include "absl/strings/escaping.h"
+#include "absl/strings/str_cat.h"
+#include "google/protobuf/util/json_util.h"
+#include "gtest/gtest.h"
+#include "proto/response.pb.h"
+
+namespace trusted_server {
+
+namespace {
+
+using ::google::protobuf::util::MessageToJsonString;
+
+std::string ProtoJson(const std::string& key, const std::string* data) {
+  trusted_server::Response response;
+  auto* creative = response.add_creatives();
+  creative->set_key(key);
+  if (data != nullptr) creative->set_creative_data(*data);
+  std::string json;
+  EXPECT_TRUE(MessageToJsonString(response, &json).ok());
+  return json;
+}
+
+std::string RenderedJson(const std::string& key, const std::string* data) {
+  std::string json(kResponseJsonPrefix);
+  if (data != nullptr) {
+    AppendCreativeJson(key, *data, &json);
+  } else {
+    AppendMissingCreativeJson(key, &json);
+  }
+  absl::StrAppend(&json, kResponseJsonSuffix);
+  return json;
+}
+
+TEST(CreativeJsonTest, MatchesProtoJsonForAscii) {
+  const std::string data = "\x08\x01";
+  for (int c = 0; c < 0x80; ++c) {
+    std::string key = absl::StrCat("google.com/", std::string(1, c), "ad");
+    EXPECT_EQ(RenderedJson(key, &data), ProtoJson(key, &data)) << c;
+    EXPECT_EQ(RenderedJson(key, nullptr), ProtoJson(key, nullptr)) << c;
+  }
+}
+
+TEST(CreativeJsonTest, MatchesProtoJsonForUnicode) {
+  const std::vector<std::string> keys = {
+      "caf\xc3\xa9",          // U+00E9, printed as is.
+      "\xc2\x80",             // U+0080, C1 control.
+      "\xc2\xad",             // U+00AD, soft hyphen.
+      "\xe2\x80\xa8",         // U+2028, line separator.
+      "\xef\xbb\xbf",         // U+FEFF, byte order mark.
+      "\xf0\x9f\x98\x80",     // U+1F600, printed as is.
+      "\xf0\x9d\x85\xb3",     // U+1D173, escaped as a surrogate pair.
+      "\xf3\xa0\x80\x81",     // U+E0001, escaped as a surrogate pair.
+  };
+  const std::string data = "creative";
+  for (const auto& key : keys) {
+    EXPECT_EQ(RenderedJson(key, &data), ProtoJson(key, &data)) << key;
+  }
+}
+
+TEST(CreativeJsonTest, MatchesProtoJsonForData) {
+  const std::string key = "google.com/ad1";
+  for (const std::string& data :
+       {std::string(), std::string("a"), std::string("ab"),
+        std::string("abc"), std::string("\0\xff\x10", 3)}) {
+    EXPECT_EQ(RenderedJson(key, &data), ProtoJson(key, &data));
+  }
+}
+
+TEST(CreativeJsonTest, FindsDataInJson) {
+  for (const std::string& key : {"google.com/ad1", "a\"}", "\\\",\""}) {
+    for (const std::string& data :
+         {std::string(), std::string("abc"), std::string("\0\xff\x10", 3)}) {
+      std::string json;
+      AppendCreativeJson(key, data, &json);
+      std::string decoded;
+      ASSERT_TRUE(absl::Base64Unescape(CreativeJsonData(json), &decoded));
+      EXPECT_EQ(decoded, data) << json;
+    }
+  }
+}
+
+}  // namespace
+
+}  // namespace trusted_server
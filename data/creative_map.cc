@@ -14,8 +14,14 @@
 
 #include "data/creative_map.h"
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <string>
 #include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 #include "absl/container/flat_hash_map.h"
 #include "absl/flags/flag.h"
@@ -23,17 +29,30 @@
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
 #include "absl/strings/str_split.h"
-#include "absl/synchronization/mutex.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
 #include "boost/asio/ip/tcp.hpp"
 #include "boost/asio/strand.hpp"
 #include "boost/beast/core.hpp"
 #include "boost/beast/http.hpp"
 #include "boost/beast/version.hpp"
+#include "data/hash_ring.h"
+#include "data/huge_page_buffer.h"
+#include "data/numa_topology.h"
+#include "data/snapshot_file.h"
+#include "data/value_codec.h"
 #include "glog/logging.h"
 #include "google/cloud/spanner/bytes.h"
 #include "google/cloud/spanner/client.h"
+#include "google/cloud/spanner/timestamp.h"
 #include "google/protobuf/util/json_util.h"
+#include "metrics/metrics.h"
 
 namespace spanner = ::google::cloud::spanner;
 
@@ -49,14 +68,187 @@ ABSL_FLAG(std::string, spanner_database_id, "trusted-server-database",
 ABSL_FLAG(int, refresh_period_sec, 600,
           "Period in seconds to refresh creative data map.");
 
+ABSL_FLAG(int, initial_load_partitions, 16,
+          "Number of partitions the initial load of the creative data map "
+          "is split into and read in parallel.");
+
+ABSL_FLAG(std::string, snapshot_path, "",
+          "Path of the snapshot file the creative data map is loaded from "
+          "on startup and periodically persisted to. Empty to disable.");
+
+ABSL_FLAG(int, snapshot_period_sec, 3600,
+          "Period in seconds to persist the creative data map to "
+          "--snapshot_path.");
+
+ABSL_FLAG(bool, snapshot_verify_checksum, true,
+          "Whether to verify the checksum of the snapshot file on load. "
+          "This reads the whole file before serving from it.");
+
+ABSL_FLAG(bool, compress_values, false,
+          "Whether to hold creatives loaded from the database compressed "
+          "with zstd and a dictionary trained on them. Saves memory at "
+          "the cost of decompressing every creative looked up. Creatives "
+          "served from --snapshot_path are never compressed.");
+
+ABSL_FLAG(int, value_dictionary_bytes, 112640,
+          "Maximum size of the dictionary trained for --compress_values.");
+
+ABSL_FLAG(int, value_compression_level, 3,
+          "zstd compression level of --compress_values.");
+
+ABSL_FLAG(int64_t, hot_creative_bytes, 0,
+          "Bytes of the most looked up creatives that refreshes copy, "
+          "decompressed and in order of popularity, into one block of "
+          "memory backed by huge pages where available, so they share "
+          "cache lines and TLB entries. Needs "
+          "--key_popularity_sample_period. 0 to disable.");
+
+ABSL_FLAG(bool, explicit_huge_pages, false,
+          "Whether to back the --hot_creative_bytes block with huge pages "
+          "reserved in /proc/sys/vm/nr_hugepages instead of transparent "
+          "huge pages, which it falls back to when not enough are free.");
+
+ABSL_FLAG(bool, numa_replicas, false,
+          "Whether to keep a copy of the creative data in the memory of "
+          "each NUMA node, which lookups read from the node they run on, "
+          "so they never read another node's memory. Every refresh "
+          "copies what it changed to each node. Takes one more copy of "
+          "the data per node. Ignored on machines with a single node.");
+
+ABSL_FLAG(int, num_shards, 1,
+          "Number of shards the creatives are split into by consistent "
+          "hashing. With more than one, the map only loads the creatives "
+          "of shard --shard_index, and a server with --router_shards "
+          "serves lookups from all of them. Keys in a --snapshot_path "
+          "file are not checked against the shard.");
+
+ABSL_FLAG(int, shard_index, 0,
+          "Shard of the creatives the map loads, from 0 to --num_shards "
+          "minus one.");
+
 namespace trusted_server {
 
+namespace {
+
+struct RefreshMetrics {
+  Histogram* refresh_seconds;
+  Histogram* publish_seconds;
+  Histogram* replicate_seconds;
+  Counter* rows;
+  Counter* failures;
+};
+
+const RefreshMetrics& Metrics() {
+  static const auto* metrics = [] {
+    MetricsRegistry& registry = MetricsRegistry::Global();
+    return new RefreshMetrics{
+        registry.AddHistogram(
+            "trusted_server_refresh_seconds",
+            "Time taken by incremental refreshes of the creative map.", "",
+            ExponentialBuckets(1e-3, 2, 20)),
+        registry.AddHistogram(
+            "trusted_server_refresh_publish_seconds",
+            "Time taken to build and publish the snapshot of a refresh. "
+            "Lookups are never blocked while it is built.",
+            "", ExponentialBuckets(1e-5, 2, 24)),
+        registry.AddHistogram(
+            "trusted_server_refresh_replicate_seconds",
+            "Time taken to copy a snapshot being published to the memory "
+            "of every NUMA node, with --numa_replicas.",
+            "", ExponentialBuckets(1e-5, 2, 24)),
+        registry.AddCounter("trusted_server_refresh_rows_total",
+                            "Rows applied to the creative map by refreshes."),
+        registry.AddCounter("trusted_server_refresh_failures_total",
+                            "Refreshes that failed to read the database."),
+    };
+  }();
+  return *metrics;
+}
+
+// Returns the condition on the rows of `shard` of `ring`, and adds the
+// parameters it refers to to `params`. The first 8 bytes of the SHA-256
+// of a key compare as bytes as HashRing::Position() does as a number.
+std::string ShardCondition(const HashRing& ring, int shard,
+                           spanner::SqlStatement::ParamType* params) {
+  std::vector<std::string> ranges;
+  for (const HashRing::Range& range : ring.RangesOf(shard)) {
+    const std::string first = absl::StrCat("shard_first_", ranges.size());
+    const std::string last = absl::StrCat("shard_last_", ranges.size());
+    (*params)[first] =
+        spanner::Value(spanner::Bytes(HashRing::PositionBytes(range.first)));
+    (*params)[last] =
+        spanner::Value(spanner::Bytes(HashRing::PositionBytes(range.last)));
+    ranges.push_back(absl::StrCat("SUBSTR(SHA256(CreativeId), 1, 8) BETWEEN @",
+                                  first, " AND @", last));
+  }
+  return absl::StrCat("(", absl::StrJoin(ranges, " OR "), ")");
+}
+
+}  // namespace
+
+std::unique_ptr<const HashRing> CreativeMap::ShardRingFromFlags() {
+  const int num_shards = absl::GetFlag(FLAGS_num_shards);
+  if (num_shards <= 1) return nullptr;
+  const int shard_index = ShardIndexFromFlags();
+  CHECK(shard_index >= 0 && shard_index < num_shards)
+      << "--shard_index must be in [0, --num_shards)";
+  LOG(INFO) << "Loading shard " << shard_index << " of " << num_shards;
+  return std::make_unique<const HashRing>(num_shards);
+}
+
+int CreativeMap::ShardIndexFromFlags() {
+  return absl::GetFlag(FLAGS_shard_index);
+}
+
+std::vector<std::shared_ptr<const CreativeSnapshot>>
+CreativeMap::ReplicasFromFlags() {
+  if (!absl::GetFlag(FLAGS_numa_replicas)) return {};
+  const int num_nodes = NumaTopology::Get().num_nodes();
+  if (num_nodes <= 1) {
+    LOG(INFO) << "Not replicating the creative map: one NUMA node";
+    return {};
+  }
+  LOG(INFO) << "Replicating the creative map to " << num_nodes
+            << " NUMA nodes";
+  return std::vector<std::shared_ptr<const CreativeSnapshot>>(
+      num_nodes, std::make_shared<const CreativeSnapshot>());
+}
+
+void CreativeMap::PublishReplicas(const CreativeSnapshot& snapshot) {
+  if (replicas_.empty()) return;
+  const absl::Time start = absl::Now();
+  const std::shared_ptr<const CreativeSnapshot> source = published();
+  const NumaTopology& topology = NumaTopology::Get();
+  // Each copy is made by a thread of its node, so the pages it allocates
+  // are first touched there and come from the node's memory.
+  std::vector<std::thread> threads;
+  for (size_t node = 0; node < replicas_.size(); ++node) {
+    threads.emplace_back([&, node] {
+      if (!topology.BindToNode(node)) {
+        LOG(WARNING) << "Copying the snapshot of NUMA node " << node
+                     << " from another node";
+      }
+      std::atomic_store(
+          &replicas_[node],
+          snapshot.Replicate(source.get(),
+                             std::atomic_load(&replicas_[node]).get()));
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  Metrics().replicate_seconds->RecordSince(start);
+}
+
 std::shared_ptr<CreativeMap> CreativeMap::CreateMap() {
   std::shared_ptr<CreativeMap> creative_map =
       std::shared_ptr<CreativeMap>(new CreativeMap());
   creative_map->InitializeSpannerClient();
-  creative_map->PopulateMap();
-  std::thread([creative_map] { creative_map->RefreshMap(); }).detach();
+  bool loaded = creative_map->LoadSnapshotFile();
+  if (!loaded) creative_map->PopulateMap();
+  std::thread([creative_map, loaded] {
+    // Catch up on what changed since the file was written.
+    if (loaded) creative_map->RefreshOnce();
+    creative_map->RefreshMap();
+  }).detach();
   return creative_map;
 }
 
@@ -69,59 +261,230 @@ void CreativeMap::InitializeSpannerClient() {
 }
 
 void CreativeMap::PopulateMap() {
-  auto rows = client_->ExecuteQuery(spanner::SqlStatement(
-      "SELECT CreativeId, CreativeData FROM CreativeMetadata"));
+  std::string sql = "SELECT CreativeId, CreativeData FROM CreativeMetadata";
+  spanner::SqlStatement::ParamType params;
+  if (ring_ != nullptr) {
+    absl::StrAppend(&sql, " WHERE ",
+                    ShardCondition(*ring_, shard_index_, &params));
+  }
+  const spanner::SqlStatement statement(std::move(sql), std::move(params));
+  const absl::Time start = absl::Now();
 
-  latest_read_ = rows.ReadTimestamp().value();
+  // Split the scan so the partitions are streamed and rendered in
+  // parallel. Fall back to a single stream if the query can't be
+  // partitioned.
+  const int max_partitions =
+      std::max(absl::GetFlag(FLAGS_initial_load_partitions), 1);
+  spanner::PartitionOptions options;
+  options.max_partitions = max_partitions;
+  std::vector<spanner::QueryPartition> partitions;
+  if (auto result = client_->PartitionQuery(spanner::MakeReadOnlyTransaction(),
+                                            statement, options)) {
+    partitions = *std::move(result);
+  } else {
+    LOG(ERROR) << "Failed to partition initial load: " << result.status();
+  }
 
-  for (auto const& row :
-       spanner::StreamOf<std::tuple<std::string, spanner::Bytes>>(rows)) {
-    if (!row) {
-      LOG(ERROR) << "Invalid Spanner response.";
-      return;
+  size_t num_streams = std::max<size_t>(partitions.size(), 1);
+  std::vector<CreativeSnapshot::Builder> builders(num_streams);
+  std::vector<absl::optional<spanner::Timestamp>> read_timestamps(
+      num_streams);
+  auto load = [&](size_t index) {
+    spanner::RowStream rows = partitions.empty()
+                                  ? client_->ExecuteQuery(statement)
+                                  : client_->ExecuteQuery(partitions[index]);
+    for (auto const& row :
+         spanner::StreamOf<std::tuple<std::string, spanner::Bytes>>(rows)) {
+      if (!row) {
+        LOG(ERROR) << "Invalid Spanner response.";
+        break;
+      }
+      // The database filters rows by shard already; the mocked one does
+      // not.
+      if (!Owns(std::get<0>(*row))) continue;
+      builders[index].Add(std::get<0>(*row), std::get<1>(*row));
+    }
+    read_timestamps[index] = rows.ReadTimestamp();
+  };
+
+  // Partitions are handed out to a bounded number of threads, since
+  // Spanner may return more than were asked for.
+  std::atomic<size_t> next_index{0};
+  size_t num_threads = std::min<size_t>(num_streams, max_partitions);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads.emplace_back([&] {
+      for (size_t index = next_index++; index < num_streams;
+           index = next_index++) {
+        load(index);
+      }
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+
+  // All partitions read at the same timestamp. Should the streams not
+  // report it, the time the load started is a safe lower bound.
+  latest_read_ = spanner::MakeTimestamp(start).value();
+  for (const auto& read_timestamp : read_timestamps) {
+    if (read_timestamp) latest_read_ = *read_timestamp;
+  }
+  std::shared_ptr<const ValueCodec> codec;
+  if (absl::GetFlag(FLAGS_compress_values)) {
+    ValueCodec::Options codec_options;
+    codec_options.dictionary_bytes =
+        std::max(absl::GetFlag(FLAGS_value_dictionary_bytes), 1024);
+    codec_options.level = absl::GetFlag(FLAGS_value_compression_level);
+    auto trained = CreativeSnapshot::TrainCodec(builders, codec_options);
+    if (trained.ok()) {
+      codec = *std::move(trained);
+      LOG(INFO) << "Compressing creatives with a "
+                << codec->dictionary_bytes() << " byte dictionary";
+    } else {
+      LOG(WARNING) << "Not compressing creatives: " << trained.status();
     }
-    creative_data_[std::get<0>(*row)] = std::get<1>(*row);
   }
+  Publish(CreativeSnapshot::Merge(std::move(builders), std::move(codec),
+                                  num_threads));
+  LOG(INFO) << "Loaded " << published()->size() << " creatives from "
+            << num_streams << " stream(s) in " << absl::Now() - start;
+}
+
+bool CreativeMap::LoadSnapshotFile() {
+  const std::string path = absl::GetFlag(FLAGS_snapshot_path);
+  if (path.empty()) return false;
+  auto file =
+      SnapshotFile::Open(path, absl::GetFlag(FLAGS_snapshot_verify_checksum));
+  if (!file.ok()) {
+    LOG(ERROR) << "Not loading snapshot file: " << file.status();
+    return false;
+  }
+  auto latest_read = spanner::MakeTimestamp((*file)->latest_read());
+  if (!latest_read.ok()) {
+    LOG(ERROR) << "Invalid snapshot timestamp: " << latest_read.status();
+    return false;
+  }
+  latest_read_ = *latest_read;
+  last_persisted_ = absl::Now();
+  LOG(INFO) << "Loaded " << (*file)->size() << " creatives from " << path
+            << " as of " << (*file)->latest_read();
+  Publish(CreativeSnapshot::FromFile(*std::move(file)));
+  return true;
+}
+
+void CreativeMap::PersistSnapshot() {
+  auto latest_read = latest_read_.get<absl::Time>();
+  if (!latest_read.ok()) {
+    LOG(ERROR) << "Invalid read timestamp: " << latest_read.status();
+    return;
+  }
+  absl::Status status = published()->WriteToFile(
+      absl::GetFlag(FLAGS_snapshot_path), *latest_read);
+  if (!status.ok()) {
+    LOG(ERROR) << "Failed to persist snapshot: " << status;
+    return;
+  }
+  last_persisted_ = absl::Now();
 }
 
 void CreativeMap::RefreshMap() {
   for (;;) {
+    if (!absl::GetFlag(FLAGS_snapshot_path).empty() &&
+        absl::Now() - last_persisted_ >=
+            absl::Seconds(absl::GetFlag(FLAGS_snapshot_period_sec))) {
+      PersistSnapshot();
+    }
     absl::SleepFor(absl::Seconds(absl::GetFlag(FLAGS_refresh_period_sec)));
-    std::string stmt(
-        "SELECT CreativeId, CreativeData FROM CreativeMetadata WHERE "
-        "LastUpdateTime > @latest_time");
-    spanner::SqlStatement::ParamType params = {
-        {"latest_time", spanner::Value(latest_read_)}};
-    auto rows = client_->ExecuteQuery(spanner::SqlStatement(stmt, params));
-    mutex_.Lock();
-    for (auto const& row :
-         spanner::StreamOf<std::tuple<std::string, spanner::Bytes>>(rows)) {
-      if (!row) {
-        LOG(ERROR) << "Invalid Spanner response.";
-        return;
-      }
-      creative_data_.insert_or_assign(std::get<0>(*row), std::get<1>(*row));
+    RefreshOnce();
+  }
+}
+
+bool CreativeMap::RefreshOnce() {
+  const RefreshMetrics& metrics = Metrics();
+  absl::Time start = absl::Now();
+  std::string stmt(
+      "SELECT CreativeId, CreativeData FROM CreativeMetadata WHERE "
+      "LastUpdateTime > @latest_time");
+  spanner::SqlStatement::ParamType params = {
+      {"latest_time", spanner::Value(latest_read_)}};
+  if (ring_ != nullptr) {
+    absl::StrAppend(&stmt, " AND ",
+                    ShardCondition(*ring_, shard_index_, &params));
+  }
+  auto rows = client_->ExecuteQuery(spanner::SqlStatement(stmt, params));
+
+  // The delta is collected off to the side so readers keep using the
+  // current snapshot for as long as the stream takes.
+  CreativeSnapshot::Updates updates;
+  for (auto const& row :
+       spanner::StreamOf<std::tuple<std::string, spanner::Bytes>>(rows)) {
+    if (!row) {
+      LOG(ERROR) << "Invalid Spanner response.";
+      metrics.failures->Increment();
+      return false;
     }
-    mutex_.Unlock();
+    if (!Owns(std::get<0>(*row))) continue;
+    updates.emplace_back(std::get<0>(*row), std::get<1>(*row));
+  }
+  if (auto read_timestamp = rows.ReadTimestamp()) {
+    latest_read_ = *read_timestamp;
+  }
+  absl::Time publish_start = absl::Now();
+  std::shared_ptr<const CreativeSnapshot> next;
+  if (!updates.empty()) {
+    metrics.rows->Increment(updates.size());
+    next = published()->WithUpdates(std::move(updates));
   }
+  // The layout follows popularity even if no data changed, in which
+  // case cached responses stay valid.
+  auto laid_out = LayOutHotKeys(next != nullptr ? *next : *published());
+  if (next != nullptr) {
+    Publish(laid_out != nullptr ? std::move(laid_out) : std::move(next));
+    metrics.publish_seconds->RecordSince(publish_start);
+  } else if (laid_out != nullptr) {
+    Republish(std::move(laid_out));
+  }
+  metrics.refresh_seconds->RecordSince(start);
+  return true;
+}
+
+std::shared_ptr<const CreativeSnapshot> CreativeMap::LayOutHotKeys(
+    const CreativeSnapshot& snapshot) {
+  const int64_t max_bytes = absl::GetFlag(FLAGS_hot_creative_bytes);
+  if (max_bytes <= 0 || !popularity_.enabled()) return nullptr;
+  std::vector<HotKey> hottest =
+      popularity_.Hottest(popularity_.options().tracked_keys);
+  popularity_.Decay();
+  std::vector<absl::string_view> keys;
+  keys.reserve(hottest.size());
+  for (const HotKey& hot : hottest) keys.push_back(hot.key);
+  if (keys.empty() && snapshot.hot_keys() == 0) return nullptr;
+  return snapshot.WithHotKeys(keys, max_bytes,
+                             absl::GetFlag(FLAGS_explicit_huge_pages)
+                                 ? HugePageBuffer::Pages::kExplicit
+                                 : HugePageBuffer::Pages::kTransparent);
 }
 
 trusted_server::Response CreativeMap::Lookup(
     const std::vector<std::string>& keys) const {
+  constexpr size_t kBatchSize = CreativeSnapshot::kFindBatchSize;
+  std::shared_ptr<const CreativeSnapshot> current = snapshot();
+  for (const std::string& key : keys) popularity_.Record(key);
   trusted_server::Response response;
-  for (const auto& key : keys) {
-    auto* creative = response.add_creatives();
-    creative->set_key(key);
-  }
-
-  mutex_.ReaderLock();
-  for (auto& creative : *response.mutable_creatives()) {
-    auto val_it = creative_data_.find(creative.key());
-    if (val_it != creative_data_.end()) {
-      creative.set_creative_data(val_it->second.get<std::string>());
+  absl::string_view batch[kBatchSize];
+  absl::optional<CreativeView> stored[kBatchSize];
+  for (size_t start = 0; start < keys.size(); start += kBatchSize) {
+    size_t count = std::min(kBatchSize, keys.size() - start);
+    for (size_t i = 0; i < count; ++i) batch[i] = keys[start + i];
+    current->FindBatch(absl::MakeConstSpan(batch, count),
+                       absl::MakeSpan(stored, count));
+    for (size_t i = 0; i < count; ++i) {
+      auto* creative = response.add_creatives();
+      creative->set_key(keys[start + i]);
+      if (stored[i].has_value()) {
+        current->AppendData(*stored[i], creative->mutable_creative_data());
+      }
     }
   }
-  mutex_.ReaderUnlock();
   return response;
 }
 
@@ -15,14 +15,20 @@
 #ifndef CREATIVE_MAP_H_
 #define CREATIVE_MAP_H_
 
+#include <atomic>
+#include <cstdint>
 #include <memory>
 #include <string>
+#include <vector>
 
-#include "absl/base/thread_annotations.h"
-#include "absl/container/flat_hash_map.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
-#include "absl/synchronization/mutex.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "data/creative_snapshot.h"
+#include "data/hash_ring.h"
+#include "data/key_popularity.h"
+#include "data/numa_topology.h"
 #include "google/cloud/spanner/bytes.h"
 #include "google/cloud/spanner/client.h"
 #include "google/cloud/spanner/timestamp.h"
@@ -43,19 +49,120 @@ class CreativeMap {
 
   trusted_server::Response Lookup(const std::vector<std::string>& keys) const;
 
+  // Returns the current version of the creative data. Lookups never
+  // block: the returned snapshot stays valid and unchanged while held,
+  // even if a refresh publishes a newer one in the meantime. With
+  // --numa_replicas, it is the copy in the memory of the NUMA node the
+  // calling thread runs on.
+  std::shared_ptr<const CreativeSnapshot> snapshot() const {
+    if (replicas_.empty()) return std::atomic_load(&snapshot_);
+    return std::atomic_load(&replicas_[NumaTopology::Get().CurrentNode()]);
+  }
+
+  // Number of copies of the snapshot kept, one per NUMA node, or 0 if
+  // lookups read the published snapshot itself.
+  int num_replicas() const { return replicas_.size(); }
+
+  // Returns the number of snapshots published so far, which refreshes
+  // bump whenever they change the data. Anything derived from a
+  // snapshot can be tagged with the epoch read *before* snapshot() and
+  // is outdated once epoch() moves past it.
+  uint64_t epoch() const { return epoch_.load(std::memory_order_acquire); }
+
+  // Popularity of the keys looked up, which lookups are to record. It
+  // decides which creatives refreshes lay out together in memory.
+  KeyPopularity& popularity() const { return popularity_; }
+
+  // Returns whether `key` is in the shard of the data the map holds, as
+  // set by --num_shards and --shard_index. Always true if unsharded.
+  bool Owns(absl::string_view key) const {
+    return ring_ == nullptr || ring_->ShardOf(key) == shard_index_;
+  }
+
  protected:
   virtual void InitializeSpannerClient();
   virtual void PopulateMap();
   void RefreshMap();
 
+  // Publishes the snapshot file named by --snapshot_path, if there is a
+  // usable one, so lookups can be served before the database has been
+  // read. Returns false if the map still has to be populated.
+  bool LoadSnapshotFile();
+
+  // Writes the current snapshot to --snapshot_path.
+  void PersistSnapshot();
+
+  // Reads the rows modified since the last read and publishes a new
+  // snapshot containing them. Returns false if the read failed, in
+  // which case the current snapshot is left in place.
+  bool RefreshOnce();
+
+  // Returns `snapshot` with the hottest creatives since the last call
+  // laid out together, as --hot_creative_bytes allows, and starts
+  // counting popularity afresh. Returns null if the layout is disabled.
+  std::shared_ptr<const CreativeSnapshot> LayOutHotKeys(
+      const CreativeSnapshot& snapshot);
+
+  // Returns the snapshot last published, which refreshes derive the
+  // next one from.
+  std::shared_ptr<const CreativeSnapshot> published() const {
+    return std::atomic_load(&snapshot_);
+  }
+
+  // Makes `snapshot` visible to all subsequent lookups.
+  void Publish(std::shared_ptr<const CreativeSnapshot> snapshot) {
+    PublishReplicas(*snapshot);
+    std::atomic_store(&snapshot_, std::move(snapshot));
+    epoch_.fetch_add(1, std::memory_order_release);
+  }
+
+  // Publishes `snapshot`, which holds the same data as the current one,
+  // without moving to a new epoch.
+  void Republish(std::shared_ptr<const CreativeSnapshot> snapshot) {
+    PublishReplicas(*snapshot);
+    std::atomic_store(&snapshot_, std::move(snapshot));
+  }
+
+  // Copies `snapshot`, about to be published, to the memory of every
+  // node of replicas_ and publishes the copies, all before returning.
+  // Each copy only copies what changed since the snapshot published
+  // last.
+  void PublishReplicas(const CreativeSnapshot& snapshot);
+
+  // Return the ring --num_shards splits the data by, null if the data
+  // is not sharded, and the shard of it given by --shard_index.
+  static std::unique_ptr<const HashRing> ShardRingFromFlags();
+  static int ShardIndexFromFlags();
+
+  // Returns an empty replica for each NUMA node if --numa_replicas is
+  // set and there is more than one, and none otherwise.
+  static std::vector<std::shared_ptr<const CreativeSnapshot>>
+  ReplicasFromFlags();
+
   std::unique_ptr<spanner::Client> client_;
-  mutable absl::Mutex mutex_;
-  absl::flat_hash_map<std::string, spanner::Bytes> creative_data_
-      ABSL_GUARDED_BY(mutex_);
+
+  const std::unique_ptr<const HashRing> ring_ = ShardRingFromFlags();
+  const int shard_index_ = ShardIndexFromFlags();
+
+  // Only ever accessed through std::atomic_load/std::atomic_store.
+  std::shared_ptr<const CreativeSnapshot> snapshot_ =
+      std::make_shared<const CreativeSnapshot>();
+  // Copies of snapshot_ by NUMA node, each in its node's memory; empty
+  // unless --numa_replicas. The vector never changes size, and the
+  // copies are accessed like snapshot_.
+  std::vector<std::shared_ptr<const CreativeSnapshot>> replicas_ =
+      ReplicasFromFlags();
+  std::atomic<uint64_t> epoch_{0};
+
+  // Counting lookups does not change the map.
+  mutable KeyPopularity popularity_{KeyPopularity::OptionsFromFlags()};
 
   // Keep a record of most recent read to only query recently
   // modified database entries on refreshes.
   spanner::Timestamp latest_read_;
+
+  // When the snapshot was last written to or loaded from disk.
+  absl::Time last_persisted_ = absl::InfinitePast();
 };
 }  // namespace trusted_server
 #endif  // SERVER_AD_AUCTIONS_H_
\ No newline at end of file
@@ -12,7 +12,12 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include "absl/flags/declare.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/reflection.h"
+#include "data/hash_ring.h"
 #include "data/mock_creative_map.h"
+#include "data/synthetic_dataset.h"
 #include "gmock/gmock.h"
 #include "google/cloud/spanner/bytes.h"
 #include "google/cloud/spanner/client.h"
@@ -22,6 +27,11 @@
 #include "gtest/gtest.h"
 #include "proto/creative_data.pb.h"
 
+ABSL_DECLARE_FLAG(int64_t, hot_creative_bytes);
+ABSL_DECLARE_FLAG(int, key_popularity_sample_period);
+ABSL_DECLARE_FLAG(int, num_shards);
+ABSL_DECLARE_FLAG(int, shard_index);
+
 namespace trusted_server {
 
 namespace {
@@ -83,6 +93,95 @@ TEST_F(CreativeMapTest, MultipleKeyLookup) {
   EXPECT_TRUE(response_map["google.com/ad2"].is_servible());
 }
 
+TEST(SyntheticCreativeMapTest, LoadsAndRefreshesDataset) {
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_hot_creative_bytes, 1 << 20);
+  absl::SetFlag(&FLAGS_key_popularity_sample_period, 1);
+  SyntheticDataset::Options options;
+  options.num_keys = 10000;
+  options.refresh_batches = 1;
+  options.refresh_batch_keys = 100;
+  SyntheticDataset dataset(options);
+  std::shared_ptr<MockCreativeMap> creative_map =
+      MockCreativeMap::CreateSyntheticMap(options);
+  EXPECT_EQ(creative_map->snapshot()->size(), options.num_keys);
+
+  std::vector<std::string> keys;
+  for (size_t i = 0; i < options.num_keys; i += 997) {
+    keys.push_back(dataset.Key(i));
+  }
+  trusted_server::Response response = creative_map->Lookup(keys);
+  ASSERT_EQ(response.creatives().size(), keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    EXPECT_EQ(response.creatives().at(i).key(), keys[i]);
+    EXPECT_EQ(response.creatives().at(i).creative_data(),
+              dataset.Value(i * 997, 0));
+  }
+
+  ASSERT_TRUE(creative_map->RefreshOnce());
+  auto batch = dataset.RefreshBatch(0);
+  keys.clear();
+  for (const auto& row : batch) keys.push_back(row.first);
+  response = creative_map->Lookup(keys);
+  ASSERT_EQ(response.creatives().size(), batch.size());
+  for (size_t i = 0; i < batch.size(); ++i) {
+    EXPECT_EQ(response.creatives().at(i).creative_data(), batch[i].second);
+  }
+  // Refreshes past the last batch change nothing.
+  const size_t size = creative_map->snapshot()->size();
+  EXPECT_TRUE(creative_map->RefreshOnce());
+  EXPECT_EQ(creative_map->snapshot()->size(), size);
+
+  // They still lay out the creatives looked up most, which changes
+  // neither the data nor its epoch.
+  const std::string hot_key = dataset.Key(42);
+  const std::string hot_data =
+      creative_map->Lookup({hot_key}).creatives(0).creative_data();
+  for (int i = 0; i < 100; ++i) creative_map->Lookup({hot_key});
+  const uint64_t epoch = creative_map->epoch();
+  EXPECT_TRUE(creative_map->RefreshOnce());
+  EXPECT_EQ(creative_map->epoch(), epoch);
+  EXPECT_GE(creative_map->snapshot()->hot_keys(), 1);
+  EXPECT_EQ(creative_map->Lookup({hot_key}).creatives(0).creative_data(),
+            hot_data);
+}
+
+TEST(SyntheticCreativeMapTest, LoadsOneShard) {
+  absl::FlagSaver flag_saver;
+  SyntheticDataset::Options options;
+  options.num_keys = 3000;
+  options.refresh_batches = 1;
+  options.refresh_batch_keys = 300;
+  SyntheticDataset dataset(options);
+  HashRing ring(3);
+  absl::SetFlag(&FLAGS_num_shards, 3);
+  size_t total = 0;
+  for (int shard = 0; shard < 3; ++shard) {
+    absl::SetFlag(&FLAGS_shard_index, shard);
+    std::shared_ptr<MockCreativeMap> creative_map =
+        MockCreativeMap::CreateSyntheticMap(options);
+    const size_t size = creative_map->snapshot()->size();
+    EXPECT_GT(size, options.num_keys / 3 * 0.7);
+    EXPECT_LT(size, options.num_keys / 3 * 1.3);
+    total += size;
+    for (size_t i = 0; i < options.num_keys; i += 7) {
+      const std::string key = dataset.Key(i);
+      EXPECT_EQ(creative_map->Lookup({key}).creatives(0).has_creative_data(),
+                ring.ShardOf(key) == shard)
+          << key;
+    }
+    // Refreshes only apply the rows of the shard too.
+    ASSERT_TRUE(creative_map->RefreshOnce());
+    for (const auto& [key, value] : dataset.RefreshBatch(0)) {
+      EXPECT_EQ(creative_map->Owns(key), ring.ShardOf(key) == shard);
+      EXPECT_EQ(creative_map->Lookup({key}).creatives(0).has_creative_data(),
+                creative_map->Owns(key))
+          << key;
+    }
+  }
+  EXPECT_EQ(total, options.num_keys);
+}
+
 }  // namespace
 
 }  // namespace trusted_server
\ No newline at end of file
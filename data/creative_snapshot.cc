@@ -0,0 +1,553 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "data/creative_snapshot.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/hash/hash.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/escaping.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "data/creative_json.h"
+#include "data/huge_page_buffer.h"
+#include "data/snapshot_file.h"
+#include "data/value_codec.h"
+#include "data/value_store.h"
+#include "glog/logging.h"
+#include "google/cloud/spanner/bytes.h"
+
+namespace trusted_server {
+
+namespace {
+
+// The low bits of the hash pick a slot inside each shard's table, so
+// shards are chosen from the top bits to keep the two independent.
+constexpr int kShardBits = 6;
+static_assert(CreativeSnapshot::kNumShards == 1 << kShardBits,
+              "kNumShards must match kShardBits");
+
+// zstd's own advice: train on about a hundred times as many bytes as
+// the dictionary may hold.
+constexpr size_t kSampleBytesPerDictionaryByte = 100;
+
+// Bytes of a row, but for its value.
+size_t RowBytes(const std::string& key, const StoredCreative& creative) {
+  return key.size() + creative.key_json.size();
+}
+
+size_t ValueBytes(const StoredCreative& creative) {
+  return creative.value->data.size() + creative.value->json.size();
+}
+
+CreativeView ViewOf(const StoredCreative& creative, bool compressed) {
+  return CreativeView{creative.data, creative.key_json, creative.json,
+                      compressed};
+}
+
+StoredCreative MakeCreative(std::string key_json,
+                            std::shared_ptr<const StoredValue> value) {
+  StoredCreative creative;
+  creative.key_json = std::move(key_json);
+  creative.data = value->data;
+  creative.json = value->json;
+  creative.value = std::move(value);
+  return creative;
+}
+
+CreativeView ViewOf(const SnapshotFile::Entry& entry) {
+  return CreativeView{entry.data, absl::string_view(), entry.json};
+}
+
+}  // namespace
+
+struct CreativeSnapshot::HotSet {
+  HotSet(size_t size, size_t max_bytes, HugePageBuffer::Pages pages)
+      : memory(size, pages), max_bytes(max_bytes), pages(pages) {}
+
+  // Returns a copy of the set, in memory of its own.
+  std::shared_ptr<const HotSet> Copy() const;
+
+  // Each creative's key, key JSON, JSON and data, one after the other.
+  HugePageBuffer memory;
+  // The budget and pages the set was laid out with.
+  const size_t max_bytes;
+  const HugePageBuffer::Pages pages;
+  // The keys laid out, hottest first, pointing into `memory`.
+  std::vector<absl::string_view> keys;
+  absl::flat_hash_map<absl::string_view, CreativeView> creatives;
+};
+
+std::shared_ptr<const CreativeSnapshot::HotSet> CreativeSnapshot::HotSet::Copy()
+    const {
+  auto copy = std::make_shared<HotSet>(memory.size(), max_bytes, pages);
+  memcpy(copy->memory.data(), memory.data(), memory.size());
+  auto rebase = [from = memory.data(),
+                 to = copy->memory.data()](absl::string_view view) {
+    return absl::string_view(to + (view.data() - from), view.size());
+  };
+  copy->keys.reserve(keys.size());
+  copy->creatives.reserve(creatives.size());
+  for (absl::string_view key : keys) {
+    const CreativeView& creative = creatives.at(key);
+    copy->keys.push_back(rebase(key));
+    copy->creatives.emplace(
+        copy->keys.back(),
+        CreativeView{rebase(creative.data), rebase(creative.key_json),
+                     rebase(creative.json), /*compressed=*/false});
+  }
+  return copy;
+}
+
+CreativeSnapshot::CreativeSnapshot()
+    : values_(std::make_shared<ValueStore>(nullptr)) {
+  auto empty = std::make_shared<const Shard>();
+  shards_.fill(empty);
+}
+
+void CreativeSnapshot::Builder::Add(std::string key,
+                                    const spanner::Bytes& value) {
+  Row row;
+  row.data = value.get<std::string>();
+  AppendCreativeKeyJson(key, &row.key_json);
+  AppendCreativeDataJson(row.data, &row.json);
+  int shard = ShardFor(key);
+  row.key = std::move(key);
+  rows_[shard].push_back(std::move(row));
+}
+
+absl::StatusOr<std::shared_ptr<const ValueCodec>>
+CreativeSnapshot::TrainCodec(const std::vector<Builder>& builders,
+                             const ValueCodec::Options& options) {
+  size_t rows = 0;
+  size_t row_bytes = 0;
+  for (const Builder& builder : builders) {
+    for (const auto& shard_rows : builder.rows_) {
+      rows += shard_rows.size();
+      for (const Builder::Row& row : shard_rows) row_bytes += row.json.size();
+    }
+  }
+  // Every `stride`th row is sampled, so the sample is spread over all
+  // shards and loading threads.
+  const size_t wanted_bytes =
+      options.dictionary_bytes * kSampleBytesPerDictionaryByte;
+  const size_t stride = std::max<size_t>(row_bytes / wanted_bytes, 1);
+  std::vector<absl::string_view> samples;
+  samples.reserve(rows / stride + 1);
+  size_t index = 0;
+  for (const Builder& builder : builders) {
+    for (const auto& shard_rows : builder.rows_) {
+      for (const Builder::Row& row : shard_rows) {
+        if (index++ % stride == 0) samples.push_back(row.json);
+      }
+    }
+  }
+  return ValueCodec::Train(samples, options);
+}
+
+std::shared_ptr<const CreativeSnapshot> CreativeSnapshot::Merge(
+    std::vector<Builder> builders, std::shared_ptr<const ValueCodec> codec,
+    size_t num_threads) {
+  auto snapshot = std::make_shared<CreativeSnapshot>();
+  if (codec != nullptr) snapshot->bytes_ = codec->dictionary_bytes();
+  snapshot->values_ = std::make_shared<ValueStore>(std::move(codec));
+  // Each thread builds the next shard left, interning, and compressing,
+  // the values of its rows from every builder.
+  std::atomic<int> next_shard{0};
+  auto build = [&] {
+    for (int i = next_shard++; i < kNumShards; i = next_shard++) {
+      size_t rows = 0;
+      for (const Builder& builder : builders) rows += builder.rows_[i].size();
+      auto shard = std::make_shared<Shard>();
+      shard->reserve(rows);
+      for (Builder& builder : builders) {
+        for (Builder::Row& row : builder.rows_[i]) {
+          shard->insert_or_assign(
+              std::move(row.key),
+              MakeCreative(std::move(row.key_json),
+                           snapshot->values_->Intern(std::move(row.data),
+                                                     std::move(row.json))));
+        }
+        builder.rows_[i].clear();
+        builder.rows_[i].shrink_to_fit();
+      }
+      snapshot->shards_[i] = std::move(shard);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < std::min<size_t>(num_threads, kNumShards); ++i) {
+    threads.emplace_back(build);
+  }
+  build();
+  for (std::thread& thread : threads) thread.join();
+
+  for (const std::shared_ptr<const Shard>& shard : snapshot->shards_) {
+    for (const auto& [key, creative] : *shard) {
+      snapshot->bytes_ += RowBytes(key, creative);
+      snapshot->unshared_value_bytes_ += ValueBytes(creative);
+    }
+    snapshot->size_ += shard->size();
+  }
+  snapshot->stored_keys_ = snapshot->size_;
+  return snapshot;
+}
+
+std::shared_ptr<const CreativeSnapshot> CreativeSnapshot::FromFile(
+    std::shared_ptr<const SnapshotFile> file) {
+  auto snapshot = std::make_shared<CreativeSnapshot>();
+  snapshot->size_ = file->size();
+  snapshot->bytes_ = file->length();
+  snapshot->file_ = std::move(file);
+  return snapshot;
+}
+
+int CreativeSnapshot::ShardFor(absl::string_view key) {
+  return static_cast<int>(absl::Hash<absl::string_view>{}(key) >>
+                          (64 - kShardBits));
+}
+
+std::shared_ptr<const CreativeSnapshot> CreativeSnapshot::WithUpdates(
+    Updates updates) const {
+  auto next = std::make_shared<CreativeSnapshot>(*this);
+  if (updates.empty()) return next;
+
+  std::array<std::shared_ptr<Shard>, kNumShards> copies;
+  bool hot_updated = false;
+  for (auto& [key, value] : updates) {
+    if (hot_ != nullptr && hot_->creatives.contains(key)) hot_updated = true;
+    int index = ShardFor(key);
+    if (copies[index] == nullptr) {
+      copies[index] = std::make_shared<Shard>(*shards_[index]);
+    }
+    bool in_file = file_ != nullptr && file_->Find(key).has_value();
+    std::string data = value.get<std::string>();
+    std::string key_json;
+    std::string json;
+    AppendCreativeKeyJson(key, &key_json);
+    AppendCreativeDataJson(data, &json);
+    StoredCreative creative = MakeCreative(
+        std::move(key_json), values_->Intern(std::move(data), std::move(json)));
+    next->bytes_ += RowBytes(key, creative);
+    next->unshared_value_bytes_ += ValueBytes(creative);
+    auto it = copies[index]->find(key);
+    if (it != copies[index]->end()) {
+      next->bytes_ -= RowBytes(it->first, it->second);
+      next->unshared_value_bytes_ -= ValueBytes(it->second);
+      it->second = std::move(creative);
+    } else {
+      copies[index]->emplace(std::move(key), std::move(creative));
+      ++next->stored_keys_;
+      if (!in_file) ++next->size_;
+    }
+  }
+
+  for (int i = 0; i < kNumShards; ++i) {
+    if (copies[i] != nullptr) next->shards_[i] = std::move(copies[i]);
+  }
+  if (hot_updated) {
+    // Laid out anew from the updated shards. The keys point into the
+    // old layout, which this snapshot keeps alive.
+    next->hot_ = next->LayOut(hot_->keys, hot_->max_bytes, hot_->pages);
+  }
+  return next;
+}
+
+std::shared_ptr<const CreativeSnapshot> CreativeSnapshot::WithHotKeys(
+    absl::Span<const absl::string_view> keys, size_t max_bytes,
+    HugePageBuffer::Pages pages) const {
+  auto next = std::make_shared<CreativeSnapshot>(*this);
+  next->hot_ = LayOut(keys, max_bytes, pages);
+  return next;
+}
+
+std::shared_ptr<const CreativeSnapshot> CreativeSnapshot::Replicate(
+    const CreativeSnapshot* source, const CreativeSnapshot* replica) const {
+  auto copy = std::make_shared<CreativeSnapshot>(*this);
+  // Snapshots loaded anew, with a store of their own, share nothing with
+  // the ones before them.
+  const bool derived = source != nullptr && replica != nullptr &&
+                       source->values_ == values_;
+  copy->values_ = derived
+                      ? replica->values_
+                      : std::make_shared<ValueStore>(values_->shared_codec());
+  // The copy of each value copied, so keys sharing a value here share
+  // its copy too.
+  absl::flat_hash_map<const StoredValue*, std::shared_ptr<const StoredValue>>
+      copied;
+  for (int i = 0; i < kNumShards; ++i) {
+    if (derived && shards_[i] == source->shards_[i]) {
+      copy->shards_[i] = replica->shards_[i];
+      continue;
+    }
+    auto shard = std::make_shared<Shard>();
+    shard->reserve(shards_[i]->size());
+    for (const auto& [key, creative] : *shards_[i]) {
+      std::shared_ptr<const StoredValue>& value = copied[creative.value.get()];
+      if (value == nullptr && derived) {
+        // `replica` holds a copy of every key of `source`.
+        auto it = source->shards_[i]->find(key);
+        if (it != source->shards_[i]->end() &&
+            it->second.value == creative.value) {
+          value = replica->shards_[i]->find(key)->second.value;
+        }
+      }
+      if (value == nullptr) value = copy->values_->Copy(*creative.value);
+      shard->emplace(key, MakeCreative(creative.key_json, value));
+    }
+    copy->shards_[i] = std::move(shard);
+  }
+  if (hot_ != nullptr) {
+    copy->hot_ = derived && hot_ == source->hot_ ? replica->hot_ : hot_->Copy();
+  }
+  return copy;
+}
+
+size_t CreativeSnapshot::hot_keys() const {
+  return hot_ == nullptr ? 0 : hot_->keys.size();
+}
+
+size_t CreativeSnapshot::hot_bytes() const {
+  return hot_ == nullptr ? 0 : hot_->memory.size();
+}
+
+std::shared_ptr<const CreativeSnapshot::HotSet> CreativeSnapshot::LayOut(
+    absl::Span<const absl::string_view> keys, size_t max_bytes,
+    HugePageBuffer::Pages pages) const {
+  // Creatives are rendered off to the side first, so the block is
+  // allocated at its final size.
+  struct Offsets {
+    size_t key;
+    size_t key_json;
+    size_t json;
+    size_t data;
+    size_t end;
+  };
+  std::vector<Offsets> laid_out;
+  std::string rendered;
+  for (absl::string_view key : keys) {
+    absl::optional<CreativeView> creative =
+        FindStored(key, absl::Hash<absl::string_view>{}(key));
+    if (!creative.has_value()) continue;
+    Offsets offsets;
+    offsets.key = rendered.size();
+    rendered.append(key.data(), key.size());
+    offsets.key_json = rendered.size();
+    rendered.append(creative->key_json.data(), creative->key_json.size());
+    offsets.json = rendered.size();
+    if (creative->compressed) {
+      CHECK(codec()->Decompress(creative->json, &rendered))
+          << "Corrupt compressed creative";
+    } else {
+      rendered.append(creative->json.data(), creative->json.size());
+    }
+    offsets.data = rendered.size();
+    AppendData(*creative, &rendered);
+    offsets.end = rendered.size();
+    if (offsets.end > max_bytes) {
+      rendered.resize(offsets.key);
+      break;
+    }
+    laid_out.push_back(offsets);
+  }
+  if (laid_out.empty()) return nullptr;
+
+  auto hot = std::make_shared<HotSet>(rendered.size(), max_bytes, pages);
+  memcpy(hot->memory.data(), rendered.data(), rendered.size());
+  const char* base = hot->memory.data();
+  auto view = [base](size_t begin, size_t end) {
+    return absl::string_view(base + begin, end - begin);
+  };
+  hot->keys.reserve(laid_out.size());
+  hot->creatives.reserve(laid_out.size());
+  for (const Offsets& offsets : laid_out) {
+    absl::string_view key = view(offsets.key, offsets.key_json);
+    if (!hot->creatives
+             .emplace(key, CreativeView{view(offsets.data, offsets.end),
+                                        view(offsets.key_json, offsets.json),
+                                        view(offsets.json, offsets.data),
+                                        /*compressed=*/false})
+             .second) {
+      continue;
+    }
+    hot->keys.push_back(key);
+  }
+  return hot;
+}
+
+absl::optional<CreativeView> CreativeSnapshot::Find(
+    absl::string_view key) const {
+  // The shards and hot set hash keys with absl::Hash too, so each key is
+  // hashed once for both picking its shard and probing it.
+  size_t hash = absl::Hash<absl::string_view>{}(key);
+  if (hot_ != nullptr) {
+    auto it = hot_->creatives.find(key, hash);
+    if (it != hot_->creatives.end()) return it->second;
+  }
+  return FindStored(key, hash);
+}
+
+absl::optional<CreativeView> CreativeSnapshot::FindStored(
+    absl::string_view key, size_t hash) const {
+  const Shard& shard = *shards_[hash >> (64 - kShardBits)];
+  auto it = shard.find(key, hash);
+  if (it != shard.end()) return ViewOf(it->second, codec() != nullptr);
+  if (file_ != nullptr) {
+    if (auto entry = file_->Find(key)) return ViewOf(*entry);
+  }
+  return absl::nullopt;
+}
+
+void CreativeSnapshot::FindBatch(
+    absl::Span<const absl::string_view> keys,
+    absl::Span<absl::optional<CreativeView>> results) const {
+  const bool compressed = codec() != nullptr;
+  for (size_t start = 0; start < keys.size(); start += kFindBatchSize) {
+    const size_t count = std::min(kFindBatchSize, keys.size() - start);
+    const absl::string_view* batch = keys.data() + start;
+    size_t hashes[kFindBatchSize];
+    const Shard* shards[kFindBatchSize];
+    // Keys to probe the shards for: those not in the hot set, if any.
+    size_t cold[kFindBatchSize];
+    size_t num_cold = 0;
+    for (size_t i = 0; i < count; ++i) {
+      hashes[i] = absl::Hash<absl::string_view>{}(batch[i]);
+      shards[i] = shards_[hashes[i] >> (64 - kShardBits)].get();
+      if (hot_ != nullptr) {
+        hot_->creatives.prefetch(batch[i]);
+      } else {
+        shards[i]->prefetch(batch[i]);
+        cold[num_cold++] = i;
+      }
+    }
+    if (hot_ != nullptr) {
+      for (size_t i = 0; i < count; ++i) {
+        auto it = hot_->creatives.find(batch[i], hashes[i]);
+        if (it != hot_->creatives.end()) {
+          results[start + i] = it->second;
+        } else {
+          shards[i]->prefetch(batch[i]);
+          cold[num_cold++] = i;
+        }
+      }
+    }
+
+    absl::string_view misses[kFindBatchSize];
+    size_t miss_index[kFindBatchSize];
+    size_t num_misses = 0;
+    for (size_t j = 0; j < num_cold; ++j) {
+      const size_t i = cold[j];
+      auto it = shards[i]->find(batch[i], hashes[i]);
+      if (it != shards[i]->end()) {
+        results[start + i] = ViewOf(it->second, compressed);
+      } else {
+        results[start + i] = absl::nullopt;
+        misses[num_misses] = batch[i];
+        miss_index[num_misses++] = start + i;
+      }
+    }
+
+    if (file_ == nullptr || num_misses == 0) continue;
+    absl::optional<SnapshotFile::Entry> entries[kFindBatchSize];
+    file_->FindBatch(absl::MakeConstSpan(misses, num_misses),
+                     absl::MakeSpan(entries, num_misses));
+    for (size_t i = 0; i < num_misses; ++i) {
+      if (const auto& entry = entries[i]) {
+        results[miss_index[i]] = ViewOf(*entry);
+      }
+    }
+  }
+}
+
+void CreativeSnapshot::AppendJson(const CreativeView& creative,
+                                  std::string* out) const {
+  out->append(creative.key_json.data(), creative.key_json.size());
+  if (!creative.compressed) {
+    out->append(creative.json.data(), creative.json.size());
+    return;
+  }
+  // The snapshot compressed the value itself, so it can only fail to
+  // decompress if memory is corrupt.
+  CHECK(codec()->Decompress(creative.json, out))
+      << "Corrupt compressed creative";
+}
+
+void CreativeSnapshot::AppendData(const CreativeView& creative,
+                                  std::string* out) const {
+  if (!creative.compressed) {
+    out->append(creative.data.data(), creative.data.size());
+    return;
+  }
+  // Scratch space is kept per thread, so it only allocates until it has
+  // grown to the largest creative.
+  thread_local std::string json;
+  thread_local std::string data;
+  json.clear();
+  CHECK(codec()->Decompress(creative.json, &json))
+      << "Corrupt compressed creative";
+  CHECK(absl::Base64Unescape(CreativeJsonData(json), &data))
+      << "Corrupt creative JSON";
+  out->append(data);
+}
+
+absl::Status CreativeSnapshot::WriteToFile(const std::string& path,
+                                           absl::Time latest_read) const {
+  // Rows of the shards are rendered whole one at a time as they are
+  // written, so persisting takes little memory beyond the sorted keys.
+  std::vector<std::pair<absl::string_view, CreativeView>> rows;
+  rows.reserve(size_);
+  const bool compressed = codec() != nullptr;
+  for (const auto& shard : shards_) {
+    for (const auto& [key, creative] : *shard) {
+      rows.emplace_back(key, ViewOf(creative, compressed));
+    }
+  }
+  if (file_ != nullptr) {
+    for (size_t i = 0; i < file_->size(); ++i) {
+      SnapshotFile::Entry entry = file_->entry(i);
+      const Shard& shard = *shards_[ShardFor(entry.key)];
+      if (!shard.contains(entry.key)) {
+        rows.emplace_back(entry.key, ViewOf(entry));
+      }
+    }
+  }
+  std::sort(rows.begin(), rows.end(),
+            [](const auto& a, const auto& b) { return a.first < b.first; });
+
+  auto writer = SnapshotFileWriter::Create(path);
+  if (!writer.ok()) return writer.status();
+  std::string data;
+  std::string json;
+  for (const auto& [key, creative] : rows) {
+    data.clear();
+    json.clear();
+    AppendData(creative, &data);
+    AppendJson(creative, &json);
+    absl::Status status = (*writer)->Add(key, data, json);
+    if (!status.ok()) return status;
+  }
+  return (*writer)->Finish(latest_read);
+}
+
+}  // namespace trusted_server
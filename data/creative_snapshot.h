@@ -0,0 +1,262 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CREATIVE_SNAPSHOT_H_
+#define CREATIVE_SNAPSHOT_H_
+
+#include <array>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "data/huge_page_buffer.h"
+#include "data/snapshot_file.h"
+#include "data/value_codec.h"
+#include "data/value_store.h"
+#include "google/cloud/spanner/bytes.h"
+
+namespace spanner = ::google::cloud::spanner;
+
+namespace trusted_server {
+
+// A creative as held in a snapshot. Its JSON object as it appears in a
+// response is rendered once when the row is ingested, so requests only
+// copy pointers to it: `key_json` followed by the value's JSON.
+struct StoredCreative {
+  std::string key_json;
+  // Shared with every other key with the same data.
+  std::shared_ptr<const StoredValue> value;
+  // The value's data and JSON, kept here so lookups need not reach the
+  // value itself, which lives elsewhere in memory.
+  absl::string_view data;
+  absl::string_view json;
+};
+
+// A creative as returned by lookups. The views point into the snapshot
+// (or the file mapped under it) and are valid for as long as it is alive.
+struct CreativeView {
+  absl::string_view data;
+  // The JSON object is `key_json` followed by `json`. Creatives served
+  // from a file have all of it in `json`.
+  absl::string_view key_json;
+  absl::string_view json;
+  // Whether `json` is compressed by the snapshot's codec, in which case
+  // `data` is empty. CreativeSnapshot::AppendJson() and AppendData()
+  // read either kind.
+  bool compressed = false;
+};
+
+// CreativeSnapshot is an immutable version of the creative data.
+// Readers pin a snapshot through a shared_ptr and can use it without
+// any locking for as long as they hold it. New versions are derived
+// with WithUpdates(), which copies only the shards an update touches
+// and shares every other shard with the previous version.
+//
+// A snapshot may sit on top of a memory-mapped SnapshotFile. The shards
+// then only hold the rows updated since the file was written and take
+// precedence over it; every other key is served from the file.
+//
+// The values of the shards are interned in a ValueStore shared by the
+// snapshot and every snapshot derived from it, so keys with the same
+// data share it. The store may also hold them compressed with a
+// ValueCodec, which trades decompressing every creative looked up for a
+// smaller footprint.
+//
+// The creatives of the most looked up keys can in addition be laid out
+// with WithHotKeys(): copied, decompressed and in order of popularity,
+// into one block of memory that is probed before the shards. The keys
+// and JSON lookups touch most then sit together on a few (huge) pages
+// instead of all over the heap.
+//
+// A snapshot can be copied with Replicate() into memory allocated by
+// another thread, e.g. one on another NUMA node, so the threads of each
+// node read a copy in their own node's memory.
+class CreativeSnapshot {
+ public:
+  static constexpr int kNumShards = 64;
+
+  using Shard = absl::flat_hash_map<std::string, StoredCreative>;
+
+  // Rows read from the database, applied in order so later entries
+  // overwrite earlier ones for the same key.
+  using Updates = std::vector<std::pair<std::string, spanner::Bytes>>;
+
+  // Collects rows for Merge(). Each loading thread fills its own
+  // builder, so the JSON rendering of the rows is spread across them.
+  class Builder {
+   public:
+    void Add(std::string key, const spanner::Bytes& value);
+
+   private:
+    friend class CreativeSnapshot;
+
+    // A row rendered but not interned yet.
+    struct Row {
+      std::string key;
+      std::string key_json;
+      std::string data;
+      std::string json;
+    };
+
+    std::array<std::vector<Row>, kNumShards> rows_;
+  };
+
+  // Creates an empty snapshot.
+  CreativeSnapshot();
+
+  // Trains a codec on an even sample of the rows of `builders`, to
+  // compress them with in Merge().
+  static absl::StatusOr<std::shared_ptr<const ValueCodec>> TrainCodec(
+      const std::vector<Builder>& builders,
+      const ValueCodec::Options& options);
+
+  // Creates a snapshot from the rows of `builders`, which hold disjoint
+  // sets of keys. Every shard is sized up front for all of its rows.
+  // Values are stored compressed with `codec` unless it is null. Shards
+  // are built, and their values interned, by `num_threads` threads.
+  static std::shared_ptr<const CreativeSnapshot> Merge(
+      std::vector<Builder> builders,
+      std::shared_ptr<const ValueCodec> codec = nullptr,
+      size_t num_threads = 1);
+
+  // Creates a snapshot serving the contents of `file`.
+  static std::shared_ptr<const CreativeSnapshot> FromFile(
+      std::shared_ptr<const SnapshotFile> file);
+
+  // Returns a new snapshot with `updates` applied on top of this one.
+  std::shared_ptr<const CreativeSnapshot> WithUpdates(Updates updates) const;
+
+  // Returns a new snapshot with the creatives of `keys`, given hottest
+  // first, laid out in that order in a block of at most `max_bytes`,
+  // replacing any previous layout. Keys the snapshot does not hold are
+  // skipped, and the layout ends at the first creative that does not
+  // fit. The block is backed with `pages`. Snapshots derived with
+  // WithUpdates() keep the layout, copying it anew should an update touch
+  // one of its keys.
+  std::shared_ptr<const CreativeSnapshot> WithHotKeys(
+      absl::Span<const absl::string_view> keys, size_t max_bytes,
+      HugePageBuffer::Pages pages = HugePageBuffer::Pages::kTransparent) const;
+
+  // Returns a copy of this snapshot whose keys, values and hot creatives
+  // are all allocated anew by the calling thread. Only the file the
+  // snapshot sits on, whose pages the kernel places, and the codec are
+  // shared with it.
+  //
+  // `replica`, if not null, must be a copy returned by an earlier call on
+  // `source`. The shards and hot creatives this snapshot shares with
+  // `source`, as those derived from it with WithUpdates() do, are then
+  // shared with `replica` instead of copied, and so are the values of
+  // keys updates did not change, so keeping a copy in step with a line of
+  // snapshots only copies what each update touched.
+  std::shared_ptr<const CreativeSnapshot> Replicate(
+      const CreativeSnapshot* source, const CreativeSnapshot* replica) const;
+
+  // Number of keys laid out by WithHotKeys(), and the bytes they take.
+  size_t hot_keys() const;
+  size_t hot_bytes() const;
+
+  // Returns the creative stored for `key`, or nullopt if there is none.
+  absl::optional<CreativeView> Find(absl::string_view key) const;
+
+  // Number of keys FindBatch() probes together.
+  static constexpr size_t kFindBatchSize = SnapshotFile::kFindBatchSize;
+
+  // Looks up every key of `keys` like Find(), storing the creative of
+  // keys[i] in results[i], which must be as long. Requests for many keys
+  // should use this: all keys of a batch are hashed and their table
+  // slots prefetched before any is probed, so the cache misses of the
+  // probes overlap instead of being taken one after the other. Does not
+  // allocate.
+  void FindBatch(absl::Span<const absl::string_view> keys,
+                 absl::Span<absl::optional<CreativeView>> results) const;
+
+  // Appends the JSON of `creative`, returned by this snapshot, to `out`,
+  // decompressing it if needed.
+  void AppendJson(const CreativeView& creative, std::string* out) const;
+
+  // Appends the data of `creative`, returned by this snapshot, to `out`,
+  // recovering it from the compressed JSON if needed.
+  void AppendData(const CreativeView& creative, std::string* out) const;
+
+  // The codec values are compressed with; null if they are not.
+  const ValueCodec* codec() const { return values_->codec(); }
+
+  // The values of the shards, and of every snapshot sharing them.
+  const ValueStore& values() const { return *values_; }
+
+  // Number of keys held by the shards, and the bytes their values would
+  // take were none shared. Against values(), they give what sharing
+  // saves.
+  size_t stored_keys() const { return stored_keys_; }
+  size_t unshared_value_bytes() const { return unshared_value_bytes_; }
+
+  // Number of keys in the snapshot.
+  size_t size() const { return size_; }
+
+  // Bytes of keys, creative data and JSON held by the snapshot, as
+  // stored, including the whole of the file it sits on, if any, the
+  // codec's dictionary and the creatives laid out by WithHotKeys().
+  // Values are counted once however many keys share them, and include
+  // those of older snapshots that are still alive.
+  size_t bytes() const { return bytes_ + values_->bytes() + hot_bytes(); }
+
+  // Writes every creative of the snapshot to a snapshot file at `path`,
+  // recording `latest_read` as the time the data is current as of.
+  // Compressed rows are written decompressed.
+  absl::Status WriteToFile(const std::string& path,
+                           absl::Time latest_read) const;
+
+  // Returns the shard `key` belongs to.
+  static int ShardFor(absl::string_view key);
+
+  // Returns the given shard; exposed so tests can check sharing.
+  const Shard* shard(int index) const { return shards_[index].get(); }
+
+ private:
+  // The creatives laid out by WithHotKeys().
+  struct HotSet;
+
+  // Find() but for the creatives of hot_. `hash` is that of `key`.
+  absl::optional<CreativeView> FindStored(absl::string_view key,
+                                          size_t hash) const;
+
+  // Copies the creatives of `keys` out of the shards and file, as
+  // WithHotKeys() lays them out. Returns null if there are none.
+  std::shared_ptr<const HotSet> LayOut(absl::Span<const absl::string_view> keys,
+                                       size_t max_bytes,
+                                       HugePageBuffer::Pages pages) const;
+
+  std::array<std::shared_ptr<const Shard>, kNumShards> shards_;
+  // Base data underneath the shards; null unless loaded from a file.
+  std::shared_ptr<const SnapshotFile> file_;
+  std::shared_ptr<ValueStore> values_;
+  // Null unless laid out by WithHotKeys().
+  std::shared_ptr<const HotSet> hot_;
+  size_t size_ = 0;
+  // Bytes of everything but the values.
+  size_t bytes_ = 0;
+  size_t stored_keys_ = 0;
+  size_t unshared_value_bytes_ = 0;
+};
+
+}  // namespace trusted_server
+#endif  // CREATIVE_SNAPSHOT_H_
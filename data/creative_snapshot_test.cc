@@ -0,0 +1,437 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "data/creative_snapshot.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "data/snapshot_file.h"
+#include "data/value_codec.h"
+#include "google/cloud/spanner/bytes.h"
+#include "gtest/gtest.h"
+
+namespace trusted_server {
+
+namespace {
+
+namespace spanner = ::google::cloud::spanner;
+
+spanner::Bytes Bytes(const std::string& value) { return spanner::Bytes(value); }
+
+std::shared_ptr<const CreativeSnapshot> MakeSnapshot(
+    CreativeSnapshot::Updates updates) {
+  return CreativeSnapshot().WithUpdates(std::move(updates));
+}
+
+// Returns the whole JSON object of the creative for `key`.
+std::string Json(const CreativeSnapshot& snapshot, absl::string_view key) {
+  std::string json;
+  if (auto creative = snapshot.Find(key)) snapshot.AppendJson(*creative, &json);
+  return json;
+}
+
+TEST(CreativeSnapshotTest, FindAfterUpdates) {
+  auto snapshot = MakeSnapshot({{"google.com/ad1", Bytes("a")},
+                                {"google.com/ad2", Bytes("b")},
+                                {"google.com/ad1", Bytes("c")}});
+  EXPECT_EQ(snapshot->size(), 2);
+  ASSERT_TRUE(snapshot->Find("google.com/ad1").has_value());
+  EXPECT_EQ(snapshot->Find("google.com/ad1")->data, "c");
+  ASSERT_TRUE(snapshot->Find("google.com/ad2").has_value());
+  EXPECT_EQ(snapshot->Find("google.com/ad2")->data, "b");
+  EXPECT_FALSE(snapshot->Find("google.com/missing").has_value());
+}
+
+TEST(CreativeSnapshotTest, RendersJsonAtIngest) {
+  auto snapshot = MakeSnapshot({{"google.com/\"ad1", Bytes("abc")}});
+  ASSERT_TRUE(snapshot->Find("google.com/\"ad1").has_value());
+  EXPECT_EQ(Json(*snapshot, "google.com/\"ad1"),
+            "{\"key\":\"google.com/\\\"ad1\",\"creativeData\":\"YWJj\"}");
+}
+
+TEST(CreativeSnapshotTest, PreviousVersionIsUnchanged) {
+  auto first = MakeSnapshot({{"google.com/ad1", Bytes("a")}});
+  auto second = first->WithUpdates({{"google.com/ad1", Bytes("b")},
+                                    {"google.com/ad2", Bytes("c")}});
+
+  EXPECT_EQ(first->size(), 1);
+  EXPECT_EQ(first->Find("google.com/ad1")->data, "a");
+  EXPECT_FALSE(first->Find("google.com/ad2").has_value());
+
+  EXPECT_EQ(second->size(), 2);
+  EXPECT_EQ(second->Find("google.com/ad1")->data, "b");
+  EXPECT_EQ(second->Find("google.com/ad2")->data, "c");
+
+  // Both count the values in the store they share; overwriting ad1
+  // replaced its key's bytes, and ad2 added its own.
+  size_t ad2_bytes = std::string("google.com/ad2").size() +
+                     second->Find("google.com/ad2")->key_json.size();
+  EXPECT_EQ(second->bytes(), first->bytes() + ad2_bytes);
+}
+
+TEST(CreativeSnapshotTest, UntouchedShardsAreShared) {
+  auto first = MakeSnapshot({{"google.com/ad1", Bytes("a")}});
+  auto second = first->WithUpdates({{"google.com/ad1", Bytes("b")}});
+
+  int updated_shard = CreativeSnapshot::ShardFor("google.com/ad1");
+  for (int i = 0; i < CreativeSnapshot::kNumShards; ++i) {
+    if (i == updated_shard) {
+      EXPECT_NE(first->shard(i), second->shard(i));
+    } else {
+      EXPECT_EQ(first->shard(i), second->shard(i));
+    }
+  }
+}
+
+TEST(CreativeSnapshotTest, MergesBuilders) {
+  std::vector<CreativeSnapshot::Builder> builders(3);
+  builders[0].Add("google.com/ad1", Bytes("a"));
+  builders[0].Add("google.com/ad2", Bytes("b"));
+  builders[2].Add("google.com/\"ad3", Bytes("abc"));
+  auto snapshot = CreativeSnapshot::Merge(std::move(builders));
+
+  EXPECT_EQ(snapshot->size(), 3);
+  EXPECT_EQ(snapshot->Find("google.com/ad1")->data, "a");
+  EXPECT_EQ(snapshot->Find("google.com/ad2")->data, "b");
+  EXPECT_EQ(Json(*snapshot, "google.com/\"ad3"),
+            "{\"key\":\"google.com/\\\"ad3\",\"creativeData\":\"YWJj\"}");
+  EXPECT_FALSE(snapshot->Find("google.com/missing").has_value());
+}
+
+TEST(CreativeSnapshotTest, MergesOnSeveralThreads) {
+  std::vector<CreativeSnapshot::Builder> builders(4);
+  for (int i = 0; i < 1000; ++i) {
+    builders[i % 4].Add(absl::StrCat("google.com/ad", i),
+                        Bytes(absl::StrCat("value", i % 10)));
+  }
+  ValueCodec::Options options;
+  options.dictionary_bytes = 1024;
+  auto codec = CreativeSnapshot::TrainCodec(builders, options);
+  ASSERT_TRUE(codec.ok()) << codec.status();
+  auto snapshot =
+      CreativeSnapshot::Merge(std::move(builders), *codec, /*num_threads=*/4);
+
+  EXPECT_EQ(snapshot->size(), 1000);
+  // Keys with the same data share it, whichever thread interned it.
+  EXPECT_EQ(snapshot->values().size(), 10);
+  for (int i : {0, 1, 999}) {
+    auto creative = snapshot->Find(absl::StrCat("google.com/ad", i));
+    ASSERT_TRUE(creative.has_value());
+    std::string data;
+    snapshot->AppendData(*creative, &data);
+    EXPECT_EQ(data, absl::StrCat("value", i % 10));
+  }
+}
+
+TEST(CreativeSnapshotTest, ServesFromFileWithOverlay) {
+  const std::string path =
+      absl::StrCat(testing::TempDir(), "/creative_snapshot_test.snap");
+  auto written = MakeSnapshot({{"google.com/ad1", Bytes("a")},
+                               {"google.com/ad2", Bytes("b")}});
+  ASSERT_TRUE(written->WriteToFile(path, absl::FromUnixSeconds(10)).ok());
+
+  auto file = SnapshotFile::Open(path, /*verify_checksum=*/true);
+  ASSERT_TRUE(file.ok()) << file.status();
+  EXPECT_EQ((*file)->latest_read(), absl::FromUnixSeconds(10));
+  auto loaded = CreativeSnapshot::FromFile(*std::move(file));
+  EXPECT_EQ(loaded->size(), 2);
+  EXPECT_EQ(loaded->Find("google.com/ad1")->data, "a");
+  EXPECT_EQ(loaded->Find("google.com/ad1")->json,
+            Json(*written, "google.com/ad1"));
+
+  auto updated = loaded->WithUpdates({{"google.com/ad1", Bytes("c")},
+                                      {"google.com/ad3", Bytes("d")}});
+  EXPECT_EQ(updated->size(), 3);
+  EXPECT_EQ(updated->Find("google.com/ad1")->data, "c");
+  EXPECT_EQ(updated->Find("google.com/ad2")->data, "b");
+  EXPECT_EQ(updated->Find("google.com/ad3")->data, "d");
+  EXPECT_EQ(loaded->Find("google.com/ad1")->data, "a");
+
+  // Rewriting a file-backed snapshot merges the overlay into the file.
+  ASSERT_TRUE(updated->WriteToFile(path, absl::FromUnixSeconds(20)).ok());
+  auto rewritten = SnapshotFile::Open(path, /*verify_checksum=*/true);
+  ASSERT_TRUE(rewritten.ok()) << rewritten.status();
+  ASSERT_EQ((*rewritten)->size(), 3);
+  EXPECT_EQ((*rewritten)->Find("google.com/ad1")->data, "c");
+  EXPECT_EQ((*rewritten)->Find("google.com/ad2")->data, "b");
+  EXPECT_EQ((*rewritten)->Find("google.com/ad3")->json,
+            Json(*updated, "google.com/ad3"));
+}
+
+TEST(CreativeSnapshotTest, FindBatchMatchesFind) {
+  const std::string path =
+      absl::StrCat(testing::TempDir(), "/find_batch_test.snap");
+  CreativeSnapshot::Updates rows;
+  for (int i = 0; i < 100; ++i) {
+    rows.emplace_back(absl::StrCat("file/", i), Bytes(absl::StrCat(i)));
+  }
+  ASSERT_TRUE(MakeSnapshot(std::move(rows))
+                  ->WriteToFile(path, absl::UnixEpoch())
+                  .ok());
+  auto file = SnapshotFile::Open(path, /*verify_checksum=*/true);
+  ASSERT_TRUE(file.ok()) << file.status();
+  auto snapshot = CreativeSnapshot::FromFile(*std::move(file))
+                      ->WithUpdates({{"file/1", Bytes("overlay")},
+                                     {"overlay/1", Bytes("x")}});
+
+  // Keys served by the shards, by the file and by neither, across
+  // several batches.
+  std::vector<std::string> keys = {"file/1", "overlay/1", "missing"};
+  for (int i = 0; i < 2 * CreativeSnapshot::kFindBatchSize; ++i) {
+    keys.push_back(absl::StrCat("file/", 3 * i));
+  }
+  std::vector<absl::string_view> views(keys.begin(), keys.end());
+  std::vector<absl::optional<CreativeView>> results(keys.size());
+  snapshot->FindBatch(views, absl::MakeSpan(results));
+  for (size_t i = 0; i < keys.size(); ++i) {
+    auto expected = snapshot->Find(keys[i]);
+    ASSERT_EQ(results[i].has_value(), expected.has_value()) << keys[i];
+    if (expected.has_value()) {
+      EXPECT_EQ(results[i]->data, expected->data);
+      EXPECT_EQ(results[i]->key_json, expected->key_json);
+      EXPECT_EQ(results[i]->json, expected->json);
+    }
+  }
+  EXPECT_EQ(results[0]->data, "overlay");
+  EXPECT_EQ(results[1]->data, "x");
+  EXPECT_FALSE(results[2].has_value());
+}
+
+TEST(CreativeSnapshotTest, CompressesWithCodec) {
+  const std::string path =
+      absl::StrCat(testing::TempDir(), "/compressed_test.snap");
+  std::vector<CreativeSnapshot::Builder> builders(2);
+  std::vector<CreativeSnapshot::Builder> uncompressed_builders(2);
+  for (int i = 0; i < 1000; ++i) {
+    std::string key = absl::StrCat("google.com/ad", i);
+    spanner::Bytes data(
+        absl::StrCat("<div class=\"ad\"><a href=\"https://ads.test/",
+                     i * 7919 % 1000, "\">Offer ", i, "</a></div>"));
+    builders[i % 2].Add(key, data);
+    uncompressed_builders[i % 2].Add(key, data);
+  }
+  ValueCodec::Options options;
+  options.dictionary_bytes = 4096;
+  auto codec = CreativeSnapshot::TrainCodec(builders, options);
+  ASSERT_TRUE(codec.ok()) << codec.status();
+  auto uncompressed =
+      CreativeSnapshot::Merge(std::move(uncompressed_builders));
+  auto snapshot = CreativeSnapshot::Merge(std::move(builders), *codec);
+  EXPECT_EQ(snapshot->size(), 1000);
+  EXPECT_LT(snapshot->bytes(), uncompressed->bytes() / 2);
+
+  auto updated = snapshot->WithUpdates({{"google.com/new", Bytes("abc")}});
+  for (const std::string& key : {"google.com/ad0", "google.com/ad999"}) {
+    auto creative = updated->Find(key);
+    auto expected = uncompressed->Find(key);
+    ASSERT_TRUE(creative.has_value());
+    EXPECT_TRUE(creative->compressed);
+    std::string json;
+    updated->AppendJson(*creative, &json);
+    EXPECT_EQ(json, Json(*uncompressed, key));
+    std::string data;
+    updated->AppendData(*creative, &data);
+    EXPECT_EQ(data, expected->data);
+  }
+  auto added = updated->Find("google.com/new");
+  ASSERT_TRUE(added.has_value());
+  EXPECT_TRUE(added->compressed);
+  std::string data;
+  updated->AppendData(*added, &data);
+  EXPECT_EQ(data, "abc");
+
+  // Files hold the creatives decompressed.
+  ASSERT_TRUE(updated->WriteToFile(path, absl::UnixEpoch()).ok());
+  auto file = SnapshotFile::Open(path, /*verify_checksum=*/true);
+  ASSERT_TRUE(file.ok()) << file.status();
+  EXPECT_EQ((*file)->size(), 1001);
+  EXPECT_EQ((*file)->Find("google.com/ad5")->data,
+            uncompressed->Find("google.com/ad5")->data);
+  EXPECT_EQ((*file)->Find("google.com/ad5")->json,
+            Json(*uncompressed, "google.com/ad5"));
+
+  // Hot creatives are laid out decompressed.
+  auto hot = updated->WithHotKeys({"google.com/ad5"}, 1 << 20);
+  auto creative = hot->Find("google.com/ad5");
+  ASSERT_TRUE(creative.has_value());
+  EXPECT_FALSE(creative->compressed);
+  EXPECT_EQ(creative->data, uncompressed->Find("google.com/ad5")->data);
+  EXPECT_EQ(Json(*hot, "google.com/ad5"),
+            Json(*uncompressed, "google.com/ad5"));
+}
+
+TEST(CreativeSnapshotTest, LaysOutHotKeys) {
+  CreativeSnapshot::Updates rows;
+  for (int i = 0; i < 100; ++i) {
+    rows.emplace_back(absl::StrCat("google.com/ad", i),
+                      Bytes(absl::StrCat("data", i)));
+  }
+  auto snapshot = MakeSnapshot(std::move(rows));
+  std::vector<absl::string_view> hottest = {
+      "google.com/ad7", "google.com/missing", "google.com/ad3"};
+  auto laid_out = snapshot->WithHotKeys(hottest, 1 << 20);
+  EXPECT_EQ(laid_out->hot_keys(), 2);
+  EXPECT_EQ(laid_out->size(), 100);
+  EXPECT_EQ(laid_out->bytes(), snapshot->bytes() + laid_out->hot_bytes());
+
+  // Hot creatives are copies, laid out hottest first.
+  auto ad7 = laid_out->Find("google.com/ad7");
+  auto ad3 = laid_out->Find("google.com/ad3");
+  ASSERT_TRUE(ad7.has_value());
+  ASSERT_TRUE(ad3.has_value());
+  EXPECT_EQ(ad7->data, "data7");
+  EXPECT_NE(ad7->data.data(), snapshot->Find("google.com/ad7")->data.data());
+  EXPECT_LT(ad7->json.data(), ad3->json.data());
+  EXPECT_EQ(Json(*laid_out, "google.com/ad7"),
+            Json(*snapshot, "google.com/ad7"));
+  EXPECT_EQ(laid_out->Find("google.com/ad4")->data, "data4");
+  EXPECT_FALSE(laid_out->Find("google.com/missing").has_value());
+
+  std::vector<absl::string_view> keys = {"google.com/ad3", "google.com/ad4",
+                                         "google.com/missing",
+                                         "google.com/ad7"};
+  std::vector<absl::optional<CreativeView>> results(keys.size());
+  laid_out->FindBatch(keys, absl::MakeSpan(results));
+  for (size_t i = 0; i < keys.size(); ++i) {
+    auto expected = laid_out->Find(keys[i]);
+    ASSERT_EQ(results[i].has_value(), expected.has_value()) << keys[i];
+    if (expected.has_value()) {
+      EXPECT_EQ(results[i]->data.data(), expected->data.data());
+      EXPECT_EQ(results[i]->json, expected->json);
+    }
+  }
+
+  // Updates to hot keys are laid out anew; others keep the layout.
+  auto updated = laid_out->WithUpdates({{"google.com/ad7", Bytes("new")}});
+  EXPECT_EQ(updated->hot_keys(), 2);
+  EXPECT_EQ(updated->Find("google.com/ad7")->data, "new");
+  EXPECT_EQ(laid_out->Find("google.com/ad7")->data, "data7");
+  auto cold_update = laid_out->WithUpdates({{"google.com/ad4", Bytes("x")}});
+  EXPECT_EQ(cold_update->Find("google.com/ad3")->data.data(),
+            ad3->data.data());
+
+  // The layout stops at the first creative over the budget.
+  size_t ad7_bytes = std::string("google.com/ad7").size() +
+                     ad7->key_json.size() + ad7->json.size() +
+                     ad7->data.size();
+  EXPECT_EQ(snapshot->WithHotKeys(hottest, ad7_bytes)->hot_keys(), 1);
+  EXPECT_EQ(snapshot->WithHotKeys(hottest, ad7_bytes - 1)->hot_keys(), 0);
+}
+
+TEST(CreativeSnapshotTest, SharesIdenticalValues) {
+  std::vector<CreativeSnapshot::Builder> builders(2);
+  for (int i = 0; i < 100; ++i) {
+    builders[i % 2].Add(absl::StrCat("google.com/ad", i),
+                        Bytes(i < 90 ? "shared" : absl::StrCat("own", i)));
+  }
+  auto snapshot = CreativeSnapshot::Merge(std::move(builders));
+  EXPECT_EQ(snapshot->size(), 100);
+  EXPECT_EQ(snapshot->stored_keys(), 100);
+  EXPECT_EQ(snapshot->values().size(), 11);
+  EXPECT_LT(snapshot->values().bytes(), snapshot->unshared_value_bytes());
+  EXPECT_EQ(snapshot->Find("google.com/ad0")->data.data(),
+            snapshot->Find("google.com/ad89")->data.data());
+  EXPECT_EQ(Json(*snapshot, "google.com/ad89"),
+            "{\"key\":\"google.com/ad89\",\"creativeData\":\"c2hhcmVk\"}");
+
+  // Updates share the values already held, and values no key holds any
+  // longer are dropped with the last snapshot holding them.
+  auto updated = snapshot->WithUpdates({{"google.com/ad90", Bytes("shared")},
+                                        {"google.com/new", Bytes("shared")},
+                                        {"google.com/ad0", Bytes("other")}});
+  EXPECT_EQ(updated->stored_keys(), 101);
+  EXPECT_EQ(updated->Find("google.com/new")->data.data(),
+            updated->Find("google.com/ad1")->data.data());
+  EXPECT_EQ(updated->values().size(), 12);
+  snapshot.reset();
+  EXPECT_EQ(updated->values().size(), 11);
+  EXPECT_EQ(updated->Find("google.com/ad0")->data, "other");
+  EXPECT_EQ(updated->Find("google.com/ad90")->data, "shared");
+}
+
+TEST(CreativeSnapshotTest, ReplicatesIntoMemoryOfItsOwn) {
+  std::vector<CreativeSnapshot::Builder> builders(1);
+  for (int i = 0; i < 100; ++i) {
+    builders[0].Add(absl::StrCat("google.com/ad", i),
+                    Bytes(i < 50 ? "shared" : absl::StrCat("own", i)));
+  }
+  std::vector<absl::string_view> hottest = {"google.com/ad7"};
+  auto snapshot =
+      CreativeSnapshot::Merge(std::move(builders))->WithHotKeys(hottest, 1024);
+  auto replica = snapshot->Replicate(nullptr, nullptr);
+  EXPECT_EQ(replica->size(), snapshot->size());
+  EXPECT_EQ(replica->bytes(), snapshot->bytes());
+  EXPECT_EQ(replica->hot_keys(), 1);
+  EXPECT_EQ(replica->values().size(), snapshot->values().size());
+  EXPECT_NE(&replica->values(), &snapshot->values());
+  for (int i : {0, 7, 49, 50, 99}) {
+    const std::string key = absl::StrCat("google.com/ad", i);
+    auto original = snapshot->Find(key);
+    auto copy = replica->Find(key);
+    ASSERT_TRUE(copy.has_value()) << key;
+    EXPECT_EQ(copy->data, original->data);
+    EXPECT_NE(copy->data.data(), original->data.data());
+    EXPECT_NE(copy->key_json.data(), original->key_json.data());
+    EXPECT_EQ(Json(*replica, key), Json(*snapshot, key));
+  }
+  EXPECT_EQ(replica->Find("google.com/ad0")->data.data(),
+            replica->Find("google.com/ad49")->data.data());
+  for (int i = 0; i < CreativeSnapshot::kNumShards; ++i) {
+    EXPECT_NE(replica->shard(i), snapshot->shard(i));
+  }
+
+  // Keeping the replica in step only copies the shards and values an
+  // update touched.
+  auto updated = snapshot->WithUpdates({{"google.com/ad1", Bytes("new")}});
+  auto next = updated->Replicate(snapshot.get(), replica.get());
+  const int touched = CreativeSnapshot::ShardFor("google.com/ad1");
+  for (int i = 0; i < CreativeSnapshot::kNumShards; ++i) {
+    if (i == touched) {
+      EXPECT_NE(next->shard(i), replica->shard(i));
+    } else {
+      EXPECT_EQ(next->shard(i), replica->shard(i));
+    }
+  }
+  EXPECT_EQ(&next->values(), &replica->values());
+  EXPECT_EQ(next->Find("google.com/ad1")->data, "new");
+  EXPECT_NE(next->Find("google.com/ad1")->data.data(),
+            updated->Find("google.com/ad1")->data.data());
+  EXPECT_EQ(next->Find("google.com/ad7")->json.data(),
+            replica->Find("google.com/ad7")->json.data());
+  for (const auto& [key, creative] : *updated->shard(touched)) {
+    if (key == "google.com/ad1") continue;
+    EXPECT_EQ(next->Find(key)->data.data(), replica->Find(key)->data.data())
+        << key;
+  }
+  EXPECT_EQ(replica->Find("google.com/ad1")->data, "shared");
+
+  // A snapshot loaded anew is copied whole.
+  auto reloaded = MakeSnapshot({{"google.com/ad1", Bytes("reloaded")}});
+  auto fresh = reloaded->Replicate(updated.get(), next.get());
+  EXPECT_EQ(fresh->size(), 1);
+  EXPECT_EQ(fresh->hot_keys(), 0);
+  EXPECT_NE(&fresh->values(), &next->values());
+  EXPECT_EQ(fresh->Find("google.com/ad1")->data, "reloaded");
+}
+
+}  // namespace
+
+}  // namespace trusted_server
@@ -0,0 +1,101 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "data/hash_ring.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "glog/logging.h"
+#include "openssl/sha.h"
+
+namespace trusted_server {
+
+HashRing::HashRing(int num_shards, int points_per_shard)
+    : num_shards_(num_shards) {
+  CHECK_GE(num_shards, 1);
+  CHECK_GE(points_per_shard, 1);
+  points_.reserve(num_shards * points_per_shard);
+  for (int shard = 0; shard < num_shards; ++shard) {
+    for (int point = 0; point < points_per_shard; ++point) {
+      points_.push_back(
+          {Position(absl::StrCat("shard ", shard, " point ", point)), shard});
+    }
+  }
+  // Ties, which take two points hashing alike, go to the lower shard.
+  std::sort(points_.begin(), points_.end(),
+            [](const Point& a, const Point& b) {
+              return a.position != b.position ? a.position < b.position
+                                              : a.shard < b.shard;
+            });
+}
+
+uint64_t HashRing::Position(absl::string_view key) {
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const unsigned char*>(key.data()), key.size(),
+         digest);
+  uint64_t position = 0;
+  for (int i = 0; i < 8; ++i) position = position << 8 | digest[i];
+  return position;
+}
+
+std::string HashRing::PositionBytes(uint64_t position) {
+  std::string bytes(8, '\0');
+  for (int i = 7; i >= 0; --i) {
+    bytes[i] = static_cast<char>(position & 0xff);
+    position >>= 8;
+  }
+  return bytes;
+}
+
+int HashRing::ShardAt(uint64_t position) const {
+  auto it = std::lower_bound(
+      points_.begin(), points_.end(), position,
+      [](const Point& point, uint64_t position) {
+        return point.position < position;
+      });
+  return it == points_.end() ? points_.front().shard : it->shard;
+}
+
+std::vector<HashRing::Range> HashRing::RangesOf(int shard) const {
+  std::vector<Range> ranges;
+  auto add = [&](uint64_t first, uint64_t last) {
+    if (!ranges.empty() && ranges.back().last + 1 == first) {
+      ranges.back().last = last;
+    } else {
+      ranges.push_back({first, last});
+    }
+  };
+  // The ring is cut open at 0: the positions up to the first point and
+  // those past the last one both belong to the first point.
+  uint64_t first = 0;
+  for (size_t i = 0; i < points_.size(); ++i) {
+    if (i > 0 && points_[i].position == points_[i - 1].position) continue;
+    if (points_[i].shard == shard) add(first, points_[i].position);
+    first = points_[i].position + 1;
+  }
+  const uint64_t last_point = points_.back().position;
+  if (points_.front().shard == shard &&
+      last_point != std::numeric_limits<uint64_t>::max()) {
+    add(last_point + 1, std::numeric_limits<uint64_t>::max());
+  }
+  return ranges;
+}
+
+}  // namespace trusted_server
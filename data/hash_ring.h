@@ -0,0 +1,84 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef HASH_RING_H_
+#define HASH_RING_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+
+namespace trusted_server {
+
+// HashRing splits the key space into shards by consistent hashing, so
+// servers can each hold the creatives of one shard and routers can tell
+// which server holds a key.
+//
+// Keys and shards are placed on a ring of 64-bit positions. A key's
+// position is the first 8 bytes of its SHA-256, read big-endian, which
+// Spanner computes as SUBSTR(SHA256(CreativeId), 1, 8) so the database
+// can filter a shard's rows itself. Each shard is placed at a number of
+// points and owns the positions from the point before, excluded, up to
+// each of them, wrapping around past the last point. Going from N to N+1
+// shards only moves keys to the new shard, about 1/(N+1) of them.
+//
+// Every ring built with the same arguments splits keys the same way, in
+// any process.
+class HashRing {
+ public:
+  static constexpr int kDefaultPointsPerShard = 64;
+
+  // Positions from `first` to `last`, both included.
+  struct Range {
+    uint64_t first;
+    uint64_t last;
+  };
+
+  // Places `num_shards` shards, at least one, at `points_per_shard`
+  // points each. More points even out the share of each shard at the
+  // cost of more ranges per shard.
+  explicit HashRing(int num_shards,
+                    int points_per_shard = kDefaultPointsPerShard);
+
+  // Returns the position of `key` on the ring.
+  static uint64_t Position(absl::string_view key);
+
+  // Returns `position` as the 8 bytes Spanner compares it as.
+  static std::string PositionBytes(uint64_t position);
+
+  // Returns the shard owning `key`, in [0, num_shards()).
+  int ShardOf(absl::string_view key) const { return ShardAt(Position(key)); }
+  int ShardAt(uint64_t position) const;
+
+  // Returns the positions owned by `shard`, as sorted ranges that
+  // neither overlap nor touch.
+  std::vector<Range> RangesOf(int shard) const;
+
+  int num_shards() const { return num_shards_; }
+
+ private:
+  struct Point {
+    uint64_t position;
+    int shard;
+  };
+
+  const int num_shards_;
+  // Sorted by position.
+  std::vector<Point> points_;
+};
+
+}  // namespace trusted_server
+#endif  // HASH_RING_H_
@@ -0,0 +1,116 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "data/hash_ring.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "gtest/gtest.h"
+
+namespace trusted_server {
+
+namespace {
+
+TEST(HashRingTest, PositionsAreSha256Prefixes) {
+  // SHA-256("abc") = ba7816bf8f01cfea...
+  EXPECT_EQ(HashRing::Position("abc"), 0xba7816bf8f01cfeaULL);
+  EXPECT_EQ(HashRing::PositionBytes(0xba7816bf8f01cfeaULL),
+            "\xba\x78\x16\xbf\x8f\x01\xcf\xea");
+}
+
+TEST(HashRingTest, SpreadsKeys) {
+  constexpr int kNumKeys = 40000;
+  HashRing ring(4);
+  std::vector<int> counts(ring.num_shards());
+  for (int i = 0; i < kNumKeys; ++i) {
+    int shard = ring.ShardOf(absl::StrCat("google.com/ad", i));
+    ASSERT_GE(shard, 0);
+    ASSERT_LT(shard, ring.num_shards());
+    ++counts[shard];
+  }
+  for (int count : counts) {
+    EXPECT_GT(count, kNumKeys / 4 * 0.7);
+    EXPECT_LT(count, kNumKeys / 4 * 1.3);
+  }
+
+  HashRing single(1);
+  EXPECT_EQ(single.ShardOf("google.com/ad1"), 0);
+  ASSERT_EQ(single.RangesOf(0).size(), 1);
+  EXPECT_EQ(single.RangesOf(0)[0].first, 0);
+  EXPECT_EQ(single.RangesOf(0)[0].last, std::numeric_limits<uint64_t>::max());
+}
+
+TEST(HashRingTest, RangesMatchShards) {
+  HashRing ring(3, 8);
+  std::vector<std::pair<HashRing::Range, int>> ranges;
+  for (int shard = 0; shard < ring.num_shards(); ++shard) {
+    for (const HashRing::Range& range : ring.RangesOf(shard)) {
+      ranges.push_back({range, shard});
+    }
+  }
+  std::sort(ranges.begin(), ranges.end(), [](const auto& a, const auto& b) {
+    return a.first.first < b.first.first;
+  });
+  // The ranges of all shards tile the ring, and the shard owning each
+  // end of a range is the shard it belongs to.
+  ASSERT_FALSE(ranges.empty());
+  EXPECT_EQ(ranges.front().first.first, 0);
+  EXPECT_EQ(ranges.back().first.last, std::numeric_limits<uint64_t>::max());
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    const auto& [range, shard] = ranges[i];
+    ASSERT_LE(range.first, range.last);
+    if (i > 0) {
+      EXPECT_EQ(ranges[i - 1].first.last + 1, range.first);
+    }
+    EXPECT_EQ(ring.ShardAt(range.first), shard);
+    EXPECT_EQ(ring.ShardAt(range.last), shard);
+  }
+  for (int i = 0; i < 1000; ++i) {
+    std::string key = absl::StrCat("google.com/ad", i);
+    uint64_t position = HashRing::Position(key);
+    int owner = ring.ShardOf(key);
+    int matches = 0;
+    for (const HashRing::Range& range : ring.RangesOf(owner)) {
+      matches += range.first <= position && position <= range.last;
+    }
+    EXPECT_EQ(matches, 1) << key;
+  }
+}
+
+TEST(HashRingTest, AddingShardOnlyMovesKeysToIt) {
+  HashRing three(3);
+  HashRing four(4);
+  int moved = 0;
+  for (int i = 0; i < 10000; ++i) {
+    std::string key = absl::StrCat("google.com/ad", i);
+    int before = three.ShardOf(key);
+    int after = four.ShardOf(key);
+    if (before != after) {
+      EXPECT_EQ(after, 3) << key;
+      ++moved;
+    }
+  }
+  EXPECT_GT(moved, 10000 / 4 * 0.7);
+  EXPECT_LT(moved, 10000 / 4 * 1.3);
+}
+
+}  // namespace
+
+}  // namespace trusted_server
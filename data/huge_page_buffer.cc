@@ -0,0 +1,84 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "data/huge_page_buffer.h"
+
+#include <sys/mman.h>
+
+#include <cstdint>
+
+#include "glog/logging.h"
+
+namespace trusted_server {
+
+HugePageBuffer::HugePageBuffer(size_t size, Pages pages) : size_(size) {
+  if (size < kHugePageSize) {
+    data_ = new char[size]();
+    return;
+  }
+  const size_t length = (size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+  if (pages == Pages::kExplicit && MapExplicit(length)) return;
+  // Transparent huge pages only back whole aligned 2 MiB ranges, which
+  // mmap does not promise, so a huge page more is mapped and the excess
+  // trimmed.
+  void* mapping = mmap(nullptr, length + kHugePageSize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    PLOG(WARNING) << "Failed to map " << length << " bytes; using the heap";
+    data_ = new char[size]();
+    return;
+  }
+  const uintptr_t start = reinterpret_cast<uintptr_t>(mapping);
+  const uintptr_t aligned = (start + kHugePageSize - 1) & ~(kHugePageSize - 1);
+  if (aligned > start) munmap(mapping, aligned - start);
+  const size_t tail = start + kHugePageSize - aligned;
+  if (tail > 0) munmap(reinterpret_cast<void*>(aligned + length), tail);
+  data_ = reinterpret_cast<char*>(aligned);
+  mapped_ = length;
+#ifdef MADV_HUGEPAGE
+  huge_pages_ = madvise(data_, mapped_, MADV_HUGEPAGE) == 0;
+#endif
+}
+
+bool HugePageBuffer::MapExplicit(size_t length) {
+#ifdef MAP_HUGETLB
+  // Mappings of reserved huge pages are aligned to them by the kernel.
+  void* mapping =
+      mmap(nullptr, length, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+  if (mapping == MAP_FAILED) {
+    // Layouts are redone on every refresh, so this is logged only once.
+    LOG_FIRST_N(WARNING, 1) << "Not enough reserved huge pages free for "
+                            << length << " bytes; using transparent ones";
+    return false;
+  }
+  data_ = static_cast<char*>(mapping);
+  mapped_ = length;
+  huge_pages_ = true;
+  explicit_huge_pages_ = true;
+  return true;
+#else
+  return false;
+#endif
+}
+
+HugePageBuffer::~HugePageBuffer() {
+  if (mapped_ > 0) {
+    munmap(data_, mapped_);
+  } else {
+    delete[] data_;
+  }
+}
+
+}  // namespace trusted_server
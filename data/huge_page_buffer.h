@@ -0,0 +1,75 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef HUGE_PAGE_BUFFER_H_
+#define HUGE_PAGE_BUFFER_H_
+
+#include <cstddef>
+
+namespace trusted_server {
+
+// HugePageBuffer is a block of memory for data that is read at random
+// and often, which it asks the kernel to back with transparent huge
+// pages, so a few TLB entries cover all of it. Where the kernel has
+// them disabled or the block is too small, it is made of ordinary pages
+// and works all the same.
+class HugePageBuffer {
+ public:
+  static constexpr size_t kHugePageSize = size_t{2} << 20;
+
+  // The huge pages blocks of at least kHugePageSize are backed with.
+  enum class Pages {
+    // Transparent huge pages, which the kernel assembles as it can.
+    kTransparent,
+    // Huge pages reserved up front in /proc/sys/vm/nr_hugepages, which
+    // are never split or reclaimed. Blocks fall back to transparent huge
+    // pages when not enough are free.
+    kExplicit,
+  };
+
+  // Allocates `size` bytes, zeroed. Blocks of at least kHugePageSize are
+  // mapped aligned to it and backed with `pages`; smaller ones come from
+  // the heap.
+  explicit HugePageBuffer(size_t size, Pages pages = Pages::kTransparent);
+  ~HugePageBuffer();
+
+  HugePageBuffer(const HugePageBuffer&) = delete;
+  HugePageBuffer& operator=(const HugePageBuffer&) = delete;
+
+  char* data() { return data_; }
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+  // Whether the kernel accepted to back the block with huge pages. It
+  // may still fall back to ordinary pages under memory pressure.
+  bool huge_pages() const { return huge_pages_; }
+
+  // Whether the block is backed with reserved huge pages.
+  bool explicit_huge_pages() const { return explicit_huge_pages_; }
+
+ private:
+  // Maps `length` bytes of reserved huge pages into data_. Returns false
+  // if there are not enough free.
+  bool MapExplicit(size_t length);
+
+  char* data_ = nullptr;
+  size_t size_ = 0;
+  // Length of the mapping at data_; 0 if allocated from the heap.
+  size_t mapped_ = 0;
+  bool huge_pages_ = false;
+  bool explicit_huge_pages_ = false;
+};
+
+}  // namespace trusted_server
+#endif  // HUGE_PAGE_BUFFER_H_
@@ -0,0 +1,68 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "data/huge_page_buffer.h"
+
+#include <cstdint>
+
+#include "gtest/gtest.h"
+
+namespace trusted_server {
+
+namespace {
+
+TEST(HugePageBufferTest, AllocatesSmallBuffersFromTheHeap) {
+  HugePageBuffer buffer(100);
+  ASSERT_NE(buffer.data(), nullptr);
+  EXPECT_EQ(buffer.size(), 100);
+  EXPECT_FALSE(buffer.huge_pages());
+  for (size_t i = 0; i < buffer.size(); ++i) EXPECT_EQ(buffer.data()[i], 0);
+}
+
+TEST(HugePageBufferTest, AlignsLargeBuffers) {
+  const size_t size = 3 * HugePageBuffer::kHugePageSize + 1;
+  HugePageBuffer buffer(size);
+  ASSERT_NE(buffer.data(), nullptr);
+  EXPECT_EQ(buffer.size(), size);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(buffer.data()) %
+                HugePageBuffer::kHugePageSize,
+            0);
+  // Whether huge pages back it depends on the kernel; either way the
+  // whole buffer is usable.
+  buffer.data()[0] = 1;
+  buffer.data()[size - 1] = 2;
+  EXPECT_EQ(buffer.data()[size / 2], 0);
+}
+
+TEST(HugePageBufferTest, FallsBackFromExplicitHugePages) {
+  // Reserved huge pages are used if the machine has enough free, and
+  // transparent ones otherwise.
+  const size_t size = 2 * HugePageBuffer::kHugePageSize;
+  HugePageBuffer buffer(size, HugePageBuffer::Pages::kExplicit);
+  ASSERT_NE(buffer.data(), nullptr);
+  EXPECT_EQ(buffer.size(), size);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(buffer.data()) %
+                HugePageBuffer::kHugePageSize,
+            0);
+  if (buffer.explicit_huge_pages()) EXPECT_TRUE(buffer.huge_pages());
+  buffer.data()[size - 1] = 1;
+  EXPECT_EQ(buffer.data()[0], 0);
+
+  HugePageBuffer small(100, HugePageBuffer::Pages::kExplicit);
+  EXPECT_FALSE(small.explicit_huge_pages());
+}
+
+}  // namespace
+
+}  // namespace trusted_server
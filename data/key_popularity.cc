@@ -0,0 +1,364 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "data/key_popularity.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/flags/flag.h"
+#include "absl/hash/hash.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
+#include "data/creative_json.h"
+
+ABSL_FLAG(int, key_popularity_sample_period, 0,
+          "Lookups of each serving thread between two counted towards the "
+          "popularity of keys, e.g. 16. 0 disables tracking popularity.");
+
+ABSL_FLAG(int, key_popularity_tracked_keys, 32768,
+          "Number of keys whose popularity is tracked, the candidates for "
+          "/debug/hot_keys and for being packed together in memory.");
+
+namespace trusted_server {
+
+namespace {
+
+// Samples a thread keeps for Hottest() to track.
+constexpr size_t kRingSlots = 512;
+
+std::atomic<uint64_t> next_popularity_id{0};
+
+size_t RoundUpToPowerOfTwo(size_t n) {
+  size_t power = 1;
+  while (power < n) power <<= 1;
+  return power;
+}
+
+}  // namespace
+
+// Keys sampled by one thread, waiting to be tracked. The thread is the
+// only one to add keys, and Hottest() the only one to take them, so
+// neither has to lock.
+//
+// A ring is shared by its tracker and by its thread, which marks it
+// exited when it exits. The tracker then takes the keys left in it and
+// drops it, and whichever of the two lets go last frees it, so threads
+// that come and go, like those of gRPC's synchronous server, do not
+// leave their rings behind.
+class KeyPopularity::ThreadRing {
+ public:
+  ThreadRing() : thread(std::this_thread::get_id()) {}
+
+  // Makes the calling thread mark `ring` exited when it exits.
+  static void Own(std::shared_ptr<ThreadRing> ring) {
+    struct Owner {
+      ~Owner() {
+        for (const std::shared_ptr<ThreadRing>& ring : rings) {
+          ring->exited.store(true, std::memory_order_release);
+        }
+      }
+      std::vector<std::shared_ptr<ThreadRing>> rings;
+    };
+    thread_local Owner owner;
+    // Rings their trackers dropped, as they were destroyed, are only
+    // held here.
+    owner.rings.erase(
+        std::remove_if(owner.rings.begin(), owner.rings.end(),
+                       [](const std::shared_ptr<ThreadRing>& owned) {
+                         return owned.use_count() == 1;
+                       }),
+        owner.rings.end());
+    owner.rings.push_back(std::move(ring));
+  }
+
+  // Copies `key` into the next slot, unless the ring is full.
+  void Push(absl::string_view key) {
+    const uint64_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == kRingSlots) return;
+    Slot& slot = slots[tail % kRingSlots];
+    slot.size = static_cast<uint8_t>(key.size());
+    memcpy(slot.key, key.data(), key.size());
+    tail_.store(tail + 1, std::memory_order_release);
+  }
+
+  // Calls `take` with every key in the ring, and empties it.
+  template <typename Take>
+  void Drain(Take take) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    const uint64_t tail = tail_.load(std::memory_order_acquire);
+    for (; head != tail; ++head) {
+      const Slot& slot = slots[head % kRingSlots];
+      take(absl::string_view(slot.key, slot.size));
+    }
+    head_.store(head, std::memory_order_release);
+  }
+
+  const std::thread::id thread;
+  // Set once the thread exited; it adds no keys after.
+  std::atomic<bool> exited{false};
+  // Lookups left until the next one counted.
+  int64_t countdown = 1;
+
+ private:
+  struct Slot {
+    uint8_t size;
+    char key[kMaxSampledKeyBytes];
+  };
+
+  Slot slots[kRingSlots];
+  alignas(64) std::atomic<uint64_t> head_{0};
+  alignas(64) std::atomic<uint64_t> tail_{0};
+};
+
+KeyPopularity::KeyPopularity(const Options& options)
+    : options_(options),
+      mask_(RoundUpToPowerOfTwo(std::max<size_t>(options.width, 1)) - 1),
+      capacity_(std::max<size_t>(options.tracked_keys, 2)),
+      id_(next_popularity_id++),
+      counters_(new std::atomic<uint32_t>[kDepth * (mask_ + 1)]) {
+  for (size_t i = 0; i < kDepth * (mask_ + 1); ++i) {
+    counters_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+KeyPopularity::~KeyPopularity() = default;
+
+KeyPopularity::Options KeyPopularity::OptionsFromFlags() {
+  Options options;
+  options.sample_period =
+      std::max(absl::GetFlag(FLAGS_key_popularity_sample_period), 0);
+  options.tracked_keys =
+      std::max(absl::GetFlag(FLAGS_key_popularity_tracked_keys), 0);
+  return options;
+}
+
+KeyPopularity::ThreadRing& KeyPopularity::ThisThread() {
+  struct Cache {
+    uint64_t id = ~uint64_t{0};
+    ThreadRing* ring = nullptr;
+  };
+  thread_local Cache cache;
+  if (cache.id == id_) return *cache.ring;
+  absl::MutexLock lock(&mutex_);
+  // A new thread may reuse the id of one that exited.
+  auto it = std::find_if(rings_.begin(), rings_.end(), [](const auto& ring) {
+    return ring->thread == std::this_thread::get_id() &&
+           !ring->exited.load(std::memory_order_relaxed);
+  });
+  if (it == rings_.end()) {
+    DrainRings(/*exited_only=*/true);
+    rings_.push_back(std::make_shared<ThreadRing>());
+    ThreadRing::Own(rings_.back());
+    it = rings_.end() - 1;
+  }
+  cache = {id_, it->get()};
+  return **it;
+}
+
+void KeyPopularity::Record(absl::Span<const absl::string_view> keys) {
+  if (!enabled()) return;
+  ThreadRing& ring = ThisThread();
+  for (absl::string_view key : keys) {
+    if (options_.sample_period > 1 && --ring.countdown > 0) continue;
+    ring.countdown = options_.sample_period;
+    Count(key, ring);
+  }
+}
+
+size_t KeyPopularity::CounterIndex(size_t hash, int row) const {
+  // Rows are indexed by double hashing, which is as good as kDepth
+  // independent hashes for a count-min sketch.
+  const uint32_t h1 = static_cast<uint32_t>(hash);
+  const uint32_t h2 = static_cast<uint32_t>(hash >> 32) | 1;
+  return row * (mask_ + 1) + ((h1 + row * h2) & mask_);
+}
+
+uint32_t KeyPopularity::SampledEstimate(size_t hash) const {
+  uint32_t estimate = std::numeric_limits<uint32_t>::max();
+  for (int row = 0; row < kDepth; ++row) {
+    estimate = std::min(estimate, counters_[CounterIndex(hash, row)].load(
+                                      std::memory_order_relaxed));
+  }
+  return estimate;
+}
+
+void KeyPopularity::Count(absl::string_view key, ThreadRing& ring) {
+  const size_t hash = absl::Hash<absl::string_view>{}(key);
+  uint32_t estimate = std::numeric_limits<uint32_t>::max();
+  for (int row = 0; row < kDepth; ++row) {
+    std::atomic<uint32_t>& counter = counters_[CounterIndex(hash, row)];
+    estimate = std::min(
+        estimate, counter.fetch_add(1, std::memory_order_relaxed) + 1);
+  }
+  // A key is offered each time its estimate doubles, which is enough
+  // for it to be tracked again after being dropped while it was cold,
+  // without filling the ring with the hottest keys.
+  if (estimate < admission_.load(std::memory_order_relaxed) ||
+      (estimate & (estimate - 1)) != 0 || key.size() > kMaxSampledKeyBytes) {
+    return;
+  }
+  ring.Push(key);
+}
+
+void KeyPopularity::Admit() {
+  // Counts are brought up to date from the sketch, as tracked keys are
+  // only offered again once their estimate doubles.
+  for (auto& [key, count] : counts_) {
+    count = SampledEstimate(absl::Hash<absl::string_view>{}(key));
+  }
+  DrainRings(/*exited_only=*/false);
+}
+
+void KeyPopularity::DrainRings(bool exited_only) {
+  for (auto it = rings_.begin(); it != rings_.end();) {
+    // Read before draining, so the last keys of an exited thread are
+    // taken before its ring is dropped.
+    const bool exited = (*it)->exited.load(std::memory_order_acquire);
+    if (exited || !exited_only) {
+      (*it)->Drain([this](absl::string_view key) {
+        mutex_.AssertHeld();
+        Track(key);
+      });
+    }
+    if (exited) {
+      it = rings_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+size_t KeyPopularity::sampling_threads() {
+  absl::MutexLock lock(&mutex_);
+  return rings_.size();
+}
+
+void KeyPopularity::Track(absl::string_view key) {
+  const uint32_t estimate =
+      SampledEstimate(absl::Hash<absl::string_view>{}(key));
+  if (estimate == 0 || estimate < admission_.load(std::memory_order_relaxed)) {
+    return;
+  }
+  auto it = counts_.find(key);
+  if (it != counts_.end()) {
+    it->second = estimate;
+    return;
+  }
+  if (counts_.size() >= capacity_) {
+    Prune();
+    if (estimate < admission_.load(std::memory_order_relaxed)) return;
+  }
+  counts_.emplace(key, estimate);
+}
+
+void KeyPopularity::Prune() {
+  std::vector<uint32_t> counts;
+  counts.reserve(counts_.size());
+  for (const auto& [key, count] : counts_) counts.push_back(count);
+  auto median = counts.begin() + counts.size() / 2;
+  std::nth_element(counts.begin(), median, counts.end());
+  const uint32_t threshold = *median;
+  // Keys as popular as the median are only dropped as far as needed to
+  // halve the table, so ties do not keep it full.
+  const size_t keep = capacity_ / 2;
+  for (auto it = counts_.begin(); it != counts_.end();) {
+    if (it->second < threshold ||
+        (it->second == threshold && counts_.size() > keep)) {
+      counts_.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  admission_.store(threshold, std::memory_order_relaxed);
+}
+
+uint64_t KeyPopularity::Estimate(absl::string_view key) const {
+  return uint64_t{SampledEstimate(absl::Hash<absl::string_view>{}(key))} *
+         options_.sample_period;
+}
+
+std::vector<HotKey> KeyPopularity::Hottest(size_t limit) {
+  std::vector<std::pair<uint32_t, std::string>> tracked;
+  {
+    absl::MutexLock lock(&mutex_);
+    Admit();
+    tracked.reserve(counts_.size());
+    for (const auto& [key, count] : counts_) tracked.emplace_back(count, key);
+  }
+  // Ties are broken by key, so the order is stable across calls.
+  auto hotter = [](const auto& a, const auto& b) {
+    return std::tie(b.first, a.second) < std::tie(a.first, b.second);
+  };
+  limit = std::min(limit, tracked.size());
+  std::partial_sort(tracked.begin(), tracked.begin() + limit, tracked.end(),
+                    hotter);
+  std::vector<HotKey> hottest;
+  hottest.reserve(limit);
+  for (size_t i = 0; i < limit; ++i) {
+    hottest.push_back({std::move(tracked[i].second),
+                       uint64_t{tracked[i].first} * options_.sample_period});
+  }
+  return hottest;
+}
+
+void KeyPopularity::Decay() {
+  // Lookups counted between the load and the store are lost, which
+  // makes no difference to an estimate.
+  for (size_t i = 0; i < kDepth * (mask_ + 1); ++i) {
+    counters_[i].store(counters_[i].load(std::memory_order_relaxed) / 2,
+                       std::memory_order_relaxed);
+  }
+  absl::MutexLock lock(&mutex_);
+  for (auto it = counts_.begin(); it != counts_.end();) {
+    it->second /= 2;
+    if (it->second == 0) {
+      counts_.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  admission_.store(admission_.load(std::memory_order_relaxed) / 2,
+                   std::memory_order_relaxed);
+}
+
+std::string KeyPopularity::RenderJson(size_t limit) {
+  std::string json =
+      absl::StrCat("{\"sample_period\":", options_.sample_period,
+                   ",\"keys\":[");
+  bool first = true;
+  for (const HotKey& hot : Hottest(limit)) {
+    if (!first) json.push_back(',');
+    first = false;
+    json.append("{\"key\":");
+    AppendJsonString(hot.key, &json);
+    absl::StrAppend(&json, ",\"lookups\":", hot.lookups, "}");
+  }
+  json.append("]}");
+  return json;
+}
+
+}  // namespace trusted_server
@@ -0,0 +1,156 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KEY_POPULARITY_H_
+#define KEY_POPULARITY_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
+
+namespace trusted_server {
+
+// A key and the number of times it was looked up, as estimated by
+// KeyPopularity.
+struct HotKey {
+  std::string key;
+  uint64_t lookups = 0;
+};
+
+// KeyPopularity estimates how often keys are looked up, so the hottest
+// ones can be reported and laid out together in memory.
+//
+// A sample of the lookups of each thread is counted in a count-min
+// sketch of relaxed atomic counters, which never locks and only
+// overestimates. Sampled keys whose estimate reaches that of the least
+// popular key tracked, and has just doubled, are also copied into a
+// fixed ring of the calling thread, so looking keys up never allocates.
+// A thread's ring is freed once the thread exits.
+// Hottest() empties the rings into a table of candidates for the
+// hottest keys, evicting the least popular half once it fills up;
+// keys longer than kMaxSampledKeyBytes, or sampled while their ring is
+// full, are counted but not offered. Decay() halves every count, so
+// popularity follows the traffic of the last few periods it is called
+// at.
+//
+// KeyPopularity is thread-safe.
+class KeyPopularity {
+ public:
+  struct Options {
+    // Lookups of each thread between two counted ones; 0 disables
+    // counting.
+    int sample_period = 16;
+    // Counters per row of the sketch, rounded up to a power of two.
+    size_t width = 1 << 16;
+    // Keys whose counts are kept.
+    size_t tracked_keys = 32768;
+  };
+
+  static constexpr size_t kMaxSampledKeyBytes = 255;
+
+  explicit KeyPopularity(const Options& options);
+  ~KeyPopularity();
+
+  KeyPopularity(const KeyPopularity&) = delete;
+  KeyPopularity& operator=(const KeyPopularity&) = delete;
+
+  // Options set by the --key_popularity_* flags.
+  static Options OptionsFromFlags();
+
+  // Notes that `keys` were looked up.
+  void Record(absl::Span<const absl::string_view> keys);
+  void Record(absl::string_view key) { Record(absl::MakeConstSpan(&key, 1)); }
+
+  // Estimated lookups of `key`, never less than those counted.
+  uint64_t Estimate(absl::string_view key) const;
+
+  // Returns the hottest keys tracked, most looked up first, at most
+  // `limit`, after tracking the keys sampled since the last call.
+  std::vector<HotKey> Hottest(size_t limit);
+
+  // Halves every count.
+  void Decay();
+
+  // Returns the hottest keys as a JSON object.
+  std::string RenderJson(size_t limit);
+
+  // Number of threads whose sampled keys are kept for Hottest(). The
+  // rings of threads that exited are dropped by the next Hottest(), or
+  // when another thread starts recording.
+  size_t sampling_threads();
+
+  bool enabled() const { return options_.sample_period > 0; }
+
+  const Options& options() const { return options_; }
+
+ private:
+  static constexpr int kDepth = 4;
+
+  class ThreadRing;
+
+  // Index in counters_ of the counter of a key hashing to `hash` in
+  // the given row.
+  size_t CounterIndex(size_t hash, int row) const;
+
+  // Estimated lookups of the key hashing to `hash`, as sampled.
+  uint32_t SampledEstimate(size_t hash) const;
+
+  // Returns the ring of the calling thread, creating it on its first
+  // lookup.
+  ThreadRing& ThisThread();
+
+  // Counts a lookup of `key` and offers it for tracking if it is hot
+  // enough.
+  void Count(absl::string_view key, ThreadRing& ring);
+
+  // Tracks the keys waiting in the rings of all threads.
+  void Admit() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Tracks the keys waiting in the rings of all threads, or only of
+  // those that exited, and drops the rings of the threads that exited.
+  void DrainRings(bool exited_only) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Tracks `key` if its estimate is high enough.
+  void Track(absl::string_view key) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Drops the least popular half of the keys of a full table.
+  void Prune() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  const Options options_;
+  const size_t mask_;
+  // Keys tracked at most.
+  const size_t capacity_;
+  // Tells the rings of trackers apart in the calling thread's cache.
+  const uint64_t id_;
+  // kDepth rows of options_.width counters, one after the other.
+  std::unique_ptr<std::atomic<uint32_t>[]> counters_;
+  // Estimate keys need to be offered; raised as the table fills up.
+  std::atomic<uint32_t> admission_{0};
+
+  absl::Mutex mutex_;
+  absl::flat_hash_map<std::string, uint32_t> counts_ ABSL_GUARDED_BY(mutex_);
+  std::vector<std::shared_ptr<ThreadRing>> rings_ ABSL_GUARDED_BY(mutex_);
+};
+
+}  // namespace trusted_server
+#endif  // KEY_POPULARITY_H_
@@ -0,0 +1,158 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "data/key_popularity.h"
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "gtest/gtest.h"
+
+namespace trusted_server {
+
+namespace {
+
+KeyPopularity::Options EveryLookup() {
+  KeyPopularity::Options options;
+  options.sample_period = 1;
+  options.tracked_keys = 128;
+  return options;
+}
+
+void Look(KeyPopularity& popularity, absl::string_view key, int times) {
+  for (int i = 0; i < times; ++i) popularity.Record(key);
+}
+
+TEST(KeyPopularityTest, RanksKeys) {
+  KeyPopularity popularity(EveryLookup());
+  Look(popularity, "a", 10);
+  Look(popularity, "b", 30);
+  Look(popularity, "c", 10);
+  EXPECT_EQ(popularity.Estimate("b"), 30);
+  EXPECT_EQ(popularity.Estimate("unknown"), 0);
+
+  std::vector<HotKey> hottest = popularity.Hottest(10);
+  ASSERT_EQ(hottest.size(), 3);
+  EXPECT_EQ(hottest[0].key, "b");
+  EXPECT_EQ(hottest[0].lookups, 30);
+  // Ties are ordered by key.
+  EXPECT_EQ(hottest[1].key, "a");
+  EXPECT_EQ(hottest[2].key, "c");
+  EXPECT_EQ(popularity.Hottest(1).size(), 1);
+
+  EXPECT_EQ(popularity.RenderJson(2),
+            "{\"sample_period\":1,\"keys\":[{\"key\":\"b\",\"lookups\":30},"
+            "{\"key\":\"a\",\"lookups\":10}]}");
+}
+
+TEST(KeyPopularityTest, KeepsHotKeysAmongColdOnes) {
+  KeyPopularity popularity(EveryLookup());
+  std::vector<std::string> hot = {"hot0", "hot1", "hot2", "hot3"};
+  for (int i = 0; i < 1000; ++i) {
+    popularity.Record(absl::StrCat("cold", i));
+    if (i % 10 == 0) {
+      for (const std::string& key : hot) popularity.Record(key);
+    }
+  }
+  std::vector<HotKey> hottest = popularity.Hottest(4);
+  ASSERT_EQ(hottest.size(), 4);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(hottest[i].key, hot[i]);
+    EXPECT_EQ(hottest[i].lookups, 100);
+  }
+  // Only as many keys as asked for are tracked.
+  EXPECT_LE(popularity.Hottest(10000).size(), 128);
+}
+
+TEST(KeyPopularityTest, SamplesLookups) {
+  KeyPopularity::Options options = EveryLookup();
+  options.sample_period = 4;
+  KeyPopularity popularity(options);
+  std::vector<absl::string_view> keys(1000, "a");
+  popularity.Record(keys);
+  EXPECT_GE(popularity.Estimate("a"), 996);
+  EXPECT_LE(popularity.Estimate("a"), 1004);
+
+  options.sample_period = 0;
+  KeyPopularity disabled(options);
+  disabled.Record(keys);
+  EXPECT_FALSE(disabled.enabled());
+  EXPECT_EQ(disabled.Estimate("a"), 0);
+  EXPECT_TRUE(disabled.Hottest(10).empty());
+}
+
+TEST(KeyPopularityTest, Decays) {
+  KeyPopularity popularity(EveryLookup());
+  Look(popularity, "a", 10);
+  Look(popularity, "b", 1);
+  popularity.Decay();
+  EXPECT_EQ(popularity.Estimate("a"), 5);
+  std::vector<HotKey> hottest = popularity.Hottest(10);
+  ASSERT_EQ(hottest.size(), 1);
+  EXPECT_EQ(hottest[0].key, "a");
+  EXPECT_EQ(hottest[0].lookups, 5);
+}
+
+TEST(KeyPopularityTest, CountsLongKeysWithoutTrackingThem) {
+  KeyPopularity popularity(EveryLookup());
+  const std::string long_key(KeyPopularity::kMaxSampledKeyBytes + 1, 'a');
+  Look(popularity, long_key, 10);
+  Look(popularity, "b", 1);
+  EXPECT_EQ(popularity.Estimate(long_key), 10);
+  std::vector<HotKey> hottest = popularity.Hottest(10);
+  ASSERT_EQ(hottest.size(), 1);
+  EXPECT_EQ(hottest[0].key, "b");
+}
+
+TEST(KeyPopularityTest, CountsFromAllThreads) {
+  KeyPopularity popularity(EveryLookup());
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&popularity] { Look(popularity, "a", 1000); });
+  }
+  for (std::thread& thread : threads) thread.join();
+  EXPECT_EQ(popularity.Estimate("a"), 4000);
+  std::vector<HotKey> hottest = popularity.Hottest(1);
+  ASSERT_EQ(hottest.size(), 1);
+  EXPECT_EQ(hottest[0].lookups, 4000);
+}
+
+TEST(KeyPopularityTest, DropsRingsOfExitedThreads) {
+  KeyPopularity popularity(EveryLookup());
+  for (int i = 0; i < 8; ++i) {
+    std::thread([&popularity] { Look(popularity, "a", 10); }).join();
+  }
+  EXPECT_LE(popularity.sampling_threads(), 1);
+  // The keys left in the rings of exited threads are still tracked.
+  std::vector<HotKey> hottest = popularity.Hottest(1);
+  ASSERT_EQ(hottest.size(), 1);
+  EXPECT_EQ(hottest[0].key, "a");
+  EXPECT_EQ(popularity.sampling_threads(), 0);
+
+  // A ring outliving its tracker is freed by its thread.
+  auto short_lived = std::make_unique<KeyPopularity>(EveryLookup());
+  std::thread thread([&short_lived] {
+    Look(*short_lived, "b", 10);
+    short_lived.reset();
+  });
+  thread.join();
+}
+
+}  // namespace
+
+}  // namespace trusted_server
@@ -14,8 +14,15 @@
 
 #include "data/mock_creative_map.h"
 
+#include <algorithm>
+#include <fstream>
+#include <memory>
 #include <string>
+#include <thread>
 
+#include "absl/flags/flag.h"
+#include "data/synthetic_dataset.h"
+#include "glog/logging.h"
 #include "gmock/gmock.h"
 #include "google/cloud/spanner/bytes.h"
 #include "google/cloud/spanner/client.h"
@@ -28,12 +35,96 @@ namespace spanner = ::google::cloud::spanner;
 
 using ::testing::_;
 using ::testing::InSequence;
+using ::testing::NiceMock;
 using ::testing::Return;
 namespace spanner = ::google::cloud::spanner;
+namespace spanner_mocks = ::google::cloud::spanner_mocks;
+
+ABSL_FLAG(int64_t, mock_num_keys, 0,
+          "With --mock_spanner, the number of synthetic creatives to load. "
+          "0 loads two fixed test creatives instead.");
+
+ABSL_FLAG(trusted_server::SizeDistribution, mock_key_bytes,
+          (trusted_server::SizeDistribution{
+              trusted_server::SizeDistribution::Kind::kUniform, 40, 120}),
+          "Distribution of the sizes of synthetic keys: fixed:N, "
+          "uniform:MIN:MAX or lognormal:MEDIAN:SIGMA.");
+
+ABSL_FLAG(trusted_server::SizeDistribution, mock_value_bytes,
+          (trusted_server::SizeDistribution{
+              trusted_server::SizeDistribution::Kind::kLogNormal, 1024, 0.5}),
+          "Distribution of the sizes of synthetic creative data, as for "
+          "--mock_key_bytes.");
+
+ABSL_FLAG(int, mock_shared_value_pct, 0,
+          "Percentage of synthetic creatives whose data is one of "
+          "--mock_shared_values common values.");
+
+ABSL_FLAG(int64_t, mock_shared_values, 1000,
+          "Number of common values synthetic creatives share.");
+
+ABSL_FLAG(int64_t, mock_refresh_batches, 0,
+          "Number of synthetic refresh batches, applied one per refresh.");
+
+ABSL_FLAG(int64_t, mock_refresh_batch_keys, 1000,
+          "Rows in each synthetic refresh batch.");
+
+ABSL_FLAG(int, mock_refresh_new_pct, 10,
+          "Percentage of the rows of refresh batches that add keys rather "
+          "than update existing ones.");
+
+ABSL_FLAG(uint64_t, mock_seed, 1,
+          "Seed of the synthetic dataset; the same seed and flags always "
+          "give the same rows.");
+
+ABSL_FLAG(std::string, mock_keys_file, "",
+          "If set, the keys of the initial synthetic load are written to "
+          "this file, one per line, e.g. for loadgen's --keys_file.");
 
 namespace trusted_server {
 
+namespace {
+
+// Result set metadata of rows read at `read_seconds`.
+google::spanner::v1::ResultSetMetadata MakeMetadata(int64_t read_seconds) {
+  google::spanner::v1::ResultSetMetadata metadata;
+  metadata.mutable_transaction()->mutable_read_timestamp()->set_seconds(
+      read_seconds);
+  return metadata;
+}
+
+}  // namespace
+
 std::shared_ptr<MockCreativeMap> MockCreativeMap::CreateMockMap() {
+  if (absl::GetFlag(FLAGS_mock_num_keys) > 0) {
+    SyntheticDataset::Options options;
+    options.num_keys = absl::GetFlag(FLAGS_mock_num_keys);
+    options.key_bytes = absl::GetFlag(FLAGS_mock_key_bytes);
+    options.value_bytes = absl::GetFlag(FLAGS_mock_value_bytes);
+    options.shared_value_pct = absl::GetFlag(FLAGS_mock_shared_value_pct);
+    options.num_shared_values =
+        std::max<int64_t>(absl::GetFlag(FLAGS_mock_shared_values), 1);
+    options.refresh_batches =
+        std::max<int64_t>(absl::GetFlag(FLAGS_mock_refresh_batches), 0);
+    options.refresh_batch_keys =
+        std::max<int64_t>(absl::GetFlag(FLAGS_mock_refresh_batch_keys), 0);
+    options.refresh_new_pct = absl::GetFlag(FLAGS_mock_refresh_new_pct);
+    options.seed = absl::GetFlag(FLAGS_mock_seed);
+    std::shared_ptr<MockCreativeMap> creative_map =
+        CreateSyntheticMap(options);
+    if (std::string path = absl::GetFlag(FLAGS_mock_keys_file);
+        !path.empty()) {
+      std::ofstream keys_file(path);
+      for (size_t i = 0; i < options.num_keys && keys_file; ++i) {
+        keys_file << creative_map->dataset_->Key(i) << '\n';
+      }
+      if (!keys_file) LOG(ERROR) << "Failed to write keys to " << path;
+    }
+    if (options.refresh_batches > 0) {
+      std::thread([creative_map] { creative_map->RefreshMap(); }).detach();
+    }
+    return creative_map;
+  }
   std::shared_ptr<MockCreativeMap> creative_map =
       std::shared_ptr<MockCreativeMap>(new MockCreativeMap());
   creative_map->InitializeSpannerClient();
@@ -41,10 +132,86 @@ std::shared_ptr<MockCreativeMap> MockCreativeMap::CreateMockMap() {
   return creative_map;
 }
 
+std::shared_ptr<MockCreativeMap> MockCreativeMap::CreateSyntheticMap(
+    const SyntheticDataset::Options& options) {
+  std::shared_ptr<MockCreativeMap> creative_map =
+      std::shared_ptr<MockCreativeMap>(new MockCreativeMap(options));
+  creative_map->InitializeSpannerClient();
+  creative_map->PopulateMap();
+  return creative_map;
+}
+
+void MockCreativeMap::InitializeSyntheticClient() {
+  auto conn = std::make_shared<NiceMock<spanner_mocks::MockConnection>>();
+  // Synthetic maps may be kept for the lifetime of a server or benchmark.
+  testing::Mock::AllowLeak(conn.get());
+  conn_ = conn;
+  client_ = std::unique_ptr<spanner::Client>(new spanner::Client(conn_));
+  ON_CALL(*conn, PartitionQuery(_))
+      .WillByDefault(
+          [this](spanner::Connection::PartitionQueryParams const& params) {
+            num_partitions_ = std::max<int64_t>(
+                params.partition_options.max_partitions.value_or(1), 1);
+            return std::vector<spanner::QueryPartition>(num_partitions_);
+          });
+  ON_CALL(*conn, ExecuteQuery(_))
+      .WillByDefault([this](spanner::Connection::SqlParams const& params) {
+        // Only refreshes ask for rows updated after a time.
+        if (params.statement.params().count("latest_time") > 0) {
+          return ReadRefreshBatch(next_batch_++);
+        }
+        return ReadPartition(next_partition_++);
+      });
+}
+
+spanner::RowStream MockCreativeMap::ReadPartition(size_t partition) {
+  const size_t num_keys = dataset_->options().num_keys;
+  const size_t per_partition =
+      (num_keys + num_partitions_ - 1) / num_partitions_;
+  size_t next = std::min(partition * per_partition, num_keys);
+  const size_t end = std::min(next + per_partition, num_keys);
+
+  auto source =
+      std::make_unique<NiceMock<spanner_mocks::MockResultSetSource>>();
+  ON_CALL(*source, Metadata()).WillByDefault(Return(MakeMetadata(0)));
+  ON_CALL(*source, NextRow())
+      .WillByDefault([this, next, end]() mutable -> spanner::Row {
+        if (next == end) return spanner::Row();
+        const size_t index = next++;
+        return spanner::MakeTestRow(
+            {{"CreativeId", spanner::Value(dataset_->Key(index))},
+             {"CreativeData",
+              spanner::Value(spanner::Bytes(dataset_->Value(index, 0)))}});
+      });
+  return spanner::RowStream(std::move(source));
+}
+
+spanner::RowStream MockCreativeMap::ReadRefreshBatch(size_t batch) {
+  const size_t num_batches = dataset_->options().refresh_batches;
+  auto rows =
+      std::make_shared<std::vector<std::pair<std::string, std::string>>>();
+  if (batch < num_batches) *rows = dataset_->RefreshBatch(batch);
+  // Each batch is read a second later than the one before.
+  auto source =
+      std::make_unique<NiceMock<spanner_mocks::MockResultSetSource>>();
+  ON_CALL(*source, Metadata())
+      .WillByDefault(Return(MakeMetadata(std::min(batch + 1, num_batches))));
+  ON_CALL(*source, NextRow())
+      .WillByDefault([rows, next = size_t{0}]() mutable -> spanner::Row {
+        if (next == rows->size()) return spanner::Row();
+        auto& [key, value] = (*rows)[next++];
+        return spanner::MakeTestRow(
+            {{"CreativeId", spanner::Value(std::move(key))},
+             {"CreativeData", spanner::Value(spanner::Bytes(value))}});
+      });
+  return spanner::RowStream(std::move(source));
+}
+
 void MockCreativeMap::InitializeSpannerClient() {
-  // Create a mock object to stream the results of a ExecuteQuery.
-  source_ = std::unique_ptr<google::cloud::spanner_mocks::MockResultSetSource>(
-      new google::cloud::spanner_mocks::MockResultSetSource);
+  if (dataset_ != nullptr) {
+    InitializeSyntheticClient();
+    return;
+  }
   // Create a mock for `spanner::Connection`:
   conn_ = std::make_shared<google::cloud::spanner_mocks::MockConnection>();
 
@@ -70,7 +237,6 @@ void MockCreativeMap::InitializeSpannerClient() {
     })pb";
   google::spanner::v1::ResultSetMetadata metadata;
   google::protobuf::TextFormat::ParseFromString(kText, &metadata);
-  EXPECT_CALL(*source_, Metadata()).WillRepeatedly(Return(metadata));
 
   trusted_server::CreativeMetadata c1;
   c1.set_is_servible(false);
@@ -79,24 +245,36 @@ void MockCreativeMap::InitializeSpannerClient() {
 
   client_ = std::unique_ptr<spanner::Client>(new spanner::Client(conn_));
 
+  // The initial load is split into one partition per creative, each
+  // streamed from its own result set.
   std::vector<std::pair<std::string, spanner::Bytes>> key_values(
       {{"google.com/ad1", spanner::Bytes(c1.SerializeAsString())},
        {"google.com/ad2", spanner::Bytes(c2.SerializeAsString())}});
-  EXPECT_CALL(*conn_, ExecuteQuery(_))
+  EXPECT_CALL(*conn_, PartitionQuery(_))
       .WillOnce(
-          [this](spanner::Connection::SqlParams const&) -> spanner::RowStream {
-            return spanner::RowStream(std::move(source_));
-          });
+          Return(std::vector<spanner::QueryPartition>(key_values.size())));
 
-  InSequence seq;
+  auto& execute_query = EXPECT_CALL(*conn_, ExecuteQuery(_));
   for (const auto& key_val : key_values) {
-    EXPECT_CALL(*source_, NextRow())
+    // Create a mock object to stream the results of a ExecuteQuery.
+    auto source = std::unique_ptr<
+        google::cloud::spanner_mocks::MockResultSetSource>(
+        new google::cloud::spanner_mocks::MockResultSetSource);
+    EXPECT_CALL(*source, Metadata()).WillRepeatedly(Return(metadata));
+    InSequence seq;
+    EXPECT_CALL(*source, NextRow())
         .WillOnce(Return(spanner::MakeTestRow(
             {{"CreativeId", spanner::Value(key_val.first)},
              {"CreativdeData", spanner::Value(key_val.second)}})));
-  }
+    EXPECT_CALL(*source, NextRow()).WillOnce(Return(spanner::Row()));
 
-  EXPECT_CALL(*source_, NextRow()).WillOnce(Return(spanner::Row()));
+    sources_.push_back(std::move(source));
+    execute_query.WillOnce(
+        [this, index = sources_.size() - 1](
+            spanner::Connection::SqlParams const&) -> spanner::RowStream {
+          return spanner::RowStream(std::move(sources_[index]));
+        });
+  }
 }
 
 }  // namespace trusted_server
\ No newline at end of file
@@ -15,14 +15,19 @@
 #ifndef MOCK_CREATIVE_MAP_H_
 #define MOCK_CREATIVE_MAP_H_
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "absl/container/flat_hash_map.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/synchronization/mutex.h"
 #include "data/creative_map.h"
+#include "data/synthetic_dataset.h"
 #include "gmock/gmock.h"
 #include "google/cloud/spanner/bytes.h"
 #include "google/cloud/spanner/client.h"
@@ -44,12 +49,50 @@ namespace trusted_server {
 // spanner for testing.
 class MockCreativeMap : public CreativeMap {
  public:
+  // Returns a map of two test creatives or, if --mock_num_keys is set,
+  // of the synthetic dataset the --mock_* flags describe. A synthetic
+  // map with refresh batches applies them every --refresh_period_sec.
   static std::shared_ptr<MockCreativeMap> CreateMockMap();
 
+  // Returns a map of the synthetic dataset `options` describe. Rows are
+  // generated as they are streamed through the mocked connection,
+  // partition by partition, the way the real map reads the database.
+  // Refreshes read the dataset's refresh batches in turn, and nothing
+  // once they run out.
+  static std::shared_ptr<MockCreativeMap> CreateSyntheticMap(
+      const SyntheticDataset::Options& options);
+
+  // Exposed so tests and benchmarks can apply refresh batches at will.
+  using CreativeMap::RefreshOnce;
+
  protected:
+  MockCreativeMap() = default;
+  explicit MockCreativeMap(const SyntheticDataset::Options& options)
+      : dataset_(std::make_unique<SyntheticDataset>(options)) {}
+
   void InitializeSpannerClient() override;
   std::shared_ptr<google::cloud::spanner_mocks::MockConnection> conn_;
-  std::unique_ptr<google::cloud::spanner_mocks::MockResultSetSource> source_;
+  // One result set per partition of the initial load.
+  std::vector<
+      std::unique_ptr<google::cloud::spanner_mocks::MockResultSetSource>>
+      sources_;
+
+ private:
+  void InitializeSyntheticClient();
+
+  // Returns a result set of the rows of `dataset_` in the given
+  // partition of the initial load.
+  spanner::RowStream ReadPartition(size_t partition);
+
+  // Returns a result set of the given refresh batch of `dataset_`,
+  // empty past the last one.
+  spanner::RowStream ReadRefreshBatch(size_t batch);
+
+  // Null unless the map is synthetic.
+  std::unique_ptr<const SyntheticDataset> dataset_;
+  std::atomic<size_t> num_partitions_{1};
+  std::atomic<size_t> next_partition_{0};
+  std::atomic<size_t> next_batch_{0};
 };
 
 }  // namespace trusted_server
@@ -0,0 +1,133 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "data/numa_topology.h"
+
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "absl/strings/strip.h"
+#include "glog/logging.h"
+
+namespace trusted_server {
+
+namespace {
+
+// Returns the contents of `path`, or an empty string if it can't be read.
+std::string ReadFile(const std::string& path) {
+  std::ifstream file(path);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  return contents.str();
+}
+
+}  // namespace
+
+NumaTopology::NumaTopology(const std::string& root) {
+  for (int id : ParseList(ReadFile(absl::StrCat(root, "/has_cpu")))) {
+    std::vector<int> cpus = ParseList(
+        ReadFile(absl::StrCat(root, "/node", id, "/cpulist")));
+    if (cpus.empty()) continue;
+    for (int cpu : cpus) {
+      if (cpu >= static_cast<int>(node_of_cpu_.size())) {
+        node_of_cpu_.resize(cpu + 1, 0);
+      }
+      node_of_cpu_[cpu] = cpus_.size();
+    }
+    cpus_.push_back(std::move(cpus));
+    ids_.push_back(id);
+  }
+  if (cpus_.empty()) {
+    std::vector<int> cpus(std::max(std::thread::hardware_concurrency(), 1u));
+    for (size_t cpu = 0; cpu < cpus.size(); ++cpu) cpus[cpu] = cpu;
+    cpus_.push_back(std::move(cpus));
+    ids_.push_back(0);
+  }
+}
+
+const NumaTopology& NumaTopology::Get() {
+  static const auto* topology = new NumaTopology(std::string(kSysfsRoot));
+  return *topology;
+}
+
+std::vector<int> NumaTopology::ParseList(absl::string_view list) {
+  std::vector<int> items;
+  list = absl::StripAsciiWhitespace(list);
+  if (list.empty()) return items;
+  for (absl::string_view range : absl::StrSplit(list, ',')) {
+    const size_t dash = range.find('-');
+    int first;
+    int last;
+    if (!absl::SimpleAtoi(range.substr(0, dash), &first)) return {};
+    if (dash == absl::string_view::npos) {
+      last = first;
+    } else if (!absl::SimpleAtoi(range.substr(dash + 1), &last)) {
+      return {};
+    }
+    if (first < 0 || last < first) return {};
+    for (int item = first; item <= last; ++item) items.push_back(item);
+  }
+  std::sort(items.begin(), items.end());
+  items.erase(std::unique(items.begin(), items.end()), items.end());
+  return items;
+}
+
+int NumaTopology::NodeOfCpu(int cpu) const {
+  if (cpu < 0 || cpu >= static_cast<int>(node_of_cpu_.size())) return 0;
+  return node_of_cpu_[cpu];
+}
+
+int NumaTopology::CurrentNode() const {
+  if (cpus_.size() == 1) return 0;
+  return NodeOfCpu(sched_getcpu());
+}
+
+bool NumaTopology::BindToNode(int node) const {
+  if (cpus_.size() == 1) return true;
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  for (int cpu : cpus_[node]) {
+    if (cpu < CPU_SETSIZE) CPU_SET(cpu, &cpus);
+  }
+  if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+    PLOG(WARNING) << "Failed to bind a thread to the CPUs of NUMA node "
+                  << ids_[node];
+    return false;
+  }
+  // The kernel reads one bit fewer than it is told the mask holds.
+  constexpr int kBitsPerWord = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> mask(ids_[node] / kBitsPerWord + 1);
+  mask[ids_[node] / kBitsPerWord] |= 1UL << (ids_[node] % kBitsPerWord);
+  if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask.data(),
+              mask.size() * kBitsPerWord + 1) != 0) {
+    PLOG(WARNING) << "Failed to prefer the memory of NUMA node "
+                  << ids_[node];
+  }
+  return true;
+}
+
+}  // namespace trusted_server
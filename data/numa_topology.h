@@ -0,0 +1,78 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NUMA_TOPOLOGY_H_
+#define NUMA_TOPOLOGY_H_
+
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+
+namespace trusted_server {
+
+// NumaTopology lists the NUMA nodes of the machine and the CPUs of each,
+// as the kernel reports them under /sys/devices/system/node, without
+// depending on libnuma. Nodes are numbered from 0 in the order of their
+// ids, and only those with CPUs are listed: memory-only nodes have no
+// threads to serve. A machine that does not report NUMA nodes has a
+// single one holding every CPU.
+//
+// NumaTopology is immutable and thread-safe.
+class NumaTopology {
+ public:
+  static constexpr absl::string_view kSysfsRoot = "/sys/devices/system/node";
+
+  // Reads the topology from `root`, laid out as kSysfsRoot is.
+  explicit NumaTopology(const std::string& root);
+
+  // Returns the topology of this machine, read on the first call.
+  static const NumaTopology& Get();
+
+  // Parses a kernel list of CPUs or nodes, e.g. "0-3,8,10-11". Returns
+  // an empty list if `list` is malformed.
+  static std::vector<int> ParseList(absl::string_view list);
+
+  int num_nodes() const { return cpus_.size(); }
+
+  // CPUs of `node`, in increasing order.
+  const std::vector<int>& cpus(int node) const { return cpus_[node]; }
+
+  // Id the kernel knows `node` by, as in its directory under kSysfsRoot.
+  int id(int node) const { return ids_[node]; }
+
+  // Returns the node of `cpu`; 0 for CPUs the kernel did not list.
+  int NodeOfCpu(int cpu) const;
+
+  // Returns the node of the CPU the calling thread runs on. Threads that
+  // are not pinned may move to another node right after.
+  int CurrentNode() const;
+
+  // Restricts the calling thread to the CPUs of `node` and makes it
+  // prefer the node's memory for the pages it touches first. Memory it
+  // allocates from pages already in use, e.g. freed by other threads,
+  // stays where it is. Returns false if the thread could not be
+  // restricted to the node's CPUs.
+  bool BindToNode(int node) const;
+
+ private:
+  std::vector<std::vector<int>> cpus_;
+  // Id the kernel knows each node by.
+  std::vector<int> ids_;
+  // Node of each CPU, by CPU number.
+  std::vector<int> node_of_cpu_;
+};
+
+}  // namespace trusted_server
+#endif  // NUMA_TOPOLOGY_H_
@@ -0,0 +1,90 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "data/numa_topology.h"
+
+#include <sys/stat.h>
+
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include "absl/strings/str_cat.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace trusted_server {
+
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+
+void WriteFile(const std::string& path, const std::string& contents) {
+  std::ofstream(path) << contents;
+}
+
+TEST(NumaTopologyTest, ParsesLists) {
+  EXPECT_THAT(NumaTopology::ParseList("0-3,8,10-11\n"),
+              ElementsAre(0, 1, 2, 3, 8, 10, 11));
+  EXPECT_THAT(NumaTopology::ParseList("5"), ElementsAre(5));
+  EXPECT_THAT(NumaTopology::ParseList("\n"), IsEmpty());
+  EXPECT_THAT(NumaTopology::ParseList("1-"), IsEmpty());
+  EXPECT_THAT(NumaTopology::ParseList("3-1"), IsEmpty());
+  EXPECT_THAT(NumaTopology::ParseList("a,b"), IsEmpty());
+}
+
+TEST(NumaTopologyTest, ReadsNodesWithCpus) {
+  // Node 1 only has memory, and node 2's CPUs are not contiguous.
+  const std::string root = absl::StrCat(testing::TempDir(), "/numa");
+  mkdir(root.c_str(), 0755);
+  for (int id : {0, 1, 2}) {
+    mkdir(absl::StrCat(root, "/node", id).c_str(), 0755);
+  }
+  WriteFile(root + "/has_cpu", "0,2\n");
+  WriteFile(root + "/node0/cpulist", "0-1\n");
+  WriteFile(root + "/node1/cpulist", "\n");
+  WriteFile(root + "/node2/cpulist", "2-3,6\n");
+
+  NumaTopology topology(root);
+  ASSERT_EQ(topology.num_nodes(), 2);
+  EXPECT_THAT(topology.cpus(0), ElementsAre(0, 1));
+  EXPECT_THAT(topology.cpus(1), ElementsAre(2, 3, 6));
+  EXPECT_EQ(topology.NodeOfCpu(1), 0);
+  EXPECT_EQ(topology.NodeOfCpu(6), 1);
+  EXPECT_EQ(topology.NodeOfCpu(5), 0);
+  EXPECT_EQ(topology.NodeOfCpu(100), 0);
+}
+
+TEST(NumaTopologyTest, FallsBackToOneNode) {
+  NumaTopology topology(absl::StrCat(testing::TempDir(), "/missing"));
+  ASSERT_EQ(topology.num_nodes(), 1);
+  EXPECT_FALSE(topology.cpus(0).empty());
+  EXPECT_EQ(topology.CurrentNode(), 0);
+  EXPECT_TRUE(topology.BindToNode(0));
+}
+
+TEST(NumaTopologyTest, ThreadsRunOnTheirNode) {
+  const NumaTopology& topology = NumaTopology::Get();
+  ASSERT_GE(topology.num_nodes(), 1);
+  const int node = topology.num_nodes() - 1;
+  std::thread([&] {
+    ASSERT_TRUE(topology.BindToNode(node));
+    EXPECT_EQ(topology.CurrentNode(), node);
+  }).join();
+}
+
+}  // namespace
+
+}  // namespace trusted_server
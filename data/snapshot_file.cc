@@ -0,0 +1,359 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "data/snapshot_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "absl/base/config.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+
+namespace trusted_server {
+
+namespace {
+
+#ifndef ABSL_IS_LITTLE_ENDIAN
+#error "Snapshot files are only supported on little-endian hosts."
+#endif
+
+constexpr char kMagic[8] = {'T', 'K', 'V', 'S', 'N', 'A', 'P', '\0'};
+constexpr uint32_t kVersion = 1;
+
+static_assert(sizeof(SnapshotFileHeader) == 48, "Header layout changed.");
+static_assert(sizeof(SnapshotIndexEntry) == 24, "Index layout changed.");
+
+constexpr uint64_t kPrime1 = 0x9e3779b185ebca87;
+constexpr uint64_t kPrime2 = 0xc2b2ae3d27d4eb4f;
+
+uint64_t RotateLeft(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+absl::Status ErrnoStatus(absl::string_view what, const std::string& path) {
+  return absl::Status(absl::StatusCode::kInternal,
+                      absl::StrCat(what, " ", path, ": ", strerror(errno)));
+}
+
+}  // namespace
+
+void SnapshotChecksum::Mix(uint64_t word) {
+  state_ = RotateLeft(state_ + word * kPrime2, 31) * kPrime1;
+}
+
+void SnapshotChecksum::Update(const char* data, size_t size) {
+  length_ += size;
+  while (size > 0 && pending_size_ > 0) {
+    pending_[pending_size_++] = *data++;
+    --size;
+    if (pending_size_ == sizeof(pending_)) {
+      uint64_t word;
+      memcpy(&word, pending_, sizeof(word));
+      Mix(word);
+      pending_size_ = 0;
+    }
+  }
+  for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    Mix(word);
+    data += sizeof(word);
+  }
+  memcpy(pending_ + pending_size_, data, size);
+  pending_size_ += size;
+}
+
+uint64_t SnapshotChecksum::Finish() const {
+  uint64_t word = 0;
+  memcpy(&word, pending_, pending_size_);
+  uint64_t hash = RotateLeft(state_ + word * kPrime2, 31) * kPrime1;
+  hash ^= length_;
+  hash ^= hash >> 33;
+  hash *= kPrime2;
+  hash ^= hash >> 29;
+  return hash;
+}
+
+SnapshotFile::SnapshotFile(void* mapping, size_t length)
+    : mapping_(mapping), length_(length) {}
+
+SnapshotFile::~SnapshotFile() { munmap(mapping_, length_); }
+
+absl::StatusOr<std::shared_ptr<const SnapshotFile>> SnapshotFile::Open(
+    const std::string& path, bool verify_checksum) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return ErrnoStatus("Failed to open", path);
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0) {
+    close(fd);
+    return ErrnoStatus("Failed to stat", path);
+  }
+  size_t length = file_stat.st_size;
+  if (length < sizeof(SnapshotFileHeader)) {
+    close(fd);
+    return absl::Status(absl::StatusCode::kDataLoss,
+                        absl::StrCat("Truncated snapshot file ", path));
+  }
+  void* mapping = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) return ErrnoStatus("Failed to map", path);
+  // Owns the mapping from here on, so early returns unmap it.
+  std::shared_ptr<SnapshotFile> file(new SnapshotFile(mapping, length));
+
+  SnapshotFileHeader header;
+  memcpy(&header, mapping, sizeof(header));
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.version != kVersion) {
+    return absl::Status(
+        absl::StatusCode::kFailedPrecondition,
+        absl::StrCat("Unsupported snapshot file format in ", path));
+  }
+  // The sizes are checked against the file before they are multiplied
+  // or added, so a corrupt header cannot overflow them.
+  const size_t body_size = length - sizeof(header);
+  if (header.num_entries > body_size / sizeof(SnapshotIndexEntry) ||
+      header.blob_size > body_size ||
+      header.blob_size % alignof(SnapshotIndexEntry) != 0 ||
+      header.blob_size + header.num_entries * sizeof(SnapshotIndexEntry) !=
+          body_size) {
+    return absl::Status(absl::StatusCode::kDataLoss,
+                        absl::StrCat("Snapshot file size mismatch in ", path));
+  }
+
+  const size_t index_size = header.num_entries * sizeof(SnapshotIndexEntry);
+  const char* base = static_cast<const char*>(mapping);
+  if (verify_checksum) {
+    SnapshotChecksum checksum;
+    checksum.Update(base + sizeof(header), header.blob_size + index_size);
+    if (checksum.Finish() != header.checksum) {
+      return absl::Status(absl::StatusCode::kDataLoss,
+                          absl::StrCat("Snapshot checksum mismatch in ", path));
+    }
+  }
+
+  file->blob_ = base + sizeof(header);
+  file->index_ = reinterpret_cast<const SnapshotIndexEntry*>(
+      file->blob_ + header.blob_size);
+  file->num_entries_ = header.num_entries;
+  file->latest_read_ = absl::FromUnixNanos(header.latest_read_unix_nanos);
+  for (size_t i = 0; i < file->num_entries_; ++i) {
+    const SnapshotIndexEntry& entry = file->index_[i];
+    uint64_t entry_size = uint64_t{entry.key_size} + entry.data_size +
+                          entry.json_size;
+    if (entry.offset > header.blob_size ||
+        entry_size > header.blob_size - entry.offset) {
+      return absl::Status(
+          absl::StatusCode::kDataLoss,
+          absl::StrCat("Snapshot index out of bounds in ", path));
+    }
+    // Find() relies on the keys being sorted, which the checksum alone
+    // does not guarantee when it is not verified.
+    if (i > 0 && file->key(i - 1) >= file->key(i)) {
+      return absl::Status(
+          absl::StatusCode::kDataLoss,
+          absl::StrCat("Snapshot keys out of order in ", path));
+    }
+  }
+  return std::shared_ptr<const SnapshotFile>(std::move(file));
+}
+
+absl::string_view SnapshotFile::key(size_t i) const {
+  return absl::string_view(blob_ + index_[i].offset, index_[i].key_size);
+}
+
+SnapshotFile::Entry SnapshotFile::entry(size_t i) const {
+  const SnapshotIndexEntry& index = index_[i];
+  const char* key = blob_ + index.offset;
+  const char* data = key + index.key_size;
+  const char* json = data + index.data_size;
+  return {absl::string_view(key, index.key_size),
+          absl::string_view(data, index.data_size),
+          absl::string_view(json, index.json_size)};
+}
+
+absl::optional<SnapshotFile::Entry> SnapshotFile::Find(
+    absl::string_view key) const {
+  size_t low = 0;
+  size_t high = num_entries_;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (this->key(mid) < key) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  if (low == num_entries_ || this->key(low) != key) return absl::nullopt;
+  return entry(low);
+}
+
+void SnapshotFile::FindBatch(absl::Span<const absl::string_view> keys,
+                             absl::Span<absl::optional<Entry>> results) const {
+  for (size_t start = 0; start < keys.size(); start += kFindBatchSize) {
+    const size_t count = std::min(kFindBatchSize, keys.size() - start);
+    size_t low[kFindBatchSize];
+    size_t high[kFindBatchSize];
+    for (size_t i = 0; i < count; ++i) {
+      low[i] = 0;
+      high[i] = num_entries_;
+    }
+    // All searches take the same number of steps, give or take one.
+    bool active = num_entries_ > 0;
+    while (active) {
+      for (size_t i = 0; i < count; ++i) {
+        if (low[i] < high[i]) {
+          __builtin_prefetch(&index_[low[i] + (high[i] - low[i]) / 2]);
+        }
+      }
+      for (size_t i = 0; i < count; ++i) {
+        if (low[i] < high[i]) {
+          __builtin_prefetch(blob_ +
+                             index_[low[i] + (high[i] - low[i]) / 2].offset);
+        }
+      }
+      active = false;
+      for (size_t i = 0; i < count; ++i) {
+        if (low[i] >= high[i]) continue;
+        size_t mid = low[i] + (high[i] - low[i]) / 2;
+        if (key(mid) < keys[start + i]) {
+          low[i] = mid + 1;
+        } else {
+          high[i] = mid;
+        }
+        active |= low[i] < high[i];
+      }
+    }
+    for (size_t i = 0; i < count; ++i) {
+      if (low[i] == num_entries_ || key(low[i]) != keys[start + i]) {
+        results[start + i] = absl::nullopt;
+      } else {
+        results[start + i] = entry(low[i]);
+      }
+    }
+  }
+}
+
+SnapshotFileWriter::SnapshotFileWriter(std::string path,
+                                       std::string temp_path, FILE* file)
+    : path_(std::move(path)), temp_path_(std::move(temp_path)), file_(file) {}
+
+SnapshotFileWriter::~SnapshotFileWriter() {
+  if (file_ != nullptr) fclose(file_);
+  if (!finished_) unlink(temp_path_.c_str());
+}
+
+absl::StatusOr<std::unique_ptr<SnapshotFileWriter>> SnapshotFileWriter::Create(
+    const std::string& path) {
+  std::string temp_path = absl::StrCat(path, ".tmp");
+  FILE* file = fopen(temp_path.c_str(), "wb");
+  if (file == nullptr) return ErrnoStatus("Failed to create", temp_path);
+  std::unique_ptr<SnapshotFileWriter> writer(
+      new SnapshotFileWriter(path, std::move(temp_path), file));
+  // Reserve room for the header, which is only known on Finish().
+  SnapshotFileHeader header = {};
+  if (fwrite(&header, sizeof(header), 1, file) != 1) {
+    return ErrnoStatus("Failed to write", writer->temp_path_);
+  }
+  return writer;
+}
+
+absl::Status SnapshotFileWriter::Write(const void* data, size_t size) {
+  if (size == 0) return absl::OkStatus();
+  if (fwrite(data, size, 1, file_) != 1) {
+    return ErrnoStatus("Failed to write", temp_path_);
+  }
+  checksum_.Update(static_cast<const char*>(data), size);
+  return absl::OkStatus();
+}
+
+absl::Status SnapshotFileWriter::Add(absl::string_view key,
+                                     absl::string_view data,
+                                     absl::string_view json) {
+  if (!index_.empty() && key <= last_key_) {
+    return absl::Status(absl::StatusCode::kInvalidArgument,
+                        absl::StrCat("Snapshot key out of order: ", key));
+  }
+  SnapshotIndexEntry entry = {};
+  entry.offset = blob_size_;
+  entry.key_size = key.size();
+  entry.data_size = data.size();
+  entry.json_size = json.size();
+  for (absl::string_view piece : {key, data, json}) {
+    absl::Status status = Write(piece.data(), piece.size());
+    if (!status.ok()) return status;
+    blob_size_ += piece.size();
+  }
+  index_.push_back(entry);
+  last_key_.assign(key.data(), key.size());
+  return absl::OkStatus();
+}
+
+absl::Status SnapshotFileWriter::Finish(absl::Time latest_read) {
+  static constexpr char kPadding[alignof(SnapshotIndexEntry)] = {};
+  size_t padding = -blob_size_ % alignof(SnapshotIndexEntry);
+  absl::Status status = Write(kPadding, padding);
+  if (!status.ok()) return status;
+  blob_size_ += padding;
+  status = Write(index_.data(), index_.size() * sizeof(SnapshotIndexEntry));
+  if (!status.ok()) return status;
+
+  SnapshotFileHeader header = {};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.latest_read_unix_nanos = absl::ToUnixNanos(latest_read);
+  header.num_entries = index_.size();
+  header.blob_size = blob_size_;
+  header.checksum = checksum_.Finish();
+  if (fseek(file_, 0, SEEK_SET) != 0 ||
+      fwrite(&header, sizeof(header), 1, file_) != 1 || fflush(file_) != 0 ||
+      fsync(fileno(file_)) != 0) {
+    return ErrnoStatus("Failed to write", temp_path_);
+  }
+  int close_result = fclose(file_);
+  file_ = nullptr;
+  if (close_result != 0) return ErrnoStatus("Failed to close", temp_path_);
+  if (rename(temp_path_.c_str(), path_.c_str()) != 0) {
+    return ErrnoStatus("Failed to rename", temp_path_);
+  }
+  // The rename is only durable once the directory holding it is synced.
+  const size_t slash = path_.rfind('/');
+  const std::string directory =
+      slash == std::string::npos ? "."
+                                 : path_.substr(0, std::max<size_t>(slash, 1));
+  const int directory_fd =
+      open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (directory_fd < 0) return ErrnoStatus("Failed to open", directory);
+  const int sync_result = fsync(directory_fd);
+  close(directory_fd);
+  if (sync_result != 0) return ErrnoStatus("Failed to sync", directory);
+  finished_ = true;
+  return absl::OkStatus();
+}
+
+}  // namespace trusted_server
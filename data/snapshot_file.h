@@ -0,0 +1,173 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SNAPSHOT_FILE_H_
+#define SNAPSHOT_FILE_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+
+namespace trusted_server {
+
+// A snapshot file persists the creative data so a restarting server can
+// serve from it right away instead of scanning the whole table first.
+// The file is little-endian and laid out to be used straight from a
+// read-only memory mapping:
+//
+//   header  SnapshotFileHeader
+//   blob    key, data and JSON bytes of every entry, padded to 8 bytes
+//   index   one SnapshotIndexEntry per entry, sorted by key
+//
+// The header carries a format version and a checksum of blob and index.
+
+struct SnapshotFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  // Spanner read timestamp the data is current as of, in Unix nanos.
+  int64_t latest_read_unix_nanos;
+  uint64_t num_entries;
+  uint64_t blob_size;
+  uint64_t checksum;
+};
+
+struct SnapshotIndexEntry {
+  // Offset of the key in the blob; data and JSON follow it directly.
+  uint64_t offset;
+  uint32_t key_size;
+  uint32_t data_size;
+  uint32_t json_size;
+  uint32_t reserved;
+};
+
+// Streaming checksum over the blob and index of a snapshot file.
+class SnapshotChecksum {
+ public:
+  void Update(const char* data, size_t size);
+  uint64_t Finish() const;
+
+ private:
+  void Mix(uint64_t word);
+
+  uint64_t state_ = 0x9e3779b97f4a7c15;
+  uint64_t length_ = 0;
+  char pending_[8];
+  size_t pending_size_ = 0;
+};
+
+// SnapshotFile is a read-only, memory-mapped snapshot file. Pages are
+// faulted in on first use, so opening a file is cheap regardless of
+// its size (unless the checksum is verified).
+class SnapshotFile {
+ public:
+  struct Entry {
+    absl::string_view key;
+    absl::string_view data;
+    absl::string_view json;
+  };
+
+  // Maps the file at `path`. Fails if the file is missing, truncated,
+  // of another format version, or, when `verify_checksum` is set, if its
+  // contents do not match the checksum.
+  static absl::StatusOr<std::shared_ptr<const SnapshotFile>> Open(
+      const std::string& path, bool verify_checksum);
+
+  ~SnapshotFile();
+
+  SnapshotFile(const SnapshotFile&) = delete;
+  SnapshotFile& operator=(const SnapshotFile&) = delete;
+
+  // Number of entries in the file.
+  size_t size() const { return num_entries_; }
+
+  // Size of the file in bytes.
+  size_t length() const { return length_; }
+
+  // Returns the i-th entry in key order.
+  Entry entry(size_t i) const;
+
+  // Binary searches the index for `key`.
+  absl::optional<Entry> Find(absl::string_view key) const;
+
+  // Number of searches FindBatch() interleaves.
+  static constexpr size_t kFindBatchSize = 16;
+
+  // Looks up every key of `keys` like Find(), storing the entry of
+  // keys[i] in results[i], which must be as long. The searches are
+  // interleaved so their cache misses overlap: each step prefetches the
+  // index entries, then the keys, that all of them compare next.
+  void FindBatch(absl::Span<const absl::string_view> keys,
+                 absl::Span<absl::optional<Entry>> results) const;
+
+  // Spanner read timestamp the data is current as of.
+  absl::Time latest_read() const { return latest_read_; }
+
+ private:
+  SnapshotFile(void* mapping, size_t length);
+
+  absl::string_view key(size_t i) const;
+
+  void* mapping_;
+  size_t length_;
+  const char* blob_ = nullptr;
+  const SnapshotIndexEntry* index_ = nullptr;
+  size_t num_entries_ = 0;
+  absl::Time latest_read_;
+};
+
+// SnapshotFileWriter writes a snapshot file. Entries go to a temporary
+// file next to the destination, which replaces the destination
+// atomically on Finish(), so readers never observe a partial file.
+class SnapshotFileWriter {
+ public:
+  static absl::StatusOr<std::unique_ptr<SnapshotFileWriter>> Create(
+      const std::string& path);
+
+  // Removes the temporary file unless Finish() succeeded.
+  ~SnapshotFileWriter();
+
+  // Appends an entry. Keys must be added in strictly increasing order.
+  absl::Status Add(absl::string_view key, absl::string_view data,
+                   absl::string_view json);
+
+  // Writes the index and header, syncs the file and moves it into place.
+  absl::Status Finish(absl::Time latest_read);
+
+ private:
+  SnapshotFileWriter(std::string path, std::string temp_path, FILE* file);
+
+  absl::Status Write(const void* data, size_t size);
+
+  std::string path_;
+  std::string temp_path_;
+  FILE* file_;
+  std::vector<SnapshotIndexEntry> index_;
+  std::string last_key_;
+  uint64_t blob_size_ = 0;
+  SnapshotChecksum checksum_;
+  bool finished_ = false;
+};
+
+}  // namespace trusted_server
+#endif  // SNAPSHOT_FILE_H_
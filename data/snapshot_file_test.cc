@@ -0,0 +1,204 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "data/snapshot_file.h"
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "gtest/gtest.h"
+
+namespace trusted_server {
+
+namespace {
+
+std::string TestPath(const std::string& name) {
+  return absl::StrCat(testing::TempDir(), "/", name);
+}
+
+void WriteTestFile(const std::string& path) {
+  auto writer = SnapshotFileWriter::Create(path);
+  ASSERT_TRUE(writer.ok()) << writer.status();
+  ASSERT_TRUE((*writer)->Add("a", "data-a", "{\"key\":\"a\"}").ok());
+  ASSERT_TRUE((*writer)->Add("bb", "", "{\"key\":\"bb\"}").ok());
+  ASSERT_TRUE((*writer)->Add("c", "data-c", "{}").ok());
+  ASSERT_TRUE((*writer)->Finish(absl::FromUnixNanos(1234567890123)).ok());
+}
+
+TEST(SnapshotFileTest, RoundTrip) {
+  const std::string path = TestPath("round_trip.snap");
+  WriteTestFile(path);
+
+  auto file = SnapshotFile::Open(path, /*verify_checksum=*/true);
+  ASSERT_TRUE(file.ok()) << file.status();
+  EXPECT_EQ((*file)->size(), 3);
+  EXPECT_EQ((*file)->latest_read(), absl::FromUnixNanos(1234567890123));
+  EXPECT_EQ((*file)->entry(1).key, "bb");
+
+  auto a = (*file)->Find("a");
+  ASSERT_TRUE(a.has_value());
+  EXPECT_EQ(a->data, "data-a");
+  EXPECT_EQ(a->json, "{\"key\":\"a\"}");
+  auto bb = (*file)->Find("bb");
+  ASSERT_TRUE(bb.has_value());
+  EXPECT_EQ(bb->data, "");
+  EXPECT_EQ((*file)->Find("c")->data, "data-c");
+  EXPECT_FALSE((*file)->Find("b").has_value());
+  EXPECT_FALSE((*file)->Find("d").has_value());
+  EXPECT_FALSE((*file)->Find("").has_value());
+}
+
+TEST(SnapshotFileTest, FindBatchMatchesFind) {
+  const std::string path = TestPath("find_batch.snap");
+  auto writer = SnapshotFileWriter::Create(path);
+  ASSERT_TRUE(writer.ok()) << writer.status();
+  for (int i = 0; i < 1000; ++i) {
+    const std::string key = absl::StrFormat("key%04d", 2 * i);
+    ASSERT_TRUE((*writer)->Add(key, "data-" + key, "{}").ok());
+  }
+  ASSERT_TRUE((*writer)->Finish(absl::UnixEpoch()).ok());
+  auto file = SnapshotFile::Open(path, /*verify_checksum=*/true);
+  ASSERT_TRUE(file.ok()) << file.status();
+
+  // More keys than one batch, mixing hits, misses and both ends.
+  std::vector<std::string> keys = {"", "key0000", "key1998", "key2000", "z"};
+  for (int i = 0; i < 100; ++i) keys.push_back(absl::StrFormat("key%04d", i));
+  std::vector<absl::string_view> views(keys.begin(), keys.end());
+  std::vector<absl::optional<SnapshotFile::Entry>> results(keys.size());
+  (*file)->FindBatch(views, absl::MakeSpan(results));
+  for (size_t i = 0; i < keys.size(); ++i) {
+    auto expected = (*file)->Find(keys[i]);
+    ASSERT_EQ(results[i].has_value(), expected.has_value()) << keys[i];
+    if (expected.has_value()) {
+      EXPECT_EQ(results[i]->key, keys[i]);
+      EXPECT_EQ(results[i]->data, expected->data);
+    }
+  }
+  EXPECT_TRUE(results[1].has_value());
+  EXPECT_TRUE(results[2].has_value());
+  EXPECT_FALSE(results[3].has_value());
+}
+
+TEST(SnapshotFileTest, EmptyFile) {
+  const std::string path = TestPath("empty.snap");
+  auto writer = SnapshotFileWriter::Create(path);
+  ASSERT_TRUE(writer.ok()) << writer.status();
+  ASSERT_TRUE((*writer)->Finish(absl::UnixEpoch()).ok());
+
+  auto file = SnapshotFile::Open(path, /*verify_checksum=*/true);
+  ASSERT_TRUE(file.ok()) << file.status();
+  EXPECT_EQ((*file)->size(), 0);
+  EXPECT_FALSE((*file)->Find("a").has_value());
+}
+
+TEST(SnapshotFileTest, DetectsCorruption) {
+  const std::string path = TestPath("corrupt.snap");
+  WriteTestFile(path);
+  {
+    std::fstream stream(path, std::ios::in | std::ios::out | std::ios::binary);
+    stream.seekp(sizeof(SnapshotFileHeader) + 2);
+    stream.put('X');
+  }
+  EXPECT_FALSE(SnapshotFile::Open(path, /*verify_checksum=*/true).ok());
+  EXPECT_TRUE(SnapshotFile::Open(path, /*verify_checksum=*/false).ok());
+
+  std::ofstream(TestPath("truncated.snap")) << "TKVSNAP";
+  EXPECT_FALSE(SnapshotFile::Open(TestPath("truncated.snap"), false).ok());
+  EXPECT_FALSE(SnapshotFile::Open(TestPath("missing.snap"), false).ok());
+}
+
+TEST(SnapshotFileTest, RejectsInconsistentHeaderAndIndex) {
+  const std::string path = TestPath("crafted.snap");
+  WriteTestFile(path);
+  SnapshotFileHeader header;
+  {
+    std::ifstream stream(path, std::ios::binary);
+    stream.read(reinterpret_cast<char*>(&header), sizeof(header));
+  }
+  auto write_header = [&](const SnapshotFileHeader& crafted) {
+    std::fstream stream(path, std::ios::in | std::ios::out | std::ios::binary);
+    stream.write(reinterpret_cast<const char*>(&crafted), sizeof(crafted));
+  };
+
+  // An entry count whose index size wraps around to the real one.
+  SnapshotFileHeader wrapping = header;
+  wrapping.num_entries += uint64_t{1} << 61;
+  write_header(wrapping);
+  EXPECT_FALSE(SnapshotFile::Open(path, /*verify_checksum=*/false).ok());
+
+  SnapshotFileHeader huge_blob = header;
+  huge_blob.blob_size = ~uint64_t{0} - 7;
+  write_header(huge_blob);
+  EXPECT_FALSE(SnapshotFile::Open(path, /*verify_checksum=*/false).ok());
+
+  // Swap the first two index entries, so the keys are out of order.
+  write_header(header);
+  const size_t index = sizeof(header) + header.blob_size;
+  SnapshotIndexEntry entries[2];
+  {
+    std::ifstream stream(path, std::ios::binary);
+    stream.seekg(index);
+    stream.read(reinterpret_cast<char*>(entries), sizeof(entries));
+  }
+  {
+    std::fstream stream(path, std::ios::in | std::ios::out | std::ios::binary);
+    stream.seekp(index);
+    stream.write(reinterpret_cast<const char*>(&entries[1]),
+                 sizeof(entries[1]));
+    stream.write(reinterpret_cast<const char*>(&entries[0]),
+                 sizeof(entries[0]));
+  }
+  EXPECT_FALSE(SnapshotFile::Open(path, /*verify_checksum=*/false).ok());
+}
+
+TEST(SnapshotFileTest, RejectsUnsortedKeys) {
+  const std::string path = TestPath("unsorted.snap");
+  {
+    auto writer = SnapshotFileWriter::Create(path);
+    ASSERT_TRUE(writer.ok()) << writer.status();
+    ASSERT_TRUE((*writer)->Add("b", "", "").ok());
+    EXPECT_FALSE((*writer)->Add("a", "", "").ok());
+    EXPECT_FALSE((*writer)->Add("b", "", "").ok());
+  }
+  // An unfinished writer leaves nothing behind.
+  EXPECT_FALSE(SnapshotFile::Open(path, false).ok());
+  EXPECT_EQ(std::fopen(absl::StrCat(path, ".tmp").c_str(), "r"), nullptr);
+}
+
+TEST(SnapshotChecksumTest, IndependentOfChunking) {
+  const std::string data = "The quick brown fox jumps over the lazy dog";
+  SnapshotChecksum whole;
+  whole.Update(data.data(), data.size());
+  SnapshotChecksum pieces;
+  for (size_t i = 0; i < data.size(); i += 3) {
+    pieces.Update(data.data() + i, std::min<size_t>(3, data.size() - i));
+  }
+  EXPECT_EQ(whole.Finish(), pieces.Finish());
+
+  SnapshotChecksum shorter;
+  shorter.Update(data.data(), data.size() - 1);
+  EXPECT_NE(whole.Finish(), shorter.Finish());
+}
+
+}  // namespace
+
+}  // namespace trusted_server
@@ -0,0 +1,212 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "data/synthetic_dataset.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_set.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+
+namespace trusted_server {
+
+namespace {
+
+// Sizes are capped so a heavy tail cannot exhaust memory.
+constexpr double kMaxSize = 1 << 24;
+
+constexpr double kPi = 3.14159265358979323846;
+
+constexpr absl::string_view kKeyPrefix = "https://creatives.synthetic.test/";
+constexpr absl::string_view kKeyAlphabet =
+    "abcdefghijklmnopqrstuvwxyz0123456789";
+
+// Words values are made of.
+constexpr absl::string_view kWords[] = {
+    "<div", "</div>", "class=\"ad\"", "<a", "</a>", "href=\"", "https://",
+    "advertiser", ".example/", "landing", "<img", "src=\"", "width=\"300\"",
+    "height=\"250\"", "alt=\"", "<span>", "</span>", "<p>", "</p>", "style=\"",
+    "color:", "#ffffff;", "font-size:", "14px;", "\">", "Buy", "now", "and",
+    "save", "on", "the", "best", "deals", "for", "your", "home", "free",
+    "shipping", "limited", "time", "offer", "today", "only", "new",
+    "collection", "shop", "sale", "price", "click", "here", "learn", "more",
+    "discover", "exclusive", "members", "get", "started", "with", "our", "app",
+    "utm_source=", "display", "&amp;", "campaign=", "spring",
+};
+
+// SplitMix64, which is cheap to seed: every row gets its own
+// generator, derived from the dataset's seed and the row.
+class Random {
+ public:
+  Random(uint64_t seed, uint64_t stream, uint64_t index, uint64_t version)
+      : state_(seed ^ stream * 0xd6e8feb86659fd93 ^
+               index * 0x9e3779b97f4a7c15 ^ version * 0xc2b2ae3d27d4eb4f) {}
+
+  uint64_t Next() {
+    uint64_t z = (state_ += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+  }
+
+  // Uniform in [0, 1).
+  double Uniform() { return (Next() >> 11) * 0x1.0p-53; }
+
+  size_t Sample(const SizeDistribution& distribution) {
+    double u = Uniform();
+    double v = Uniform();
+    return distribution.Sample(u, v);
+  }
+
+ private:
+  uint64_t state_;
+};
+
+// Streams of random numbers, so rows draw different numbers for
+// different purposes.
+enum Stream : uint64_t {
+  kKeyStream = 1,
+  kValueStream,
+  kSharedValueStream,
+  kRefreshStream,
+};
+
+std::string MakeValue(Random& random, size_t size) {
+  std::string value;
+  value.reserve(size + 16);
+  while (value.size() < size) {
+    if (!value.empty()) value.push_back(' ');
+    absl::string_view word = kWords[random.Next() % std::size(kWords)];
+    value.append(word.data(), word.size());
+  }
+  value.resize(size);
+  return value;
+}
+
+}  // namespace
+
+size_t SizeDistribution::Sample(double u, double v) const {
+  double size = a;
+  switch (kind) {
+    case Kind::kFixed:
+      break;
+    case Kind::kUniform:
+      size = std::floor(a + u * (b - a + 1));
+      break;
+    case Kind::kLogNormal: {
+      // Box-Muller.
+      double normal =
+          std::sqrt(-2 * std::log(1 - u)) * std::cos(2 * kPi * v);
+      size = std::round(a * std::exp(b * normal));
+      break;
+    }
+  }
+  return static_cast<size_t>(std::clamp(size, 0.0, kMaxSize));
+}
+
+bool AbslParseFlag(absl::string_view text, SizeDistribution* distribution,
+                   std::string* error) {
+  std::vector<absl::string_view> parts = absl::StrSplit(text, ':');
+  std::vector<double> numbers;
+  for (size_t i = 1; i < parts.size(); ++i) {
+    double number;
+    if (!absl::SimpleAtod(parts[i], &number) || !(number >= 0)) {
+      *error = absl::StrCat("not a non-negative number: ", parts[i]);
+      return false;
+    }
+    numbers.push_back(number);
+  }
+  SizeDistribution parsed;
+  if (parts[0] == "fixed" && numbers.size() == 1) {
+    parsed = {SizeDistribution::Kind::kFixed, numbers[0], 0};
+  } else if (parts[0] == "uniform" && numbers.size() == 2 &&
+             numbers[0] <= numbers[1]) {
+    parsed = {SizeDistribution::Kind::kUniform, numbers[0], numbers[1]};
+  } else if (parts[0] == "lognormal" && numbers.size() == 2) {
+    parsed = {SizeDistribution::Kind::kLogNormal, numbers[0], numbers[1]};
+  } else {
+    *error =
+        "expected fixed:N, uniform:MIN:MAX with MIN <= MAX or "
+        "lognormal:MEDIAN:SIGMA";
+    return false;
+  }
+  *distribution = parsed;
+  return true;
+}
+
+std::string AbslUnparseFlag(const SizeDistribution& distribution) {
+  switch (distribution.kind) {
+    case SizeDistribution::Kind::kFixed:
+      return absl::StrCat("fixed:", distribution.a);
+    case SizeDistribution::Kind::kUniform:
+      return absl::StrCat("uniform:", distribution.a, ":", distribution.b);
+    case SizeDistribution::Kind::kLogNormal:
+      return absl::StrCat("lognormal:", distribution.a, ":", distribution.b);
+  }
+  return "";
+}
+
+std::string SyntheticDataset::Key(size_t index) const {
+  Random random(options_.seed, kKeyStream, index, 0);
+  std::string key = absl::StrCat(kKeyPrefix, index, "/");
+  size_t size = random.Sample(options_.key_bytes);
+  while (key.size() < size) {
+    key.push_back(kKeyAlphabet[random.Next() % kKeyAlphabet.size()]);
+  }
+  return key;
+}
+
+std::string SyntheticDataset::Value(size_t index, size_t version) const {
+  Random random(options_.seed, kValueStream, index, version);
+  if (options_.num_shared_values > 0 &&
+      random.Uniform() * 100 < options_.shared_value_pct) {
+    size_t shared = random.Next() % options_.num_shared_values;
+    Random shared_random(options_.seed, kSharedValueStream, shared, 0);
+    return MakeValue(shared_random,
+                     shared_random.Sample(options_.value_bytes));
+  }
+  return MakeValue(random, random.Sample(options_.value_bytes));
+}
+
+std::vector<std::pair<std::string, std::string>>
+SyntheticDataset::RefreshBatch(size_t batch) const {
+  Random random(options_.seed, kRefreshStream, batch, 0);
+  std::vector<std::pair<std::string, std::string>> rows;
+  rows.reserve(options_.refresh_batch_keys);
+  // A batch holds a key at most once, as a query for the rows updated
+  // since a time would.
+  absl::flat_hash_set<size_t> updated;
+  for (size_t i = 0; i < options_.refresh_batch_keys; ++i) {
+    size_t index = options_.num_keys + batch * options_.refresh_batch_keys + i;
+    if (updated.size() < options_.num_keys &&
+        random.Uniform() * 100 >= options_.refresh_new_pct) {
+      do {
+        index = random.Next() % options_.num_keys;
+      } while (!updated.insert(index).second);
+    }
+    rows.emplace_back(Key(index), Value(index, batch + 1));
+  }
+  return rows;
+}
+
+}  // namespace trusted_server
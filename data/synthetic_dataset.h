@@ -0,0 +1,103 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SYNTHETIC_DATASET_H_
+#define SYNTHETIC_DATASET_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+
+namespace trusted_server {
+
+// A distribution of sizes in bytes, written as one of
+//   fixed:N              always N
+//   uniform:MIN:MAX      uniform over [MIN, MAX]
+//   lognormal:MEDIAN:SIGMA
+//                        log-normal with the given median and sigma of
+//                        the underlying normal, as object sizes tend to be
+// so it can be given as a flag.
+struct SizeDistribution {
+  enum class Kind { kFixed, kUniform, kLogNormal };
+
+  Kind kind = Kind::kFixed;
+  double a = 0;
+  double b = 0;
+
+  // Returns the size for `u` and `v`, independent uniform draws in
+  // [0, 1).
+  size_t Sample(double u, double v) const;
+};
+
+bool AbslParseFlag(absl::string_view text, SizeDistribution* distribution,
+                   std::string* error);
+std::string AbslUnparseFlag(const SizeDistribution& distribution);
+
+// SyntheticDataset generates creative rows of a configurable shape,
+// standing in for the CreativeMetadata table in load tests and
+// benchmarks. Every row is a pure function of the seed and its index,
+// so rows can be generated lazily, in any order and from any number of
+// threads, and the same options always give the same rows.
+//
+// Values are made of words from a small vocabulary, so they compress
+// about as well as markup does, and a share of the keys can be given
+// one of a few common values, as many creatives share theirs.
+class SyntheticDataset {
+ public:
+  struct Options {
+    // Keys loaded initially, Key(0) to Key(num_keys - 1).
+    size_t num_keys = 1000000;
+    SizeDistribution key_bytes = {SizeDistribution::Kind::kUniform, 40, 120};
+    SizeDistribution value_bytes = {SizeDistribution::Kind::kLogNormal, 1024,
+                                    0.5};
+    // Percentage of rows whose value is one of `num_shared_values`
+    // values, rather than a value of their own.
+    int shared_value_pct = 0;
+    size_t num_shared_values = 1000;
+    // Incremental batches, each of `refresh_batch_keys` rows, of which
+    // `refresh_new_pct` percent add keys and the rest update existing
+    // ones.
+    size_t refresh_batches = 0;
+    size_t refresh_batch_keys = 1000;
+    int refresh_new_pct = 10;
+    uint64_t seed = 1;
+  };
+
+  explicit SyntheticDataset(const Options& options) : options_(options) {}
+
+  const Options& options() const { return options_; }
+
+  // Returns the key of the given index. Keys are unique and start with
+  // the URL of a synthetic creative, so they look like render URLs.
+  std::string Key(size_t index) const;
+
+  // Returns the value of the key of the given index, as of the given
+  // refresh batch; version 0 is that of the initial load.
+  std::string Value(size_t index, size_t version) const;
+
+  // Returns the rows of the given refresh batch, numbered from 0, as
+  // (key, value) pairs.
+  std::vector<std::pair<std::string, std::string>> RefreshBatch(
+      size_t batch) const;
+
+ private:
+  const Options options_;
+};
+
+}  // namespace trusted_server
+#endif  // SYNTHETIC_DATASET_H_
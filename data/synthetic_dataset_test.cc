@@ -0,0 +1,138 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "data/synthetic_dataset.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_set.h"
+#include "absl/strings/match.h"
+#include "gtest/gtest.h"
+
+namespace trusted_server {
+
+namespace {
+
+SyntheticDataset::Options SmallOptions() {
+  SyntheticDataset::Options options;
+  options.num_keys = 1000;
+  return options;
+}
+
+TEST(SyntheticDatasetTest, IsDeterministic) {
+  SyntheticDataset a(SmallOptions());
+  SyntheticDataset b(SmallOptions());
+  for (size_t i : {0, 1, 500, 999}) {
+    EXPECT_EQ(a.Key(i), b.Key(i));
+    EXPECT_EQ(a.Value(i, 0), b.Value(i, 0));
+  }
+  EXPECT_NE(a.Value(1, 0), a.Value(1, 1));
+
+  SyntheticDataset::Options options = SmallOptions();
+  options.seed = 2;
+  SyntheticDataset c(options);
+  EXPECT_NE(a.Value(1, 0), c.Value(1, 0));
+}
+
+TEST(SyntheticDatasetTest, KeysAreUnique) {
+  SyntheticDataset dataset(SmallOptions());
+  absl::flat_hash_set<std::string> keys;
+  for (size_t i = 0; i < 1000; ++i) {
+    std::string key = dataset.Key(i);
+    EXPECT_TRUE(absl::StartsWith(key, "https://")) << key;
+    EXPECT_TRUE(keys.insert(key).second) << key;
+  }
+}
+
+TEST(SyntheticDatasetTest, SizesFollowDistributions) {
+  SyntheticDataset::Options options = SmallOptions();
+  options.key_bytes = {SizeDistribution::Kind::kUniform, 50, 60};
+  options.value_bytes = {SizeDistribution::Kind::kFixed, 200, 0};
+  SyntheticDataset dataset(options);
+  for (size_t i = 0; i < 1000; ++i) {
+    std::string key = dataset.Key(i);
+    EXPECT_GE(key.size(), 50);
+    EXPECT_LE(key.size(), 60);
+    EXPECT_EQ(dataset.Value(i, 0).size(), 200);
+  }
+
+  SizeDistribution lognormal = {SizeDistribution::Kind::kLogNormal, 1000,
+                                0.5};
+  // v picks the sign of the normal, with v = 0.25 giving the median.
+  EXPECT_EQ(lognormal.Sample(0.5, 0.25), 1000);
+  EXPECT_GT(lognormal.Sample(0.9, 0), 1000);
+  EXPECT_LT(lognormal.Sample(0.9, 0.5), 1000);
+}
+
+TEST(SyntheticDatasetTest, SharesValues) {
+  SyntheticDataset::Options options = SmallOptions();
+  options.shared_value_pct = 100;
+  options.num_shared_values = 10;
+  SyntheticDataset dataset(options);
+  absl::flat_hash_set<std::string> values;
+  for (size_t i = 0; i < 1000; ++i) values.insert(dataset.Value(i, 0));
+  EXPECT_LE(values.size(), 10);
+}
+
+TEST(SyntheticDatasetTest, RefreshBatchesAddAndUpdateKeys) {
+  SyntheticDataset::Options options = SmallOptions();
+  options.refresh_batches = 2;
+  options.refresh_batch_keys = 100;
+  options.refresh_new_pct = 50;
+  SyntheticDataset dataset(options);
+  absl::flat_hash_set<std::string> initial_keys;
+  for (size_t i = 0; i < options.num_keys; ++i) {
+    initial_keys.insert(dataset.Key(i));
+  }
+  auto batch = dataset.RefreshBatch(1);
+  ASSERT_EQ(batch.size(), 100);
+  EXPECT_EQ(batch, dataset.RefreshBatch(1));
+  size_t updated = std::count_if(batch.begin(), batch.end(), [&](auto& row) {
+    return initial_keys.contains(row.first);
+  });
+  absl::flat_hash_set<std::string> batch_keys;
+  for (const auto& row : batch) {
+    EXPECT_TRUE(batch_keys.insert(row.first).second) << row.first;
+  }
+  EXPECT_GT(updated, 20);
+  EXPECT_LT(updated, 80);
+  // Each batch adds keys of its own.
+  for (const auto& row : dataset.RefreshBatch(0)) {
+    if (initial_keys.contains(row.first)) continue;
+    for (const auto& other : batch) EXPECT_NE(row.first, other.first);
+  }
+}
+
+TEST(SyntheticDatasetTest, ParsesSizeDistributions) {
+  SizeDistribution distribution;
+  std::string error;
+  ASSERT_TRUE(AbslParseFlag("fixed:10", &distribution, &error));
+  EXPECT_EQ(distribution.kind, SizeDistribution::Kind::kFixed);
+  EXPECT_EQ(distribution.a, 10);
+  ASSERT_TRUE(AbslParseFlag("uniform:1:5", &distribution, &error));
+  EXPECT_EQ(AbslUnparseFlag(distribution), "uniform:1:5");
+  ASSERT_TRUE(AbslParseFlag("lognormal:1024:0.5", &distribution, &error));
+  EXPECT_EQ(AbslUnparseFlag(distribution), "lognormal:1024:0.5");
+
+  EXPECT_FALSE(AbslParseFlag("uniform:5:1", &distribution, &error));
+  EXPECT_FALSE(AbslParseFlag("fixed:-1", &distribution, &error));
+  EXPECT_FALSE(AbslParseFlag("zipf:1", &distribution, &error));
+  EXPECT_FALSE(AbslParseFlag("fixed", &distribution, &error));
+}
+
+}  // namespace
+
+}  // namespace trusted_server
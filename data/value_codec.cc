@@ -0,0 +1,130 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "data/value_codec.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "glog/logging.h"
+#include "zdict.h"
+#include "zstd.h"
+
+namespace trusted_server {
+
+namespace {
+
+struct CCtxDeleter {
+  void operator()(ZSTD_CCtx* cctx) const { ZSTD_freeCCtx(cctx); }
+};
+
+struct DCtxDeleter {
+  void operator()(ZSTD_DCtx* dctx) const { ZSTD_freeDCtx(dctx); }
+};
+
+// Contexts are reused across calls, and across codecs, so compressing a
+// value allocates nothing but its result.
+ZSTD_CCtx* ThreadCCtx() {
+  thread_local std::unique_ptr<ZSTD_CCtx, CCtxDeleter> cctx(ZSTD_createCCtx());
+  return cctx.get();
+}
+
+ZSTD_DCtx* ThreadDCtx() {
+  thread_local std::unique_ptr<ZSTD_DCtx, DCtxDeleter> dctx(ZSTD_createDCtx());
+  return dctx.get();
+}
+
+}  // namespace
+
+absl::StatusOr<std::shared_ptr<const ValueCodec>> ValueCodec::Train(
+    absl::Span<const absl::string_view> samples, const Options& options) {
+  std::string buffer;
+  std::vector<size_t> sizes;
+  sizes.reserve(samples.size());
+  for (absl::string_view sample : samples) {
+    buffer.append(sample.data(), sample.size());
+    sizes.push_back(sample.size());
+  }
+  std::string dictionary(options.dictionary_bytes, '\0');
+  size_t size = ZDICT_trainFromBuffer(&dictionary[0], dictionary.size(),
+                                      buffer.data(), sizes.data(),
+                                      static_cast<unsigned>(sizes.size()));
+  if (ZDICT_isError(size)) {
+    return absl::Status(
+        absl::StatusCode::kFailedPrecondition,
+        absl::StrCat("Failed to train a dictionary on ", samples.size(),
+                     " values: ", ZDICT_getErrorName(size)));
+  }
+  // zstd copies the dictionary into both of these.
+  ZSTD_CDict* cdict =
+      ZSTD_createCDict(dictionary.data(), size, options.level);
+  ZSTD_DDict* ddict = ZSTD_createDDict(dictionary.data(), size);
+  if (cdict == nullptr || ddict == nullptr) {
+    ZSTD_freeCDict(cdict);
+    ZSTD_freeDDict(ddict);
+    return absl::Status(absl::StatusCode::kResourceExhausted,
+                        "Failed to load the dictionary.");
+  }
+  return std::shared_ptr<const ValueCodec>(
+      new ValueCodec(cdict, ddict, size));
+}
+
+ValueCodec::~ValueCodec() {
+  ZSTD_freeCDict(cdict_);
+  ZSTD_freeDDict(ddict_);
+}
+
+std::string ValueCodec::Compress(absl::string_view value) const {
+  ZSTD_CCtx* cctx = ThreadCCtx();
+  ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+  ZSTD_CCtx_refCDict(cctx, cdict_);
+  // Every value is decompressed with this codec's dictionary, so the
+  // frames need not name it.
+  ZSTD_CCtx_setParameter(cctx, ZSTD_c_dictIDFlag, 0);
+  std::string compressed(ZSTD_compressBound(value.size()), '\0');
+  size_t size = ZSTD_compress2(cctx, &compressed[0], compressed.size(),
+                               value.data(), value.size());
+  // The output is large enough, so this only fails for want of memory.
+  CHECK(!ZSTD_isError(size)) << ZSTD_getErrorName(size);
+  compressed.resize(size);
+  compressed.shrink_to_fit();
+  return compressed;
+}
+
+bool ValueCodec::Decompress(absl::string_view compressed,
+                            std::string* out) const {
+  unsigned long long size =
+      ZSTD_getFrameContentSize(compressed.data(), compressed.size());
+  if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN) {
+    return false;
+  }
+  size_t offset = out->size();
+  out->resize(offset + size);
+  size_t result = ZSTD_decompress_usingDDict(
+      ThreadDCtx(), &(*out)[offset], size, compressed.data(),
+      compressed.size(), ddict_);
+  if (ZSTD_isError(result) || result != size) {
+    out->resize(offset);
+    return false;
+  }
+  return true;
+}
+
+}  // namespace trusted_server
@@ -0,0 +1,79 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VALUE_CODEC_H_
+#define VALUE_CODEC_H_
+
+#include <memory>
+#include <string>
+
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+
+struct ZSTD_CDict_s;
+struct ZSTD_DDict_s;
+
+namespace trusted_server {
+
+// ValueCodec compresses values held in memory with zstd and a dictionary
+// trained on a sample of them. Values are small and alike, so each is
+// compressed on its own but shares the dictionary, which holds what
+// they have in common. Compressed values are plain zstd frames, minus
+// the dictionary ID.
+//
+// A codec is immutable and may be used from any number of threads; each
+// thread compresses and decompresses with its own zstd contexts.
+class ValueCodec {
+ public:
+  struct Options {
+    // Upper bound on the size of the trained dictionary.
+    size_t dictionary_bytes = 112640;
+    // zstd compression level.
+    int level = 3;
+  };
+
+  // Trains a dictionary on `samples`. Fails if they are too few or too
+  // small to train one, e.g. fewer than about ten values.
+  static absl::StatusOr<std::shared_ptr<const ValueCodec>> Train(
+      absl::Span<const absl::string_view> samples, const Options& options);
+
+  ~ValueCodec();
+
+  ValueCodec(const ValueCodec&) = delete;
+  ValueCodec& operator=(const ValueCodec&) = delete;
+
+  // Returns `value` compressed.
+  std::string Compress(absl::string_view value) const;
+
+  // Appends the value `compressed` was made from to `out`. Returns
+  // false, leaving `out` as it was, if it is not a value compressed by
+  // this codec.
+  bool Decompress(absl::string_view compressed, std::string* out) const;
+
+  // Size of the dictionary.
+  size_t dictionary_bytes() const { return dictionary_bytes_; }
+
+ private:
+  ValueCodec(ZSTD_CDict_s* cdict, ZSTD_DDict_s* ddict,
+             size_t dictionary_bytes)
+      : cdict_(cdict), ddict_(ddict), dictionary_bytes_(dictionary_bytes) {}
+
+  ZSTD_CDict_s* cdict_;
+  ZSTD_DDict_s* ddict_;
+  size_t dictionary_bytes_;
+};
+
+}  // namespace trusted_server
+#endif  // VALUE_CODEC_H_
@@ -0,0 +1,88 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "data/value_codec.h"
+
+#include <string>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "gtest/gtest.h"
+
+namespace trusted_server {
+
+namespace {
+
+std::vector<std::string> Values(int count) {
+  std::vector<std::string> values;
+  for (int i = 0; i < count; ++i) {
+    values.push_back(absl::StrCat(
+        "{\"key\":\"https://ads.test/creative/", i,
+        "\",\"creativeData\":\"PGRpdiBjbGFzcz0iYWQiPjxhIGhyZWY9Imh0dHBz",
+        i * 7919 % 1000, "\"}"));
+  }
+  return values;
+}
+
+ValueCodec::Options SmallDictionary() {
+  ValueCodec::Options options;
+  options.dictionary_bytes = 4096;
+  return options;
+}
+
+TEST(ValueCodecTest, RoundTrips) {
+  std::vector<std::string> values = Values(1000);
+  std::vector<absl::string_view> samples(values.begin(), values.end());
+  auto codec = ValueCodec::Train(samples, SmallDictionary());
+  ASSERT_TRUE(codec.ok()) << codec.status();
+  EXPECT_GT((*codec)->dictionary_bytes(), 0);
+  EXPECT_LE((*codec)->dictionary_bytes(), 4096);
+
+  values.push_back("");
+  values.push_back("not like the others");
+  for (const std::string& value : values) {
+    std::string compressed = (*codec)->Compress(value);
+    std::string out = "prefix";
+    ASSERT_TRUE((*codec)->Decompress(compressed, &out));
+    EXPECT_EQ(out, "prefix" + value);
+  }
+  // What the values have in common is in the dictionary.
+  EXPECT_LT((*codec)->Compress(values[0]).size(), values[0].size() / 2);
+}
+
+TEST(ValueCodecTest, FailsWithoutEnoughSamples) {
+  std::vector<std::string> values = Values(2);
+  std::vector<absl::string_view> samples(values.begin(), values.end());
+  EXPECT_FALSE(ValueCodec::Train(samples, SmallDictionary()).ok());
+}
+
+TEST(ValueCodecTest, RejectsCorruptInput) {
+  std::vector<std::string> values = Values(1000);
+  std::vector<absl::string_view> samples(values.begin(), values.end());
+  auto codec = ValueCodec::Train(samples, SmallDictionary());
+  ASSERT_TRUE(codec.ok()) << codec.status();
+
+  std::string out = "prefix";
+  EXPECT_FALSE((*codec)->Decompress("", &out));
+  EXPECT_FALSE((*codec)->Decompress("garbage", &out));
+  std::string truncated = (*codec)->Compress(values[0]);
+  truncated.resize(truncated.size() / 2);
+  EXPECT_FALSE((*codec)->Decompress(truncated, &out));
+  EXPECT_EQ(out, "prefix");
+}
+
+}  // namespace
+
+}  // namespace trusted_server
@@ -0,0 +1,128 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "data/value_store.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/hash/hash.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "data/value_codec.h"
+
+namespace trusted_server {
+
+namespace {
+
+size_t ValueBytes(const StoredValue& value) {
+  return value.data.size() + value.json.size();
+}
+
+}  // namespace
+
+ValueStore::ValueStore(std::shared_ptr<const ValueCodec> codec)
+    : codec_(std::move(codec)), stats_(std::make_shared<Stats>()) {}
+
+std::shared_ptr<const StoredValue> ValueStore::Intern(std::string data,
+                                                      std::string json) {
+  const size_t hash = absl::Hash<absl::string_view>{}(data);
+  // The top bits pick the shard, as the table of a shard hashes by the
+  // bottom ones.
+  Shard& shard = shards_[(hash >> 56) % kNumShards];
+  std::shared_ptr<const StoredValue> value;
+  {
+    absl::MutexLock lock(&shard.mutex);
+    auto it = shard.values.find(hash);
+    if (it != shard.values.end()) value = it->second.lock();
+  }
+  if (value != nullptr && Holds(*value, data, json)) return value;
+
+  // Created, and compressed, without the lock, so other threads can
+  // intern meanwhile.
+  std::shared_ptr<const StoredValue> created =
+      Create(std::move(data), std::move(json));
+  std::shared_ptr<const StoredValue> current;
+  {
+    absl::MutexLock lock(&shard.mutex);
+    std::weak_ptr<const StoredValue>& entry = shard.values[hash];
+    current = entry.lock();
+    if (current == nullptr) {
+      entry = created;
+      if (shard.values.size() >= shard.next_sweep) Sweep(shard);
+      return created;
+    }
+  }
+  // Should the entry be taken by other data with the same hash, it
+  // keeps it and the new value is simply not shared. Another thread may
+  // also have created the same value meanwhile.
+  if (current != value && Same(*current, *created)) return current;
+  return created;
+}
+
+bool ValueStore::Holds(const StoredValue& value, absl::string_view data,
+                       absl::string_view json) const {
+  if (codec_ == nullptr) return value.data == data;
+  // Compressed values only keep their JSON, which has the data.
+  thread_local std::string stored_json;
+  stored_json.clear();
+  return codec_->Decompress(value.json, &stored_json) && stored_json == json;
+}
+
+bool ValueStore::Same(const StoredValue& a, const StoredValue& b) const {
+  // Compression is deterministic, so equal JSON compresses alike.
+  return codec_ == nullptr ? a.data == b.data : a.json == b.json;
+}
+
+std::shared_ptr<const StoredValue> ValueStore::Create(std::string data,
+                                                      std::string json) {
+  auto* value = new StoredValue{std::move(data), std::move(json)};
+  if (codec_ != nullptr) {
+    value->json = codec_->Compress(value->json);
+    value->data = std::string();
+  }
+  return Track(value);
+}
+
+std::shared_ptr<const StoredValue> ValueStore::Copy(const StoredValue& value) {
+  return Track(new StoredValue(value));
+}
+
+std::shared_ptr<const StoredValue> ValueStore::Track(StoredValue* value) {
+  stats_->values.fetch_add(1);
+  stats_->bytes.fetch_add(ValueBytes(*value));
+  return std::shared_ptr<const StoredValue>(
+      value, [stats = stats_](const StoredValue* value) {
+        stats->values.fetch_sub(1);
+        stats->bytes.fetch_sub(ValueBytes(*value));
+        delete value;
+      });
+}
+
+void ValueStore::Sweep(Shard& shard) {
+  for (auto it = shard.values.begin(); it != shard.values.end();) {
+    if (it->second.expired()) {
+      shard.values.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  // Sweeping again once the shard has doubled keeps it amortized O(1)
+  // per value interned.
+  shard.next_sweep = std::max(2 * shard.values.size(), kMinSweepSize);
+}
+
+}  // namespace trusted_server
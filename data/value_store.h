@@ -0,0 +1,129 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VALUE_STORE_H_
+#define VALUE_STORE_H_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "data/value_codec.h"
+
+namespace trusted_server {
+
+// Creative data as held in a snapshot, shared by every key whose data
+// is byte-identical.
+struct StoredValue {
+  std::string data;
+  // The end of the JSON object of a Creative with this data, as
+  // appended by AppendCreativeDataJson(). Stored compressed if the
+  // store has a codec, in which case `data`, which can be recovered
+  // from it, is left empty.
+  std::string json;
+};
+
+// ValueStore interns the values of a line of snapshots, so keys with
+// the same data share one StoredValue however many snapshots they are
+// in. Values are found by a hash of their data and reference counted:
+// a value lives for as long as any key of any snapshot holds it, and
+// the store forgets it with the last one.
+//
+// ValueStore is thread-safe. Its table is sharded by hash, and values
+// are compressed outside of any lock, so threads can intern at once.
+class ValueStore {
+ public:
+  // Values are stored compressed with `codec` unless it is null.
+  explicit ValueStore(std::shared_ptr<const ValueCodec> codec);
+
+  ValueStore(const ValueStore&) = delete;
+  ValueStore& operator=(const ValueStore&) = delete;
+
+  // Returns the value holding `data`, whose JSON, as appended by
+  // AppendCreativeDataJson(), is `json`. Values are only created, and
+  // compressed, for data the store does not hold yet, unless several
+  // threads intern the same new data at once.
+  std::shared_ptr<const StoredValue> Intern(std::string data,
+                                            std::string json);
+
+  // Returns a copy of `value`, held as this store would hold it by a
+  // store with the same codec, e.g. to place it elsewhere in memory.
+  // Copies are counted like other values but not interned: only the
+  // keys handed the copy share it.
+  std::shared_ptr<const StoredValue> Copy(const StoredValue& value);
+
+  // The codec values are compressed with; null if they are not.
+  const ValueCodec* codec() const { return codec_.get(); }
+  const std::shared_ptr<const ValueCodec>& shared_codec() const {
+    return codec_;
+  }
+
+  // Number of distinct values alive.
+  size_t size() const { return stats_->values.load(); }
+
+  // Bytes of data and JSON held by the values alive.
+  size_t bytes() const { return stats_->bytes.load(); }
+
+ private:
+  static constexpr int kNumShards = 16;
+  // A shard is not swept before it has this many entries.
+  static constexpr size_t kMinSweepSize = 1024;
+
+  // Shared with the deleters of the values, which may outlive the store.
+  struct Stats {
+    std::atomic<size_t> values{0};
+    std::atomic<size_t> bytes{0};
+  };
+
+  struct Shard {
+    absl::Mutex mutex;
+    // Values by the hash of their data. Values are only found through
+    // their entries, so should two data hash alike the second is simply
+    // not shared.
+    absl::flat_hash_map<size_t, std::weak_ptr<const StoredValue>> values
+        ABSL_GUARDED_BY(mutex);
+    // Size of `values` at which it is next swept.
+    size_t next_sweep ABSL_GUARDED_BY(mutex) = kMinSweepSize;
+  };
+
+  // Whether `value` holds `data`, whose JSON is `json`.
+  bool Holds(const StoredValue& value, absl::string_view data,
+             absl::string_view json) const;
+
+  // Whether `a` and `b`, both created by this store, hold the same data.
+  bool Same(const StoredValue& a, const StoredValue& b) const;
+
+  // Creates a value, compressed if need be, counted in stats_.
+  std::shared_ptr<const StoredValue> Create(std::string data,
+                                            std::string json);
+
+  // Takes ownership of `value`, counting it in stats_ while it lives.
+  std::shared_ptr<const StoredValue> Track(StoredValue* value);
+
+  // Drops the entries of `shard` whose values are gone.
+  static void Sweep(Shard& shard) ABSL_EXCLUSIVE_LOCKS_REQUIRED(shard.mutex);
+
+  const std::shared_ptr<const ValueCodec> codec_;
+  const std::shared_ptr<Stats> stats_;
+  std::array<Shard, kNumShards> shards_;
+};
+
+}  // namespace trusted_server
+#endif  // VALUE_STORE_H_
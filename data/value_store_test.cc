@@ -0,0 +1,122 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "data/value_store.h"
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "data/creative_json.h"
+#include "data/value_codec.h"
+#include "gtest/gtest.h"
+
+namespace trusted_server {
+
+namespace {
+
+std::shared_ptr<const StoredValue> Intern(ValueStore& store,
+                                          const std::string& data) {
+  std::string json;
+  AppendCreativeDataJson(data, &json);
+  return store.Intern(data, json);
+}
+
+TEST(ValueStoreTest, SharesIdenticalData) {
+  ValueStore store(nullptr);
+  auto a = Intern(store, "a");
+  auto b = Intern(store, "b");
+  EXPECT_EQ(Intern(store, "a"), a);
+  EXPECT_NE(a, b);
+  EXPECT_EQ(a->data, "a");
+  EXPECT_EQ(a->json, "\"creativeData\":\"YQ==\"}");
+  EXPECT_EQ(store.size(), 2);
+  EXPECT_EQ(store.bytes(), 2 * (1 + a->json.size()));
+}
+
+TEST(ValueStoreTest, ForgetsValuesNoLongerHeld) {
+  ValueStore store(nullptr);
+  auto a = Intern(store, "a");
+  a.reset();
+  EXPECT_EQ(store.size(), 0);
+  EXPECT_EQ(store.bytes(), 0);
+  a = Intern(store, "a");
+  EXPECT_EQ(store.size(), 1);
+
+  // Values may outlive their store.
+  auto store2 = std::make_unique<ValueStore>(nullptr);
+  auto b = Intern(*store2, "b");
+  store2.reset();
+  EXPECT_EQ(b->data, "b");
+}
+
+TEST(ValueStoreTest, SweepsForgottenValues) {
+  ValueStore store(nullptr);
+  std::vector<std::shared_ptr<const StoredValue>> kept;
+  for (int i = 0; i < 10000; ++i) {
+    auto value = Intern(store, absl::StrCat(i));
+    if (i % 10 == 0) kept.push_back(value);
+  }
+  EXPECT_EQ(store.size(), 1000);
+  for (int i = 0; i < 10000; i += 10) {
+    EXPECT_EQ(Intern(store, absl::StrCat(i)), kept[i / 10]);
+  }
+}
+
+TEST(ValueStoreTest, SharesValuesInternedByEveryThread) {
+  ValueStore store(nullptr);
+  std::vector<std::vector<std::shared_ptr<const StoredValue>>> interned(4);
+  std::vector<std::thread> threads;
+  for (auto& values : interned) {
+    threads.emplace_back([&store, &values] {
+      for (int i = 0; i < 1000; ++i) {
+        values.push_back(Intern(store, absl::StrCat(i)));
+      }
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  EXPECT_EQ(store.size(), 1000);
+  for (const auto& values : interned) EXPECT_EQ(values, interned[0]);
+}
+
+TEST(ValueStoreTest, SharesCompressedValues) {
+  std::vector<std::string> samples;
+  for (int i = 0; i < 1000; ++i) {
+    std::string json;
+    AppendCreativeDataJson(absl::StrCat("<div class=\"ad\">", i, "</div>"),
+                           &json);
+    samples.push_back(json);
+  }
+  ValueCodec::Options options;
+  options.dictionary_bytes = 4096;
+  auto codec = ValueCodec::Train(
+      std::vector<absl::string_view>(samples.begin(), samples.end()),
+      options);
+  ASSERT_TRUE(codec.ok()) << codec.status();
+  ValueStore store(*codec);
+  auto a = Intern(store, "<div class=\"ad\">1</div>");
+  EXPECT_EQ(Intern(store, "<div class=\"ad\">1</div>"), a);
+  EXPECT_NE(Intern(store, "<div class=\"ad\">2</div>"), a);
+  EXPECT_TRUE(a->data.empty());
+  std::string json;
+  ASSERT_TRUE((*codec)->Decompress(a->json, &json));
+  EXPECT_EQ(json, "\"creativeData\":\"PGRpdiBjbGFzcz0iYWQiPjE8L2Rpdj4=\"}");
+}
+
+}  // namespace
+
+}  // namespace trusted_server
@@ -0,0 +1,198 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "metrics/metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_set.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/synchronization/mutex.h"
+
+namespace trusted_server {
+
+namespace {
+
+std::string LabelSet(const std::string& labels, const std::string& extra) {
+  if (labels.empty() && extra.empty()) return "";
+  if (labels.empty() || extra.empty()) {
+    return absl::StrCat("{", labels, extra, "}");
+  }
+  return absl::StrCat("{", labels, ",", extra, "}");
+}
+
+}  // namespace
+
+int MetricShard() {
+  static std::atomic<int> next_shard{0};
+  thread_local const int shard =
+      next_shard.fetch_add(1, std::memory_order_relaxed) % kMetricShards;
+  return shard;
+}
+
+int64_t Counter::Value() const {
+  int64_t value = 0;
+  for (const Shard& shard : shards_) {
+    value += shard.value.load(std::memory_order_relaxed);
+  }
+  return value;
+}
+
+Histogram::Histogram(std::vector<double> bounds) : bounds_(std::move(bounds)) {
+  for (Shard& shard : shards_) {
+    shard.counts.reset(new std::atomic<int64_t>[bounds_.size() + 1]);
+    for (size_t i = 0; i <= bounds_.size(); ++i) shard.counts[i] = 0;
+  }
+}
+
+void Histogram::Record(double value) {
+  size_t bucket = std::lower_bound(bounds_.begin(), bounds_.end(), value) -
+                  bounds_.begin();
+  Shard& shard = shards_[MetricShard()];
+  shard.counts[bucket].fetch_add(1, std::memory_order_relaxed);
+  // Other threads rarely share the shard, so this seldom retries.
+  double sum = shard.sum.load(std::memory_order_relaxed);
+  while (!shard.sum.compare_exchange_weak(sum, sum + value,
+                                          std::memory_order_relaxed)) {
+  }
+}
+
+Histogram::Totals Histogram::Collect() const {
+  Totals totals;
+  totals.counts.resize(bounds_.size() + 1);
+  for (const Shard& shard : shards_) {
+    for (size_t i = 0; i <= bounds_.size(); ++i) {
+      int64_t count = shard.counts[i].load(std::memory_order_relaxed);
+      totals.counts[i] += count;
+      totals.count += count;
+    }
+    totals.sum += shard.sum.load(std::memory_order_relaxed);
+  }
+  return totals;
+}
+
+std::vector<double> ExponentialBuckets(double start, double factor,
+                                       int count) {
+  std::vector<double> bounds;
+  bounds.reserve(count);
+  for (double bound = start; static_cast<int>(bounds.size()) < count;
+       bound *= factor) {
+    bounds.push_back(bound);
+  }
+  return bounds;
+}
+
+const std::vector<double>& LatencyBuckets() {
+  static const auto* buckets =
+      new std::vector<double>(ExponentialBuckets(1e-6, 2, 25));
+  return *buckets;
+}
+
+MetricsRegistry& MetricsRegistry::Global() {
+  static auto* registry = new MetricsRegistry();
+  return *registry;
+}
+
+Counter* MetricsRegistry::AddCounter(const std::string& name,
+                                     const std::string& help,
+                                     const std::string& labels) {
+  auto entry = std::make_unique<Entry>();
+  entry->name = name;
+  entry->help = help;
+  entry->labels = labels;
+  entry->counter = std::make_unique<Counter>();
+  Counter* counter = entry->counter.get();
+  absl::MutexLock lock(&mutex_);
+  entries_.push_back(std::move(entry));
+  return counter;
+}
+
+Histogram* MetricsRegistry::AddHistogram(const std::string& name,
+                                         const std::string& help,
+                                         const std::string& labels,
+                                         std::vector<double> bounds) {
+  auto entry = std::make_unique<Entry>();
+  entry->name = name;
+  entry->help = help;
+  entry->labels = labels;
+  entry->histogram = std::make_unique<Histogram>(std::move(bounds));
+  Histogram* histogram = entry->histogram.get();
+  absl::MutexLock lock(&mutex_);
+  entries_.push_back(std::move(entry));
+  return histogram;
+}
+
+void MetricsRegistry::AddGauge(const std::string& name,
+                               const std::string& help,
+                               const std::string& labels,
+                               std::function<double()> value) {
+  auto entry = std::make_unique<Entry>();
+  entry->name = name;
+  entry->help = help;
+  entry->labels = labels;
+  entry->gauge = std::move(value);
+  absl::MutexLock lock(&mutex_);
+  entries_.push_back(std::move(entry));
+}
+
+std::string MetricsRegistry::Render() const {
+  absl::MutexLock lock(&mutex_);
+  std::string out;
+  absl::flat_hash_set<std::string> rendered;
+  for (const auto& first : entries_) {
+    if (!rendered.insert(first->name).second) continue;
+    const char* type = first->counter != nullptr     ? "counter"
+                       : first->histogram != nullptr ? "histogram"
+                                                     : "gauge";
+    absl::StrAppend(&out, "# HELP ", first->name, " ", first->help, "\n",
+                    "# TYPE ", first->name, " ", type, "\n");
+    // All series of a metric are rendered together.
+    for (const auto& entry : entries_) {
+      if (entry->name != first->name) continue;
+      const std::string& name = entry->name;
+      if (entry->counter != nullptr) {
+        absl::StrAppend(&out, name, LabelSet(entry->labels, ""), " ",
+                        entry->counter->Value(), "\n");
+      } else if (entry->histogram != nullptr) {
+        Histogram::Totals totals = entry->histogram->Collect();
+        const std::vector<double>& bounds = entry->histogram->bounds();
+        int64_t cumulative = 0;
+        for (size_t i = 0; i < totals.counts.size(); ++i) {
+          cumulative += totals.counts[i];
+          std::string le = i < bounds.size()
+                               ? absl::StrFormat("le=\"%g\"", bounds[i])
+                               : "le=\"+Inf\"";
+          absl::StrAppend(&out, name, "_bucket", LabelSet(entry->labels, le),
+                          " ", cumulative, "\n");
+        }
+        absl::StrAppend(
+            &out, name, "_sum", LabelSet(entry->labels, ""), " ",
+            absl::StrFormat("%.9g", totals.sum), "\n", name, "_count",
+            LabelSet(entry->labels, ""), " ", totals.count, "\n");
+      } else {
+        absl::StrAppend(&out, name, LabelSet(entry->labels, ""), " ",
+                        absl::StrFormat("%.17g", entry->gauge()), "\n");
+      }
+    }
+  }
+  return out;
+}
+
+}  // namespace trusted_server
@@ -0,0 +1,137 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+namespace trusted_server {
+
+// Metrics are updated on the request path from every serving thread, so
+// each one is split into shards and threads are spread across them.
+// Updates are relaxed atomic adds on a cache line the thread rarely
+// shares; they never lock or allocate. Shards are only summed up when
+// the metrics are collected.
+constexpr int kMetricShards = 16;
+
+// Returns the shard the calling thread updates.
+int MetricShard();
+
+// A monotonically increasing count.
+class Counter {
+ public:
+  void Increment(int64_t amount = 1) {
+    shards_[MetricShard()].value.fetch_add(amount, std::memory_order_relaxed);
+  }
+
+  int64_t Value() const;
+
+ private:
+  struct alignas(64) Shard {
+    std::atomic<int64_t> value{0};
+  };
+
+  std::array<Shard, kMetricShards> shards_;
+};
+
+// A distribution of values over fixed buckets, exported as a Prometheus
+// histogram.
+class Histogram {
+ public:
+  // `bounds` are the inclusive upper bounds of the buckets, ascending.
+  // Values above the last bound fall into an implicit +Inf bucket.
+  explicit Histogram(std::vector<double> bounds);
+
+  void Record(double value);
+
+  // Records the time elapsed since `start` in seconds.
+  void RecordSince(absl::Time start) {
+    Record(absl::ToDoubleSeconds(absl::Now() - start));
+  }
+
+  struct Totals {
+    // Per-bucket, not cumulative, counts; the last one is +Inf.
+    std::vector<int64_t> counts;
+    int64_t count = 0;
+    double sum = 0;
+  };
+  Totals Collect() const;
+
+  const std::vector<double>& bounds() const { return bounds_; }
+
+ private:
+  struct alignas(64) Shard {
+    std::unique_ptr<std::atomic<int64_t>[]> counts;
+    std::atomic<double> sum{0};
+  };
+
+  const std::vector<double> bounds_;
+  std::array<Shard, kMetricShards> shards_;
+};
+
+// Returns `count` bucket bounds starting at `start`, each `factor`
+// times the previous one.
+std::vector<double> ExponentialBuckets(double start, double factor,
+                                       int count);
+
+// Bounds for latencies in seconds, from 1us to about 16s.
+const std::vector<double>& LatencyBuckets();
+
+// MetricsRegistry holds the metrics of the process and renders them in
+// the Prometheus text exposition format. Metrics are registered once,
+// typically on first use, and live for the rest of the process.
+class MetricsRegistry {
+ public:
+  static MetricsRegistry& Global();
+
+  // `labels` is a rendered label set such as `stage="lookup"`, or empty.
+  // Metrics sharing a name must share a type and differ in labels.
+  Counter* AddCounter(const std::string& name, const std::string& help,
+                      const std::string& labels = "");
+  Histogram* AddHistogram(const std::string& name, const std::string& help,
+                          const std::string& labels,
+                          std::vector<double> bounds);
+  // Adds a gauge whose value is read from `value` on every collection.
+  void AddGauge(const std::string& name, const std::string& help,
+                const std::string& labels, std::function<double()> value);
+
+  std::string Render() const;
+
+ private:
+  struct Entry {
+    std::string name;
+    std::string help;
+    std::string labels;
+    std::unique_ptr<Counter> counter;
+    std::unique_ptr<Histogram> histogram;
+    std::function<double()> gauge;
+  };
+
+  mutable absl::Mutex mutex_;
+  std::vector<std::unique_ptr<Entry>> entries_ ABSL_GUARDED_BY(mutex_);
+};
+
+}  // namespace trusted_server
+#endif  // METRICS_H_
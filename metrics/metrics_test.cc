@@ -0,0 +1,92 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "metrics/metrics.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace trusted_server {
+
+namespace {
+
+using ::testing::HasSubstr;
+
+TEST(MetricsTest, CounterSumsAcrossThreads) {
+  Counter counter;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([&counter] {
+      for (int j = 0; j < 1000; ++j) counter.Increment();
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  EXPECT_EQ(counter.Value(), 8000);
+}
+
+TEST(MetricsTest, HistogramBuckets) {
+  Histogram histogram({1, 10, 100});
+  for (double value : {0.5, 1.0, 5.0, 50.0, 500.0, 5000.0}) {
+    histogram.Record(value);
+  }
+  Histogram::Totals totals = histogram.Collect();
+  EXPECT_THAT(totals.counts, testing::ElementsAre(2, 1, 1, 2));
+  EXPECT_EQ(totals.count, 6);
+  EXPECT_DOUBLE_EQ(totals.sum, 5556.5);
+}
+
+TEST(MetricsTest, ExponentialBuckets) {
+  EXPECT_THAT(ExponentialBuckets(1, 10, 3), testing::ElementsAre(1, 10, 100));
+}
+
+TEST(MetricsTest, RendersPrometheusText) {
+  MetricsRegistry registry;
+  registry.AddCounter("test_requests_total", "Requests.", "code=\"200\"")
+      ->Increment(3);
+  registry.AddCounter("test_requests_total", "Requests.", "code=\"400\"");
+  registry.AddHistogram("test_seconds", "Latency.", "", {0.1, 1})
+      ->Record(0.5);
+  registry.AddGauge("test_entries", "Entries.", "", [] { return 42.0; });
+
+  EXPECT_EQ(registry.Render(),
+            "# HELP test_requests_total Requests.\n"
+            "# TYPE test_requests_total counter\n"
+            "test_requests_total{code=\"200\"} 3\n"
+            "test_requests_total{code=\"400\"} 0\n"
+            "# HELP test_seconds Latency.\n"
+            "# TYPE test_seconds histogram\n"
+            "test_seconds_bucket{le=\"0.1\"} 0\n"
+            "test_seconds_bucket{le=\"1\"} 1\n"
+            "test_seconds_bucket{le=\"+Inf\"} 1\n"
+            "test_seconds_sum 0.5\n"
+            "test_seconds_count 1\n"
+            "# HELP test_entries Entries.\n"
+            "# TYPE test_entries gauge\n"
+            "test_entries 42\n");
+}
+
+TEST(MetricsTest, LabelsAreMergedWithBucketBounds) {
+  MetricsRegistry registry;
+  registry.AddHistogram("test_stage_seconds", "Stages.", "stage=\"a\"", {1});
+  EXPECT_THAT(registry.Render(),
+              HasSubstr("test_stage_seconds_bucket{stage=\"a\",le=\"1\"} 0\n"));
+}
+
+}  // namespace
+
+}  // namespace trusted_server
@@ -0,0 +1,155 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/admission_control.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+#include "absl/time/time.h"
+#include "boost/asio/steady_timer.hpp"
+#include "boost/system/error_code.hpp"
+#include "metrics/metrics.h"
+
+namespace trusted_server {
+
+namespace {
+
+struct AdmissionMetrics {
+  Counter* shed[static_cast<int>(ShedReason::kLatency) + 1];
+  Histogram* loop_lag_seconds;
+};
+
+const AdmissionMetrics& Metrics() {
+  static const auto* metrics = [] {
+    MetricsRegistry& registry = MetricsRegistry::Global();
+    constexpr char kShed[] = "trusted_server_shed_total";
+    constexpr char kShedHelp[] =
+        "Connections and requests rejected with a 503, by the limit they "
+        "hit: connections (--max_connections), requests "
+        "(--max_inflight_requests) or latency (--max_queue_delay_ms).";
+    auto* metrics = new AdmissionMetrics();
+    metrics->shed[static_cast<int>(ShedReason::kConnections)] =
+        registry.AddCounter(kShed, kShedHelp, "reason=\"connections\"");
+    metrics->shed[static_cast<int>(ShedReason::kRequests)] =
+        registry.AddCounter(kShed, kShedHelp, "reason=\"requests\"");
+    metrics->shed[static_cast<int>(ShedReason::kLatency)] =
+        registry.AddCounter(kShed, kShedHelp, "reason=\"latency\"");
+    metrics->loop_lag_seconds = registry.AddHistogram(
+        "trusted_server_event_loop_lag_seconds",
+        "How late the event loop ran a timer, i.e. how long handlers wait "
+        "for a thread.",
+        "", LatencyBuckets());
+    return metrics;
+  }();
+  return *metrics;
+}
+
+// Increments `count` unless that would take it past `limit`, or always
+// if `limit` is zero.
+bool TryAcquire(std::atomic<int>& count, int limit) {
+  if (limit <= 0) {
+    count.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+  int current = count.load(std::memory_order_relaxed);
+  do {
+    if (current >= limit) return false;
+  } while (!count.compare_exchange_weak(current, current + 1,
+                                        std::memory_order_relaxed));
+  return true;
+}
+
+int64_t SteadyNanos(std::chrono::steady_clock::time_point time) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             time.time_since_epoch())
+      .count();
+}
+
+}  // namespace
+
+AdmissionController::AdmissionController(Options options)
+    : options_(options),
+      retry_after_seconds_(
+          std::max<int64_t>(1, absl::ToInt64Seconds(options.retry_after))) {
+  Metrics();
+}
+
+bool AdmissionController::AdmitConnection() {
+  if (TryAcquire(connections_, options_.max_connections)) return true;
+  RecordShed(ShedReason::kConnections);
+  return false;
+}
+
+void AdmissionController::ReleaseConnection() {
+  connections_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool AdmissionController::AdmitRequest(absl::Duration queue_delay) {
+  if (options_.max_queue_delay > absl::ZeroDuration() &&
+      queue_delay > options_.max_queue_delay) {
+    RecordShed(ShedReason::kLatency);
+    return false;
+  }
+  if (TryAcquire(requests_, options_.max_inflight_requests)) return true;
+  RecordShed(ShedReason::kRequests);
+  return false;
+}
+
+void AdmissionController::ReleaseRequest() {
+  requests_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void AdmissionController::RecordShed(ShedReason reason) {
+  Metrics().shed[static_cast<int>(reason)]->Increment();
+}
+
+EventLoopMonitor::EventLoopMonitor(boost::asio::io_context& ioc,
+                                   absl::Duration interval)
+    : timer_(ioc), interval_(interval) {}
+
+void EventLoopMonitor::Run() { Schedule(); }
+
+absl::Duration EventLoopMonitor::lag() const {
+  int64_t expiry_nanos = expiry_nanos_.load(std::memory_order_relaxed);
+  int64_t overdue =
+      expiry_nanos == 0
+          ? 0
+          : SteadyNanos(std::chrono::steady_clock::now()) - expiry_nanos;
+  return absl::Nanoseconds(
+      std::max(overdue, lag_nanos_.load(std::memory_order_relaxed)));
+}
+
+void EventLoopMonitor::Schedule() {
+  timer_.expires_after(absl::ToChronoNanoseconds(interval_));
+  expiry_nanos_.store(SteadyNanos(timer_.expiry()), std::memory_order_relaxed);
+  timer_.async_wait([self = shared_from_this()](
+                        const boost::system::error_code& error_code) {
+    if (error_code) return;
+    int64_t lag_nanos = std::max<int64_t>(
+        0, SteadyNanos(std::chrono::steady_clock::now()) -
+               self->expiry_nanos_.load(std::memory_order_relaxed));
+    self->lag_nanos_.store(lag_nanos, std::memory_order_relaxed);
+    RecordLag(absl::Nanoseconds(lag_nanos));
+    self->Schedule();
+  });
+}
+
+void EventLoopMonitor::RecordLag(absl::Duration lag) {
+  Metrics().loop_lag_seconds->Record(absl::ToDoubleSeconds(lag));
+}
+
+}  // namespace trusted_server
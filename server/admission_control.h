@@ -0,0 +1,134 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ADMISSION_CONTROL_H_
+#define ADMISSION_CONTROL_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "absl/time/time.h"
+#include "boost/asio/io_context.hpp"
+#include "boost/asio/steady_timer.hpp"
+
+namespace trusted_server {
+
+// Reasons a connection or request is shed, as exported in
+// trusted_server_shed_total.
+enum class ShedReason {
+  kConnections,
+  kRequests,
+  kLatency,
+};
+
+// AdmissionController bounds the work the server takes on, so that under
+// overload the excess is rejected quickly with a 503 instead of every
+// request slowing down together.
+//
+// Three limits are enforced: open connections, requests in flight, and
+// the queueing delay of the event loop a request arrives on, as measured
+// by an EventLoopMonitor. A limit of zero disables it. One controller is
+// shared by all listeners; it is thread-safe and does not allocate.
+class AdmissionController {
+ public:
+  struct Options {
+    int max_connections = 0;
+    int max_inflight_requests = 0;
+    // Requests arriving while the event loop lags by more than this are
+    // shed.
+    absl::Duration max_queue_delay = absl::ZeroDuration();
+    // Sent as Retry-After with every 503 response.
+    absl::Duration retry_after = absl::Seconds(1);
+  };
+
+  explicit AdmissionController(Options options);
+
+  AdmissionController(const AdmissionController&) = delete;
+  AdmissionController& operator=(const AdmissionController&) = delete;
+
+  // Admits a new connection. Every admitted connection must be released
+  // with ReleaseConnection() when it closes.
+  bool AdmitConnection();
+  void ReleaseConnection();
+
+  // Admits a request that found its event loop lagging by `queue_delay`.
+  // Returns false if it is to be shed, and otherwise counts it in flight
+  // until ReleaseRequest() is called.
+  bool AdmitRequest(absl::Duration queue_delay);
+  void ReleaseRequest();
+
+  // Counts a connection or request shed for `reason`.
+  static void RecordShed(ShedReason reason);
+
+  // Whether requests are shed on the queueing delay of their event loop,
+  // which is only worth measuring then.
+  bool limits_queue_delay() const {
+    return options_.max_queue_delay > absl::ZeroDuration();
+  }
+
+  // Seconds clients are told to wait before retrying a shed request.
+  int64_t retry_after_seconds() const { return retry_after_seconds_; }
+
+  int open_connections() const {
+    return connections_.load(std::memory_order_relaxed);
+  }
+  int inflight_requests() const {
+    return requests_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  const Options options_;
+  const int64_t retry_after_seconds_;
+  std::atomic<int> connections_{0};
+  std::atomic<int> requests_{0};
+};
+
+// EventLoopMonitor measures how far behind an io_context runs its
+// handlers. A timer is scheduled every `interval`; the time it fires
+// late is how long handlers sit queued before a thread picks them up,
+// which is also what every request arriving on that loop waits before
+// being served.
+class EventLoopMonitor : public std::enable_shared_from_this<EventLoopMonitor> {
+ public:
+  static constexpr absl::Duration kDefaultInterval = absl::Milliseconds(5);
+
+  explicit EventLoopMonitor(boost::asio::io_context& ioc,
+                            absl::Duration interval = kDefaultInterval);
+
+  // Starts probing. The monitor keeps itself alive while the io_context
+  // runs.
+  void Run();
+
+  // Lag measured by the latest probe, or how overdue the pending probe
+  // already is if that is more, so a stalled loop is noticed before its
+  // probe gets to run.
+  absl::Duration lag() const;
+
+  // Records a lag measured by this or another event loop's probe in
+  // trusted_server_event_loop_lag_seconds.
+  static void RecordLag(absl::Duration lag);
+
+ private:
+  void Schedule();
+
+  boost::asio::steady_timer timer_;
+  const absl::Duration interval_;
+  std::atomic<int64_t> lag_nanos_{0};
+  // Expiry of the pending probe, in steady_clock nanoseconds.
+  std::atomic<int64_t> expiry_nanos_{0};
+};
+
+}  // namespace trusted_server
+#endif  // ADMISSION_CONTROL_H_
@@ -0,0 +1,101 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/admission_control.h"
+
+#include <memory>
+#include <thread>
+
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "boost/asio/io_context.hpp"
+#include "boost/asio/post.hpp"
+#include "gtest/gtest.h"
+
+namespace trusted_server {
+
+namespace {
+
+TEST(AdmissionControllerTest, LimitsConnections) {
+  AdmissionController::Options options;
+  options.max_connections = 2;
+  AdmissionController admission(options);
+  EXPECT_TRUE(admission.AdmitConnection());
+  EXPECT_TRUE(admission.AdmitConnection());
+  EXPECT_FALSE(admission.AdmitConnection());
+  EXPECT_EQ(admission.open_connections(), 2);
+  admission.ReleaseConnection();
+  EXPECT_TRUE(admission.AdmitConnection());
+  EXPECT_EQ(admission.open_connections(), 2);
+}
+
+TEST(AdmissionControllerTest, LimitsRequests) {
+  AdmissionController::Options options;
+  options.max_inflight_requests = 1;
+  options.max_queue_delay = absl::Milliseconds(10);
+  AdmissionController admission(options);
+  EXPECT_TRUE(admission.AdmitRequest(absl::ZeroDuration()));
+  EXPECT_FALSE(admission.AdmitRequest(absl::ZeroDuration()));
+  EXPECT_EQ(admission.inflight_requests(), 1);
+  admission.ReleaseRequest();
+  EXPECT_FALSE(admission.AdmitRequest(absl::Milliseconds(11)));
+  EXPECT_EQ(admission.inflight_requests(), 0);
+  EXPECT_TRUE(admission.AdmitRequest(absl::Milliseconds(10)));
+  EXPECT_TRUE(admission.limits_queue_delay());
+}
+
+TEST(AdmissionControllerTest, ZeroIsUnlimited) {
+  AdmissionController::Options options;
+  options.retry_after = absl::ZeroDuration();
+  AdmissionController admission(options);
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_TRUE(admission.AdmitConnection());
+    EXPECT_TRUE(admission.AdmitRequest(absl::Hours(1)));
+  }
+  EXPECT_EQ(admission.open_connections(), 1000);
+  EXPECT_EQ(admission.inflight_requests(), 1000);
+  // Nothing needs event loops probed for their lag.
+  EXPECT_FALSE(admission.limits_queue_delay());
+  // Clients are never told to retry right away.
+  EXPECT_EQ(admission.retry_after_seconds(), 1);
+}
+
+TEST(EventLoopMonitorTest, MeasuresBlockedLoop) {
+  boost::asio::io_context ioc(1);
+  auto monitor =
+      std::make_shared<EventLoopMonitor>(ioc, absl::Milliseconds(1));
+  monitor->Run();
+  std::thread runner([&ioc] { ioc.run(); });
+
+  // Let the probe settle on an idle loop, then block the only thread.
+  absl::SleepFor(absl::Milliseconds(20));
+  EXPECT_LT(monitor->lag(), absl::Milliseconds(20));
+  absl::Notification blocked, release;
+  boost::asio::post(ioc, [&] {
+    blocked.Notify();
+    release.WaitForNotification();
+  });
+  blocked.WaitForNotification();
+  absl::SleepFor(absl::Milliseconds(50));
+  EXPECT_GE(monitor->lag(), absl::Milliseconds(40));
+
+  release.Notify();
+  ioc.stop();
+  runner.join();
+}
+
+}  // namespace
+
+}  // namespace trusted_server
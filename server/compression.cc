@@ -0,0 +1,275 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/compression.h"
+
+#include <time.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "absl/base/macros.h"
+#include "absl/flags/flag.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "brotli/encode.h"
+#include "glog/logging.h"
+#include "metrics/metrics.h"
+#include "zlib.h"
+
+ABSL_FLAG(std::vector<std::string>, response_encodings,
+          std::vector<std::string>({"br", "gzip"}),
+          "Content encodings responses may be compressed with, most "
+          "preferred first. Supported are br and gzip; empty disables "
+          "compression.");
+
+ABSL_FLAG(int, compression_min_bytes, 1024,
+          "Responses smaller than this many bytes are sent uncompressed.");
+
+ABSL_FLAG(int, gzip_level, 6, "zlib compression level for gzip, 1-9.");
+
+ABSL_FLAG(int, brotli_quality, 5, "Brotli compression quality, 0-11.");
+
+namespace trusted_server {
+
+namespace {
+
+constexpr ContentEncoding kCompressedEncodings[] = {ContentEncoding::kGzip,
+                                                    ContentEncoding::kBrotli};
+
+const std::vector<ContentEncoding>& EnabledEncodings() {
+  static const auto* encodings = [] {
+    auto* encodings = new std::vector<ContentEncoding>();
+    for (const std::string& name : absl::GetFlag(FLAGS_response_encodings)) {
+      bool known = false;
+      for (ContentEncoding encoding : kCompressedEncodings) {
+        if (name == ContentEncodingName(encoding)) {
+          encodings->push_back(encoding);
+          known = true;
+        }
+      }
+      if (!known) LOG(ERROR) << "Ignoring unsupported encoding " << name;
+    }
+    return encodings;
+  }();
+  return *encodings;
+}
+
+// Returns the CPU time the calling thread has used so far.
+absl::Duration ThreadCpuTime() {
+  timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return absl::DurationFromTimespec(now);
+}
+
+// Returns the label set for `encoding`.
+std::string EncodingLabel(ContentEncoding encoding) {
+  return absl::StrCat("encoding=\"", ContentEncodingName(encoding), "\"");
+}
+
+struct CompressionMetrics {
+  // Indexed by ContentEncoding; null for kIdentity.
+  Histogram* cpu_seconds[static_cast<int>(ContentEncoding::kBrotli) + 1] = {};
+  Counter* saved_bytes[static_cast<int>(ContentEncoding::kBrotli) + 1] = {};
+};
+
+const CompressionMetrics& Metrics() {
+  static const auto* metrics = [] {
+    MetricsRegistry& registry = MetricsRegistry::Global();
+    auto* metrics = new CompressionMetrics();
+    for (ContentEncoding encoding : kCompressedEncodings) {
+      int index = static_cast<int>(encoding);
+      metrics->cpu_seconds[index] = registry.AddHistogram(
+          "trusted_server_compression_cpu_seconds",
+          "CPU time spent compressing a response, by encoding.",
+          EncodingLabel(encoding), LatencyBuckets());
+      metrics->saved_bytes[index] = registry.AddCounter(
+          "trusted_server_compression_saved_bytes_total",
+          "Bytes compression took off the responses sent, by encoding.",
+          EncodingLabel(encoding));
+    }
+    return metrics;
+  }();
+  return *metrics;
+}
+
+bool CompressGzip(absl::string_view input, std::string* output) {
+  z_stream stream = {};
+  // 16 added to the window bits asks for a gzip header and trailer.
+  if (deflateInit2(&stream, absl::GetFlag(FLAGS_gzip_level), Z_DEFLATED,
+                   MAX_WBITS + 16, /*memLevel=*/8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+  size_t offset = output->size();
+  output->resize(offset + deflateBound(&stream, input.size()));
+  stream.next_in =
+      reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+  stream.avail_in = input.size();
+  stream.next_out = reinterpret_cast<Bytef*>(&(*output)[offset]);
+  stream.avail_out = output->size() - offset;
+  int result = deflate(&stream, Z_FINISH);
+  deflateEnd(&stream);
+  if (result != Z_STREAM_END) {
+    output->resize(offset);
+    return false;
+  }
+  output->resize(offset + stream.total_out);
+  return true;
+}
+
+bool CompressBrotli(absl::string_view input, std::string* output) {
+  size_t max_size = BrotliEncoderMaxCompressedSize(input.size());
+  if (max_size == 0) return false;
+  size_t offset = output->size();
+  output->resize(offset + max_size);
+  size_t encoded_size = max_size;
+  if (!BrotliEncoderCompress(
+          absl::GetFlag(FLAGS_brotli_quality), BROTLI_DEFAULT_WINDOW,
+          BROTLI_MODE_TEXT, input.size(),
+          reinterpret_cast<const uint8_t*>(input.data()), &encoded_size,
+          reinterpret_cast<uint8_t*>(&(*output)[offset]))) {
+    output->resize(offset);
+    return false;
+  }
+  output->resize(offset + encoded_size);
+  return true;
+}
+
+}  // namespace
+
+absl::string_view ContentEncodingName(ContentEncoding encoding) {
+  switch (encoding) {
+    case ContentEncoding::kIdentity:
+      return "identity";
+    case ContentEncoding::kGzip:
+      return "gzip";
+    case ContentEncoding::kBrotli:
+      return "br";
+  }
+  return "identity";
+}
+
+bool CompressionEnabled() { return !EnabledEncodings().empty(); }
+
+ContentEncoding NegotiateEncoding(absl::string_view accept_encoding) {
+  const std::vector<ContentEncoding>& enabled = EnabledEncodings();
+  if (enabled.empty() || accept_encoding.empty()) {
+    return ContentEncoding::kIdentity;
+  }
+  // Weights the client gave each enabled encoding and "*"; negative
+  // when not mentioned.
+  double weights[ABSL_ARRAYSIZE(kCompressedEncodings) + 1];
+  std::fill(std::begin(weights), std::end(weights), -1);
+  double& wildcard_weight = weights[ABSL_ARRAYSIZE(kCompressedEncodings)];
+  for (absl::string_view coding : absl::StrSplit(accept_encoding, ',')) {
+    absl::string_view name = coding.substr(0, coding.find(';'));
+    name = absl::StripAsciiWhitespace(name);
+    double weight = 1;
+    if (name.size() < coding.size()) {
+      // Only the q parameter is defined for Accept-Encoding.
+      absl::string_view param = absl::StripAsciiWhitespace(
+          coding.substr(coding.find(';') + 1));
+      if (absl::ConsumePrefix(&param, "q=") ||
+          absl::ConsumePrefix(&param, "Q=")) {
+        if (!absl::SimpleAtod(param, &weight)) weight = 0;
+      }
+    }
+    if (name == "*") {
+      wildcard_weight = weight;
+      continue;
+    }
+    for (size_t i = 0; i < ABSL_ARRAYSIZE(kCompressedEncodings); ++i) {
+      absl::string_view known = ContentEncodingName(kCompressedEncodings[i]);
+      if (absl::EqualsIgnoreCase(name, known) ||
+          (kCompressedEncodings[i] == ContentEncoding::kGzip &&
+           absl::EqualsIgnoreCase(name, "x-gzip"))) {
+        weights[i] = weight;
+      }
+    }
+  }
+
+  ContentEncoding best = ContentEncoding::kIdentity;
+  double best_weight = 0;
+  for (ContentEncoding encoding : enabled) {
+    double weight = wildcard_weight;
+    for (size_t i = 0; i < ABSL_ARRAYSIZE(kCompressedEncodings); ++i) {
+      if (kCompressedEncodings[i] == encoding && weights[i] >= 0) {
+        weight = weights[i];
+      }
+    }
+    if (weight > best_weight) {
+      best = encoding;
+      best_weight = weight;
+    }
+  }
+  return best;
+}
+
+size_t CompressionMinBytes() {
+  static const size_t min_bytes =
+      std::max(0, absl::GetFlag(FLAGS_compression_min_bytes));
+  return min_bytes;
+}
+
+bool Compress(ContentEncoding encoding, absl::string_view input,
+              std::string* output) {
+  absl::Duration start = ThreadCpuTime();
+  bool compressed = false;
+  switch (encoding) {
+    case ContentEncoding::kIdentity:
+      output->append(input.data(), input.size());
+      return true;
+    case ContentEncoding::kGzip:
+      compressed = CompressGzip(input, output);
+      break;
+    case ContentEncoding::kBrotli:
+      compressed = CompressBrotli(input, output);
+      break;
+  }
+  Metrics().cpu_seconds[static_cast<int>(encoding)]->Record(
+      absl::ToDoubleSeconds(ThreadCpuTime() - start));
+  return compressed;
+}
+
+bool CompressIfSmaller(ContentEncoding encoding, absl::string_view input,
+                       std::string* output) {
+  const size_t size = output->size();
+  if (!Compress(encoding, input, output)) return false;
+  if (output->size() - size < input.size()) return true;
+  output->resize(size);
+  return false;
+}
+
+void RecordCompressedResponse(ContentEncoding encoding,
+                              size_t uncompressed_size,
+                              size_t compressed_size) {
+  // A counter must not go down.
+  if (encoding == ContentEncoding::kIdentity ||
+      compressed_size >= uncompressed_size) {
+    return;
+  }
+  Metrics().saved_bytes[static_cast<int>(encoding)]->Increment(
+      static_cast<int64_t>(uncompressed_size - compressed_size));
+}
+
+}  // namespace trusted_server
@@ -0,0 +1,71 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef COMPRESSION_H_
+#define COMPRESSION_H_
+
+#include <cstddef>
+#include <string>
+
+#include "absl/strings/string_view.h"
+
+namespace trusted_server {
+
+// Content codings a response body can be sent with.
+enum class ContentEncoding {
+  kIdentity,
+  kGzip,
+  kBrotli,
+};
+
+// Returns the name of `encoding` as used in Content-Encoding headers.
+absl::string_view ContentEncodingName(ContentEncoding encoding);
+
+// Returns whether any encoding is enabled by --response_encodings, in
+// which case responses vary with the Accept-Encoding request header.
+bool CompressionEnabled();
+
+// Picks the encoding for a response to a request carrying the given
+// Accept-Encoding header. Only encodings enabled by --response_encodings
+// are considered; among those the client weighs highest, the one listed
+// first in the flag wins. Returns kIdentity if the client accepts none
+// of them. Does not allocate.
+ContentEncoding NegotiateEncoding(absl::string_view accept_encoding);
+
+// Returns the smallest body worth compressing, from
+// --compression_min_bytes.
+size_t CompressionMinBytes();
+
+// Appends `input` compressed with `encoding` to `output`. Returns false
+// if compression failed, leaving `output` as it was. The CPU time spent
+// is exported as trusted_server_compression_cpu_seconds.
+bool Compress(ContentEncoding encoding, absl::string_view input,
+              std::string* output);
+
+// Like Compress(), but also returns false, leaving `output` as it was,
+// if the compressed body is not smaller than `input`, e.g. for tiny or
+// incompressible bodies, which are better sent as they are.
+bool CompressIfSmaller(ContentEncoding encoding, absl::string_view input,
+                       std::string* output);
+
+// Accounts a response sent with `encoding` in
+// trusted_server_compression_saved_bytes_total, whether it was just
+// compressed or came precompressed from a cache. Responses that saved
+// nothing are not counted.
+void RecordCompressedResponse(ContentEncoding encoding,
+                              size_t uncompressed_size,
+                              size_t compressed_size);
+
+}  // namespace trusted_server
+#endif  // COMPRESSION_H_
@@ -0,0 +1,114 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/compression.h"
+
+#include <cstdint>
+#include <random>
+#include <string>
+
+#include "absl/strings/str_cat.h"
+#include "brotli/decode.h"
+#include "gtest/gtest.h"
+#include "zlib.h"
+
+namespace trusted_server {
+
+namespace {
+
+std::string Gunzip(const std::string& input) {
+  z_stream stream = {};
+  EXPECT_EQ(inflateInit2(&stream, MAX_WBITS + 16), Z_OK);
+  std::string output(1 << 20, '\0');
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+  stream.avail_in = input.size();
+  stream.next_out = reinterpret_cast<Bytef*>(&output[0]);
+  stream.avail_out = output.size();
+  EXPECT_EQ(inflate(&stream, Z_FINISH), Z_STREAM_END);
+  output.resize(stream.total_out);
+  inflateEnd(&stream);
+  return output;
+}
+
+std::string Unbrotli(const std::string& input) {
+  std::string output(1 << 20, '\0');
+  size_t size = output.size();
+  EXPECT_EQ(BrotliDecoderDecompress(
+                input.size(), reinterpret_cast<const uint8_t*>(input.data()),
+                &size, reinterpret_cast<uint8_t*>(&output[0])),
+            BROTLI_DECODER_RESULT_SUCCESS);
+  output.resize(size);
+  return output;
+}
+
+TEST(CompressionTest, NegotiateEncoding) {
+  // By default br is preferred over gzip.
+  EXPECT_EQ(NegotiateEncoding(""), ContentEncoding::kIdentity);
+  EXPECT_EQ(NegotiateEncoding("identity"), ContentEncoding::kIdentity);
+  EXPECT_EQ(NegotiateEncoding("deflate"), ContentEncoding::kIdentity);
+  EXPECT_EQ(NegotiateEncoding("gzip"), ContentEncoding::kGzip);
+  EXPECT_EQ(NegotiateEncoding("x-gzip"), ContentEncoding::kGzip);
+  EXPECT_EQ(NegotiateEncoding("GZIP"), ContentEncoding::kGzip);
+  EXPECT_EQ(NegotiateEncoding("gzip, deflate, br"), ContentEncoding::kBrotli);
+  EXPECT_EQ(NegotiateEncoding("gzip;q=1.0, br;q=0.5"),
+            ContentEncoding::kGzip);
+  EXPECT_EQ(NegotiateEncoding("gzip ; q=0.8,br; q=0.8"),
+            ContentEncoding::kBrotli);
+  EXPECT_EQ(NegotiateEncoding("*"), ContentEncoding::kBrotli);
+  EXPECT_EQ(NegotiateEncoding("br;q=0, *"), ContentEncoding::kGzip);
+  EXPECT_EQ(NegotiateEncoding("gzip;q=0, br;q=0"), ContentEncoding::kIdentity);
+  EXPECT_EQ(NegotiateEncoding("*;q=0"), ContentEncoding::kIdentity);
+  EXPECT_EQ(NegotiateEncoding("gzip;q=x"), ContentEncoding::kIdentity);
+}
+
+TEST(CompressionTest, RoundTrip) {
+  std::string input;
+  for (int i = 0; i < 100; ++i) {
+    absl::StrAppend(&input, "{\"key\":\"https://example.com/ad", i,
+                    "\",\"creativeData\":\"CAEQAhgD\"},");
+  }
+  for (ContentEncoding encoding :
+       {ContentEncoding::kGzip, ContentEncoding::kBrotli}) {
+    std::string output = "prefix";
+    ASSERT_TRUE(Compress(encoding, input, &output));
+    EXPECT_EQ(output.substr(0, 6), "prefix");
+    std::string compressed = output.substr(6);
+    EXPECT_LT(compressed.size(), input.size() / 4);
+    EXPECT_EQ(encoding == ContentEncoding::kGzip ? Gunzip(compressed)
+                                                 : Unbrotli(compressed),
+              input);
+  }
+  std::string output;
+  ASSERT_TRUE(Compress(ContentEncoding::kIdentity, input, &output));
+  EXPECT_EQ(output, input);
+}
+
+TEST(CompressionTest, KeepsIncompressibleInputAsItIs) {
+  // Random bytes do not compress, and compressing them adds a header.
+  std::mt19937 random(1);
+  std::string input;
+  for (int i = 0; i < 1000; ++i) input.push_back(static_cast<char>(random()));
+  for (ContentEncoding encoding :
+       {ContentEncoding::kGzip, ContentEncoding::kBrotli}) {
+    std::string output = "prefix";
+    EXPECT_FALSE(CompressIfSmaller(encoding, input, &output));
+    EXPECT_EQ(output, "prefix");
+    EXPECT_FALSE(CompressIfSmaller(encoding, "a", &output));
+    EXPECT_EQ(output, "prefix");
+  }
+}
+
+}  // namespace
+
+}  // namespace trusted_server
@@ -0,0 +1,356 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/flight_recorder.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "glog/logging.h"
+#include "metrics/metrics.h"
+
+ABSL_FLAG(double, flight_recorder_sample_rate, 0.01,
+          "Fraction of requests whose stage timestamps are kept by the "
+          "flight recorder and served on /debug/requests. 0 disables it.");
+
+ABSL_FLAG(int, flight_recorder_slow_ms, 100,
+          "Milliseconds from which a recorded request is kept as slow, and "
+          "dumped to the log with the requests recorded before it.");
+
+ABSL_FLAG(int, flight_recorder_slots, 1024,
+          "Recent requests the flight recorder keeps per serving thread.");
+
+ABSL_FLAG(int, flight_recorder_dump_interval_sec, 10,
+          "Minimum seconds between two slow request dumps to the log.");
+
+namespace trusted_server {
+
+namespace {
+
+// Requests logged with a slow one.
+constexpr size_t kDumpedRequests = 32;
+// Requests of each kind served on kDebugRequestsPath.
+constexpr size_t kRenderedRequests = 100;
+
+constexpr absl::string_view kStageNames[kNumRequestStages] = {
+    "accepted", "read", "parsed", "snapshot", "looked_up", "encoded",
+    "written",
+};
+
+// Fields of a RequestRecord as stored in a slot.
+constexpr int kKeysField = kNumRequestStages;
+constexpr int kBytesField = kNumRequestStages + 1;
+constexpr int kStatusField = kNumRequestStages + 2;
+constexpr int kNumFields = kNumRequestStages + 3;
+
+Counter* SlowRequests() {
+  static Counter* counter = MetricsRegistry::Global().AddCounter(
+      "trusted_server_slow_requests_total",
+      "Requests recorded by the flight recorder that took at least "
+      "--flight_recorder_slow_ms.");
+  return counter;
+}
+
+std::atomic<uint64_t> next_recorder_id{0};
+
+// The trace of the request being handled on this thread.
+thread_local RequestTrace* current_trace = nullptr;
+
+// Renders `record` as a JSON object.
+void AppendRecordJson(const RequestRecord& record, std::string* out) {
+  const int64_t read = record.nanos(RequestStage::kRead);
+  absl::StrAppend(
+      out, "{\"time\":\"",
+      absl::FormatTime(absl::RFC3339_full, absl::FromUnixNanos(read),
+                       absl::UTCTimeZone()),
+      "\",\"status\":", record.status, ",\"keys\":", record.keys,
+      ",\"response_bytes\":", record.response_bytes,
+      absl::StrFormat(",\"latency_us\":%.1f",
+                      absl::ToDoubleMicroseconds(record.latency())),
+      ",\"stages_us\":{");
+  bool first = true;
+  for (int i = 0; i < kNumRequestStages; ++i) {
+    if (record.stage_nanos[i] == 0) continue;
+    absl::StrAppendFormat(out, "%s\"%s\":%.1f", first ? "" : ",",
+                          kStageNames[i], (record.stage_nanos[i] - read) / 1e3);
+    first = false;
+  }
+  out->append("}}");
+}
+
+}  // namespace
+
+absl::string_view RequestStageName(RequestStage stage) {
+  return kStageNames[static_cast<int>(stage)];
+}
+
+// A record as written by one thread and copied out by others. Every
+// field is atomic, so a copy racing with a write is merely torn, and
+// `sequence`, odd while a write is under way, tells torn copies apart.
+struct FlightRecorder::Slot {
+  std::atomic<uint64_t> sequence{0};
+  std::array<std::atomic<int64_t>, kNumFields> fields;
+};
+
+// A ring of the latest records of one thread. Only that thread writes
+// to it.
+class FlightRecorder::Ring {
+ public:
+  explicit Ring(size_t capacity)
+      : slots_(new Slot[std::max<size_t>(capacity, 1)]),
+        capacity_(std::max<size_t>(capacity, 1)) {}
+
+  void Push(const RequestRecord& record) {
+    uint64_t index = written_.load(std::memory_order_relaxed);
+    Slot& slot = slots_[index % capacity_];
+    uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+    slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (int i = 0; i < kNumRequestStages; ++i) {
+      slot.fields[i].store(record.stage_nanos[i], std::memory_order_relaxed);
+    }
+    slot.fields[kKeysField].store(record.keys, std::memory_order_relaxed);
+    slot.fields[kBytesField].store(record.response_bytes,
+                                   std::memory_order_relaxed);
+    slot.fields[kStatusField].store(record.status, std::memory_order_relaxed);
+    slot.sequence.store(sequence + 2, std::memory_order_release);
+    written_.store(index + 1, std::memory_order_release);
+  }
+
+  // Appends the records of the ring to `out`, newest first, at most
+  // `limit`.
+  void CopyTo(size_t limit, std::vector<RequestRecord>* out) const {
+    uint64_t written = written_.load(std::memory_order_acquire);
+    uint64_t count = std::min<uint64_t>({written, capacity_, limit});
+    for (uint64_t index = written; index > written - count; --index) {
+      const Slot& slot = slots_[(index - 1) % capacity_];
+      uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+      if (sequence % 2 != 0) continue;
+      RequestRecord record;
+      for (int i = 0; i < kNumRequestStages; ++i) {
+        record.stage_nanos[i] =
+            slot.fields[i].load(std::memory_order_relaxed);
+      }
+      record.keys = slot.fields[kKeysField].load(std::memory_order_relaxed);
+      record.response_bytes =
+          slot.fields[kBytesField].load(std::memory_order_relaxed);
+      record.status = static_cast<int>(
+          slot.fields[kStatusField].load(std::memory_order_relaxed));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.sequence.load(std::memory_order_relaxed) != sequence) continue;
+      out->push_back(record);
+    }
+  }
+
+ private:
+  const std::unique_ptr<Slot[]> slots_;
+  const size_t capacity_;
+  std::atomic<uint64_t> written_{0};
+};
+
+struct FlightRecorder::ThreadRings {
+  explicit ThreadRings(const Options& options)
+      : thread(std::this_thread::get_id()),
+        recent(options.recent_slots),
+        slow(options.slow_slots) {}
+
+  const std::thread::id thread;
+  Ring recent;
+  Ring slow;
+};
+
+FlightRecorder::FlightRecorder(const Options& options)
+    : options_(options),
+      sample_period_(options.sample_rate > 0
+                         ? std::max<int64_t>(
+                               std::llround(1 / options.sample_rate), 1)
+                         : 0),
+      id_(next_recorder_id++) {}
+
+FlightRecorder::~FlightRecorder() = default;
+
+FlightRecorder& FlightRecorder::Global() {
+  static FlightRecorder* recorder = [] {
+    Options options;
+    options.sample_rate = absl::GetFlag(FLAGS_flight_recorder_sample_rate);
+    int slow_ms = absl::GetFlag(FLAGS_flight_recorder_slow_ms);
+    options.slow_threshold = slow_ms > 0 ? absl::Milliseconds(slow_ms)
+                                         : absl::InfiniteDuration();
+    options.recent_slots =
+        std::max(absl::GetFlag(FLAGS_flight_recorder_slots), 1);
+    options.dump_interval =
+        absl::Seconds(absl::GetFlag(FLAGS_flight_recorder_dump_interval_sec));
+    return new FlightRecorder(options);
+  }();
+  return *recorder;
+}
+
+bool FlightRecorder::Sample() {
+  if (sample_period_ == 0) return false;
+  // Shared by the recorders of a thread, which is only ever one outside
+  // of tests.
+  thread_local int64_t countdown = 1;
+  if (--countdown > 0) return false;
+  countdown = sample_period_;
+  return true;
+}
+
+FlightRecorder::ThreadRings& FlightRecorder::ThisThread() {
+  struct Cache {
+    uint64_t id = ~uint64_t{0};
+    ThreadRings* rings = nullptr;
+  };
+  thread_local Cache cache;
+  if (cache.id == id_) return *cache.rings;
+  absl::MutexLock lock(&mutex_);
+  auto it = std::find_if(rings_.begin(), rings_.end(), [](const auto& rings) {
+    return rings->thread == std::this_thread::get_id();
+  });
+  if (it == rings_.end()) {
+    // Serving threads live as long as the process, so rings are kept
+    // for good, along with what they recorded.
+    rings_.push_back(std::make_unique<ThreadRings>(options_));
+    it = rings_.end() - 1;
+  }
+  cache = {id_, it->get()};
+  return **it;
+}
+
+void FlightRecorder::Record(const RequestRecord& record) {
+  ThreadRings& rings = ThisThread();
+  rings.recent.Push(record);
+  if (record.latency() < options_.slow_threshold) return;
+  rings.slow.Push(record);
+  SlowRequests()->Increment();
+  int64_t now = absl::GetCurrentTimeNanos();
+  int64_t last_dump = last_dump_nanos_.load(std::memory_order_relaxed);
+  if (last_dump != 0 &&
+      absl::Nanoseconds(now - last_dump) < options_.dump_interval) {
+    return;
+  }
+  if (last_dump_nanos_.compare_exchange_strong(last_dump, now,
+                                               std::memory_order_relaxed)) {
+    Dump(record, rings);
+  }
+}
+
+void FlightRecorder::Dump(const RequestRecord& record,
+                          const ThreadRings& rings) const {
+  std::vector<RequestRecord> recent;
+  rings.recent.CopyTo(kDumpedRequests, &recent);
+  std::string dump;
+  AppendRecordJson(record, &dump);
+  absl::StrAppend(&dump, "\nRequests recorded on its thread, newest first:");
+  for (const RequestRecord& request : recent) {
+    dump.push_back('\n');
+    AppendRecordJson(request, &dump);
+  }
+  LOG(WARNING) << "Slow request took "
+               << absl::FormatDuration(record.latency()) << ": " << dump;
+}
+
+std::vector<RequestRecord> FlightRecorder::Collect(bool slow,
+                                                   size_t limit) const {
+  std::vector<RequestRecord> records;
+  {
+    absl::MutexLock lock(&mutex_);
+    for (const auto& rings : rings_) {
+      (slow ? rings->slow : rings->recent).CopyTo(limit, &records);
+    }
+  }
+  std::sort(records.begin(), records.end(),
+            [](const RequestRecord& a, const RequestRecord& b) {
+              return a.nanos(RequestStage::kRead) >
+                     b.nanos(RequestStage::kRead);
+            });
+  if (records.size() > limit) records.resize(limit);
+  return records;
+}
+
+std::vector<RequestRecord> FlightRecorder::Recent(size_t limit) const {
+  return Collect(/*slow=*/false, limit);
+}
+
+std::vector<RequestRecord> FlightRecorder::Slow(size_t limit) const {
+  return Collect(/*slow=*/true, limit);
+}
+
+std::string FlightRecorder::RenderJson() const {
+  std::string json = absl::StrCat(
+      "{\"sample_rate\":", options_.sample_rate, ",\"slow_threshold_ms\":",
+      absl::ToDoubleMilliseconds(options_.slow_threshold), ",\"slow\":[");
+  bool first = true;
+  for (const RequestRecord& record : Slow(kRenderedRequests)) {
+    if (!first) json.push_back(',');
+    AppendRecordJson(record, &json);
+    first = false;
+  }
+  json.append("],\"recent\":[");
+  first = true;
+  for (const RequestRecord& record : Recent(kRenderedRequests)) {
+    if (!first) json.push_back(',');
+    AppendRecordJson(record, &json);
+    first = false;
+  }
+  json.append("]}");
+  return json;
+}
+
+void RequestTrace::Start(absl::Time accepted, absl::Time read) {
+  active_ = recorder_->Sample();
+  if (!active_) return;
+  record_ = RequestRecord();
+  Mark(RequestStage::kAccepted, accepted);
+  Mark(RequestStage::kRead, read);
+}
+
+void RequestTrace::Mark(RequestStage stage) {
+  if (active_) {
+    record_.stage_nanos[static_cast<int>(stage)] =
+        absl::GetCurrentTimeNanos();
+  }
+}
+
+void RequestTrace::Finish(int status, size_t response_bytes,
+                          absl::Time written) {
+  if (!active_) return;
+  Mark(RequestStage::kWritten, written);
+  record_.status = status;
+  record_.response_bytes = response_bytes;
+  recorder_->Record(record_);
+  active_ = false;
+}
+
+RequestTrace* RequestTrace::Current() { return current_trace; }
+
+RequestTrace::Scope::Scope(RequestTrace* trace) : previous_(current_trace) {
+  current_trace = trace->active() ? trace : nullptr;
+}
+
+RequestTrace::Scope::~Scope() { current_trace = previous_; }
+
+}  // namespace trusted_server
@@ -0,0 +1,212 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FLIGHT_RECORDER_H_
+#define FLIGHT_RECORDER_H_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+namespace trusted_server {
+
+// Stages of serving a request, in the order they are reached.
+enum class RequestStage {
+  // The connection the request came on was accepted.
+  kAccepted,
+  // The request was read in full.
+  kRead,
+  // Its target was parsed, and the lookup started.
+  kParsed,
+  // The snapshot the keys are looked up in was acquired, which may
+  // have to wait for a lock.
+  kSnapshot,
+  // The keys were looked up and the body assembled.
+  kLookedUp,
+  // The response was compressed, if need be, and its headers set.
+  kEncoded,
+  // The response was written.
+  kWritten,
+};
+constexpr int kNumRequestStages = 7;
+
+// Returns the name of `stage`, e.g. "looked_up".
+absl::string_view RequestStageName(RequestStage stage);
+
+// What the flight recorder keeps of a request.
+struct RequestRecord {
+  // Unix time in nanoseconds at which each stage was reached; 0 for
+  // stages the request did not go through, e.g. kSnapshot for
+  // responses served from the cache.
+  std::array<int64_t, kNumRequestStages> stage_nanos = {};
+  int64_t keys = 0;
+  int64_t response_bytes = 0;
+  int status = 0;
+
+  int64_t nanos(RequestStage stage) const {
+    return stage_nanos[static_cast<int>(stage)];
+  }
+
+  // Time from the request being read to its response being written.
+  absl::Duration latency() const {
+    return absl::Nanoseconds(nanos(RequestStage::kWritten) -
+                             nanos(RequestStage::kRead));
+  }
+};
+
+// FlightRecorder keeps the stage timestamps of a sample of requests,
+// so the requests behind a bad latency percentile can be found and
+// taken apart after the fact.
+//
+// Each serving thread records into rings of its own: one of the most
+// recent sampled requests, and one of those that took at least the
+// slow threshold. Recording is a handful of relaxed stores guarded by
+// a per-slot sequence number, so it never locks, allocates or contends
+// with other threads; readers copy slots out and skip any that were
+// overwritten meanwhile. When a slow request is recorded, the ring of
+// recent requests of its thread, which shows what it was queued behind,
+// is dumped to the log, at most once per dump interval.
+class FlightRecorder {
+ public:
+  struct Options {
+    // Fraction of requests recorded. Every 1/sample_rate-th request of
+    // each thread is, so 0 disables the recorder and 1 records all.
+    double sample_rate = 0.01;
+    // Latency from which a recorded request counts as slow; infinite
+    // to never count one.
+    absl::Duration slow_threshold = absl::Milliseconds(100);
+    // Requests kept per thread in each ring.
+    size_t recent_slots = 1024;
+    size_t slow_slots = 64;
+    // Minimum time between two dumps of a ring to the log.
+    absl::Duration dump_interval = absl::Seconds(10);
+  };
+
+  explicit FlightRecorder(const Options& options);
+  ~FlightRecorder();
+
+  FlightRecorder(const FlightRecorder&) = delete;
+  FlightRecorder& operator=(const FlightRecorder&) = delete;
+
+  // The recorder of the process, configured by the --flight_recorder_*
+  // flags.
+  static FlightRecorder& Global();
+
+  // Returns whether the calling thread's next request is to be
+  // recorded.
+  bool Sample();
+
+  // Records a request on the calling thread's rings.
+  void Record(const RequestRecord& record);
+
+  // Requests recorded on every thread, newest first, at most `limit`.
+  std::vector<RequestRecord> Recent(size_t limit) const;
+  std::vector<RequestRecord> Slow(size_t limit) const;
+
+  // Returns the slow and most recent requests as a JSON object, with
+  // stage times in microseconds from the request being read.
+  std::string RenderJson() const;
+
+  const Options& options() const { return options_; }
+
+ private:
+  struct Slot;
+  class Ring;
+  struct ThreadRings;
+
+  // Returns the rings of the calling thread, creating them on its first
+  // request.
+  ThreadRings& ThisThread();
+
+  std::vector<RequestRecord> Collect(bool slow, size_t limit) const;
+
+  // Logs `record` and the recent requests of `rings`.
+  void Dump(const RequestRecord& record, const ThreadRings& rings) const;
+
+  const Options options_;
+  // Requests of a thread between two recorded ones; 0 if disabled.
+  const int64_t sample_period_;
+  // Tells the rings of recorders apart in the calling thread's cache.
+  const uint64_t id_;
+  std::atomic<int64_t> last_dump_nanos_{0};
+  mutable absl::Mutex mutex_;
+  std::vector<std::unique_ptr<ThreadRings>> rings_ ABSL_GUARDED_BY(mutex_);
+};
+
+// RequestTrace follows a request of a connection through its stages
+// and hands it to a flight recorder once its response is written. A
+// connection holds one trace, restarted for each of its requests; only
+// sampled requests are timed, so the others pay for a branch per stage.
+class RequestTrace {
+ public:
+  explicit RequestTrace(FlightRecorder* recorder = &FlightRecorder::Global())
+      : recorder_(recorder) {}
+
+  // Starts tracing the next request of a connection accepted at
+  // `accepted`, read in full at `read`, if the recorder samples it.
+  void Start(absl::Time accepted, absl::Time read);
+
+  // Whether the current request is traced.
+  bool active() const { return active_; }
+
+  // Notes that the current request reached `stage` at `time`.
+  void Mark(RequestStage stage, absl::Time time) {
+    if (active_) {
+      record_.stage_nanos[static_cast<int>(stage)] = absl::ToUnixNanos(time);
+    }
+  }
+  void Mark(RequestStage stage);
+
+  void set_keys(size_t keys) { record_.keys = keys; }
+
+  // Records the current request, answered with `status` in
+  // `response_bytes` and written at `written`, and stops tracing it.
+  void Finish(int status, size_t response_bytes, absl::Time written);
+
+  // Returns the trace of the request the calling thread is handling, or
+  // null if it is not traced. Set by Scope.
+  static RequestTrace* Current();
+
+  // Makes `trace`, if active, the calling thread's current trace for
+  // the scope's lifetime, so the request handler can mark the stages it
+  // goes through.
+  class Scope {
+   public:
+    explicit Scope(RequestTrace* trace);
+    ~Scope();
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+   private:
+    RequestTrace* const previous_;
+  };
+
+ private:
+  FlightRecorder* const recorder_;
+  bool active_ = false;
+  RequestRecord record_;
+};
+
+}  // namespace trusted_server
+#endif  // FLIGHT_RECORDER_H_
@@ -0,0 +1,155 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/flight_recorder.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/strings/match.h"
+#include "absl/time/time.h"
+#include "gtest/gtest.h"
+
+namespace trusted_server {
+
+namespace {
+
+const absl::Time kRead = absl::FromUnixSeconds(1600000000);
+
+FlightRecorder::Options AllRequests() {
+  FlightRecorder::Options options;
+  options.sample_rate = 1;
+  options.slow_threshold = absl::Milliseconds(10);
+  options.recent_slots = 4;
+  options.slow_slots = 2;
+  return options;
+}
+
+// Traces a request read at kRead plus `offset` that takes `latency`.
+void Serve(RequestTrace& trace, absl::Duration offset,
+           absl::Duration latency) {
+  absl::Time read = kRead + offset;
+  trace.Start(read - absl::Seconds(1), read);
+  {
+    RequestTrace::Scope scope(&trace);
+    if (RequestTrace* current = RequestTrace::Current()) {
+      current->Mark(RequestStage::kParsed, read + absl::Microseconds(1));
+      current->set_keys(3);
+    }
+  }
+  trace.Finish(200, 1000, read + latency);
+}
+
+TEST(FlightRecorderTest, RecordsStages) {
+  FlightRecorder recorder(AllRequests());
+  RequestTrace trace(&recorder);
+  Serve(trace, absl::ZeroDuration(), absl::Microseconds(50));
+  EXPECT_EQ(RequestTrace::Current(), nullptr);
+
+  std::vector<RequestRecord> recent = recorder.Recent(10);
+  ASSERT_EQ(recent.size(), 1);
+  const RequestRecord& record = recent[0];
+  EXPECT_EQ(record.nanos(RequestStage::kRead), absl::ToUnixNanos(kRead));
+  EXPECT_EQ(record.nanos(RequestStage::kAccepted),
+            absl::ToUnixNanos(kRead - absl::Seconds(1)));
+  EXPECT_EQ(record.nanos(RequestStage::kParsed),
+            absl::ToUnixNanos(kRead + absl::Microseconds(1)));
+  EXPECT_EQ(record.nanos(RequestStage::kSnapshot), 0);
+  EXPECT_EQ(record.latency(), absl::Microseconds(50));
+  EXPECT_EQ(record.keys, 3);
+  EXPECT_EQ(record.response_bytes, 1000);
+  EXPECT_EQ(record.status, 200);
+  EXPECT_TRUE(recorder.Slow(10).empty());
+}
+
+TEST(FlightRecorderTest, KeepsSlowRequests) {
+  FlightRecorder recorder(AllRequests());
+  RequestTrace trace(&recorder);
+  Serve(trace, absl::Seconds(1), absl::Milliseconds(20));
+  for (int i = 2; i < 10; ++i) {
+    Serve(trace, absl::Seconds(i), absl::Microseconds(50));
+  }
+  // The slow request has left the ring of recent ones, not that of slow
+  // ones.
+  std::vector<RequestRecord> recent = recorder.Recent(10);
+  ASSERT_EQ(recent.size(), 4);
+  EXPECT_EQ(recent[0].nanos(RequestStage::kRead),
+            absl::ToUnixNanos(kRead + absl::Seconds(9)));
+  EXPECT_EQ(recent[3].nanos(RequestStage::kRead),
+            absl::ToUnixNanos(kRead + absl::Seconds(6)));
+  std::vector<RequestRecord> slow = recorder.Slow(10);
+  ASSERT_EQ(slow.size(), 1);
+  EXPECT_EQ(slow[0].latency(), absl::Milliseconds(20));
+
+  std::string json = recorder.RenderJson();
+  EXPECT_TRUE(absl::StrContains(
+      json,
+      "\"slow\":[{\"time\":\"2020-09-13T12:26:41+00:00\",\"status\":200,"
+      "\"keys\":3,\"response_bytes\":1000,\"latency_us\":20000.0,"
+      "\"stages_us\":{\"accepted\":-1000000.0,\"read\":0.0,"
+      "\"parsed\":1.0,\"written\":20000.0}}]"))
+      << json;
+}
+
+TEST(FlightRecorderTest, SamplesRequests) {
+  FlightRecorder::Options options = AllRequests();
+  options.sample_rate = 0.25;
+  FlightRecorder recorder(options);
+  RequestTrace trace(&recorder);
+  int traced = 0;
+  for (int i = 0; i < 100; ++i) {
+    trace.Start(kRead, kRead);
+    traced += trace.active();
+    trace.Finish(200, 0, kRead);
+  }
+  EXPECT_EQ(traced, 25);
+
+  options.sample_rate = 0;
+  FlightRecorder disabled(options);
+  RequestTrace untraced(&disabled);
+  Serve(untraced, absl::ZeroDuration(), absl::Seconds(1));
+  EXPECT_TRUE(disabled.Recent(10).empty());
+  EXPECT_TRUE(disabled.Slow(10).empty());
+}
+
+TEST(FlightRecorderTest, CollectsFromAllThreads) {
+  FlightRecorder recorder(AllRequests());
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&recorder, i] {
+      RequestTrace trace(&recorder);
+      for (int j = 0; j < 1000; ++j) {
+        Serve(trace, absl::Seconds(i), absl::Microseconds(j));
+      }
+    });
+  }
+  // Reading while the threads record only ever sees whole records.
+  for (int i = 0; i < 100; ++i) {
+    for (const RequestRecord& record : recorder.Recent(100)) {
+      EXPECT_EQ(record.keys, 3);
+      EXPECT_GE(record.nanos(RequestStage::kWritten),
+                record.nanos(RequestStage::kRead));
+    }
+  }
+  for (std::thread& thread : threads) thread.join();
+  std::vector<RequestRecord> recent = recorder.Recent(100);
+  ASSERT_EQ(recent.size(), 16);
+  EXPECT_EQ(recent[0].nanos(RequestStage::kRead),
+            absl::ToUnixNanos(kRead + absl::Seconds(3)));
+}
+
+}  // namespace
+
+}  // namespace trusted_server
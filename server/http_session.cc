@@ -0,0 +1,352 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/http_session.h"
+
+#include <chrono>
+#include <memory>
+#include <utility>
+
+#include "absl/base/macros.h"
+#include "absl/flags/flag.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "boost/asio/dispatch.hpp"
+#include "boost/asio/post.hpp"
+#include "boost/asio/steady_timer.hpp"
+#include "boost/asio/strand.hpp"
+#include "boost/beast/core.hpp"
+#include "boost/beast/http.hpp"
+#include "data/creative_map.h"
+#include "glog/logging.h"
+#include "metrics/metrics.h"
+#include "proto/response.pb.h"
+#include "server/request_handler.h"
+
+ABSL_FLAG(int, read_timeout_sec, 30,
+          "Seconds a connection may take to send its first complete request.");
+
+ABSL_FLAG(int, idle_timeout_sec, 60,
+          "Seconds a kept-alive connection may sit idle between requests.");
+
+ABSL_FLAG(int, write_timeout_sec, 30,
+          "Seconds a client may take to read a response before the "
+          "connection is dropped.");
+
+ABSL_FLAG(int, max_requests_per_connection, 1000,
+          "Number of requests served on a connection before it is closed. "
+          "Zero means unlimited.");
+
+namespace trusted_server {
+
+namespace {
+
+using ::boost::asio::ip::tcp;
+
+// How long a connection over --max_connections gets to send the request
+// its 503 answers.
+constexpr std::chrono::seconds kShedReadTimeout(1);
+
+// How long to wait before accepting again after an accept failed, e.g.
+// with EMFILE, which would otherwise fail again right away.
+constexpr std::chrono::milliseconds kAcceptRetryDelay(50);
+
+// Status codes counted separately; everything else is "other".
+constexpr int kCountedStatuses[] = {200, 400, 404, 500, 503};
+
+struct SessionMetrics {
+  Histogram* write_seconds;
+  Histogram* total_seconds;
+  Counter* requests_by_status[ABSL_ARRAYSIZE(kCountedStatuses) + 1];
+  Counter* read_errors;
+  Counter* write_errors;
+  Counter* connections;
+
+  Counter* requests(unsigned status) const {
+    for (size_t i = 0; i < ABSL_ARRAYSIZE(kCountedStatuses); ++i) {
+      if (kCountedStatuses[i] == status) return requests_by_status[i];
+    }
+    return requests_by_status[ABSL_ARRAYSIZE(kCountedStatuses)];
+  }
+};
+
+const SessionMetrics& Metrics() {
+  static const auto* metrics = [] {
+    MetricsRegistry& registry = MetricsRegistry::Global();
+    auto* metrics = new SessionMetrics();
+    metrics->write_seconds =
+        registry.AddHistogram(kStageSecondsMetric, kStageSecondsHelp,
+                              "stage=\"write\"", LatencyBuckets());
+    metrics->total_seconds =
+        registry.AddHistogram(kStageSecondsMetric, kStageSecondsHelp,
+                              "stage=\"total\"", LatencyBuckets());
+    constexpr char kRequests[] = "trusted_server_http_requests_total";
+    constexpr char kRequestsHelp[] = "HTTP requests answered, by status.";
+    for (size_t i = 0; i < ABSL_ARRAYSIZE(kCountedStatuses); ++i) {
+      metrics->requests_by_status[i] = registry.AddCounter(
+          kRequests, kRequestsHelp,
+          absl::StrCat("code=\"", kCountedStatuses[i], "\""));
+    }
+    metrics->requests_by_status[ABSL_ARRAYSIZE(kCountedStatuses)] =
+        registry.AddCounter(kRequests, kRequestsHelp, "code=\"other\"");
+    constexpr char kErrors[] = "trusted_server_connection_errors_total";
+    constexpr char kErrorsHelp[] =
+        "Connections failed while reading a request or writing a response.";
+    metrics->read_errors =
+        registry.AddCounter(kErrors, kErrorsHelp, "op=\"read\"");
+    metrics->write_errors =
+        registry.AddCounter(kErrors, kErrorsHelp, "op=\"write\"");
+    metrics->connections =
+        registry.AddCounter("trusted_server_connections_total",
+                            "Connections accepted.");
+    return metrics;
+  }();
+  return *metrics;
+}
+
+}  // namespace
+
+HttpSession::HttpSession(tcp::socket&& socket,
+                         std::shared_ptr<CreativeMap> creative_map,
+                         std::shared_ptr<ResponseCache> cache,
+                         std::shared_ptr<const ShardRouter> router,
+                         std::shared_ptr<AdmissionController> admission,
+                         std::shared_ptr<const EventLoopMonitor> loop_monitor)
+    : stream_(std::move(socket)),
+      response_(std::piecewise_construct, std::make_tuple(),
+                std::make_tuple(ArenaAllocator<char>(&arena_))),
+      creative_map_(std::move(creative_map)),
+      cache_(std::move(cache)),
+      router_(std::move(router)),
+      admission_(std::move(admission)),
+      loop_monitor_(std::move(loop_monitor)),
+      connection_admitted_(admission_->AdmitConnection()),
+      accepted_(absl::Now()) {}
+
+HttpSession::~HttpSession() {
+  // A session is dropped without OnWrite() running if its io_context is
+  // stopped mid-write.
+  if (request_admitted_) admission_->ReleaseRequest();
+  if (connection_admitted_) admission_->ReleaseConnection();
+}
+
+void HttpSession::Run() {
+  // Accepted sockets are not bound to the strand yet, so hop onto it
+  // before touching the stream.
+  boost::asio::dispatch(
+      stream_.get_executor(),
+      boost::beast::bind_front_handler(&HttpSession::DoRead,
+                                       shared_from_this()));
+}
+
+void HttpSession::DoRead() {
+  // Release everything allocated from the arena before rewinding it.
+  // Clearing the body also unpins the snapshot it pointed into.
+  parser_.reset();
+  response_.clear();
+  response_.body().Clear();
+  arena_.Reset();
+  parser_.emplace(std::piecewise_construct, std::make_tuple(),
+                  std::make_tuple(ArenaAllocator<char>(&arena_)));
+
+  // Pipelined requests already sitting in buffer_ are parsed from there
+  // first, so they are answered in order without another socket read.
+  if (!connection_admitted_) {
+    stream_.expires_after(kShedReadTimeout);
+  } else {
+    stream_.expires_after(std::chrono::seconds(
+        requests_served_ == 0 ? absl::GetFlag(FLAGS_read_timeout_sec)
+                              : absl::GetFlag(FLAGS_idle_timeout_sec)));
+  }
+  http::async_read(
+      stream_, buffer_, *parser_,
+      boost::beast::bind_front_handler(&HttpSession::OnRead,
+                                       shared_from_this()));
+}
+
+void HttpSession::OnRead(boost::beast::error_code error_code,
+                         std::size_t bytes) {
+  if (error_code == http::error::end_of_stream ||
+      error_code == boost::beast::error::timeout) {
+    return DoClose();
+  }
+  read_done_ = absl::Now();
+  trace_.Start(accepted_, read_done_);
+  const SessionMetrics& metrics = Metrics();
+  if (error_code) {
+    // Mirror the synchronous server and reply to unreadable requests
+    // with a 400 before dropping the connection.
+    metrics.read_errors->Increment();
+    ErrorResponse(parser_->get(), http::status::bad_request, &response_);
+    response_.keep_alive(false);
+  } else if (!connection_admitted_) {
+    ServiceUnavailableResponse(parser_->get(),
+                               admission_->retry_after_seconds(), &response_);
+    response_.keep_alive(false);
+  } else if (!admission_->AdmitRequest(loop_monitor_->lag())) {
+    ServiceUnavailableResponse(parser_->get(),
+                               admission_->retry_after_seconds(), &response_);
+  } else {
+    request_admitted_ = true;
+    ++requests_served_;
+    RequestTrace::Scope trace_scope(&trace_);
+    if (!HandleRequest(parser_->get(), *creative_map_, cache_.get(),
+                       router_.get(), &response_)) {
+      auto done = [self = shared_from_this()](
+                      absl::StatusOr<Response> result) mutable {
+        PostRouted(std::move(self), std::move(result));
+      };
+      // OnRouted() writes the response once the shards reply.
+      if (StartRoutedRequest(parser_->get(), *router_, std::move(done),
+                             &response_)) {
+        return;
+      }
+    }
+  }
+  DoWrite();
+}
+
+void HttpSession::PostRouted(std::shared_ptr<HttpSession> session,
+                             absl::StatusOr<Response> result) {
+  // Called on the router's thread, which must not end up holding the
+  // last reference to the session, so it moves into the handler.
+  auto executor = session->stream_.get_executor();
+  boost::asio::post(executor, [session = std::move(session),
+                               result = std::move(result)]() mutable {
+    session->OnRouted(std::move(result));
+  });
+}
+
+void HttpSession::OnRouted(absl::StatusOr<Response> result) {
+  {
+    RequestTrace::Scope trace_scope(&trace_);
+    FinishRoutedRequest(parser_->get(), result, &response_);
+  }
+  DoWrite();
+}
+
+void HttpSession::DoWrite() {
+  if (request_admitted_) {
+    int max_requests = absl::GetFlag(FLAGS_max_requests_per_connection);
+    if (max_requests > 0 && requests_served_ >= max_requests) {
+      response_.keep_alive(false);
+    }
+  }
+  RecordHttpResponse(response_.result_int());
+  write_start_ = absl::Now();
+  trace_.Mark(RequestStage::kEncoded, write_start_);
+  stream_.expires_after(
+      std::chrono::seconds(absl::GetFlag(FLAGS_write_timeout_sec)));
+  http::async_write(
+      stream_, response_,
+      boost::beast::bind_front_handler(&HttpSession::OnWrite,
+                                       shared_from_this()));
+}
+
+void HttpSession::OnWrite(boost::beast::error_code error_code,
+                          std::size_t bytes) {
+  if (request_admitted_) {
+    admission_->ReleaseRequest();
+    request_admitted_ = false;
+  }
+  const SessionMetrics& metrics = Metrics();
+  if (error_code) {
+    metrics.write_errors->Increment();
+    LOG(ERROR) << "Failed to write response: " << error_code.message();
+    return;
+  }
+  absl::Time now = absl::Now();
+  metrics.write_seconds->Record(absl::ToDoubleSeconds(now - write_start_));
+  metrics.total_seconds->Record(absl::ToDoubleSeconds(now - read_done_));
+  trace_.Finish(response_.result_int(), bytes, now);
+  if (response_.need_eof()) {
+    return DoClose();
+  }
+  DoRead();
+}
+
+void HttpSession::DoClose() {
+  boost::beast::error_code error_code;
+  stream_.socket().shutdown(tcp::socket::shutdown_send, error_code);
+}
+
+Listener::Listener(boost::asio::io_context& ioc, tcp::endpoint endpoint,
+                   std::shared_ptr<CreativeMap> creative_map,
+                   std::shared_ptr<ResponseCache> cache,
+                   std::shared_ptr<const ShardRouter> router,
+                   std::shared_ptr<AdmissionController> admission,
+                   bool reuse_port)
+    : ioc_(ioc),
+      acceptor_(boost::asio::make_strand(ioc)),
+      accept_retry_timer_(acceptor_.get_executor()),
+      creative_map_(std::move(creative_map)),
+      cache_(std::move(cache)),
+      router_(std::move(router)),
+      admission_(std::move(admission)),
+      loop_monitor_(std::make_shared<EventLoopMonitor>(ioc)) {
+  acceptor_.open(endpoint.protocol());
+  acceptor_.set_option(boost::asio::socket_base::reuse_address(true));
+  if (reuse_port) {
+    acceptor_.set_option(
+        boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(
+            true));
+  }
+  acceptor_.bind(endpoint);
+  acceptor_.listen(boost::asio::socket_base::max_listen_connections);
+}
+
+void Listener::Run() {
+  // Probing wakes the loop every few milliseconds, for nothing unless
+  // admission sheds on lag.
+  if (admission_->limits_queue_delay()) loop_monitor_->Run();
+  DoAccept();
+}
+
+void Listener::DoAccept() {
+  // Each connection gets its own strand so its handlers never run
+  // concurrently while different connections proceed in parallel.
+  acceptor_.async_accept(
+      boost::asio::make_strand(ioc_),
+      boost::beast::bind_front_handler(&Listener::OnAccept,
+                                       shared_from_this()));
+}
+
+void Listener::OnAccept(boost::beast::error_code error_code,
+                        tcp::socket socket) {
+  if (error_code) {
+    LOG_EVERY_N(ERROR, 1000)
+        << "Failed to accept connection: " << error_code.message();
+    accept_retry_timer_.expires_after(kAcceptRetryDelay);
+    accept_retry_timer_.async_wait(
+        [self = shared_from_this()](boost::beast::error_code) {
+          self->DoAccept();
+        });
+    return;
+  }
+  RecordHttpConnection();
+  std::make_shared<HttpSession>(std::move(socket), creative_map_, cache_,
+                                router_, admission_, loop_monitor_)
+      ->Run();
+  DoAccept();
+}
+
+void RecordHttpConnection() { Metrics().connections->Increment(); }
+
+void RecordHttpResponse(unsigned status) {
+  Metrics().requests(status)->Increment();
+}
+
+}  // namespace trusted_server
@@ -0,0 +1,156 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef HTTP_SESSION_H_
+#define HTTP_SESSION_H_
+
+#include <memory>
+
+#include "absl/status/statusor.h"
+#include "absl/time/time.h"
+#include "boost/asio/io_context.hpp"
+#include "boost/asio/ip/tcp.hpp"
+#include "boost/asio/steady_timer.hpp"
+#include "boost/beast/core.hpp"
+#include "boost/beast/http.hpp"
+#include "boost/optional.hpp"
+#include "data/creative_map.h"
+#include "proto/response.pb.h"
+#include "server/admission_control.h"
+#include "server/flight_recorder.h"
+#include "server/request_arena.h"
+#include "server/response_body.h"
+#include "server/response_cache.h"
+#include "server/shard_router.h"
+
+namespace trusted_server {
+
+namespace http = ::boost::beast::http;
+
+// HttpSession serves an accepted connection asynchronously. Requests
+// are read one after another on the same connection for as long as the
+// client keeps it alive, up to --max_requests_per_connection. All of
+// its handlers run on the strand the socket was accepted on, so a
+// session never needs to synchronize with itself.
+//
+// Each connection and request is admitted by `admission`. A connection
+// over the limit gets its first request answered with a 503 and is then
+// closed; a request over a limit, including one arriving while
+// `loop_monitor` reports the event loop lagging too far behind, is
+// answered with a 503 on its own.
+class HttpSession : public std::enable_shared_from_this<HttpSession> {
+ public:
+  // `cache` may be null to render every response. `router` is null
+  // unless lookups are routed to shards, see HandleRequest().
+  HttpSession(boost::asio::ip::tcp::socket&& socket,
+              std::shared_ptr<CreativeMap> creative_map,
+              std::shared_ptr<ResponseCache> cache,
+              std::shared_ptr<const ShardRouter> router,
+              std::shared_ptr<AdmissionController> admission,
+              std::shared_ptr<const EventLoopMonitor> loop_monitor);
+  ~HttpSession();
+
+  // Starts reading from the connection. The session keeps itself
+  // alive until the connection is closed.
+  void Run();
+
+ private:
+  void DoRead();
+  void OnRead(boost::beast::error_code error_code, std::size_t bytes);
+  // Hands the result of a routed lookup over to OnRouted() on the
+  // strand of `session`.
+  static void PostRouted(std::shared_ptr<HttpSession> session,
+                         absl::StatusOr<Response> result);
+  void OnRouted(absl::StatusOr<Response> result);
+  void DoWrite();
+  void OnWrite(boost::beast::error_code error_code, std::size_t bytes);
+  void DoClose();
+
+  boost::beast::tcp_stream stream_;
+  // Kept for the whole connection so its capacity is reused by every
+  // request instead of being reallocated per read.
+  boost::beast::flat_buffer buffer_;
+  // Backs the headers of parser_ and response_, rewound per request.
+  RequestArena arena_;
+  // A Beast parser handles a single message, so one is emplaced for
+  // each request.
+  boost::optional<http::request_parser<http::string_body, ArenaAllocator<char>>>
+      parser_;
+  http::response<GatherBody, ArenaFields> response_;
+  std::shared_ptr<CreativeMap> creative_map_;
+  std::shared_ptr<ResponseCache> cache_;
+  std::shared_ptr<const ShardRouter> router_;
+  std::shared_ptr<AdmissionController> admission_;
+  std::shared_ptr<const EventLoopMonitor> loop_monitor_;
+  const bool connection_admitted_;
+  // Whether the request being answered counts against the in-flight
+  // limit.
+  bool request_admitted_ = false;
+  int requests_served_ = 0;
+  // When the current request finished reading and its response started
+  // writing, for the stage latency metrics.
+  absl::Time read_done_;
+  absl::Time write_start_;
+  const absl::Time accepted_;
+  RequestTrace trace_;
+};
+
+// Listener accepts incoming connections and launches an HttpSession
+// for each of them, each on its own strand of the io_context. All
+// sessions share `cache` and `router`, which may be null, and
+// `admission`. If
+// admission sheds requests on latency, the listener also monitors how
+// far its io_context lags behind.
+//
+// With `reuse_port`, the socket is bound with SO_REUSEPORT so several
+// listeners, typically one per io_context, can share the endpoint. The
+// kernel then spreads incoming connections across them.
+class Listener : public std::enable_shared_from_this<Listener> {
+ public:
+  // Throws boost::system::system_error if the endpoint cannot be bound.
+  Listener(boost::asio::io_context& ioc,
+           boost::asio::ip::tcp::endpoint endpoint,
+           std::shared_ptr<CreativeMap> creative_map,
+           std::shared_ptr<ResponseCache> cache,
+           std::shared_ptr<const ShardRouter> router,
+           std::shared_ptr<AdmissionController> admission,
+           bool reuse_port = false);
+
+  // Starts accepting connections and monitoring the io_context.
+  void Run();
+
+ private:
+  void DoAccept();
+  void OnAccept(boost::beast::error_code error_code,
+                boost::asio::ip::tcp::socket socket);
+
+  boost::asio::io_context& ioc_;
+  boost::asio::ip::tcp::acceptor acceptor_;
+  // Delays accepting again after a failed accept.
+  boost::asio::steady_timer accept_retry_timer_;
+  std::shared_ptr<CreativeMap> creative_map_;
+  std::shared_ptr<ResponseCache> cache_;
+  std::shared_ptr<const ShardRouter> router_;
+  std::shared_ptr<AdmissionController> admission_;
+  std::shared_ptr<EventLoopMonitor> loop_monitor_;
+};
+
+// Account an accepted connection and an answered request in the same
+// metrics HttpSession and Listener export, for other transports serving
+// HTTP.
+void RecordHttpConnection();
+void RecordHttpResponse(unsigned status);
+
+}  // namespace trusted_server
+#endif  // HTTP_SESSION_H_
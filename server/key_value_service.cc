@@ -0,0 +1,185 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/key_value_service.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "data/creative_map.h"
+#include "data/creative_snapshot.h"
+#include "grpcpp/grpcpp.h"
+#include "metrics/metrics.h"
+#include "proto/key_value_service.pb.h"
+#include "proto/response.pb.h"
+
+namespace trusted_server {
+
+namespace {
+
+struct MethodMetrics {
+  Counter* requests;
+  Counter* errors;
+  Histogram* seconds;
+};
+
+struct ServiceMetrics {
+  MethodMetrics batch_lookup;
+  MethodMetrics batch_lookup_stream;
+  Histogram* keys_per_request;
+};
+
+MethodMetrics AddMethodMetrics(const std::string& method) {
+  MetricsRegistry& registry = MetricsRegistry::Global();
+  std::string labels = "method=\"" + method + "\"";
+  return {
+      registry.AddCounter("trusted_server_grpc_requests_total",
+                          "gRPC calls received, by method.", labels),
+      registry.AddCounter("trusted_server_grpc_errors_total",
+                          "gRPC calls failed, by method.", labels),
+      registry.AddHistogram("trusted_server_grpc_request_seconds",
+                            "Time spent serving gRPC calls, by method.",
+                            labels, LatencyBuckets()),
+  };
+}
+
+const ServiceMetrics& Metrics() {
+  static const auto* metrics = new ServiceMetrics{
+      AddMethodMetrics("BatchLookup"),
+      AddMethodMetrics("BatchLookupStream"),
+      MetricsRegistry::Global().AddHistogram(
+          "trusted_server_grpc_keys_per_request",
+          "Number of keys looked up per gRPC call.", "",
+          {1, 10, 100, 1000, 10000, 100000}),
+  };
+  return *metrics;
+}
+
+constexpr int kBatchSize = CreativeSnapshot::kFindBatchSize;
+
+// Looks up keys[start, start + count) in `snapshot` into `stored`.
+void FindBatch(const CreativeSnapshot& snapshot,
+               const google::protobuf::RepeatedPtrField<std::string>& keys,
+               int start, int count, absl::optional<CreativeView>* stored) {
+  absl::string_view batch[kBatchSize];
+  for (int i = 0; i < count; ++i) batch[i] = keys[start + i];
+  snapshot.FindBatch(absl::MakeConstSpan(batch, count),
+                     absl::MakeSpan(stored, count));
+}
+
+// Adds the creative `stored` in `snapshot` for `key` to `response`.
+const Creative& AddCreative(const CreativeSnapshot& snapshot,
+                            const std::string& key,
+                            const absl::optional<CreativeView>& stored,
+                            Response* response) {
+  Creative* creative = response->add_creatives();
+  creative->set_key(key);
+  if (stored.has_value()) {
+    snapshot.AppendData(*stored, creative->mutable_creative_data());
+  }
+  return *creative;
+}
+
+}  // namespace
+
+KeyValueServiceImpl::KeyValueServiceImpl(
+    std::shared_ptr<CreativeMap> creative_map, size_t max_stream_message_bytes)
+    : creative_map_(std::move(creative_map)),
+      max_stream_message_bytes_(max_stream_message_bytes) {}
+
+grpc::Status KeyValueServiceImpl::BatchLookup(
+    grpc::ServerContext* context, const BatchLookupRequest* request,
+    Response* response) {
+  const MethodMetrics& metrics = Metrics().batch_lookup;
+  absl::Time start = absl::Now();
+  metrics.requests->Increment();
+  if (request->keys().empty()) {
+    metrics.errors->Increment();
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "No keys given.");
+  }
+  Metrics().keys_per_request->Record(request->keys_size());
+  for (const std::string& key : request->keys()) {
+    creative_map_->popularity().Record(key);
+  }
+  std::shared_ptr<const CreativeSnapshot> snapshot = creative_map_->snapshot();
+  response->mutable_creatives()->Reserve(request->keys_size());
+  absl::optional<CreativeView> stored[kBatchSize];
+  for (int start = 0; start < request->keys_size(); start += kBatchSize) {
+    int count = std::min(kBatchSize, request->keys_size() - start);
+    FindBatch(*snapshot, request->keys(), start, count, stored);
+    for (int i = 0; i < count; ++i) {
+      AddCreative(*snapshot, request->keys(start + i), stored[i], response);
+    }
+  }
+  metrics.seconds->RecordSince(start);
+  return grpc::Status::OK;
+}
+
+grpc::Status KeyValueServiceImpl::BatchLookupStream(
+    grpc::ServerContext* context, const BatchLookupRequest* request,
+    grpc::ServerWriter<Response>* writer) {
+  const MethodMetrics& metrics = Metrics().batch_lookup_stream;
+  absl::Time start = absl::Now();
+  metrics.requests->Increment();
+  if (request->keys().empty()) {
+    metrics.errors->Increment();
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "No keys given.");
+  }
+  Metrics().keys_per_request->Record(request->keys_size());
+  for (const std::string& key : request->keys()) {
+    creative_map_->popularity().Record(key);
+  }
+  std::shared_ptr<const CreativeSnapshot> snapshot = creative_map_->snapshot();
+  Response response;
+  size_t response_bytes = 0;
+  absl::optional<CreativeView> stored[kBatchSize];
+  for (int i = 0; i < request->keys_size(); ++i) {
+    if (i % kBatchSize == 0) {
+      FindBatch(*snapshot, request->keys(), i,
+                std::min(kBatchSize, request->keys_size() - i), stored);
+    }
+    const Creative& creative =
+        AddCreative(*snapshot, request->keys(i), stored[i % kBatchSize],
+                    &response);
+    // An estimate of the serialized size that is cheap to keep up to
+    // date; tags and lengths take at most a few bytes per field.
+    response_bytes +=
+        creative.key().size() + creative.creative_data().size() + 16;
+    if (response_bytes >= max_stream_message_bytes_) {
+      if (!writer->Write(response)) {
+        metrics.errors->Increment();
+        return grpc::Status(grpc::StatusCode::CANCELLED,
+                            "Stream closed by the client.");
+      }
+      response.Clear();
+      response_bytes = 0;
+    }
+  }
+  if (response.creatives_size() > 0 && !writer->Write(response)) {
+    metrics.errors->Increment();
+    return grpc::Status(grpc::StatusCode::CANCELLED,
+                        "Stream closed by the client.");
+  }
+  metrics.seconds->RecordSince(start);
+  return grpc::Status::OK;
+}
+
+}  // namespace trusted_server
@@ -0,0 +1,57 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KEY_VALUE_SERVICE_H_
+#define KEY_VALUE_SERVICE_H_
+
+#include <cstddef>
+#include <memory>
+
+#include "data/creative_map.h"
+#include "grpcpp/grpcpp.h"
+#include "proto/key_value_service.grpc.pb.h"
+#include "proto/key_value_service.pb.h"
+#include "proto/response.pb.h"
+
+namespace trusted_server {
+
+// KeyValueServiceImpl serves the gRPC KeyValueService from the same
+// CreativeMap as the HTTP endpoint. Every call reads a single snapshot
+// of the map, so all creatives it returns are from the same version of
+// the data, even across the messages of a stream.
+class KeyValueServiceImpl final : public KeyValueService::Service {
+ public:
+  // Streamed responses are cut once they reach this many bytes, well
+  // below the default 4 MiB limit on received messages.
+  static constexpr size_t kDefaultStreamMessageBytes = 1 << 20;
+
+  explicit KeyValueServiceImpl(
+      std::shared_ptr<CreativeMap> creative_map,
+      size_t max_stream_message_bytes = kDefaultStreamMessageBytes);
+
+  grpc::Status BatchLookup(grpc::ServerContext* context,
+                           const BatchLookupRequest* request,
+                           Response* response) override;
+
+  grpc::Status BatchLookupStream(grpc::ServerContext* context,
+                                 const BatchLookupRequest* request,
+                                 grpc::ServerWriter<Response>* writer) override;
+
+ private:
+  std::shared_ptr<CreativeMap> creative_map_;
+  const size_t max_stream_message_bytes_;
+};
+
+}  // namespace trusted_server
+#endif  // KEY_VALUE_SERVICE_H_
@@ -0,0 +1,113 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/key_value_service.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "data/mock_creative_map.h"
+#include "grpcpp/grpcpp.h"
+#include "gtest/gtest.h"
+#include "proto/creative_data.pb.h"
+#include "proto/key_value_service.grpc.pb.h"
+#include "proto/key_value_service.pb.h"
+#include "proto/response.pb.h"
+
+namespace trusted_server {
+
+namespace {
+
+class KeyValueServiceTest : public testing::Test {
+ protected:
+  // Streamed responses are cut after about one creative each.
+  KeyValueServiceTest()
+      : service_(MockCreativeMap::CreateMockMap(),
+                 /*max_stream_message_bytes=*/1) {
+    grpc::ServerBuilder builder;
+    builder.RegisterService(&service_);
+    server_ = builder.BuildAndStart();
+    stub_ = KeyValueService::NewStub(
+        server_->InProcessChannel(grpc::ChannelArguments()));
+  }
+
+  ~KeyValueServiceTest() override { server_->Shutdown(); }
+
+  static BatchLookupRequest Request(const std::vector<std::string>& keys) {
+    BatchLookupRequest request;
+    for (const std::string& key : keys) request.add_keys(key);
+    return request;
+  }
+
+  static std::string CreativeData(bool is_servible) {
+    CreativeMetadata metadata;
+    metadata.set_is_servible(is_servible);
+    return metadata.SerializeAsString();
+  }
+
+  KeyValueServiceImpl service_;
+  std::unique_ptr<grpc::Server> server_;
+  std::unique_ptr<KeyValueService::Stub> stub_;
+};
+
+TEST_F(KeyValueServiceTest, BatchLookup) {
+  grpc::ClientContext context;
+  Response response;
+  grpc::Status status = stub_->BatchLookup(
+      &context,
+      Request({"google.com/ad2", "google.com/missing", "google.com/ad1"}),
+      &response);
+  ASSERT_TRUE(status.ok()) << status.error_message();
+  ASSERT_EQ(response.creatives_size(), 3);
+  EXPECT_EQ(response.creatives(0).key(), "google.com/ad2");
+  EXPECT_EQ(response.creatives(0).creative_data(), CreativeData(true));
+  EXPECT_EQ(response.creatives(1).key(), "google.com/missing");
+  EXPECT_FALSE(response.creatives(1).has_creative_data());
+  EXPECT_EQ(response.creatives(2).key(), "google.com/ad1");
+  EXPECT_EQ(response.creatives(2).creative_data(), CreativeData(false));
+}
+
+TEST_F(KeyValueServiceTest, BatchLookupStream) {
+  grpc::ClientContext context;
+  auto reader = stub_->BatchLookupStream(
+      &context, Request({"google.com/ad1", "google.com/missing"}));
+  std::vector<Response> responses;
+  Response response;
+  while (reader->Read(&response)) responses.push_back(response);
+  grpc::Status status = reader->Finish();
+  ASSERT_TRUE(status.ok()) << status.error_message();
+  ASSERT_EQ(responses.size(), 2);
+  ASSERT_EQ(responses[0].creatives_size(), 1);
+  EXPECT_EQ(responses[0].creatives(0).key(), "google.com/ad1");
+  EXPECT_EQ(responses[0].creatives(0).creative_data(), CreativeData(false));
+  ASSERT_EQ(responses[1].creatives_size(), 1);
+  EXPECT_EQ(responses[1].creatives(0).key(), "google.com/missing");
+}
+
+TEST_F(KeyValueServiceTest, RejectsEmptyRequests) {
+  grpc::ClientContext context;
+  Response response;
+  EXPECT_EQ(stub_->BatchLookup(&context, Request({}), &response).error_code(),
+            grpc::StatusCode::INVALID_ARGUMENT);
+
+  grpc::ClientContext stream_context;
+  auto reader = stub_->BatchLookupStream(&stream_context, Request({}));
+  EXPECT_FALSE(reader->Read(&response));
+  EXPECT_EQ(reader->Finish().error_code(), grpc::StatusCode::INVALID_ARGUMENT);
+}
+
+}  // namespace
+
+}  // namespace trusted_server
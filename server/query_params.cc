@@ -0,0 +1,241 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/query_params.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include <cstring>
+#include <string>
+
+#include "absl/strings/string_view.h"
+
+namespace trusted_server {
+
+namespace query_internal {
+
+namespace {
+
+bool IsDelimiter(char c) {
+  switch (c) {
+    case '&':
+    case ';':
+    case '=':
+    case ',':
+    case '%':
+    case '+':
+      return true;
+    default:
+      return false;
+  }
+}
+
+}  // namespace
+
+const char* FindDelimiterScalar(const char* begin, const char* end) {
+  while (begin < end && !IsDelimiter(*begin)) ++begin;
+  return begin;
+}
+
+#if defined(__x86_64__)
+
+// SSE2 is part of x86-64, so this needs no check. One byte comparison
+// per delimiter beats the SSE4.2 string instructions at this set size.
+const char* FindDelimiterSse2(const char* begin, const char* end) {
+  const __m128i amp = _mm_set1_epi8('&');
+  const __m128i semicolon = _mm_set1_epi8(';');
+  const __m128i equals = _mm_set1_epi8('=');
+  const __m128i comma = _mm_set1_epi8(',');
+  const __m128i percent = _mm_set1_epi8('%');
+  const __m128i plus = _mm_set1_epi8('+');
+  for (; end - begin >= 16; begin += 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+    __m128i hits = _mm_or_si128(
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, amp),
+                                  _mm_cmpeq_epi8(chunk, semicolon)),
+                     _mm_or_si128(_mm_cmpeq_epi8(chunk, equals),
+                                  _mm_cmpeq_epi8(chunk, comma))),
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, percent),
+                     _mm_cmpeq_epi8(chunk, plus)));
+    int mask = _mm_movemask_epi8(hits);
+    if (mask != 0) return begin + __builtin_ctz(mask);
+  }
+  return FindDelimiterScalar(begin, end);
+}
+
+__attribute__((target("avx2"))) const char* FindDelimiterAvx2(
+    const char* begin, const char* end) {
+  const __m256i amp = _mm256_set1_epi8('&');
+  const __m256i semicolon = _mm256_set1_epi8(';');
+  const __m256i equals = _mm256_set1_epi8('=');
+  const __m256i comma = _mm256_set1_epi8(',');
+  const __m256i percent = _mm256_set1_epi8('%');
+  const __m256i plus = _mm256_set1_epi8('+');
+  for (; end - begin >= 32; begin += 32) {
+    __m256i chunk =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+    __m256i hits = _mm256_or_si256(
+        _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, amp),
+                                        _mm256_cmpeq_epi8(chunk, semicolon)),
+                        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, equals),
+                                        _mm256_cmpeq_epi8(chunk, comma))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, percent),
+                        _mm256_cmpeq_epi8(chunk, plus)));
+    unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(hits));
+    if (mask != 0) return begin + __builtin_ctz(mask);
+  }
+  return FindDelimiterSse2(begin, end);
+}
+
+bool CpuHasAvx2() { return __builtin_cpu_supports("avx2"); }
+
+#endif
+
+}  // namespace query_internal
+
+namespace {
+
+using FindDelimiterFunction = const char* (*)(const char*, const char*);
+
+FindDelimiterFunction FindDelimiter() {
+#if defined(__x86_64__)
+  static const FindDelimiterFunction find =
+      query_internal::CpuHasAvx2() ? query_internal::FindDelimiterAvx2
+                                   : query_internal::FindDelimiterSse2;
+  return find;
+#else
+  return query_internal::FindDelimiterScalar;
+#endif
+}
+
+int HexValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Where Decode() stops, besides at '&', ';' and the end of the query.
+enum StopAt {
+  kStopAtEquals,  // A parameter name.
+  kStopAtComma,   // A key in a key list.
+  kStopAtNothing  // Any other value.
+};
+
+// Decodes [p, end) into `*out` up to the first delimiter given by
+// `stop_at`, and returns a pointer to it or `end`. Advances `*out` past
+// the decoded bytes, which are never more than the input ones.
+const char* Decode(FindDelimiterFunction find, const char* p,
+                   const char* end, StopAt stop_at, char** out) {
+  while (true) {
+    const char* next = find(p, end);
+    std::memcpy(*out, p, next - p);
+    *out += next - p;
+    p = next;
+    if (p == end) return p;
+    switch (*p) {
+      case '&':
+      case ';':
+        return p;
+      case '=':
+        if (stop_at == kStopAtEquals) return p;
+        *(*out)++ = '=';
+        ++p;
+        break;
+      case ',':
+        if (stop_at == kStopAtComma) return p;
+        *(*out)++ = ',';
+        ++p;
+        break;
+      case '+':
+        *(*out)++ = ' ';
+        ++p;
+        break;
+      case '%': {
+        int high = end - p > 2 ? HexValue(p[1]) : -1;
+        int low = high >= 0 ? HexValue(p[2]) : -1;
+        if (low >= 0) {
+          *(*out)++ = static_cast<char>(high << 4 | low);
+          p += 3;
+        } else {
+          *(*out)++ = '%';
+          ++p;
+        }
+        break;
+      }
+    }
+  }
+}
+
+}  // namespace
+
+void LookupQuery::Parse(absl::string_view query,
+                        absl::string_view key_param) {
+  keys_.clear();
+  key_list_.clear();
+  hostname_ = absl::string_view();
+  // Keys point into decoded_, so it is sized for the whole query up
+  // front; decoding never makes anything longer. It is never shrunk, so
+  // it is only zero-filled when it grows.
+  if (decoded_.size() < query.size()) decoded_.resize(query.size());
+
+  const FindDelimiterFunction find = FindDelimiter();
+  const char* p = query.data();
+  const char* end = p + query.size();
+  char* out = &decoded_[0];
+  while (p < end) {
+    // Names are decoded too but not kept, so the value overwrites them.
+    char* name_start = out;
+    p = Decode(find, p, end, kStopAtEquals, &out);
+    absl::string_view name(name_start, out - name_start);
+    const bool is_key_list = name == key_param || name == kRenderUrlsParam ||
+                             name == kAdComponentRenderUrlsParam;
+    const bool is_hostname = name == kHostnameParam;
+    out = name_start;
+    if (p < end && *p == '=') {
+      ++p;
+      if (is_key_list) {
+        const char* raw = p;
+        while (p < end && *p != '&' && *p != ';') {
+          char* key = out;
+          p = Decode(find, p, end, kStopAtComma, &out);
+          keys_.emplace_back(key, out - key);
+          if (p < end && *p == ',') {
+            ++p;
+            // A trailing comma still ends an empty key.
+            if (p == end || *p == '&' || *p == ';') keys_.emplace_back();
+          }
+        }
+        if (p > raw) {
+          if (!key_list_.empty()) key_list_.push_back('&');
+          key_list_.append(raw, p - raw);
+        }
+      } else {
+        char* value = out;
+        p = Decode(find, p, end, kStopAtNothing, &out);
+        if (is_hostname && hostname_.data() == nullptr) {
+          hostname_ = absl::string_view(value, out - value);
+        } else {
+          out = value;
+        }
+      }
+    }
+    // Skip the '&' or ';' ending the parameter.
+    if (p < end) ++p;
+  }
+}
+
+}  // namespace trusted_server
@@ -0,0 +1,88 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef QUERY_PARAMS_H_
+#define QUERY_PARAMS_H_
+
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+
+namespace trusted_server {
+
+// Parameters FLEDGE sends key lists in, besides the --key_param one:
+// render URLs to trusted scoring signals servers, alongside the URLs of
+// ad components.
+constexpr char kRenderUrlsParam[] = "renderUrls";
+constexpr char kAdComponentRenderUrlsParam[] = "adComponentRenderUrls";
+// The publisher's hostname, sent with every FLEDGE request.
+constexpr char kHostnameParam[] = "hostname";
+
+// LookupQuery holds the parameters of a lookup request, parsed from its
+// query string. Keys are comma-separated lists in any number of key
+// parameters, and are returned percent-decoded, with '+' standing for a
+// space, so render URLs match the keys they are stored under. A '%'
+// that does not start an escape is kept as is.
+//
+// Parsing scans the query once, finding delimiters and escapes with
+// vector instructions where available, and decodes into a buffer the
+// object keeps. An object reused across requests stops allocating once
+// its buffers have grown to the usual size.
+class LookupQuery {
+ public:
+  // Parses `query`, replacing what was parsed before. Keys are taken,
+  // in order, from every parameter called `key_param`, kRenderUrlsParam
+  // or kAdComponentRenderUrlsParam. Parameters are separated by '&' or
+  // ';'.
+  void Parse(absl::string_view query, absl::string_view key_param);
+
+  // The decoded keys. They point into this object and are valid until
+  // the next call to Parse().
+  absl::Span<const absl::string_view> keys() const { return keys_; }
+
+  // The decoded value of the first kHostnameParam, empty if there is
+  // none.
+  absl::string_view hostname() const { return hostname_; }
+
+  // The undecoded values of the key parameters, joined by '&'. Requests
+  // for the same list of keys sent the same way have the same key list,
+  // so it identifies their response.
+  absl::string_view key_list() const { return key_list_; }
+
+ private:
+  std::string decoded_;
+  std::string key_list_;
+  std::vector<absl::string_view> keys_;
+  absl::string_view hostname_;
+};
+
+namespace query_internal {
+
+// Returns the first of '&', ';', '=', ',', '%' and '+' in [begin, end),
+// or `end` if there is none. Exposed so tests can check the vectorized
+// versions against the scalar one.
+const char* FindDelimiterScalar(const char* begin, const char* end);
+#if defined(__x86_64__)
+const char* FindDelimiterSse2(const char* begin, const char* end);
+// Must only be called if CpuHasAvx2().
+const char* FindDelimiterAvx2(const char* begin, const char* end);
+bool CpuHasAvx2();
+#endif
+
+}  // namespace query_internal
+
+}  // namespace trusted_server
+#endif  // QUERY_PARAMS_H_
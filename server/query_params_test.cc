@@ -0,0 +1,209 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/query_params.h"
+
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "absl/random/random.h"
+#include "absl/strings/str_join.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace trusted_server {
+
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+
+std::vector<std::string> Keys(const LookupQuery& query) {
+  return std::vector<std::string>(query.keys().begin(), query.keys().end());
+}
+
+// Straightforward decoding of one name, key or value, to check the
+// single pass parser against.
+std::string ReferenceDecode(absl::string_view text) {
+  auto hex = [](char c) -> int {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+  };
+  std::string decoded;
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (text[i] == '+') {
+      decoded.push_back(' ');
+    } else if (text[i] == '%' && i + 2 < text.size() &&
+               hex(text[i + 1]) >= 0 && hex(text[i + 2]) >= 0) {
+      decoded.push_back(
+          static_cast<char>(hex(text[i + 1]) << 4 | hex(text[i + 2])));
+      i += 2;
+    } else {
+      decoded.push_back(text[i]);
+    }
+  }
+  return decoded;
+}
+
+struct ReferenceQuery {
+  std::vector<std::string> keys;
+  std::string hostname;
+  std::string key_list;
+};
+
+ReferenceQuery ReferenceParse(absl::string_view query,
+                              absl::string_view key_param) {
+  ReferenceQuery result;
+  bool has_hostname = false;
+  std::vector<absl::string_view> key_values;
+  for (absl::string_view param : absl::StrSplit(query, absl::ByAnyChar("&;"))) {
+    size_t eq_pos = param.find('=');
+    if (eq_pos == absl::string_view::npos) continue;
+    std::string name = ReferenceDecode(param.substr(0, eq_pos));
+    absl::string_view value = param.substr(eq_pos + 1);
+    if (name == key_param || name == kRenderUrlsParam ||
+        name == kAdComponentRenderUrlsParam) {
+      if (value.empty()) continue;
+      key_values.push_back(value);
+      for (absl::string_view key : absl::StrSplit(value, ',')) {
+        result.keys.push_back(ReferenceDecode(key));
+      }
+    } else if (name == kHostnameParam && !has_hostname) {
+      has_hostname = true;
+      result.hostname = ReferenceDecode(value);
+    }
+  }
+  result.key_list = absl::StrJoin(key_values, "&");
+  return result;
+}
+
+TEST(LookupQueryTest, FindsKeys) {
+  LookupQuery query;
+  query.Parse("keys=a,b&x=1", "keys");
+  EXPECT_THAT(Keys(query), ElementsAre("a", "b"));
+  EXPECT_EQ(query.key_list(), "a,b");
+  query.Parse("x=1;keys=a", "keys");
+  EXPECT_THAT(Keys(query), ElementsAre("a"));
+  query.Parse("x=keys&keysx=1&keys&keys=", "keys");
+  EXPECT_THAT(Keys(query), IsEmpty());
+  EXPECT_EQ(query.key_list(), "");
+  query.Parse("k=a,,b,", "k");
+  EXPECT_THAT(Keys(query), ElementsAre("a", "", "b", ""));
+}
+
+TEST(LookupQueryTest, PercentDecodes) {
+  LookupQuery query;
+  query.Parse(
+      "keys=https%3A%2F%2Fad.test%2Fad%3Fx%3D1%26y%3D2,a%2Cb,a+b,%e2%82%ac"
+      "&hostname=pub%2Etest",
+      "keys");
+  EXPECT_THAT(Keys(query), ElementsAre("https://ad.test/ad?x=1&y=2", "a,b",
+                                       "a b", "\xe2\x82\xac"));
+  EXPECT_EQ(query.hostname(), "pub.test");
+  EXPECT_EQ(query.key_list(),
+            "https%3A%2F%2Fad.test%2Fad%3Fx%3D1%26y%3D2,a%2Cb,a+b,%e2%82%ac");
+
+  // Stray '%' are kept.
+  query.Parse("keys=100%,%zz,%4,%%41", "keys");
+  EXPECT_THAT(Keys(query), ElementsAre("100%", "%zz", "%4", "%A"));
+
+  // So are '=' in values.
+  query.Parse("keys=a=b", "keys");
+  EXPECT_THAT(Keys(query), ElementsAre("a=b"));
+}
+
+TEST(LookupQueryTest, CollectsRepeatedAndFledgeParams) {
+  LookupQuery query;
+  query.Parse(
+      "hostname=www.example.com&renderUrls=https%3A%2F%2Fa.test%2F1"
+      "&adComponentRenderUrls=https%3A%2F%2Fa.test%2Fc1,https%3A%2F%2F"
+      "a.test%2Fc2&keys=k1&keys=k2&hostname=other.test",
+      "keys");
+  EXPECT_THAT(Keys(query),
+              ElementsAre("https://a.test/1", "https://a.test/c1",
+                          "https://a.test/c2", "k1", "k2"));
+  EXPECT_EQ(query.hostname(), "www.example.com");
+  EXPECT_EQ(query.key_list(),
+            "https%3A%2F%2Fa.test%2F1&https%3A%2F%2Fa.test%2Fc1,https%3A%2F%2F"
+            "a.test%2Fc2&k1&k2");
+}
+
+TEST(LookupQueryTest, ReusesBuffers) {
+  LookupQuery query;
+  query.Parse("keys=a%2Cb,c&keys=d", "keys");
+  query.Parse("keys=x", "keys");
+  EXPECT_THAT(Keys(query), ElementsAre("x"));
+  EXPECT_EQ(query.hostname(), "");
+}
+
+// Tokens random queries are made of, weighted towards delimiters,
+// escapes and parameter names.
+const char* const kTokens[] = {
+    "a", "Z", "0", "f", "/", ".", ":", "\xff", "\n",
+    "&", ";", "=", ",", "+", "%", "%2", "%2C", "%2c", "%41", "%zz", "%%",
+    "%3D", "%26", "keys", "k%65ys", "renderUrls", "adComponentRenderUrls",
+    "hostname", "keys=", "&keys=", "hostname=", "https%3A%2F%2Fad.test%2F",
+    "abcdefghijklmnopqrstuvwxyz0123456789"};
+
+TEST(LookupQueryTest, MatchesReferenceOnRandomQueries) {
+  absl::BitGen random;
+  LookupQuery query;
+  for (int i = 0; i < 20000; ++i) {
+    std::string text;
+    int tokens = absl::Uniform(random, 0, 40);
+    for (int j = 0; j < tokens; ++j) {
+      text += kTokens[absl::Uniform<size_t>(random, 0, std::size(kTokens))];
+    }
+    query.Parse(text, "keys");
+    ReferenceQuery expected = ReferenceParse(text, "keys");
+    ASSERT_EQ(Keys(query), expected.keys) << text;
+    ASSERT_EQ(query.hostname(), expected.hostname) << text;
+    ASSERT_EQ(query.key_list(), expected.key_list) << text;
+  }
+}
+
+#if defined(__x86_64__)
+TEST(FindDelimiterTest, VectorizedMatchesScalar) {
+  absl::BitGen random;
+  const std::string alphabet = "ab&;=,%+\x80";
+  std::string buffer;
+  for (int i = 0; i < 20000; ++i) {
+    // Sparse and dense delimiters, at every alignment.
+    buffer.resize(absl::Uniform(random, 0, 100));
+    int dense = absl::Uniform(random, 0, 2);
+    for (char& c : buffer) {
+      c = dense || absl::Uniform(random, 0, 50) == 0
+              ? alphabet[absl::Uniform<size_t>(random, 0, alphabet.size())]
+              : 'x';
+    }
+    const char* begin = buffer.data() + absl::Uniform<size_t>(
+                                            random, 0, buffer.size() + 1);
+    const char* end = buffer.data() + buffer.size();
+    const char* expected = query_internal::FindDelimiterScalar(begin, end);
+    ASSERT_EQ(query_internal::FindDelimiterSse2(begin, end), expected);
+    if (query_internal::CpuHasAvx2()) {
+      ASSERT_EQ(query_internal::FindDelimiterAvx2(begin, end), expected);
+    }
+  }
+}
+#endif
+
+}  // namespace
+
+}  // namespace trusted_server
@@ -0,0 +1,98 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REQUEST_ARENA_H_
+#define REQUEST_ARENA_H_
+
+#include <cstddef>
+#include <new>
+
+#include "boost/beast/http/fields.hpp"
+
+namespace trusted_server {
+
+// RequestArena provides the scratch memory of one request at a time:
+// the parsed request target and headers and the response headers. It
+// is owned by a connection and rewound between its requests, so
+// steady-state requests never reach the heap. Allocations that do not
+// fit in the inline block fall back to operator new.
+class RequestArena {
+ public:
+  static constexpr size_t kInlineSize = 8192;
+
+  RequestArena() = default;
+  RequestArena(const RequestArena&) = delete;
+  RequestArena& operator=(const RequestArena&) = delete;
+
+  void* Allocate(size_t bytes, size_t alignment) {
+    size_t offset = (used_ + alignment - 1) & ~(alignment - 1);
+    if (offset + bytes <= kInlineSize) {
+      used_ = offset + bytes;
+      return block_ + offset;
+    }
+    return ::operator new(bytes);
+  }
+
+  // Memory from the inline block is reclaimed only by Reset().
+  void Deallocate(void* p, size_t bytes) {
+    if (p < block_ || p >= block_ + kInlineSize) ::operator delete(p);
+  }
+
+  // Rewinds the arena. Everything allocated from it must have been
+  // released already.
+  void Reset() { used_ = 0; }
+
+ private:
+  alignas(std::max_align_t) char block_[kInlineSize];
+  size_t used_ = 0;
+};
+
+// Standard allocator adaptor over a RequestArena, used for the
+// Beast fields of requests and responses.
+template <class T>
+class ArenaAllocator {
+ public:
+  using value_type = T;
+
+  explicit ArenaAllocator(RequestArena* arena) : arena_(arena) {}
+
+  template <class U>
+  ArenaAllocator(const ArenaAllocator<U>& other) : arena_(other.arena()) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(arena_->Allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T* p, size_t n) { arena_->Deallocate(p, n * sizeof(T)); }
+
+  RequestArena* arena() const { return arena_; }
+
+  template <class U>
+  bool operator==(const ArenaAllocator<U>& other) const {
+    return arena_ == other.arena();
+  }
+
+  template <class U>
+  bool operator!=(const ArenaAllocator<U>& other) const {
+    return arena_ != other.arena();
+  }
+
+ private:
+  RequestArena* arena_;
+};
+
+using ArenaFields = boost::beast::http::basic_fields<ArenaAllocator<char>>;
+
+}  // namespace trusted_server
+#endif  // REQUEST_ARENA_H_
@@ -0,0 +1,345 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/request_handler.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/flags/flag.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "absl/strings/strip.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "boost/beast/http.hpp"
+#include "data/creative_json.h"
+#include "data/creative_map.h"
+#include "data/creative_snapshot.h"
+#include "data/key_popularity.h"
+#include "glog/logging.h"
+#include "metrics/metrics.h"
+#include "proto/response.pb.h"
+#include "server/compression.h"
+#include "server/flight_recorder.h"
+#include "server/query_params.h"
+#include "server/response_body.h"
+#include "server/response_cache.h"
+#include "server/shard_router.h"
+
+ABSL_FLAG(std::string, key_param, "keys",
+          "Parameter name to use for the key value lookup.");
+
+ABSL_FLAG(bool, serve_hot_keys, false,
+          "Whether to serve the most looked up keys on /debug/hot_keys, "
+          "which tells anyone who can reach the server what is looked up.");
+
+namespace trusted_server {
+
+namespace {
+
+struct HandlerMetrics {
+  Histogram* query_seconds;
+  Histogram* lookup_seconds;
+  Histogram* keys_per_request;
+};
+
+const HandlerMetrics& Metrics() {
+  static const auto* metrics = [] {
+    MetricsRegistry& registry = MetricsRegistry::Global();
+    return new HandlerMetrics{
+        registry.AddHistogram(kStageSecondsMetric, kStageSecondsHelp,
+                              "stage=\"query\"", LatencyBuckets()),
+        registry.AddHistogram(kStageSecondsMetric, kStageSecondsHelp,
+                              "stage=\"lookup\"", LatencyBuckets()),
+        registry.AddHistogram(
+            "trusted_server_keys_per_request",
+            "Number of keys looked up per request.", "",
+            {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000}),
+    };
+  }();
+  return *metrics;
+}
+
+}  // namespace
+
+absl::StatusOr<absl::string_view> QueryString(absl::string_view target) {
+  if (target.length() < 2) {
+    return absl::Status(absl::StatusCode::kInvalidArgument,
+                        "Target does not contain valid query string.");
+  }
+  auto query_pos = target.find('?');
+  if (query_pos == absl::string_view::npos) {
+    return absl::Status(absl::StatusCode::kInvalidArgument,
+                        "Target does not contain query delimiter.");
+  }
+  return target.substr(query_pos + 1);
+}
+
+namespace {
+
+// Parses the keys requested by `target` and accounts for them in the
+// metrics and in the trace of the request, which is marked parsed at
+// `*query_done`. Returns null if the target requests no keys. The
+// result is reused by the next request on the same thread.
+const LookupQuery* ParseLookupTarget(absl::string_view target,
+                                     absl::Time* query_done) {
+  // Read once; the flag is fixed after startup and copying a string
+  // flag on every request would allocate.
+  static const std::string& key_param =
+      *new std::string(absl::GetFlag(FLAGS_key_param));
+
+  // Requests are rendered start to finish on one thread, so each thread
+  // can parse into the same buffers every time.
+  thread_local LookupQuery lookup_query;
+
+  const HandlerMetrics& metrics = Metrics();
+  absl::Time start = absl::Now();
+  auto query = QueryString(target);
+  if (!query.ok()) return nullptr;
+  lookup_query.Parse(*query, key_param);
+  absl::Span<const absl::string_view> keys = lookup_query.keys();
+  if (keys.empty()) return nullptr;
+  *query_done = absl::Now();
+  metrics.query_seconds->Record(absl::ToDoubleSeconds(*query_done - start));
+  metrics.keys_per_request->Record(keys.size());
+  if (RequestTrace* trace = RequestTrace::Current()) {
+    trace->Mark(RequestStage::kParsed, *query_done);
+    trace->set_keys(keys.size());
+  }
+  return &lookup_query;
+}
+
+}  // namespace
+
+http::status RenderLookupResponse(absl::string_view target,
+                                  const CreativeMap& creative_map,
+                                  ResponseCache* cache,
+                                  ContentEncoding* encoding,
+                                  ResponseBuffers* body) {
+  const HandlerMetrics& metrics = Metrics();
+  absl::Time query_done;
+  const LookupQuery* parsed = ParseLookupTarget(target, &query_done);
+  if (parsed == nullptr) return http::status::bad_request;
+  const LookupQuery& lookup_query = *parsed;
+  absl::Span<const absl::string_view> keys = lookup_query.keys();
+  creative_map.popularity().Record(keys);
+  RequestTrace* trace = RequestTrace::Current();
+
+  const ContentEncoding accepted = *encoding;
+  const absl::string_view accepted_name = ContentEncodingName(accepted);
+  *encoding = ContentEncoding::kIdentity;
+  // The epoch has to be read before the snapshot, so a response is
+  // never cached under a newer epoch than the data it was rendered from.
+  uint64_t epoch = creative_map.epoch();
+  std::shared_ptr<const CachedResponse> identity;
+  if (cache != nullptr) {
+    std::shared_ptr<const CachedResponse> cached;
+    if (accepted != ContentEncoding::kIdentity) {
+      cached = cache->Lookup(epoch, lookup_query.key_list(), accepted_name);
+    }
+    if (cached != nullptr) {
+      *encoding = accepted;
+      RecordCompressedResponse(accepted, cached->uncompressed_size,
+                               cached->body.size());
+    } else {
+      cached = cache->Lookup(epoch, lookup_query.key_list(),
+                             ContentEncodingName(ContentEncoding::kIdentity));
+      identity = cached;
+    }
+    if (cached != nullptr) {
+      body->AppendExternal(cached->body);
+      body->Pin(std::move(cached));
+    }
+  }
+
+  if (body->size() == 0) {
+    // Found keys are served straight from the snapshot's pre-rendered
+    // JSON; only keys without data are rendered, and compressed JSON
+    // decompressed, into the body itself.
+    std::shared_ptr<const CreativeSnapshot> snapshot =
+        creative_map.snapshot();
+    if (trace != nullptr) trace->Mark(RequestStage::kSnapshot);
+    // Keys are looked up in batches, so the cache misses of their
+    // probes overlap.
+    constexpr size_t kBatchSize = CreativeSnapshot::kFindBatchSize;
+    absl::optional<CreativeView> creatives[kBatchSize];
+    body->AppendExternal(kResponseJsonPrefix);
+    for (size_t start = 0; start < keys.size(); start += kBatchSize) {
+      absl::Span<const absl::string_view> batch =
+          keys.subspan(start, kBatchSize);
+      snapshot->FindBatch(batch, absl::MakeSpan(creatives, batch.size()));
+      for (size_t i = 0; i < batch.size(); ++i) {
+        if (start + i > 0) body->AppendExternal(kResponseJsonSeparator);
+        if (creatives[i].has_value() && !creatives[i]->compressed) {
+          if (!creatives[i]->key_json.empty()) {
+            body->AppendExternal(creatives[i]->key_json);
+          }
+          body->AppendExternal(creatives[i]->json);
+        } else if (creatives[i].has_value()) {
+          body->AppendRendered(
+              [&snapshot, &creative = *creatives[i]](std::string* out) {
+                snapshot->AppendJson(creative, out);
+              });
+        } else {
+          body->AppendRendered([key = batch[i]](std::string* out) {
+            AppendMissingCreativeJson(key, out);
+          });
+        }
+      }
+    }
+    body->AppendExternal(kResponseJsonSuffix);
+    body->Pin(std::move(snapshot));
+  }
+  absl::Time lookup_done = absl::Now();
+  metrics.lookup_seconds->Record(
+      absl::ToDoubleSeconds(lookup_done - query_done));
+  if (trace != nullptr) trace->Mark(RequestStage::kLookedUp, lookup_done);
+  if (*encoding != ContentEncoding::kIdentity) return http::status::ok;
+
+  bool compress = accepted != ContentEncoding::kIdentity &&
+                  body->size() >= CompressionMinBytes();
+  if (!compress && (cache == nullptr || identity != nullptr)) {
+    return http::status::ok;
+  }
+  // Caching or compressing needs the body in one piece.
+  size_t uncompressed_size = body->size();
+  std::string rendered = identity == nullptr ? body->ToString() : "";
+  std::string compressed;
+  if (compress &&
+      CompressIfSmaller(accepted,
+                        identity == nullptr ? rendered : identity->body,
+                        &compressed)) {
+    RecordCompressedResponse(accepted, uncompressed_size, compressed.size());
+    *encoding = accepted;
+    body->Clear();
+    if (cache == nullptr) {
+      body->AppendCopy(compressed);
+      return http::status::ok;
+    }
+    std::shared_ptr<const CachedResponse> cached =
+        cache->Insert(epoch, {std::string(lookup_query.key_list()),
+                              std::string(accepted_name),
+                              std::move(compressed), uncompressed_size});
+    body->AppendExternal(cached->body);
+    body->Pin(std::move(cached));
+  } else if (cache != nullptr && identity == nullptr) {
+    // The body itself keeps pointing into the snapshot it pinned.
+    cache->Insert(epoch,
+                  {std::string(lookup_query.key_list()),
+                   std::string(ContentEncodingName(ContentEncoding::kIdentity)),
+                   std::move(rendered), uncompressed_size});
+  }
+  return http::status::ok;
+}
+
+http::status StartRoutedLookup(absl::string_view target,
+                               const ShardRouter& router,
+                               ShardRouter::Done done) {
+  absl::Time query_done;
+  const LookupQuery* lookup_query = ParseLookupTarget(target, &query_done);
+  if (lookup_query == nullptr) return http::status::bad_request;
+  router.LookupAsync(
+      lookup_query->keys(),
+      [query_done, done = std::move(done)](absl::StatusOr<Response> result) {
+        Metrics().lookup_seconds->RecordSince(query_done);
+        done(std::move(result));
+      });
+  return http::status::ok;
+}
+
+http::status RenderRoutedResponse(const absl::StatusOr<Response>& response,
+                                  ContentEncoding* encoding,
+                                  ResponseBuffers* body) {
+  if (!response.ok()) {
+    LOG_EVERY_N(WARNING, 1000) << "Routed lookup failed: "
+                               << response.status();
+    return http::status::bad_gateway;
+  }
+  std::string json(kResponseJsonPrefix);
+  for (int i = 0; i < response->creatives_size(); ++i) {
+    const Creative& creative = response->creatives(i);
+    if (i > 0) {
+      json.append(kResponseJsonSeparator.data(),
+                  kResponseJsonSeparator.size());
+    }
+    if (creative.has_creative_data()) {
+      AppendCreativeJson(creative.key(), creative.creative_data(), &json);
+    } else {
+      AppendMissingCreativeJson(creative.key(), &json);
+    }
+  }
+  json.append(kResponseJsonSuffix.data(), kResponseJsonSuffix.size());
+  if (RequestTrace* trace = RequestTrace::Current()) {
+    trace->Mark(RequestStage::kLookedUp);
+  }
+
+  const ContentEncoding accepted = *encoding;
+  *encoding = ContentEncoding::kIdentity;
+  std::string compressed;
+  if (accepted != ContentEncoding::kIdentity &&
+      json.size() >= CompressionMinBytes() &&
+      CompressIfSmaller(accepted, json, &compressed)) {
+    RecordCompressedResponse(accepted, json.size(), compressed.size());
+    *encoding = accepted;
+    body->AppendCopy(compressed);
+  } else {
+    body->AppendCopy(json);
+  }
+  return http::status::ok;
+}
+
+bool RenderMetricsResponse(absl::string_view target, ResponseBuffers* body) {
+  if (target.substr(0, target.find('?')) != kMetricsPath) return false;
+  body->AppendCopy(MetricsRegistry::Global().Render());
+  return true;
+}
+
+bool RenderDebugRequestsResponse(absl::string_view target,
+                                 ResponseBuffers* body) {
+  if (target.substr(0, target.find('?')) != kDebugRequestsPath) return false;
+  body->AppendCopy(FlightRecorder::Global().RenderJson());
+  return true;
+}
+
+bool RenderHotKeysResponse(absl::string_view target,
+                           const CreativeMap& creative_map,
+                           ResponseBuffers* body) {
+  size_t query_pos = target.find('?');
+  if (target.substr(0, query_pos) != kHotKeysPath ||
+      !absl::GetFlag(FLAGS_serve_hot_keys)) {
+    return false;
+  }
+  size_t limit = kDefaultHotKeysLimit;
+  if (query_pos != absl::string_view::npos) {
+    for (absl::string_view param :
+         absl::StrSplit(target.substr(query_pos + 1), '&')) {
+      if (absl::ConsumePrefix(&param, "limit=")) {
+        absl::SimpleAtoi(param, &limit);
+      }
+    }
+  }
+  body->AppendCopy(creative_map.popularity().RenderJson(limit));
+  return true;
+}
+
+}  // namespace trusted_server
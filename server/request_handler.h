@@ -0,0 +1,262 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REQUEST_HANDLER_H_
+#define REQUEST_HANDLER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/optional.h"
+#include "boost/beast/http.hpp"
+#include "boost/beast/version.hpp"
+#include "data/creative_map.h"
+#include "proto/response.pb.h"
+#include "server/compression.h"
+#include "server/response_body.h"
+#include "server/response_cache.h"
+#include "server/shard_router.h"
+
+namespace trusted_server {
+
+namespace http = ::boost::beast::http;
+
+// Path the process metrics are served on.
+constexpr absl::string_view kMetricsPath = "/metrics";
+constexpr char kMetricsContentType[] = "text/plain; version=0.0.4";
+
+// Path the requests kept by the flight recorder are served on.
+constexpr absl::string_view kDebugRequestsPath = "/debug/requests";
+
+// Path the most looked up keys are served on, as many as its `limit`
+// parameter asks for.
+constexpr absl::string_view kHotKeysPath = "/debug/hot_keys";
+constexpr size_t kDefaultHotKeysLimit = 100;
+
+// Request latency by stage. Stages are recorded where they happen, so
+// the histogram is registered under the same name from several places.
+constexpr char kStageSecondsMetric[] = "trusted_server_request_stage_seconds";
+constexpr char kStageSecondsHelp[] =
+    "Time spent serving requests, by stage: query (parsing the request "
+    "target), lookup (looking up the keys and assembling the body), "
+    "write (writing the response) and total (from the request being read "
+    "to the response being written).";
+
+// Returns the query string of a request target, i.e. everything after
+// the '?'. The result points into `target`.
+absl::StatusOr<absl::string_view> QueryString(absl::string_view target);
+
+// Looks up the keys requested by `target`, as parsed by LookupQuery,
+// and fills `body` with the JSON response. The body points into the
+// pre-rendered JSON of the creative map's current snapshot, which it
+// keeps alive until it is destroyed or cleared. Returns the status the
+// response should carry; the body is left empty for anything but 200.
+//
+// `*encoding` is the encoding negotiated with the client. Bodies of at
+// least CompressionMinBytes() are compressed with it, and `*encoding`
+// is set to the encoding the body ends up with.
+//
+// If `cache` is not null, a response cached for the same key list and
+// encoding in the map's current epoch is served instead, and freshly
+// rendered or compressed responses are added to it, so compression is
+// only paid for once per key list and epoch.
+http::status RenderLookupResponse(absl::string_view target,
+                                  const CreativeMap& creative_map,
+                                  ResponseCache* cache,
+                                  ContentEncoding* encoding,
+                                  ResponseBuffers* body);
+
+// Starts looking up the keys requested by `target` in the shards
+// `router` routes them to, and calls `done` with the result as
+// ShardRouter::LookupAsync() does. Returns 400, without starting the
+// lookup, if `target` requests no keys, and 200 otherwise.
+http::status StartRoutedLookup(absl::string_view target,
+                               const ShardRouter& router,
+                               ShardRouter::Done done);
+
+// Fills `body` with the JSON response for `response`, the result of a
+// lookup started by StartRoutedLookup(), compressed with `*encoding` as
+// RenderLookupResponse() does. Returns 502 if a shard could not be
+// looked up.
+http::status RenderRoutedResponse(const absl::StatusOr<Response>& response,
+                                  ContentEncoding* encoding,
+                                  ResponseBuffers* body);
+
+// Fills `body` with the process metrics in the Prometheus text format
+// if `target` is kMetricsPath. Returns false for any other target.
+bool RenderMetricsResponse(absl::string_view target, ResponseBuffers* body);
+
+// Fills `body` with the slow and recent requests of the flight recorder
+// as JSON if `target` is kDebugRequestsPath. Returns false for any
+// other target.
+bool RenderDebugRequestsResponse(absl::string_view target,
+                                 ResponseBuffers* body);
+
+// Fills `body` with the hottest keys of the creative map, and their
+// estimated lookups, as JSON if `target` is kHotKeysPath and
+// --serve_hot_keys is set. Returns false otherwise.
+bool RenderHotKeysResponse(absl::string_view target,
+                           const CreativeMap& creative_map,
+                           ResponseBuffers* body);
+
+// Fills `response` with an empty response with the given status.
+template <class RequestFields, class ResponseFields>
+void ErrorResponse(
+    const http::request<http::string_body, RequestFields>& request,
+    http::status status, http::response<GatherBody, ResponseFields>* response) {
+  response->clear();
+  response->result(status);
+  response->version(request.version());
+  response->set(http::field::server, BOOST_BEAST_VERSION_STRING);
+  response->keep_alive(request.keep_alive());
+  response->body().Clear();
+  response->prepare_payload();
+}
+
+// Fills `response` with an empty 503 response asking the client to retry
+// after `retry_after_seconds`.
+template <class RequestFields, class ResponseFields>
+void ServiceUnavailableResponse(
+    const http::request<http::string_body, RequestFields>& request,
+    int64_t retry_after_seconds,
+    http::response<GatherBody, ResponseFields>* response) {
+  ErrorResponse(request, http::status::service_unavailable, response);
+  response->set(http::field::retry_after, std::to_string(retry_after_seconds));
+}
+
+// Sets the status line and headers of `response`, whose body is
+// already rendered, to answer `request` with `status`. `lookup` tells
+// whether the body depends on the Accept-Encoding header. Anything but
+// a 200 gets an empty response.
+template <class RequestFields, class ResponseFields>
+void FinishResponse(
+    const http::request<http::string_body, RequestFields>& request,
+    http::status status, const char* content_type, ContentEncoding encoding,
+    bool lookup, http::response<GatherBody, ResponseFields>* response) {
+  if (status != http::status::ok) {
+    return ErrorResponse(request, status, response);
+  }
+  response->clear();
+  response->result(status);
+  response->version(request.version());
+  response->set(http::field::server, BOOST_BEAST_VERSION_STRING);
+  response->set(http::field::content_type, content_type);
+  if (encoding != ContentEncoding::kIdentity) {
+    absl::string_view name = ContentEncodingName(encoding);
+    response->set(http::field::content_encoding,
+                  boost::beast::string_view(name.data(), name.size()));
+  }
+  if (lookup && CompressionEnabled()) {
+    response->set(http::field::vary, "Accept-Encoding");
+  }
+  response->keep_alive(request.keep_alive());
+  response->prepare_payload();
+}
+
+// Returns the encoding negotiated from the Accept-Encoding header of
+// `request`.
+template <class RequestFields>
+ContentEncoding NegotiateEncoding(
+    const http::request<http::string_body, RequestFields>& request) {
+  auto accept_encoding = request[http::field::accept_encoding];
+  return NegotiateEncoding(
+      absl::string_view(accept_encoding.data(), accept_encoding.size()));
+}
+
+// Fills `response` for a single key/value lookup request, with the
+// metrics for a request to kMetricsPath, with the flight recorder's
+// requests for one to kDebugRequestsPath, or with the hottest keys for
+// one to kHotKeysPath. Lookup responses are
+// compressed as negotiated from the request's Accept-Encoding header
+// and use `cache` as RenderLookupResponse() does. Malformed requests
+// are answered with a 400 response. `response` may be reused across
+// requests; it is overwritten, not appended to. Neither the request nor
+// the response needs to be allocated from the heap, so with
+// arena-backed fields a lookup is served without heap allocations
+// (other than to compress, to fill the cache on a miss, or to start
+// tracking the popularity of a key).
+//
+// If `router` is not null, lookups are routed to the shards holding the
+// keys instead, and neither cached nor served without allocations.
+// Those are left to the caller, which starts them with
+// StartRoutedRequest() and answers them with FinishRoutedRequest() once
+// the shards reply, and false is returned. Returns true once
+// `response` is filled.
+template <class RequestFields, class ResponseFields>
+bool HandleRequest(
+    const http::request<http::string_body, RequestFields>& request,
+    const CreativeMap& creative_map, ResponseCache* cache,
+    const ShardRouter* router,
+    http::response<GatherBody, ResponseFields>* response) {
+  response->body().Clear();
+  absl::string_view target(request.target().data(), request.target().size());
+  const char* content_type = "application/json";
+  ContentEncoding encoding = ContentEncoding::kIdentity;
+  http::status status = http::status::ok;
+  bool lookup = false;
+  if (RenderMetricsResponse(target, &response->body())) {
+    content_type = kMetricsContentType;
+  } else if (RenderDebugRequestsResponse(target, &response->body()) ||
+             RenderHotKeysResponse(target, creative_map, &response->body())) {
+    // JSON, as lookups are, but never compressed or cached.
+  } else if (router != nullptr) {
+    return false;
+  } else {
+    encoding = NegotiateEncoding(request);
+    status = RenderLookupResponse(target, creative_map, cache, &encoding,
+                                  &response->body());
+    lookup = true;
+  }
+  FinishResponse(request, status, content_type, encoding, lookup, response);
+  return true;
+}
+
+// Starts routing the lookup `request`, which HandleRequest() left to the
+// caller, with `router`, and calls `done` with its result as
+// StartRoutedLookup() does. Returns false, with `response` filled with
+// a 400 response, if the request is malformed.
+template <class RequestFields, class ResponseFields>
+bool StartRoutedRequest(
+    const http::request<http::string_body, RequestFields>& request,
+    const ShardRouter& router, ShardRouter::Done done,
+    http::response<GatherBody, ResponseFields>* response) {
+  absl::string_view target(request.target().data(), request.target().size());
+  http::status status = StartRoutedLookup(target, router, std::move(done));
+  if (status == http::status::ok) return true;
+  ErrorResponse(request, status, response);
+  return false;
+}
+
+// Fills `response` for the routed lookup `request` with `result`, as
+// passed to the callback of StartRoutedRequest(), compressed as
+// negotiated from the request's Accept-Encoding header.
+template <class RequestFields, class ResponseFields>
+void FinishRoutedRequest(
+    const http::request<http::string_body, RequestFields>& request,
+    const absl::StatusOr<Response>& result,
+    http::response<GatherBody, ResponseFields>* response) {
+  response->body().Clear();
+  ContentEncoding encoding = NegotiateEncoding(request);
+  http::status status =
+      RenderRoutedResponse(result, &encoding, &response->body());
+  FinishResponse(request, status, "application/json", encoding,
+                 /*lookup=*/true, response);
+}
+
+}  // namespace trusted_server
+#endif  // REQUEST_HANDLER_H_
@@ -0,0 +1,352 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/request_handler.h"
+
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "absl/flags/declare.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/reflection.h"
+#include "absl/strings/escaping.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "boost/asio/buffer.hpp"
+#include "boost/beast/core.hpp"
+#include "boost/beast/http.hpp"
+#include "boost/optional.hpp"
+#include "data/mock_creative_map.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "server/flight_recorder.h"
+#include "server/request_arena.h"
+#include "server/response_body.h"
+#include "server/response_cache.h"
+
+namespace {
+
+// Heap allocations made by the current thread while counting is on.
+thread_local bool count_allocations = false;
+thread_local int allocation_count = 0;
+
+}  // namespace
+
+void* operator new(size_t size) {
+  if (count_allocations) ++allocation_count;
+  if (void* p = std::malloc(size == 0 ? 1 : size)) return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+ABSL_DECLARE_FLAG(int, key_popularity_sample_period);
+ABSL_DECLARE_FLAG(bool, serve_hot_keys);
+
+namespace trusted_server {
+
+namespace {
+
+namespace http = ::boost::beast::http;
+
+using ::testing::HasSubstr;
+using RequestParser =
+    http::request_parser<http::string_body, ArenaAllocator<char>>;
+using Response = http::response<GatherBody, ArenaFields>;
+
+const char kCreativeJson[] = "{\"key\":\"%s\",\"creativeData\":\"%s\"}";
+
+class RequestHandlerTest : public testing::Test {
+ protected:
+  RequestHandlerTest()
+      : creative_map_(MockCreativeMap::CreateMockMap()),
+        response_(std::piecewise_construct, std::make_tuple(),
+                  std::make_tuple(ArenaAllocator<char>(&arena_))) {}
+
+  // Parses `raw` and handles it the way a session does, reusing the
+  // arena, the response and the output string across calls. The
+  // serialized response is left in serialized_.
+  void Handle(const std::string& raw, ResponseCache* cache = nullptr) {
+    parser_.reset();
+    response_.clear();
+    response_.body().Clear();
+    arena_.Reset();
+    parser_.emplace(std::piecewise_construct, std::make_tuple(),
+                    std::make_tuple(ArenaAllocator<char>(&arena_)));
+    boost::beast::error_code error_code;
+    parser_->put(boost::asio::buffer(raw), error_code);
+    EXPECT_FALSE(error_code) << error_code.message();
+    EXPECT_TRUE(parser_->is_done());
+
+    HandleRequest(parser_->get(), *creative_map_, cache, /*router=*/nullptr,
+                  &response_);
+
+    // Drive the serializer as http::write would, without a socket.
+    http::response_serializer<GatherBody, ArenaFields> serializer(response_);
+    serialized_.clear();
+    do {
+      serializer.next(error_code, [&](boost::beast::error_code&,
+                                      const auto& buffers) {
+        for (auto buffer : boost::beast::buffers_range_ref(buffers)) {
+          serialized_.append(static_cast<const char*>(buffer.data()),
+                             buffer.size());
+        }
+        serializer.consume(boost::beast::buffer_bytes(buffers));
+      });
+    } while (!error_code && !serializer.is_done());
+    EXPECT_FALSE(error_code) << error_code.message();
+  }
+
+  static std::string GetRequest(const std::string& target) {
+    return absl::StrCat("GET ", target, " HTTP/1.1\r\nHost: test\r\n\r\n");
+  }
+
+  // Serves a GET request for `target` and returns the response body.
+  std::string Serve(const std::string& target,
+                    ResponseCache* cache = nullptr) {
+    Handle(GetRequest(target), cache);
+    return serialized_.substr(serialized_.size() - response_.body().size());
+  }
+
+  std::shared_ptr<MockCreativeMap> creative_map_;
+  RequestArena arena_;
+  boost::optional<RequestParser> parser_;
+  Response response_;
+  std::string serialized_;
+};
+
+TEST(QueryParamsTest, QueryString) {
+  EXPECT_EQ(*QueryString("/?keys=a"), "keys=a");
+  EXPECT_EQ(*QueryString("/?"), "");
+  EXPECT_FALSE(QueryString("").ok());
+  EXPECT_FALSE(QueryString("/keys=a").ok());
+}
+
+TEST_F(RequestHandlerTest, FoundAndMissingKeys) {
+  trusted_server::CreativeMetadata c1;
+  c1.set_is_servible(false);
+  std::string c1_json =
+      absl::StrFormat(kCreativeJson, "google.com/ad1",
+                      absl::Base64Escape(c1.SerializeAsString()));
+  EXPECT_EQ(Serve("/?keys=google.com/ad1,google.com/missing"),
+            absl::StrCat("{\"creatives\":[", c1_json,
+                         ",{\"key\":\"google.com/missing\"}]}"));
+  EXPECT_EQ(response_.result(), http::status::ok);
+}
+
+TEST_F(RequestHandlerTest, DecodesKeysFromAllKeyParams) {
+  std::string body = Serve(
+      "/?hostname=pub.test&renderUrls=google.com%2Fad1"
+      "&keys=google.com/ad2,google.com%2Fmissing+ad&keys=google.com%2cad3");
+  EXPECT_EQ(response_.result(), http::status::ok);
+  EXPECT_THAT(body, HasSubstr("{\"key\":\"google.com/ad1\",\"creative"));
+  EXPECT_THAT(body, HasSubstr("{\"key\":\"google.com/ad2\",\"creative"));
+  EXPECT_THAT(body, HasSubstr("{\"key\":\"google.com/missing ad\"}"));
+  EXPECT_THAT(body, HasSubstr("{\"key\":\"google.com,ad3\"}"));
+}
+
+TEST_F(RequestHandlerTest, BadRequests) {
+  for (const std::string target :
+       {"/keys=google.com/ad1", "/?x=1", "/?keys=", "/?keys&x=1"}) {
+    EXPECT_EQ(Serve(target), "") << target;
+    EXPECT_EQ(response_.result(), http::status::bad_request) << target;
+    EXPECT_EQ(response_.count(http::field::content_type), 0) << target;
+  }
+}
+
+TEST_F(RequestHandlerTest, SmallResponsesAreNotCompressed) {
+  Handle(
+      "GET /?keys=google.com/ad1 HTTP/1.1\r\nHost: test\r\n"
+      "Accept-Encoding: gzip, br\r\n\r\n");
+  EXPECT_EQ(response_.result(), http::status::ok);
+  EXPECT_EQ(response_[http::field::vary], "Accept-Encoding");
+  EXPECT_EQ(response_.count(http::field::content_encoding), 0);
+}
+
+TEST_F(RequestHandlerTest, ServesMetrics) {
+  Serve("/?keys=google.com/ad1,google.com/ad2");
+  std::string metrics = Serve("/metrics");
+  EXPECT_EQ(response_.result(), http::status::ok);
+  EXPECT_EQ(response_[http::field::content_type], kMetricsContentType);
+  EXPECT_THAT(metrics, HasSubstr("# TYPE trusted_server_keys_per_request "
+                                 "histogram\n"));
+  EXPECT_THAT(metrics, HasSubstr("trusted_server_request_stage_seconds_count"
+                                 "{stage=\"lookup\"}"));
+}
+
+TEST_F(RequestHandlerTest, TracesStages) {
+  FlightRecorder::Options options;
+  options.sample_rate = 1;
+  FlightRecorder recorder(options);
+  RequestTrace trace(&recorder);
+  absl::Time read = absl::Now();
+  trace.Start(read, read);
+  {
+    RequestTrace::Scope scope(&trace);
+    Serve("/?keys=google.com/ad1,google.com/ad2");
+  }
+  trace.Finish(response_.result_int(), serialized_.size(), absl::Now());
+
+  std::vector<RequestRecord> recent = recorder.Recent(1);
+  ASSERT_EQ(recent.size(), 1);
+  EXPECT_EQ(recent[0].keys, 2);
+  EXPECT_EQ(recent[0].status, 200);
+  int64_t previous = 0;
+  for (RequestStage stage :
+       {RequestStage::kRead, RequestStage::kParsed, RequestStage::kSnapshot,
+        RequestStage::kLookedUp, RequestStage::kWritten}) {
+    EXPECT_GE(recent[0].nanos(stage), previous) << RequestStageName(stage);
+    previous = recent[0].nanos(stage);
+  }
+}
+
+TEST_F(RequestHandlerTest, ServesDebugRequests) {
+  std::string requests = Serve("/debug/requests");
+  EXPECT_EQ(response_.result(), http::status::ok);
+  EXPECT_EQ(response_[http::field::content_type], "application/json");
+  EXPECT_THAT(requests, HasSubstr("\"slow\":["));
+  EXPECT_THAT(requests, HasSubstr("\"recent\":["));
+}
+
+TEST_F(RequestHandlerTest, ServesHotKeys) {
+  Serve("/debug/hot_keys");
+  EXPECT_EQ(response_.result(), http::status::bad_request);
+
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_serve_hot_keys, true);
+  absl::SetFlag(&FLAGS_key_popularity_sample_period, 16);
+  creative_map_ = MockCreativeMap::CreateMockMap();
+  // One lookup in 16 is counted, which cycles through the three keys.
+  for (int i = 0; i < 64; ++i) {
+    Serve("/?keys=google.com/ad1,google.com/ad2,google.com/ad3");
+  }
+  std::string hot_keys = Serve("/debug/hot_keys?limit=1");
+  EXPECT_EQ(response_.result(), http::status::ok);
+  EXPECT_EQ(response_[http::field::content_type], "application/json");
+  EXPECT_THAT(hot_keys,
+              HasSubstr("\"keys\":[{\"key\":\"google.com/ad1\","
+                        "\"lookups\":64}]"));
+
+  hot_keys = Serve("/debug/hot_keys");
+  EXPECT_THAT(hot_keys, HasSubstr("\"key\":\"google.com/ad3\""));
+}
+
+TEST_F(RequestHandlerTest, NoHeapAllocationsPerRequest) {
+  const std::string target =
+      "/?keys=google.com/ad1,google.com/ad2,google.com/missing&x=1";
+  const std::string raw = GetRequest(target);
+  ResponseCache cache(1 << 20);
+  for (ResponseCache* response_cache : {static_cast<ResponseCache*>(nullptr),
+                                        &cache}) {
+    // The first request grows the reused buffers to their working size
+    // and fills the cache.
+    const std::string expected = Serve(target, response_cache);
+
+    count_allocations = true;
+    allocation_count = 0;
+    for (int i = 0; i < 10; ++i) Handle(raw, response_cache);
+    count_allocations = false;
+
+    EXPECT_EQ(allocation_count, 0);
+    EXPECT_EQ(Serve(target, response_cache), expected);
+  }
+}
+
+// Exposes Publish() so tests can change the data under a cache.
+class PublishableCreativeMap : public CreativeMap {
+ public:
+  using CreativeMap::Publish;
+};
+
+class CachedLookupTest : public testing::Test {
+ protected:
+  void Publish(absl::string_view value) {
+    CreativeSnapshot::Updates updates = {
+        {"a", spanner::Bytes(std::string(value))}};
+    creative_map_.Publish(
+        creative_map_.snapshot()->WithUpdates(std::move(updates)));
+  }
+
+  // Renders the response to `target` accepting `encoding`, which is set
+  // to the encoding of the returned body.
+  std::string Render(absl::string_view target, ContentEncoding* encoding) {
+    ResponseBuffers body;
+    EXPECT_EQ(RenderLookupResponse(target, creative_map_, &cache_, encoding,
+                                   &body),
+              http::status::ok);
+    return body.ToString();
+  }
+
+  std::string Render(absl::string_view target) {
+    ContentEncoding encoding = ContentEncoding::kIdentity;
+    return Render(target, &encoding);
+  }
+
+  PublishableCreativeMap creative_map_;
+  ResponseCache cache_{1 << 20};
+};
+
+TEST_F(CachedLookupTest, ServedUntilTheDataChanges) {
+  Publish("v1");
+  const std::string v1 = Render("/?keys=a,b");
+  EXPECT_THAT(v1, HasSubstr(absl::Base64Escape("v1")));
+  EXPECT_EQ(cache_.size(), 1);
+  EXPECT_EQ(Render("/?keys=a,b"), v1);
+  EXPECT_EQ(Render("/?x=1&keys=a,b"), v1);
+  EXPECT_EQ(cache_.size(), 1);
+  EXPECT_NE(Render("/?keys=b,a"), v1);
+  EXPECT_EQ(cache_.size(), 2);
+
+  Publish("v2");
+  const std::string v2 = Render("/?keys=a,b");
+  EXPECT_THAT(v2, HasSubstr(absl::Base64Escape("v2")));
+  EXPECT_EQ(Render("/?keys=a,b"), v2);
+}
+
+TEST_F(CachedLookupTest, CompressesLargeResponses) {
+  Publish(std::string(4 * CompressionMinBytes(), 'x'));
+  const std::string identity = Render("/?keys=a,b");
+
+  for (ContentEncoding accepted :
+       {ContentEncoding::kGzip, ContentEncoding::kBrotli}) {
+    ContentEncoding encoding = accepted;
+    std::string compressed = Render("/?keys=a,b", &encoding);
+    EXPECT_EQ(encoding, accepted);
+    EXPECT_LT(compressed.size(), identity.size() / 4);
+    if (accepted == ContentEncoding::kGzip) {
+      EXPECT_EQ(compressed.substr(0, 2), "\x1f\x8b");
+    }
+    // Compressed once, then served from the cache.
+    encoding = accepted;
+    EXPECT_EQ(Render("/?keys=a,b", &encoding), compressed);
+    EXPECT_EQ(encoding, accepted);
+  }
+  EXPECT_EQ(cache_.size(), 3);
+
+  // Small responses are sent as they are.
+  ContentEncoding encoding = ContentEncoding::kGzip;
+  EXPECT_EQ(Render("/?keys=b", &encoding),
+            "{\"creatives\":[{\"key\":\"b\"}]}");
+  EXPECT_EQ(encoding, ContentEncoding::kIdentity);
+}
+
+}  // namespace
+
+}  // namespace trusted_server
@@ -0,0 +1,42 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/response_body.h"
+
+#include <string>
+
+#include "boost/asio/buffer.hpp"
+
+namespace trusted_server {
+
+void ResponseBuffers::ResolveBuffers() const {
+  buffers_.clear();
+  buffers_.reserve(pieces_.size());
+  for (const Piece& piece : pieces_) {
+    const char* data = piece.owned ? owned_.data() + piece.offset : piece.data;
+    buffers_.emplace_back(data, piece.size);
+  }
+}
+
+std::string ResponseBuffers::ToString() const {
+  std::string body;
+  body.reserve(size_);
+  for (const Piece& piece : pieces_) {
+    const char* data = piece.owned ? owned_.data() + piece.offset : piece.data;
+    body.append(data, piece.size);
+  }
+  return body;
+}
+
+}  // namespace trusted_server
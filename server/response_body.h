@@ -0,0 +1,144 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RESPONSE_BODY_H_
+#define RESPONSE_BODY_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "boost/asio/buffer.hpp"
+#include "boost/beast/core/error.hpp"
+#include "boost/beast/core/span.hpp"
+#include "boost/beast/http/message.hpp"
+#include "boost/optional.hpp"
+
+namespace trusted_server {
+
+// ResponseBuffers is a response body made of pieces that mostly point
+// into storage owned elsewhere, such as the pre-rendered JSON of a
+// pinned CreativeSnapshot. The pieces are handed to the socket as one
+// buffer sequence, so the body is written with a single gather write
+// and never concatenated into one string.
+class ResponseBuffers {
+ public:
+  // Keeps `owner` alive for as long as the body is, so pieces appended
+  // with AppendExternal() may point into memory it owns.
+  void Pin(std::shared_ptr<const void> owner) { owner_ = std::move(owner); }
+
+  // Appends a piece without copying it. `piece` must stay valid for
+  // the lifetime of the body, either statically or through Pin().
+  void AppendExternal(absl::string_view piece) {
+    pieces_.push_back({piece.data(), 0, piece.size(), /*owned=*/false});
+    size_ += piece.size();
+  }
+
+  // Appends a copy of `piece` held by the body itself.
+  void AppendCopy(absl::string_view piece) {
+    AppendRendered([piece](std::string* out) {
+      out->append(piece.data(), piece.size());
+    });
+  }
+
+  // Appends whatever `render` appends to the string it is passed. The
+  // body owns those bytes, so nothing needs to outlive the call.
+  template <typename Render>
+  void AppendRendered(Render&& render) {
+    // Owned pieces are recorded by offset since owned_ may still grow.
+    size_t offset = owned_.size();
+    render(&owned_);
+    size_t size = owned_.size() - offset;
+    pieces_.push_back({nullptr, offset, size, /*owned=*/true});
+    size_ += size;
+  }
+
+  // Empties the body but keeps its capacity, so a body reused across
+  // requests stops allocating once it has grown to the usual size.
+  void Clear() {
+    owner_.reset();
+    pieces_.clear();
+    owned_.clear();
+    buffers_.clear();
+    size_ = 0;
+  }
+
+  // Total number of bytes in the body.
+  std::uint64_t size() const { return size_; }
+
+  // Returns the body as one string. Meant for tests and callers that
+  // need the bytes rather than the buffers.
+  std::string ToString() const;
+
+ private:
+  friend struct GatherBody;
+
+  // Resolves the pieces into buffers_. Copies live in owned_, which
+  // moves along with the message, so this runs only once the message
+  // is in its final place and about to be written.
+  void ResolveBuffers() const;
+
+  struct Piece {
+    const char* data;
+    size_t offset;
+    size_t size;
+    bool owned;
+  };
+
+  std::shared_ptr<const void> owner_;
+  std::vector<Piece> pieces_;
+  std::string owned_;
+  mutable std::vector<boost::asio::const_buffer> buffers_;
+  std::uint64_t size_ = 0;
+};
+
+// Beast Body type that serializes a ResponseBuffers.
+struct GatherBody {
+  using value_type = ResponseBuffers;
+
+  static std::uint64_t size(const value_type& body) { return body.size(); }
+
+  class writer {
+   public:
+    using const_buffers_type =
+        boost::beast::span<const boost::asio::const_buffer>;
+
+    template <bool isRequest, class Fields>
+    writer(const boost::beast::http::header<isRequest, Fields>&,
+           const value_type& body)
+        : body_(body) {}
+
+    void init(boost::beast::error_code& error_code) {
+      error_code = {};
+      body_.ResolveBuffers();
+    }
+
+    boost::optional<std::pair<const_buffers_type, bool>> get(
+        boost::beast::error_code& error_code) {
+      error_code = {};
+      if (body_.size() == 0) return boost::none;
+      return {{{body_.buffers_.data(), body_.buffers_.size()},
+               /*more=*/false}};
+    }
+
+   private:
+    const value_type& body_;
+  };
+};
+
+}  // namespace trusted_server
+#endif  // RESPONSE_BODY_H_
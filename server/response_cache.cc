@@ -0,0 +1,139 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/response_cache.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/hash/hash.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "metrics/metrics.h"
+
+namespace trusted_server {
+
+namespace {
+
+struct CacheMetrics {
+  Counter* hits;
+  Counter* misses;
+  Counter* evictions;
+};
+
+const CacheMetrics& Metrics() {
+  static const auto* metrics = [] {
+    MetricsRegistry& registry = MetricsRegistry::Global();
+    constexpr char kLookups[] = "trusted_server_response_cache_lookups_total";
+    constexpr char kLookupsHelp[] = "Response cache lookups, by result.";
+    return new CacheMetrics{
+        registry.AddCounter(kLookups, kLookupsHelp, "result=\"hit\""),
+        registry.AddCounter(kLookups, kLookupsHelp, "result=\"miss\""),
+        registry.AddCounter(
+            "trusted_server_response_cache_evictions_total",
+            "Responses evicted from the response cache to make room."),
+    };
+  }();
+  return *metrics;
+}
+
+}  // namespace
+
+ResponseCache::ResponseCache(size_t max_bytes)
+    : max_shard_bytes_(max_bytes / kNumShards) {}
+
+ResponseCache::Shard& ResponseCache::ShardFor(absl::string_view key) {
+  return shards_[absl::Hash<absl::string_view>()(key) % kNumShards];
+}
+
+bool ResponseCache::AdvanceEpoch(Shard& shard, uint64_t epoch) {
+  if (epoch < shard.epoch) return false;
+  if (epoch > shard.epoch) {
+    shard.epoch = epoch;
+    shard.index.clear();
+    shard.lru.clear();
+    shard.bytes = 0;
+  }
+  return true;
+}
+
+std::shared_ptr<const CachedResponse> ResponseCache::Lookup(
+    uint64_t epoch, absl::string_view key, absl::string_view encoding) {
+  const CacheMetrics& metrics = Metrics();
+  Shard& shard = ShardFor(key);
+  {
+    absl::MutexLock lock(&shard.mutex);
+    if (AdvanceEpoch(shard, epoch)) {
+      auto it = shard.index.find(std::make_pair(key, encoding));
+      if (it != shard.index.end()) {
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        metrics.hits->Increment();
+        return *it->second;
+      }
+    }
+  }
+  metrics.misses->Increment();
+  return nullptr;
+}
+
+std::shared_ptr<const CachedResponse> ResponseCache::Insert(
+    uint64_t epoch, CachedResponse response) {
+  auto entry = std::make_shared<const CachedResponse>(std::move(response));
+  size_t entry_bytes = EntryBytes(*entry);
+  if (entry_bytes > max_shard_bytes_) return entry;
+
+  const CacheMetrics& metrics = Metrics();
+  Shard& shard = ShardFor(entry->key);
+  absl::MutexLock lock(&shard.mutex);
+  if (!AdvanceEpoch(shard, epoch)) return entry;
+  // Concurrent misses on the same key may both insert; keep the first.
+  auto existing = shard.index.find(std::make_pair(
+      absl::string_view(entry->key), absl::string_view(entry->encoding)));
+  if (existing != shard.index.end()) return *existing->second;
+  while (shard.bytes + entry_bytes > max_shard_bytes_) {
+    const CachedResponse& oldest = *shard.lru.back();
+    shard.bytes -= EntryBytes(oldest);
+    shard.index.erase(std::make_pair(absl::string_view(oldest.key),
+                                     absl::string_view(oldest.encoding)));
+    shard.lru.pop_back();
+    metrics.evictions->Increment();
+  }
+  shard.lru.push_front(entry);
+  shard.index.emplace(std::make_pair(absl::string_view(entry->key),
+                                     absl::string_view(entry->encoding)),
+                      shard.lru.begin());
+  shard.bytes += entry_bytes;
+  return entry;
+}
+
+size_t ResponseCache::size() const {
+  size_t size = 0;
+  for (const Shard& shard : shards_) {
+    absl::MutexLock lock(&shard.mutex);
+    size += shard.lru.size();
+  }
+  return size;
+}
+
+size_t ResponseCache::bytes() const {
+  size_t bytes = 0;
+  for (const Shard& shard : shards_) {
+    absl::MutexLock lock(&shard.mutex);
+    bytes += shard.bytes;
+  }
+  return bytes;
+}
+
+}  // namespace trusted_server
@@ -0,0 +1,118 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RESPONSE_CACHE_H_
+#define RESPONSE_CACHE_H_
+
+#include <array>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+
+namespace trusted_server {
+
+// A fully rendered response body held by a ResponseCache.
+struct CachedResponse {
+  std::string key;
+  // Content encoding of the body; each encoding is cached separately.
+  std::string encoding;
+  std::string body;
+  // Size of the body before it was compressed.
+  size_t uncompressed_size = 0;
+};
+
+// ResponseCache holds the rendered bodies of recent responses, so the
+// identical key lists that bidders send over and over are answered
+// without looking up every key again.
+//
+// Entries are tagged with the epoch of the creative map they were
+// rendered from (see CreativeMap::epoch()). Once a lookup or insert
+// carries a newer epoch, everything rendered from older ones is dropped
+// and never served again. Within an epoch, the least recently used
+// entries are evicted to stay under the byte limit.
+//
+// The cache is split into shards with a lock each. Lookups that hit do
+// not allocate.
+class ResponseCache {
+ public:
+  // Bytes accounted per entry on top of its key, encoding and body.
+  static constexpr size_t kEntryOverhead = 128;
+
+  explicit ResponseCache(size_t max_bytes);
+
+  ResponseCache(const ResponseCache&) = delete;
+  ResponseCache& operator=(const ResponseCache&) = delete;
+
+  // Returns the response cached for `key` in `encoding` and `epoch`, or
+  // null. The entry stays valid for as long as it is held, even once
+  // evicted.
+  std::shared_ptr<const CachedResponse> Lookup(uint64_t epoch,
+                                               absl::string_view key,
+                                               absl::string_view encoding);
+
+  // Caches `response` as rendered in `epoch` and returns it, or the
+  // entry already cached for its key and encoding. Responses rendered
+  // from an epoch older than the newest one seen are not kept, nor are
+  // responses too large to ever fit.
+  std::shared_ptr<const CachedResponse> Insert(uint64_t epoch,
+                                               CachedResponse response);
+
+  // Number of cached responses.
+  size_t size() const;
+
+  // Bytes accounted to the cached responses.
+  size_t bytes() const;
+
+ private:
+  static constexpr int kNumShards = 16;
+
+  using LruList = std::list<std::shared_ptr<const CachedResponse>>;
+
+  struct Shard {
+    mutable absl::Mutex mutex;
+    uint64_t epoch ABSL_GUARDED_BY(mutex) = 0;
+    // Most recently used first.
+    LruList lru ABSL_GUARDED_BY(mutex);
+    // Keys and encodings point into the entries held by lru.
+    absl::flat_hash_map<std::pair<absl::string_view, absl::string_view>,
+                        LruList::iterator>
+        index ABSL_GUARDED_BY(mutex);
+    size_t bytes ABSL_GUARDED_BY(mutex) = 0;
+  };
+
+  static size_t EntryBytes(const CachedResponse& entry) {
+    return entry.key.size() + entry.encoding.size() + entry.body.size() +
+           kEntryOverhead;
+  }
+
+  Shard& ShardFor(absl::string_view key);
+
+  // Drops the shard's entries if `epoch` is newer than theirs. Returns
+  // false if `epoch` is older, i.e. the caller's data is outdated.
+  static bool AdvanceEpoch(Shard& shard, uint64_t epoch)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(shard.mutex);
+
+  const size_t max_shard_bytes_;
+  std::array<Shard, kNumShards> shards_;
+};
+
+}  // namespace trusted_server
+#endif  // RESPONSE_CACHE_H_
@@ -0,0 +1,114 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/response_cache.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/strings/str_cat.h"
+#include "gtest/gtest.h"
+
+namespace trusted_server {
+
+namespace {
+
+CachedResponse Response(std::string key, std::string body) {
+  size_t size = body.size();
+  return {std::move(key), "identity", std::move(body), size};
+}
+
+TEST(ResponseCacheTest, LookupAndInsert) {
+  ResponseCache cache(1 << 20);
+  EXPECT_EQ(cache.Lookup(1, "a,b", "identity"), nullptr);
+  auto inserted = cache.Insert(1, Response("a,b", "body"));
+  auto cached = cache.Lookup(1, "a,b", "identity");
+  ASSERT_NE(cached, nullptr);
+  EXPECT_EQ(cached, inserted);
+  EXPECT_EQ(cached->key, "a,b");
+  EXPECT_EQ(cached->body, "body");
+  EXPECT_EQ(cache.Lookup(1, "b,a", "identity"), nullptr);
+  EXPECT_EQ(cache.Lookup(1, "a,b", "gzip"), nullptr);
+
+  // The first of two concurrent fills wins.
+  EXPECT_EQ(cache.Insert(1, Response("a,b", "other")), cached);
+  EXPECT_EQ(cache.Lookup(1, "a,b", "identity")->body, "body");
+  EXPECT_EQ(cache.size(), 1);
+  EXPECT_EQ(cache.bytes(), 3 + 8 + 4 + ResponseCache::kEntryOverhead);
+
+  // Each encoding is cached separately.
+  cache.Insert(1, {"a,b", "gzip", "compressed", 4});
+  EXPECT_EQ(cache.Lookup(1, "a,b", "gzip")->body, "compressed");
+  EXPECT_EQ(cache.Lookup(1, "a,b", "gzip")->uncompressed_size, 4);
+  EXPECT_EQ(cache.Lookup(1, "a,b", "identity")->body, "body");
+  EXPECT_EQ(cache.size(), 2);
+}
+
+TEST(ResponseCacheTest, NewerEpochInvalidates) {
+  ResponseCache cache(1 << 20);
+  cache.Insert(1, Response("a", "old"));
+  auto old = cache.Lookup(1, "a", "identity");
+  EXPECT_EQ(cache.Lookup(2, "a", "identity"), nullptr);
+  // Responses rendered from outdated data are neither served nor kept.
+  EXPECT_EQ(cache.Lookup(1, "a", "identity"), nullptr);
+  cache.Insert(1, Response("a", "old"));
+  EXPECT_EQ(cache.Lookup(2, "a", "identity"), nullptr);
+
+  cache.Insert(2, Response("a", "new"));
+  EXPECT_EQ(cache.Lookup(2, "a", "identity")->body, "new");
+  // Entries that were handed out stay valid.
+  EXPECT_EQ(old->body, "old");
+}
+
+TEST(ResponseCacheTest, EvictsLeastRecentlyUsed) {
+  // Room for two entries of this size in each shard.
+  const std::string body(100, 'x');
+  const size_t entry_bytes =
+      2 + 8 + body.size() + ResponseCache::kEntryOverhead;
+  ResponseCache cache(16 * 2 * entry_bytes);
+
+  // Fill the cache well past its size; it never holds more than it may.
+  for (int i = 10; i < 99; ++i) {
+    cache.Insert(1, Response(absl::StrCat(i), body));
+    EXPECT_LE(cache.bytes(), 16 * 2 * entry_bytes);
+  }
+  EXPECT_LT(cache.size(), 89);
+  EXPECT_EQ(cache.bytes(), cache.size() * entry_bytes);
+  // The latest insert is always kept.
+  EXPECT_NE(cache.Lookup(1, "98", "identity"), nullptr);
+
+  // Bodies larger than a shard are not cached at all.
+  cache.Insert(1, Response("big", std::string(4 * entry_bytes, 'x')));
+  EXPECT_EQ(cache.Lookup(1, "big", "identity"), nullptr);
+}
+
+TEST(ResponseCacheTest, LookupRefreshesRecency) {
+  const std::string body(100, 'x');
+  const size_t entry_bytes =
+      2 + 8 + body.size() + ResponseCache::kEntryOverhead;
+  ResponseCache cache(16 * 2 * entry_bytes);
+  // Keys are spread over shards, so keep adding until "10" would have
+  // been evicted had it not been looked up in between.
+  cache.Insert(1, Response("10", body));
+  for (int i = 11; i < 99; ++i) {
+    ASSERT_NE(cache.Lookup(1, "10", "identity"), nullptr) << i;
+    cache.Insert(1, Response(absl::StrCat(i), body));
+  }
+  EXPECT_NE(cache.Lookup(1, "10", "identity"), nullptr);
+}
+
+}  // namespace
+
+}  // namespace trusted_server
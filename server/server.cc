@@ -12,30 +12,39 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cerrno>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <memory>
+#include <stdexcept>
+#include <string>
 #include <thread>
-#include <unordered_set>
+#include <vector>
 
-#include "absl/container/flat_hash_map.h"
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
-#include "absl/status/status.h"
-#include "absl/status/statusor.h"
-#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/str_split.h"
+#include "absl/time/time.h"
+#include "boost/asio/io_context.hpp"
 #include "boost/asio/ip/tcp.hpp"
-#include "boost/asio/strand.hpp"
-#include "boost/beast/core.hpp"
-#include "boost/beast/http.hpp"
-#include "boost/beast/version.hpp"
+#include "boost/asio/signal_set.hpp"
 #include "data/creative_map.h"
 #include "data/mock_creative_map.h"
 #include "glog/logging.h"
-#include "google/cloud/spanner/client.h"
-#include "google/protobuf/util/json_util.h"
-#include "proto/response.pb.h"
+#include "grpcpp/grpcpp.h"
+#include "metrics/metrics.h"
+#include "server/admission_control.h"
+#include "server/http_session.h"
+#include "server/key_value_service.h"
+#include "server/response_cache.h"
+#include "server/shard_router.h"
+#include "server/uring_server.h"
 
 ABSL_FLAG(bool, mock_spanner, false,
           "If enabled uses a mock spanner client with test data.");
@@ -45,107 +54,304 @@ ABSL_FLAG(std::string, address, "0.0.0.0", "Server address to bind to.");
 // Default Cloud Run port value is 8080.
 ABSL_FLAG(std::uint16_t, port, 8080, "Port the address is listening on.");
 
-ABSL_FLAG(std::string, key_param, "keys",
-          "Parameter name to use for the key value lookup.");
+ABSL_FLAG(int, num_threads, 0,
+          "Number of threads running the io_context. Defaults to the number "
+          "of hardware threads when zero.");
+
+ABSL_FLAG(bool, reactor_per_thread, false,
+          "If enabled, each of the --num_threads threads runs its own "
+          "io_context with its own SO_REUSEPORT listener, instead of all "
+          "threads sharing one.");
+
+ABSL_FLAG(std::string, network_backend, "epoll",
+          "How HTTP connections are served: epoll, with Asio, or io_uring, "
+          "with one io_uring loop and SO_REUSEPORT listener per thread. "
+          "Falls back to epoll if io_uring is unavailable.");
+
+ABSL_FLAG(bool, pin_threads, false,
+          "If enabled, pins each serving thread to one of the CPUs the "
+          "process may run on, round-robin.");
+
+ABSL_FLAG(int, max_connections, 0,
+          "Open HTTP connections beyond which new ones are answered with a "
+          "503 and closed. Zero means unlimited.");
+
+ABSL_FLAG(int, max_inflight_requests, 0,
+          "HTTP requests being served at once beyond which new ones are "
+          "answered with a 503. Zero means unlimited.");
+
+ABSL_FLAG(int, max_queue_delay_ms, 0,
+          "Milliseconds requests may wait for a thread before they are "
+          "answered with a 503 instead. Zero disables the check.");
+
+ABSL_FLAG(int, retry_after_sec, 1,
+          "Seconds clients are told to wait before retrying a request "
+          "answered with a 503.");
+
+ABSL_FLAG(std::uint16_t, grpc_port, 50051,
+          "Port the gRPC KeyValueService listens on, on --address. Zero "
+          "disables it.");
+
+ABSL_FLAG(size_t, response_cache_bytes, 64 << 20,
+          "Bytes of rendered responses cached for repeated key lists. Zero "
+          "disables the response cache.");
+
+ABSL_FLAG(std::string, router_shards, "",
+          "Comma-separated gRPC addresses of the servers holding each "
+          "shard of the creatives, in shard order, e.g. servers run with "
+          "--num_shards and --shard_index. If set, the server loads no "
+          "creatives and answers HTTP lookups by looking up each key in "
+          "the shard owning it. Serving threads only start lookups, which "
+          "complete on a thread of the router's own, so the lookups routed "
+          "at once are bounded by --max_inflight_requests, if set, rather "
+          "than by --num_threads.");
+
+ABSL_FLAG(int, router_connections_per_shard, 4,
+          "Connections kept open to each of --router_shards.");
+
+ABSL_FLAG(int, router_timeout_ms, 100,
+          "Milliseconds a routed lookup may wait for the shards before it "
+          "is answered with a 502.");
 
 using ::boost::asio::ip::tcp;
-using ::google::protobuf::util::MessageToJsonString;
+using ::trusted_server::AdmissionController;
 using ::trusted_server::CreativeMap;
+using ::trusted_server::KeyValueServiceImpl;
+using ::trusted_server::Listener;
+using ::trusted_server::MetricsRegistry;
 using ::trusted_server::MockCreativeMap;
-namespace http = ::boost::beast::http;
-
-absl::StatusOr<absl::flat_hash_map<std::string, std::string>> QueryParamsToMap(
-    const http::request<http::string_body>& request) {
-  absl::flat_hash_map<std::string, std::string> params;
-  if (request.target().length() < 2) {
-    return absl::Status(absl::StatusCode::kInvalidArgument,
-                        "Target does not contain valid query string.");
+using ::trusted_server::ResponseCache;
+using ::trusted_server::ShardRouter;
+using ::trusted_server::UringServer;
+
+// Returns the CPUs the process is allowed to run on.
+std::vector<int> AllowedCpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+    LOG(ERROR) << "Failed to get CPU affinity: " << strerror(errno);
+    return cpus;
   }
-  auto query_pos = request.target().to_string().find("?");
-  if (query_pos == std::string::npos) {
-    return absl::Status(absl::StatusCode::kInvalidArgument,
-                        "Target does not contain query delimiter.");
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
   }
-  // =&; are reservered url query characters.
-  params = absl::StrSplit(request.target().to_string().substr(query_pos + 1),
-                          absl::ByAnyChar("=&;"));
-  return params;
+  return cpus;
 }
 
-void SendErrorResponse(tcp::socket& socket, uint http_version,
-                       http::status status) {
-  boost::beast::error_code error_code;
-  http::response<http::string_body> response{status, http_version};
-  http::write(socket, response, error_code);
-  socket.shutdown(tcp::socket::shutdown_send, error_code);
+// Restricts the calling thread to `cpu`.
+void PinToCpu(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+    LOG(ERROR) << "Failed to pin thread to CPU " << cpu << ": "
+               << strerror(error);
+  }
 }
 
-void HandleSession(tcp::socket socket,
-                   std::shared_ptr<CreativeMap> creative_map) {
-  boost::beast::error_code error_code;
-  boost::beast::flat_buffer buffer;
-
-  http::request<http::string_body> request;
-  http::read(socket, buffer, request, error_code);
-
-  if (error_code) {
-    SendErrorResponse(socket, request.version(), http::status::bad_request);
-    return;
+void RunServer() {
+  auto address = boost::asio::ip::make_address(absl::GetFlag(FLAGS_address));
+  auto port = absl::GetFlag(FLAGS_port);
+  std::shared_ptr<const ShardRouter> router;
+  std::shared_ptr<CreativeMap> creative_map;
+  if (std::string shards = absl::GetFlag(FLAGS_router_shards);
+      !shards.empty()) {
+    ShardRouter::Options router_options;
+    router_options.shards = absl::StrSplit(shards, ',', absl::SkipEmpty());
+    router_options.connections_per_shard =
+        absl::GetFlag(FLAGS_router_connections_per_shard);
+    router_options.timeout =
+        absl::Milliseconds(absl::GetFlag(FLAGS_router_timeout_ms));
+    router = std::make_shared<const ShardRouter>(router_options);
+    // Left empty; the shards hold the creatives.
+    creative_map = std::make_shared<CreativeMap>();
+  } else if (absl::GetFlag(FLAGS_mock_spanner)) {
+    creative_map = MockCreativeMap::CreateMockMap();
+  } else {
+    creative_map = CreativeMap::CreateMap();
   }
+  MetricsRegistry::Global().AddGauge(
+      "trusted_server_creatives", "Creatives in the current snapshot.", "",
+      [creative_map] { return creative_map->snapshot()->size(); });
+  MetricsRegistry::Global().AddGauge(
+      "trusted_server_creative_bytes",
+      "Bytes of keys, data and JSON held by the current snapshot.", "",
+      [creative_map] { return creative_map->snapshot()->bytes(); });
+  MetricsRegistry::Global().AddGauge(
+      "trusted_server_creative_values",
+      "Distinct creative data held; keys with the same data share it.", "",
+      [creative_map] { return creative_map->snapshot()->values().size(); });
+  MetricsRegistry::Global().AddGauge(
+      "trusted_server_creative_value_dedup_ratio",
+      "Keys held per distinct creative data.", "", [creative_map] {
+        auto snapshot = creative_map->snapshot();
+        size_t values = snapshot->values().size();
+        return values == 0 ? 1.0
+                           : static_cast<double>(snapshot->stored_keys()) /
+                                 values;
+      });
+  MetricsRegistry::Global().AddGauge(
+      "trusted_server_creative_value_bytes_saved",
+      "Bytes saved by keys sharing their creative data.", "",
+      [creative_map] {
+        auto snapshot = creative_map->snapshot();
+        double unshared = snapshot->unshared_value_bytes();
+        return std::max(unshared - snapshot->values().bytes(), 0.0);
+      });
+  MetricsRegistry::Global().AddGauge(
+      "trusted_server_hot_creatives",
+      "Creatives laid out together in memory for being looked up most.", "",
+      [creative_map] { return creative_map->snapshot()->hot_keys(); });
+  MetricsRegistry::Global().AddGauge(
+      "trusted_server_hot_creative_bytes",
+      "Bytes of the creatives laid out together in memory.", "",
+      [creative_map] { return creative_map->snapshot()->hot_bytes(); });
+  MetricsRegistry::Global().AddGauge(
+      "trusted_server_snapshot_replicas",
+      "Copies of the snapshot kept, one per NUMA node, with --numa_replicas.",
+      "", [creative_map] { return creative_map->num_replicas(); });
 
-  std::string key_param = absl::GetFlag(FLAGS_key_param);
-  auto status_or_params = QueryParamsToMap(request);
-  if (!status_or_params.ok() ||
-      status_or_params.value().find(key_param) ==
-          status_or_params.value().end() ||
-      status_or_params.value()[key_param].empty()) {
-    SendErrorResponse(socket, request.version(), http::status::bad_request);
-    return;
+  std::shared_ptr<ResponseCache> cache;
+  if (size_t cache_bytes = absl::GetFlag(FLAGS_response_cache_bytes)) {
+    cache = std::make_shared<ResponseCache>(cache_bytes);
+    MetricsRegistry::Global().AddGauge(
+        "trusted_server_response_cache_bytes",
+        "Bytes accounted to the responses in the response cache.", "",
+        [cache] { return cache->bytes(); });
   }
-  std::vector<std::string> keys =
-      absl::StrSplit(status_or_params.value()[key_param], ",");
-
-  ::trusted_server::Response proto_response = creative_map->Lookup(keys);
-  std::string json_response;
-  if (!MessageToJsonString(proto_response, &json_response).ok()) {
-    SendErrorResponse(socket, request.version(), http::status::bad_request);
-    return;
+
+  AdmissionController::Options admission_options;
+  admission_options.max_connections = absl::GetFlag(FLAGS_max_connections);
+  admission_options.max_inflight_requests =
+      absl::GetFlag(FLAGS_max_inflight_requests);
+  admission_options.max_queue_delay =
+      absl::Milliseconds(absl::GetFlag(FLAGS_max_queue_delay_ms));
+  admission_options.retry_after =
+      absl::Seconds(absl::GetFlag(FLAGS_retry_after_sec));
+  auto admission = std::make_shared<AdmissionController>(admission_options);
+  MetricsRegistry::Global().AddGauge(
+      "trusted_server_open_connections", "Open HTTP connections.", "",
+      [admission] { return admission->open_connections(); });
+  MetricsRegistry::Global().AddGauge(
+      "trusted_server_inflight_requests", "HTTP requests being served.", "",
+      [admission] { return admission->inflight_requests(); });
+  constexpr char kLimit[] = "trusted_server_admission_limit";
+  constexpr char kLimitHelp[] =
+      "Admission limits in effect, zero where disabled.";
+  MetricsRegistry::Global().AddGauge(
+      kLimit, kLimitHelp, "limit=\"connections\"",
+      [admission_options] { return admission_options.max_connections; });
+  MetricsRegistry::Global().AddGauge(
+      kLimit, kLimitHelp, "limit=\"inflight_requests\"",
+      [admission_options] { return admission_options.max_inflight_requests; });
+  MetricsRegistry::Global().AddGauge(
+      kLimit, kLimitHelp, "limit=\"queue_delay_seconds\"",
+      [admission_options] {
+        return absl::ToDoubleSeconds(admission_options.max_queue_delay);
+      });
+
+  int num_threads = absl::GetFlag(FLAGS_num_threads);
+  if (num_threads <= 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
   }
 
-  // Send the response
-  http::response<http::string_body> response{http::status::ok,
-                                             request.version()};
+  std::vector<std::unique_ptr<UringServer>> uring_servers;
+  const std::string backend = absl::GetFlag(FLAGS_network_backend);
+  if (backend == "io_uring") {
+    for (int i = 0; i < num_threads; ++i) {
+      auto uring_server =
+          UringServer::Create(tcp::endpoint{address, port}, creative_map,
+                              cache, router, admission);
+      if (!uring_server.ok()) {
+        LOG(WARNING) << "Falling back to epoll: " << uring_server.status();
+        uring_servers.clear();
+        break;
+      }
+      uring_servers.push_back(*std::move(uring_server));
+    }
+  } else if (backend != "epoll") {
+    throw std::runtime_error(
+        absl::StrCat("Unknown --network_backend ", backend));
+  }
 
-  response.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-  response.set(http::field::content_type, "application/json");
-  response.keep_alive(request.keep_alive());
-  response.body() = std::move(json_response);
-  response.prepare_payload();
+  // Either all threads run one shared io_context, or each runs its own
+  // with a listener of its own, so a connection is served start to end
+  // by the thread whose listener the kernel handed it to. With io_uring,
+  // a single io_context without listeners only waits for signals.
+  const bool per_thread = absl::GetFlag(FLAGS_reactor_per_thread);
+  std::vector<std::unique_ptr<boost::asio::io_context>> contexts;
+  if (!uring_servers.empty()) {
+    contexts.push_back(std::make_unique<boost::asio::io_context>(1));
+  } else {
+    for (int i = 0; i < (per_thread ? num_threads : 1); ++i) {
+      contexts.push_back(std::make_unique<boost::asio::io_context>(
+          /*concurrency_hint=*/per_thread ? 1 : num_threads));
+      std::make_shared<Listener>(*contexts.back(),
+                                 tcp::endpoint{address, port}, creative_map,
+                                 cache, router, admission,
+                                 /*reuse_port=*/per_thread)
+          ->Run();
+    }
+  }
 
-  http::write(socket, response, error_code);
-  if (error_code) {
-    return;
+  // The gRPC server runs on its own threads, next to the io_context.
+  KeyValueServiceImpl key_value_service(creative_map);
+  std::unique_ptr<grpc::Server> grpc_server;
+  if (router != nullptr) {
+    LOG(INFO) << "Not serving gRPC: routed lookups are only served over "
+                 "HTTP";
+  } else if (auto grpc_port = absl::GetFlag(FLAGS_grpc_port)) {
+    std::string grpc_address =
+        address.is_v6()
+            ? absl::StrCat("[", address.to_string(), "]:", grpc_port)
+            : absl::StrCat(address.to_string(), ":", grpc_port);
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort(grpc_address, grpc::InsecureServerCredentials());
+    builder.RegisterService(&key_value_service);
+    grpc_server = builder.BuildAndStart();
+    if (grpc_server == nullptr) {
+      throw std::runtime_error(
+          absl::StrCat("Failed to start gRPC server on ", grpc_address));
+    }
   }
 
-  socket.shutdown(tcp::socket::shutdown_send, error_code);
-}
+  // Stop all worker threads on SIGINT/SIGTERM so in-flight handlers
+  // are abandoned cleanly instead of killed mid-write.
+  boost::asio::signal_set signals(*contexts.front(), SIGINT, SIGTERM);
+  signals.async_wait(
+      [&contexts, &uring_servers](const boost::system::error_code&, int) {
+        for (auto& context : contexts) context->stop();
+        for (auto& uring_server : uring_servers) uring_server->Stop();
+      });
 
-void RunServer() {
-  auto address = boost::asio::ip::make_address(absl::GetFlag(FLAGS_address));
-  auto port = absl::GetFlag(FLAGS_port);
-  std::shared_ptr<CreativeMap> creative_map =
-      absl::GetFlag(FLAGS_mock_spanner) ? MockCreativeMap::CreateMockMap()
-                                        : CreativeMap::CreateMap();
-
-  boost::asio::io_context ioc{/*concurrency_hint=*/80};
-  tcp::acceptor acceptor{ioc, {address, port}};
-  for (;;) {
-    // Blocks until a new connection is attempted.
-    auto socket = acceptor.accept(ioc);
-    if (!socket.is_open()) break;
-    // Run a thread per-session, transferring ownership of the socket
-    std::thread{HandleSession, std::move(socket), std::ref(creative_map)}
-        .detach();
+  const std::vector<int> cpus = absl::GetFlag(FLAGS_pin_threads)
+                                    ? AllowedCpus()
+                                    : std::vector<int>();
+  std::vector<std::thread> workers;
+  workers.reserve(num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    if (!uring_servers.empty()) {
+      workers.emplace_back([&uring_servers, &cpus, i] {
+        if (!cpus.empty()) PinToCpu(cpus[i % cpus.size()]);
+        uring_servers[i]->Run();
+      });
+      continue;
+    }
+    boost::asio::io_context& context = *contexts[i % contexts.size()];
+    workers.emplace_back([&context, &cpus, i] {
+      if (!cpus.empty()) PinToCpu(cpus[i % cpus.size()]);
+      context.run();
+    });
+  }
+  if (!uring_servers.empty()) {
+    contexts.front()->run();
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  if (grpc_server != nullptr) {
+    grpc_server->Shutdown();
   }
 }
 
@@ -15,6 +15,10 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 
+#include <string>
+#include <utility>
+#include <vector>
+
 #include "absl/cleanup/cleanup.h"
 #include "absl/random/random.h"
 #include "absl/status/status.h"
@@ -22,6 +26,7 @@
 #include "absl/strings/escaping.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
+#include "absl/strings/str_join.h"
 #include "boost/asio/connect.hpp"
 #include "boost/asio/deadline_timer.hpp"
 #include "boost/asio/io_service.hpp"
@@ -44,25 +49,48 @@ namespace asio = ::boost::asio;
 
 const char kCreaiveJson[] = "{\"key\":\"%s\",\"creativeData\":\"%s\"}";
 
-class TrustedServer : public ::testing::Environment {
+// Runs the server binary as a subprocess serving HTTP on an unused port.
+class ServerProcess {
  public:
-  void SetUp() override {
+  // Starts the server with `flags`, next to those setting its address
+  // and HTTP port, and waits until it accepts connections.
+  void Start(const std::vector<std::string>& flags) {
     std::string test_workspace_dir =
         absl::StrCat(std::string(std::getenv("TEST_SRCDIR")), "/",
                      std::string(std::getenv("TEST_WORKSPACE")));
     std::string server_binary =
         absl::StrCat(test_workspace_dir, "/server/server");
-    server_process_ =
-        subprocess::RunBuilder(
-            {server_binary, "--mock_spanner=true", "--address=0.0.0.0",
-             absl::StrCat("--port=", FindUnusedPort().value())})
-            .popen();
+    port_ = FindUnusedPort().value();
+    std::vector<std::string> command = {
+        server_binary, "--address=0.0.0.0", absl::StrCat("--port=", port_)};
+    command.insert(command.end(), flags.begin(), flags.end());
+    server_process_ = subprocess::RunBuilder(command).popen();
     ABSL_ASSERT(WaitUntilServerIsReady());
   }
-  void TearDown() override { server_process_.kill(); }
+  void Stop() { server_process_.kill(); }
   std::string Address() const { return address_; }
   int Port() const { return port_; }
 
+  // Finds an unused local TCP port.
+  static absl::StatusOr<int> FindUnusedPort() {
+    auto fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    absl::Cleanup fd_closer = [&fd] { close(fd); };
+    sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0;  // port 0 will automatically find a free port.
+    addr.sin_addr.s_addr = 0;
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(sockaddr_in)) == -1) {
+      return false;
+    }
+    if (listen(fd, 1) == -1) {
+      return false;
+    }
+    // getsockname will reserve a free port for the address.
+    socklen_t addrlen = sizeof(addr);
+    getsockname(fd, (struct sockaddr*)&addr, &addrlen);
+    return ntohs(addr.sin_port);
+  }
+
  private:
   // Waits until server under test is ready to accept connections.
   // Returns true if the server is accepting connections.
@@ -88,32 +116,50 @@ class TrustedServer : public ::testing::Environment {
 
     return result;
   }
-  // Finds an unused local TCP port.
-  absl::StatusOr<int> FindUnusedPort() {
-    auto fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    absl::Cleanup fd_closer = [&fd] { close(fd); };
-    sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = 0;  // port 0 will automatically find a free port.
-    addr.sin_addr.s_addr = 0;
-    if (bind(fd, (struct sockaddr*)&addr, sizeof(sockaddr_in)) == -1) {
-      return false;
-    }
-    if (listen(fd, 1) == -1) {
-      return false;
-    }
-    // getsockname will reserve a free port for the address.
-    socklen_t addrlen = sizeof(addr);
-    getsockname(fd, (struct sockaddr*)&addr, &addrlen);
-    port_ = ntohs(addr.sin_port);
-    return port_;
-  }
 
   short unsigned int port_;
   std::string address_;
   subprocess::Popen server_process_;
 };
 
+class TrustedServer : public ::testing::Environment, public ServerProcess {
+ public:
+  void SetUp() override { Start({"--mock_spanner=true", "--grpc_port=0"}); }
+  void TearDown() override { Stop(); }
+};
+
+// Servers holding one shard of the mock creatives each, and a server
+// routing lookups to them.
+class ShardedCluster : public ::testing::Environment {
+ public:
+  static constexpr int kNumShards = 2;
+
+  void SetUp() override {
+    std::vector<std::string> shard_addresses;
+    for (int i = 0; i < kNumShards; ++i) {
+      int grpc_port = ServerProcess::FindUnusedPort().value();
+      shards_[i].Start({"--mock_spanner=true",
+                        absl::StrCat("--num_shards=", kNumShards),
+                        absl::StrCat("--shard_index=", i),
+                        absl::StrCat("--grpc_port=", grpc_port)});
+      shard_addresses.push_back(absl::StrCat("127.0.0.1:", grpc_port));
+    }
+    router_.Start(
+        {absl::StrCat("--router_shards=", absl::StrJoin(shard_addresses, ",")),
+         "--router_timeout_ms=5000"});
+  }
+  void TearDown() override {
+    router_.Stop();
+    for (ServerProcess& shard : shards_) shard.Stop();
+  }
+  const ServerProcess& router() const { return router_; }
+  const ServerProcess& shard(int index) const { return shards_[index]; }
+
+ private:
+  ServerProcess shards_[kNumShards];
+  ServerProcess router_;
+};
+
 // Creates a single environment per T and register as a GlobalTestEnvironment.
 template <typename T>
 T* GetEnv() {
@@ -126,9 +172,15 @@ T* GetEnv() {
 }
 
 TrustedServer* const trusted_server_env = GetEnv<TrustedServer>();
+ShardedCluster* const sharded_cluster_env = GetEnv<ShardedCluster>();
 class ServerTest : public ::testing::Test {
  protected:
   http::response<http::string_body> SendRequest(std::string target) {
+    return SendRequest(*GetEnv<TrustedServer>(), std::move(target));
+  }
+
+  http::response<http::string_body> SendRequest(const ServerProcess& server,
+                                                std::string target) {
     // The io_context is required for all I/O
     asio::io_context ioc;
 
@@ -138,8 +190,7 @@ class ServerTest : public ::testing::Test {
 
     // Look up the domain name
     auto const results =
-        resolver.resolve(GetEnv<TrustedServer>()->Address(),
-                         absl::StrCat(GetEnv<TrustedServer>()->Port()));
+        resolver.resolve(server.Address(), absl::StrCat(server.Port()));
 
     // Make the connection on the IP address we get from a lookup
     stream.connect(results);
@@ -147,7 +198,7 @@ class ServerTest : public ::testing::Test {
     // Set up an HTTP GET request message
     http::request<http::string_body> req{http::verb::get, target,
                                          /*version=*/11};
-    req.set(http::field::host, GetEnv<TrustedServer>()->Address());
+    req.set(http::field::host, server.Address());
     req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
 
     http::write(stream, req);
@@ -164,6 +215,42 @@ class ServerTest : public ::testing::Test {
     stream.socket().shutdown(tcp::socket::shutdown_both, ec);
     return res;
   }
+
+  // Sends every target on a single connection and returns the responses
+  // in order. When pipelined, all requests are written before any
+  // response is read.
+  std::vector<http::response<http::string_body>> SendRequestsOnConnection(
+      const std::vector<std::string>& targets, bool pipelined) {
+    asio::io_context ioc;
+    tcp::resolver resolver(ioc);
+    boost::beast::tcp_stream stream(ioc);
+    stream.connect(
+        resolver.resolve(GetEnv<TrustedServer>()->Address(),
+                         absl::StrCat(GetEnv<TrustedServer>()->Port())));
+
+    boost::beast::flat_buffer buffer;
+    std::vector<http::response<http::string_body>> responses;
+    auto read_response = [&] {
+      http::response<http::string_body> res;
+      http::read(stream, buffer, res);
+      responses.push_back(std::move(res));
+    };
+    for (const auto& target : targets) {
+      http::request<http::string_body> req{http::verb::get, target,
+                                           /*version=*/11};
+      req.set(http::field::host, GetEnv<TrustedServer>()->Address());
+      req.keep_alive(true);
+      http::write(stream, req);
+      if (!pipelined) read_response();
+    }
+    if (pipelined) {
+      for (size_t i = 0; i < targets.size(); ++i) read_response();
+    }
+
+    boost::beast::error_code ec;
+    stream.socket().shutdown(tcp::socket::shutdown_both, ec);
+    return responses;
+  }
 };
 
 TEST_F(ServerTest, BasicTest) {
@@ -226,3 +313,68 @@ TEST_F(ServerTest, NoKeyValues) {
       SendRequest("?keys=&randparam=123");
   EXPECT_EQ(response.result_int(), 400);
 }
+
+TEST_F(ServerTest, KeepAlive) {
+  std::vector<http::response<http::string_body>> responses =
+      SendRequestsOnConnection({"?keys=google.com/ad1", "?keys=google.com/ad2"},
+                               /*pipelined=*/false);
+  ASSERT_EQ(responses.size(), 2);
+  for (const auto& response : responses) {
+    EXPECT_EQ(response.result_int(), 200);
+    EXPECT_TRUE(response.keep_alive());
+  }
+  EXPECT_THAT(responses[0].body(), ::testing::HasSubstr("google.com/ad1"));
+  EXPECT_THAT(responses[1].body(), ::testing::HasSubstr("google.com/ad2"));
+}
+
+TEST_F(ServerTest, PipelinedRequests) {
+  std::vector<http::response<http::string_body>> responses =
+      SendRequestsOnConnection(
+          {"?keys=google.com/ad1", "?randparam=1", "?keys=google.com/ad2"},
+          /*pipelined=*/true);
+  ASSERT_EQ(responses.size(), 3);
+  EXPECT_EQ(responses[0].result_int(), 200);
+  EXPECT_THAT(responses[0].body(), ::testing::HasSubstr("google.com/ad1"));
+  EXPECT_EQ(responses[1].result_int(), 400);
+  EXPECT_EQ(responses[2].result_int(), 200);
+  EXPECT_THAT(responses[2].body(), ::testing::HasSubstr("google.com/ad2"));
+}
+
+TEST_F(ServerTest, ShardedCluster) {
+  const ShardedCluster& cluster = *GetEnv<ShardedCluster>();
+  const std::string target =
+      "?keys=google.com/ad2,google.com/nonexistentad,google.com/ad1";
+  trusted_server::CreativeMetadata c1;
+  c1.set_is_servible(false);
+  trusted_server::CreativeMetadata c2;
+  c2.set_is_servible(true);
+
+  // The router answers as a single server holding all creatives does.
+  http::response<http::string_body> response =
+      SendRequest(cluster.router(), target);
+  EXPECT_EQ(response.result_int(), 200);
+  EXPECT_EQ(response.body(), SendRequest(target).body());
+  EXPECT_EQ(
+      response.body(),
+      absl::StrCat("{\"creatives\":[",
+                   absl::StrFormat(kCreaiveJson, "google.com/ad2",
+                                   absl::Base64Escape(c2.SerializeAsString())),
+                   ",{\"key\":\"google.com/nonexistentad\"},",
+                   absl::StrFormat(kCreaiveJson, "google.com/ad1",
+                                   absl::Base64Escape(c1.SerializeAsString())),
+                   "]}"));
+
+  // Each creative is held by exactly one of the shards.
+  int found = 0;
+  for (int i = 0; i < ShardedCluster::kNumShards; ++i) {
+    trusted_server::Response shard_response;
+    ASSERT_TRUE(google::protobuf::util::JsonStringToMessage(
+                    SendRequest(cluster.shard(i), target).body(),
+                    &shard_response)
+                    .ok());
+    for (const auto& creative : shard_response.creatives()) {
+      found += creative.has_creative_data();
+    }
+  }
+  EXPECT_EQ(found, 2);
+}
@@ -0,0 +1,264 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/shard_router.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "data/hash_ring.h"
+#include "glog/logging.h"
+#include "grpcpp/grpcpp.h"
+#include "metrics/metrics.h"
+#include "proto/key_value_service.grpc.pb.h"
+#include "proto/key_value_service.pb.h"
+#include "proto/response.pb.h"
+
+namespace trusted_server {
+
+namespace {
+
+struct RouterMetrics {
+  Histogram* call_seconds;
+  Counter* call_failures;
+  Histogram* shards_per_lookup;
+};
+
+const RouterMetrics& Metrics() {
+  static const auto* metrics = [] {
+    MetricsRegistry& registry = MetricsRegistry::Global();
+    return new RouterMetrics{
+        registry.AddHistogram(
+            "trusted_server_shard_call_seconds",
+            "Time taken by the BatchLookup calls of routed lookups.", "",
+            LatencyBuckets()),
+        registry.AddCounter("trusted_server_shard_call_failures_total",
+                            "BatchLookup calls of routed lookups that "
+                            "failed or timed out."),
+        registry.AddHistogram("trusted_server_shards_per_lookup",
+                              "Number of shards a routed lookup calls.", "",
+                              {1, 2, 4, 8, 16, 32, 64}),
+    };
+  }();
+  return *metrics;
+}
+
+absl::StatusCode ToStatusCode(grpc::StatusCode code) {
+  // The codes are the same numbers in both.
+  return static_cast<absl::StatusCode>(code);
+}
+
+std::shared_ptr<grpc::Channel> Connect(const std::string& address) {
+  grpc::ChannelArguments args;
+  // Without a subchannel pool of its own, every channel to an address
+  // would share a single connection.
+  args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+  // Keep connections open however long the router goes without calls.
+  args.SetInt(GRPC_ARG_CLIENT_IDLE_TIMEOUT_MS,
+              std::numeric_limits<int>::max());
+  std::shared_ptr<grpc::Channel> channel = grpc::CreateCustomChannel(
+      address, grpc::InsecureChannelCredentials(), args);
+  // Connect up front rather than on the first call.
+  channel->GetState(/*try_to_connect=*/true);
+  return channel;
+}
+
+std::vector<std::vector<std::shared_ptr<grpc::Channel>>> ConnectAll(
+    const ShardRouter::Options& options) {
+  std::vector<std::vector<std::shared_ptr<grpc::Channel>>> channels;
+  for (const std::string& address : options.shards) {
+    channels.emplace_back();
+    for (int i = 0; i < std::max(options.connections_per_shard, 1); ++i) {
+      channels.back().push_back(Connect(address));
+    }
+  }
+  return channels;
+}
+
+}  // namespace
+
+ShardRouter::ShardRouter(const Options& options)
+    : ShardRouter(ConnectAll(options), options.timeout) {
+  LOG(INFO) << "Routing lookups to " << options.shards.size() << " shards";
+}
+
+ShardRouter::ShardRouter(
+    std::vector<std::vector<std::shared_ptr<grpc::Channel>>> channels,
+    absl::Duration timeout)
+    : ring_(std::max<int>(channels.size(), 1)),
+      timeout_(timeout),
+      shards_(channels.size()) {
+  CHECK(!channels.empty()) << "No shards to route lookups to";
+  for (size_t shard = 0; shard < channels.size(); ++shard) {
+    CHECK(!channels[shard].empty()) << "No channel to shard " << shard;
+    for (std::shared_ptr<grpc::Channel>& channel : channels[shard]) {
+      shards_[shard].stubs.push_back(
+          KeyValueService::NewStub(std::move(channel)));
+    }
+  }
+  poller_ = std::thread(&ShardRouter::Poll, this);
+}
+
+struct ShardRouter::PendingLookup {
+  struct Call {
+    PendingLookup* lookup;
+    BatchLookupRequest request;
+    // Index in the keys of the lookup of each key of the request.
+    std::vector<size_t> positions;
+    grpc::ClientContext context;
+    std::unique_ptr<grpc::ClientAsyncResponseReader<Response>> reader;
+    Response response;
+    grpc::Status status;
+  };
+
+  PendingLookup(size_t num_shards, size_t num_keys, Done done)
+      : calls(num_shards), num_keys(num_keys), done(std::move(done)) {}
+
+  // Drops a reference to the lookup. The last one, once every call has
+  // completed and LookupAsync() has returned, merges the responses and
+  // hands them to `done`.
+  void Release() {
+    if (references.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+    std::unique_ptr<PendingLookup> owned(this);
+    Done callback = std::move(done);
+    absl::StatusOr<Response> result = Merge();
+    owned.reset();
+    callback(std::move(result));
+  }
+
+  absl::StatusOr<Response> Merge() {
+    const RouterMetrics& metrics = Metrics();
+    absl::Status status;
+    for (size_t shard = 0; shard < calls.size(); ++shard) {
+      const Call& call = calls[shard];
+      if (call.positions.empty()) continue;
+      if (!call.status.ok()) {
+        status.Update(absl::Status(
+            ToStatusCode(call.status.error_code()),
+            absl::StrCat("Lookup from shard ", shard,
+                         " failed: ", call.status.error_message())));
+      } else if (call.response.creatives_size() != call.positions.size()) {
+        status.Update(absl::InternalError(
+            absl::StrCat("Shard ", shard, " returned ",
+                         call.response.creatives_size(), " creatives for ",
+                         call.positions.size(), " keys")));
+      } else {
+        continue;
+      }
+      metrics.call_failures->Increment();
+    }
+    if (!status.ok()) return status;
+
+    Response merged;
+    merged.mutable_creatives()->Reserve(num_keys);
+    for (size_t i = 0; i < num_keys; ++i) merged.add_creatives();
+    for (Call& call : calls) {
+      for (size_t i = 0; i < call.positions.size(); ++i) {
+        merged.mutable_creatives(call.positions[i])
+            ->Swap(call.response.mutable_creatives(i));
+      }
+    }
+    return merged;
+  }
+
+  // Indexed by shard; shards that own none of the keys are not called.
+  std::vector<Call> calls;
+  const size_t num_keys;
+  Done done;
+  absl::Time start;
+  // One per call in flight, plus one held by LookupAsync() while it
+  // starts them.
+  std::atomic<int> references{1};
+};
+
+ShardRouter::~ShardRouter() {
+  queue_.Shutdown();
+  poller_.join();
+}
+
+void ShardRouter::LookupAsync(absl::Span<const absl::string_view> keys,
+                              Done done) const {
+  const RouterMetrics& metrics = Metrics();
+  auto* lookup =
+      new PendingLookup(shards_.size(), keys.size(), std::move(done));
+  for (size_t i = 0; i < keys.size(); ++i) {
+    PendingLookup::Call& call = lookup->calls[ring_.ShardOf(keys[i])];
+    call.request.add_keys(std::string(keys[i]));
+    call.positions.push_back(i);
+  }
+
+  lookup->start = absl::Now();
+  const auto deadline =
+      std::chrono::system_clock::now() + absl::ToChronoMilliseconds(timeout_);
+  int calls = 0;
+  for (size_t shard = 0; shard < lookup->calls.size(); ++shard) {
+    PendingLookup::Call& call = lookup->calls[shard];
+    if (call.positions.empty()) continue;
+    const Shard& target = shards_[shard];
+    const size_t turn =
+        target.next_stub.fetch_add(1, std::memory_order_relaxed);
+    KeyValueService::Stub& stub = *target.stubs[turn % target.stubs.size()];
+    call.lookup = lookup;
+    call.context.set_deadline(deadline);
+    call.reader = stub.PrepareAsyncBatchLookup(&call.context, call.request,
+                                               &queue_);
+    lookup->references.fetch_add(1, std::memory_order_relaxed);
+    call.reader->StartCall();
+    call.reader->Finish(&call.response, &call.status, &call);
+    ++calls;
+  }
+  metrics.shards_per_lookup->Record(calls);
+  lookup->Release();
+}
+
+absl::StatusOr<Response> ShardRouter::Lookup(
+    absl::Span<const absl::string_view> keys) const {
+  absl::Notification done;
+  absl::StatusOr<Response> result;
+  LookupAsync(keys, [&](absl::StatusOr<Response> response) {
+    result = std::move(response);
+    done.Notify();
+  });
+  done.WaitForNotification();
+  return result;
+}
+
+void ShardRouter::Poll() {
+  const RouterMetrics& metrics = Metrics();
+  void* tag;
+  bool ok;
+  while (queue_.Next(&tag, &ok)) {
+    auto* call = static_cast<PendingLookup::Call*>(tag);
+    metrics.call_seconds->RecordSince(call->lookup->start);
+    call->lookup->Release();
+  }
+}
+
+}  // namespace trusted_server
@@ -0,0 +1,116 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SHARD_ROUTER_H_
+#define SHARD_ROUTER_H_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "data/hash_ring.h"
+#include "grpcpp/grpcpp.h"
+#include "proto/key_value_service.grpc.pb.h"
+#include "proto/response.pb.h"
+
+namespace trusted_server {
+
+// ShardRouter looks keys up in a cluster of servers that each hold one
+// shard of the creatives, as split by a HashRing with as many shards as
+// there are servers. The keys of a lookup are grouped by the shard
+// owning them, each group is looked up with a BatchLookup call to its
+// server, all calls in parallel, and the creatives they return are put
+// back in the order of the keys.
+//
+// Each server is called over a fixed pool of gRPC channels, each its
+// own HTTP/2 connection kept alive between calls, which calls take in
+// turn. The calls of every lookup complete on a thread of the router's
+// own, which merges their creatives and hands the result to a callback,
+// so serving threads never wait for shards.
+//
+// ShardRouter is thread-safe.
+class ShardRouter {
+ public:
+  struct Options {
+    // gRPC addresses of the servers, in the order of their shards.
+    std::vector<std::string> shards;
+    // Connections kept open to each server.
+    int connections_per_shard = 4;
+    // Time a lookup may take, for all of its calls.
+    absl::Duration timeout = absl::Milliseconds(100);
+  };
+
+  // Connects to the servers of `options`.
+  explicit ShardRouter(const Options& options);
+
+  // Calls each shard over the channels in `channels`, which are indexed
+  // by shard, e.g. in-process channels in tests.
+  ShardRouter(
+      std::vector<std::vector<std::shared_ptr<grpc::Channel>>> channels,
+      absl::Duration timeout);
+
+  // Waits for the lookups in flight to complete.
+  ~ShardRouter();
+
+  ShardRouter(const ShardRouter&) = delete;
+  ShardRouter& operator=(const ShardRouter&) = delete;
+
+  // Called with the result of a lookup.
+  using Done = std::function<void(absl::StatusOr<Response>)>;
+
+  // Starts looking up `keys`, which need not outlive the call, and
+  // returns right away. `done` is called with a creative for each of
+  // the keys, in the same order, with creative_data unset for keys that
+  // have no data, or with the status of the first call that failed, if
+  // any did. It is called on the router's thread, or on the calling one
+  // if every call completes before LookupAsync() returns, so it should
+  // hand the result off rather than block, and must not destroy the
+  // router.
+  void LookupAsync(absl::Span<const absl::string_view> keys,
+                   Done done) const;
+
+  // Like LookupAsync(), but waits for the result on the calling thread.
+  absl::StatusOr<Response> Lookup(
+      absl::Span<const absl::string_view> keys) const;
+
+  const HashRing& ring() const { return ring_; }
+
+ private:
+  struct Shard {
+    std::vector<std::unique_ptr<KeyValueService::Stub>> stubs;
+    // Index of the stub the next call takes, modulo their number.
+    mutable std::atomic<size_t> next_stub{0};
+  };
+  struct PendingLookup;
+
+  // Completes the calls of lookups until the queue is shut down.
+  void Poll();
+
+  const HashRing ring_;
+  const absl::Duration timeout_;
+  std::vector<Shard> shards_;
+  // Every call is started on this queue, which the poller reaps.
+  mutable grpc::CompletionQueue queue_;
+  std::thread poller_;
+};
+
+}  // namespace trusted_server
+#endif  // SHARD_ROUTER_H_
@@ -0,0 +1,152 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/shard_router.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/flags/declare.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/reflection.h"
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "absl/time/time.h"
+#include "data/mock_creative_map.h"
+#include "data/synthetic_dataset.h"
+#include "grpcpp/grpcpp.h"
+#include "gtest/gtest.h"
+#include "proto/response.pb.h"
+#include "server/key_value_service.h"
+
+ABSL_DECLARE_FLAG(int, num_shards);
+ABSL_DECLARE_FLAG(int, shard_index);
+
+namespace trusted_server {
+
+namespace {
+
+constexpr int kNumShards = 3;
+
+// Serves each shard of a synthetic dataset from its own gRPC server, as
+// a cluster of servers with --num_shards and --shard_index would.
+class ShardRouterTest : public testing::Test {
+ protected:
+  ShardRouterTest() : dataset_(DatasetOptions()) {
+    absl::FlagSaver flag_saver;
+    absl::SetFlag(&FLAGS_num_shards, kNumShards);
+    for (int shard = 0; shard < kNumShards; ++shard) {
+      absl::SetFlag(&FLAGS_shard_index, shard);
+      services_.push_back(std::make_unique<KeyValueServiceImpl>(
+          MockCreativeMap::CreateSyntheticMap(DatasetOptions())));
+      grpc::ServerBuilder builder;
+      builder.RegisterService(services_.back().get());
+      servers_.push_back(builder.BuildAndStart());
+      channels_.push_back(
+          {servers_.back()->InProcessChannel(grpc::ChannelArguments()),
+           servers_.back()->InProcessChannel(grpc::ChannelArguments())});
+    }
+    router_ = std::make_unique<ShardRouter>(channels_, absl::Seconds(10));
+  }
+
+  ~ShardRouterTest() override {
+    for (auto& server : servers_) server->Shutdown();
+  }
+
+  static SyntheticDataset::Options DatasetOptions() {
+    SyntheticDataset::Options options;
+    options.num_keys = 300;
+    return options;
+  }
+
+  SyntheticDataset dataset_;
+  std::vector<std::unique_ptr<KeyValueServiceImpl>> services_;
+  std::vector<std::unique_ptr<grpc::Server>> servers_;
+  std::vector<std::vector<std::shared_ptr<grpc::Channel>>> channels_;
+  std::unique_ptr<ShardRouter> router_;
+};
+
+TEST_F(ShardRouterTest, MergesLookupsInKeyOrder) {
+  std::vector<std::string> keys;
+  for (size_t i = 0; i < 100; ++i) keys.push_back(dataset_.Key(i * 3));
+  keys.push_back("google.com/missing");
+  keys.push_back(dataset_.Key(7));
+  std::vector<absl::string_view> views(keys.begin(), keys.end());
+
+  absl::StatusOr<Response> response = router_->Lookup(views);
+  ASSERT_TRUE(response.ok()) << response.status();
+  ASSERT_EQ(response->creatives_size(), keys.size());
+  for (size_t i = 0; i < 100; ++i) {
+    EXPECT_EQ(response->creatives(i).key(), keys[i]);
+    EXPECT_EQ(response->creatives(i).creative_data(),
+              dataset_.Value(i * 3, 0));
+  }
+  EXPECT_EQ(response->creatives(100).key(), "google.com/missing");
+  EXPECT_FALSE(response->creatives(100).has_creative_data());
+  EXPECT_EQ(response->creatives(101).creative_data(), dataset_.Value(7, 0));
+
+  response = router_->Lookup({});
+  ASSERT_TRUE(response.ok()) << response.status();
+  EXPECT_EQ(response->creatives_size(), 0);
+}
+
+TEST_F(ShardRouterTest, FailsIfShardFails) {
+  // Nothing listens on port 1, so calls to shard 1 fail right away.
+  channels_[1] = {grpc::CreateChannel("127.0.0.1:1",
+                                      grpc::InsecureChannelCredentials())};
+  router_ = std::make_unique<ShardRouter>(channels_, absl::Seconds(10));
+  std::string down;
+  std::string up;
+  for (size_t i = 0; down.empty() || up.empty(); ++i) {
+    std::string key = dataset_.Key(i);
+    (router_->ring().ShardOf(key) == 1 ? down : up) = key;
+  }
+  const absl::string_view both[] = {up, down};
+  EXPECT_EQ(router_->Lookup(both).status().code(),
+            absl::StatusCode::kUnavailable);
+  const absl::string_view only_up[] = {up};
+  absl::StatusOr<Response> response = router_->Lookup(only_up);
+  ASSERT_TRUE(response.ok()) << response.status();
+  EXPECT_TRUE(response->creatives(0).has_creative_data());
+}
+
+TEST_F(ShardRouterTest, KeepsLookupsInFlightTogether) {
+  constexpr int kLookups = 50;
+  std::vector<absl::StatusOr<Response>> results(kLookups);
+  absl::BlockingCounter pending(kLookups);
+  for (int i = 0; i < kLookups; ++i) {
+    // The keys only need to live until LookupAsync() returns.
+    std::vector<std::string> keys = {dataset_.Key(i), dataset_.Key(i + 100)};
+    std::vector<absl::string_view> views(keys.begin(), keys.end());
+    router_->LookupAsync(views, [&, i](absl::StatusOr<Response> response) {
+      results[i] = std::move(response);
+      pending.DecrementCount();
+    });
+  }
+  pending.Wait();
+  for (int i = 0; i < kLookups; ++i) {
+    ASSERT_TRUE(results[i].ok()) << results[i].status();
+    ASSERT_EQ(results[i]->creatives_size(), 2);
+    EXPECT_EQ(results[i]->creatives(0).creative_data(), dataset_.Value(i, 0));
+    EXPECT_EQ(results[i]->creatives(1).creative_data(),
+              dataset_.Value(i + 100, 0));
+  }
+}
+
+}  // namespace
+
+}  // namespace trusted_server
@@ -0,0 +1,731 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/uring_server.h"
+
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/flags/declare.h"
+#include "absl/flags/flag.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "boost/asio/buffer.hpp"
+#include "boost/beast/core.hpp"
+#include "boost/beast/http.hpp"
+#include "boost/optional.hpp"
+#include "glog/logging.h"
+#include "metrics/metrics.h"
+#include "proto/response.pb.h"
+#include "server/flight_recorder.h"
+#include "server/http_session.h"
+#include "server/request_arena.h"
+#include "server/request_handler.h"
+#include "server/response_body.h"
+
+// Defined in server/http_session.cc; both backends honor them.
+ABSL_DECLARE_FLAG(int, read_timeout_sec);
+ABSL_DECLARE_FLAG(int, idle_timeout_sec);
+ABSL_DECLARE_FLAG(int, write_timeout_sec);
+ABSL_DECLARE_FLAG(int, max_requests_per_connection);
+
+namespace trusted_server {
+
+namespace {
+
+namespace http = ::boost::beast::http;
+
+constexpr unsigned kRingEntries = 4096;
+// Read buffers provided to the kernel. A buffer is handed back as soon
+// as its data is copied out, so this bounds reads completing at once,
+// not connections.
+constexpr unsigned kNumBuffers = 1024;
+constexpr size_t kBufferSize = 4096;
+constexpr uint16_t kBufferGroup = 0;
+// Buffers gathered into a single sendmsg.
+constexpr int kMaxIovecs = 256;
+// How long a connection over --max_connections gets to send the request
+// its 503 answers.
+constexpr absl::Duration kShedReadTimeout = absl::Seconds(1);
+// How long to wait before accepting again after a failed accept.
+constexpr absl::Duration kAcceptRetryDelay = absl::Milliseconds(50);
+
+struct UringMetrics {
+  Counter* enters;
+};
+
+const UringMetrics& Metrics() {
+  static const auto* metrics = [] {
+    return new UringMetrics{MetricsRegistry::Global().AddCounter(
+        "trusted_server_uring_enter_total",
+        "io_uring_enter() calls made by the io_uring backend, which are "
+        "all the syscalls it makes while serving.")};
+  }();
+  return *metrics;
+}
+
+int IoUringSetup(unsigned entries, io_uring_params* params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int IoUringEnter(int fd, unsigned to_submit, unsigned min_complete,
+                 unsigned flags) {
+  Metrics().enters->Increment();
+  return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+                                  min_complete, flags, nullptr, 0));
+}
+
+int IoUringRegister(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+absl::Status ErrnoStatus(absl::string_view what) {
+  return absl::Status(absl::StatusCode::kUnavailable,
+                      absl::StrCat(what, ": ", strerror(errno)));
+}
+
+template <class T>
+std::atomic<T>* AtomicAt(void* base, size_t offset) {
+  return reinterpret_cast<std::atomic<T>*>(static_cast<char*>(base) +
+                                           offset);
+}
+
+__kernel_timespec ToKernelTimespec(absl::Duration duration) {
+  timespec ts = absl::ToTimespec(std::max(duration, absl::ZeroDuration()));
+  __kernel_timespec kernel_ts;
+  kernel_ts.tv_sec = ts.tv_sec;
+  kernel_ts.tv_nsec = ts.tv_nsec;
+  return kernel_ts;
+}
+
+}  // namespace
+
+struct UringServer::Connection {
+  explicit Connection(int fd)
+      : fd(fd),
+        response(std::piecewise_construct, std::make_tuple(),
+                 std::make_tuple(ArenaAllocator<char>(&arena))) {}
+
+  int fd;
+  bool admitted = false;
+  // Whether the request being answered counts against the in-flight
+  // limit.
+  bool request_admitted = false;
+  // Set once the close of fd is queued; nothing else is queued after.
+  bool closing = false;
+  int requests_served = 0;
+  const absl::Time accepted = absl::Now();
+  // When the request being read must be complete.
+  absl::Time read_deadline;
+  // Bytes received but not parsed yet, including pipelined requests.
+  std::string input;
+  // Backs the headers of parser and response, rewound per request.
+  RequestArena arena;
+  boost::optional<http::request_parser<http::string_body, ArenaAllocator<char>>>
+      parser;
+  http::response<GatherBody, ArenaFields> response;
+  boost::optional<http::response_serializer<GatherBody, ArenaFields>>
+      serializer;
+  // The kernel reads these when the queued entries are submitted.
+  __kernel_timespec timeout;
+  msghdr message;
+  iovec iovecs[kMaxIovecs];
+  // Bytes in the sendmsg in flight, and of the response sent so far.
+  size_t sending = 0;
+  size_t sent = 0;
+  RequestTrace trace;
+};
+
+struct UringServer::RoutedLookups {
+  // Queues the result of the routed lookup of `connection` for the loop,
+  // waking it up unless results are already queued. Called on the
+  // router's thread.
+  void Post(Connection* connection, absl::StatusOr<Response> result) {
+    absl::MutexLock lock(&mutex);
+    if (wake_fd < 0) return;
+    done.emplace_back(connection, std::move(result));
+    if (done.size() > 1) return;
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+      LOG(ERROR) << "Failed to wake io_uring loop: " << strerror(errno);
+    }
+  }
+
+  absl::Mutex mutex;
+  // The server's eventfd, or -1 once the server is destroyed.
+  int wake_fd ABSL_GUARDED_BY(mutex) = -1;
+  std::vector<std::pair<Connection*, absl::StatusOr<Response>>> done
+      ABSL_GUARDED_BY(mutex);
+};
+
+absl::StatusOr<std::unique_ptr<UringServer>> UringServer::Create(
+    boost::asio::ip::tcp::endpoint endpoint,
+    std::shared_ptr<CreativeMap> creative_map,
+    std::shared_ptr<ResponseCache> cache,
+    std::shared_ptr<const ShardRouter> router,
+    std::shared_ptr<AdmissionController> admission) {
+  std::unique_ptr<UringServer> server(
+      new UringServer(std::move(creative_map), std::move(cache),
+                      std::move(router), std::move(admission)));
+  absl::Status status = server->Init(endpoint);
+  if (!status.ok()) return status;
+  return server;
+}
+
+UringServer::UringServer(std::shared_ptr<CreativeMap> creative_map,
+                         std::shared_ptr<ResponseCache> cache,
+                         std::shared_ptr<const ShardRouter> router,
+                         std::shared_ptr<AdmissionController> admission)
+    : creative_map_(std::move(creative_map)),
+      cache_(std::move(cache)),
+      router_(std::move(router)),
+      admission_(std::move(admission)),
+      routed_(std::make_shared<RoutedLookups>()) {
+  Metrics();
+}
+
+UringServer::~UringServer() {
+  {
+    // Routed lookups still in flight complete into the void.
+    absl::MutexLock lock(&routed_->mutex);
+    routed_->wake_fd = -1;
+  }
+  // Closing the ring cancels whatever is still in flight.
+  if (ring_fd_ >= 0) close(ring_fd_);
+  if (sq_ring_ != nullptr) munmap(sq_ring_, sq_ring_size_);
+  if (cq_ring_ != nullptr) munmap(cq_ring_, cq_ring_size_);
+  if (sqes_ != nullptr) munmap(sqes_, sqes_size_);
+  if (buf_ring_ != nullptr) munmap(buf_ring_, buf_ring_size_);
+  if (listen_fd_ >= 0) close(listen_fd_);
+  if (wake_fd_ >= 0) close(wake_fd_);
+  for (auto& entry : connections_) {
+    Connection* connection = entry.first;
+    if (!connection->closing) close(connection->fd);
+    if (connection->request_admitted) admission_->ReleaseRequest();
+    if (connection->admitted) admission_->ReleaseConnection();
+  }
+}
+
+absl::Status UringServer::Init(boost::asio::ip::tcp::endpoint endpoint) {
+  io_uring_params params = {};
+  // The ring starts disabled so that Run() enables it, which binds it to
+  // the thread that runs it as its single issuer.
+  params.flags = IORING_SETUP_R_DISABLED | IORING_SETUP_SINGLE_ISSUER |
+                 IORING_SETUP_DEFER_TASKRUN;
+  ring_fd_ = IoUringSetup(kRingEntries, &params);
+  if (ring_fd_ < 0 && errno == EINVAL) {
+    // Kernels before 6.1 lack the single issuer optimizations.
+    params = {};
+    params.flags = IORING_SETUP_R_DISABLED;
+    ring_fd_ = IoUringSetup(kRingEntries, &params);
+  }
+  if (ring_fd_ < 0) return ErrnoStatus("io_uring_setup failed");
+  if (!(params.features & IORING_FEAT_NODROP)) {
+    return absl::Status(absl::StatusCode::kUnavailable,
+                        "io_uring lacks IORING_FEAT_NODROP");
+  }
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    sq_ring_ = nullptr;
+    return ErrnoStatus("Failed to map the submission queue");
+  }
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+  if (cq_ring_ == MAP_FAILED) {
+    cq_ring_ = nullptr;
+    return ErrnoStatus("Failed to map the completion queue");
+  }
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return ErrnoStatus("Failed to map the submission queue entries");
+  }
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  sq_head_ = AtomicAt<unsigned>(sq_ring_, params.sq_off.head);
+  sq_tail_ = AtomicAt<unsigned>(sq_ring_, params.sq_off.tail);
+  sq_mask_ = *AtomicAt<unsigned>(sq_ring_, params.sq_off.ring_mask);
+  sq_entries_ = params.sq_entries;
+  // Entries are used in ring order, so the indirection array is the
+  // identity.
+  unsigned* array = reinterpret_cast<unsigned*>(
+      static_cast<char*>(sq_ring_) + params.sq_off.array);
+  for (unsigned i = 0; i < sq_entries_; ++i) array[i] = i;
+  cq_head_ = AtomicAt<unsigned>(cq_ring_, params.cq_off.head);
+  cq_tail_ = AtomicAt<unsigned>(cq_ring_, params.cq_off.tail);
+  cq_mask_ = *AtomicAt<unsigned>(cq_ring_, params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(static_cast<char*>(cq_ring_) +
+                                          params.cq_off.cqes);
+
+  buf_ring_size_ = kNumBuffers * sizeof(io_uring_buf);
+  void* buf_ring = mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf_ring == MAP_FAILED) {
+    return ErrnoStatus("Failed to map the buffer ring");
+  }
+  buf_ring_ = static_cast<io_uring_buf_ring*>(buf_ring);
+  io_uring_buf_reg reg = {};
+  reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring_);
+  reg.ring_entries = kNumBuffers;
+  reg.bgid = kBufferGroup;
+  if (IoUringRegister(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    return ErrnoStatus("Failed to register the buffer ring");
+  }
+  buffers_.resize(kNumBuffers * kBufferSize);
+  for (unsigned id = 0; id < kNumBuffers; ++id) ReturnBuffer(id);
+
+  wake_fd_ = eventfd(0, EFD_CLOEXEC);
+  if (wake_fd_ < 0) return ErrnoStatus("Failed to create eventfd");
+  {
+    absl::MutexLock lock(&routed_->mutex);
+    routed_->wake_fd = wake_fd_;
+  }
+
+  listen_fd_ = socket(endpoint.protocol().family(),
+                      SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+  if (listen_fd_ < 0) return ErrnoStatus("Failed to create socket");
+  int one = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+  if (bind(listen_fd_, endpoint.data(), endpoint.size()) != 0) {
+    return ErrnoStatus(absl::StrCat("Failed to bind ", endpoint.port()));
+  }
+  if (listen(listen_fd_, SOMAXCONN) != 0) {
+    return ErrnoStatus("Failed to listen");
+  }
+  return absl::OkStatus();
+}
+
+uint16_t UringServer::port() const {
+  sockaddr_storage address = {};
+  socklen_t length = sizeof(address);
+  getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&address), &length);
+  return address.ss_family == AF_INET6
+             ? ntohs(reinterpret_cast<sockaddr_in6*>(&address)->sin6_port)
+             : ntohs(reinterpret_cast<sockaddr_in*>(&address)->sin_port);
+}
+
+void UringServer::Run() {
+  if (IoUringRegister(ring_fd_, IORING_REGISTER_ENABLE_RINGS, nullptr, 0) !=
+      0) {
+    LOG(ERROR) << "Failed to enable io_uring: " << strerror(errno);
+    return;
+  }
+  ArmAccept();
+  ArmWake();
+  if (admission_->limits_queue_delay()) ArmProbe();
+  while (!stopping_.load(std::memory_order_relaxed)) {
+    SubmitAndWait();
+    unsigned head = cq_head_->load(std::memory_order_relaxed);
+    unsigned tail = cq_tail_->load(std::memory_order_acquire);
+    for (; head != tail; ++head) {
+      // Copied out, as handling it may queue entries and submit them,
+      // which lets the kernel reuse the slot.
+      io_uring_cqe cqe = cqes_[head & cq_mask_];
+      cq_head_->store(head + 1, std::memory_order_release);
+      auto* connection = reinterpret_cast<Connection*>(cqe.user_data &
+                                                       ~kOpMask);
+      switch (static_cast<Op>(cqe.user_data & kOpMask)) {
+        case kAccept:
+          OnAccept(cqe);
+          break;
+        case kAcceptRetry:
+          ArmAccept();
+          break;
+        case kWake:
+          // Woken up by Stop() or by routed lookups completing.
+          ArmWake();
+          OnRouted();
+          break;
+        case kRecv:
+          OnRecv(connection, cqe);
+          break;
+        case kSend:
+          OnSend(connection, cqe);
+          break;
+        case kClose:
+          if (connection->request_admitted) admission_->ReleaseRequest();
+          if (connection->admitted) admission_->ReleaseConnection();
+          connections_.erase(connection);
+          break;
+        case kTimeout:
+          // The operation it was linked to reports the timeout.
+          break;
+        case kProbe:
+          OnProbe();
+          break;
+      }
+    }
+  }
+}
+
+void UringServer::Stop() {
+  stopping_.store(true, std::memory_order_relaxed);
+  uint64_t one = 1;
+  if (write(wake_fd_, &one, sizeof(one)) < 0) {
+    LOG(ERROR) << "Failed to wake io_uring loop: " << strerror(errno);
+  }
+}
+
+void UringServer::ReserveSqes(unsigned count) {
+  unsigned head = sq_head_->load(std::memory_order_acquire);
+  unsigned tail = sq_tail_->load(std::memory_order_relaxed);
+  if (tail - head + count <= sq_entries_) return;
+  int result;
+  do {
+    result = IoUringEnter(ring_fd_, to_submit_, 0, 0);
+  } while (result < 0 && errno == EINTR);
+  if (result > 0) to_submit_ -= std::min<unsigned>(result, to_submit_);
+}
+
+io_uring_sqe* UringServer::GetSqe() {
+  ReserveSqes(1);
+  unsigned tail = sq_tail_->load(std::memory_order_relaxed);
+  io_uring_sqe* sqe = &sqes_[tail & sq_mask_];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_tail_->store(tail + 1, std::memory_order_release);
+  ++to_submit_;
+  return sqe;
+}
+
+void UringServer::SubmitAndWait() {
+  int result = IoUringEnter(ring_fd_, to_submit_, 1, IORING_ENTER_GETEVENTS);
+  if (result < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+    LOG(ERROR) << "io_uring_enter failed: " << strerror(errno);
+  }
+  if (result > 0) to_submit_ -= std::min<unsigned>(result, to_submit_);
+}
+
+void UringServer::ArmAccept() {
+  io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listen_fd_;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = kAccept;
+}
+
+void UringServer::ArmAcceptRetry() {
+  accept_retry_delay_ = ToKernelTimespec(kAcceptRetryDelay);
+  io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = reinterpret_cast<uint64_t>(&accept_retry_delay_);
+  sqe->len = 1;
+  sqe->user_data = kAcceptRetry;
+}
+
+void UringServer::ArmWake() {
+  io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = wake_fd_;
+  sqe->addr = reinterpret_cast<uint64_t>(&wake_value_);
+  sqe->len = sizeof(wake_value_);
+  sqe->user_data = kWake;
+}
+
+void UringServer::ArmProbe() {
+  probe_interval_ = ToKernelTimespec(EventLoopMonitor::kDefaultInterval);
+  probe_expiry_ = absl::Now() + EventLoopMonitor::kDefaultInterval;
+  io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = reinterpret_cast<uint64_t>(&probe_interval_);
+  sqe->len = 1;
+  sqe->user_data = kProbe;
+}
+
+void UringServer::OnProbe() {
+  probe_lag_ = std::max(absl::ZeroDuration(), absl::Now() - probe_expiry_);
+  EventLoopMonitor::RecordLag(probe_lag_);
+  ArmProbe();
+}
+
+absl::Duration UringServer::loop_lag() const {
+  return std::max(probe_lag_, absl::Now() - probe_expiry_);
+}
+
+void UringServer::ArmRecv(Connection* connection) {
+  absl::Duration timeout = connection->read_deadline - absl::Now();
+  if (timeout <= absl::ZeroDuration()) return Close(connection);
+  // The recv and its timeout are linked, so they must be submitted
+  // together.
+  ReserveSqes(2);
+  io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = connection->fd;
+  sqe->flags = IOSQE_BUFFER_SELECT | IOSQE_IO_LINK;
+  sqe->buf_group = kBufferGroup;
+  sqe->user_data = reinterpret_cast<uint64_t>(connection) | kRecv;
+  connection->timeout = ToKernelTimespec(timeout);
+  sqe = GetSqe();
+  sqe->opcode = IORING_OP_LINK_TIMEOUT;
+  sqe->addr = reinterpret_cast<uint64_t>(&connection->timeout);
+  sqe->len = 1;
+  sqe->user_data = kTimeout;
+}
+
+void UringServer::ReturnBuffer(uint16_t id) {
+  // The ring tail overlays the reserved field of the first entry, so
+  // entries are filled field by field. They are indexed from the start
+  // of the ring rather than through bufs, which C++ lays out 8 bytes
+  // further in than the kernel does.
+  io_uring_buf& buf = reinterpret_cast<io_uring_buf*>(
+      buf_ring_)[buf_tail_ & (kNumBuffers - 1)];
+  buf.addr = reinterpret_cast<uint64_t>(&buffers_[id * kBufferSize]);
+  buf.len = kBufferSize;
+  buf.bid = id;
+  ++buf_tail_;
+  reinterpret_cast<std::atomic<uint16_t>*>(&buf_ring_->tail)
+      ->store(buf_tail_, std::memory_order_release);
+}
+
+void UringServer::OnAccept(const io_uring_cqe& cqe) {
+  if (cqe.res < 0) {
+    // Accepting again right away would spin, e.g. while the process is
+    // out of file descriptors, so retry after a delay as Listener does.
+    LOG_EVERY_N(ERROR, 1000)
+        << "Failed to accept connection: " << strerror(-cqe.res);
+    if (!(cqe.flags & IORING_CQE_F_MORE)) ArmAcceptRetry();
+    return;
+  }
+  // The multishot accept stays armed for as long as the kernel sets
+  // IORING_CQE_F_MORE.
+  if (!(cqe.flags & IORING_CQE_F_MORE)) ArmAccept();
+  RecordHttpConnection();
+  auto owned = std::make_unique<Connection>(cqe.res);
+  Connection* connection = owned.get();
+  connections_.emplace(connection, std::move(owned));
+  connection->admitted = admission_->AdmitConnection();
+  StartRequest(connection,
+               connection->admitted
+                   ? absl::Seconds(absl::GetFlag(FLAGS_read_timeout_sec))
+                   : kShedReadTimeout);
+}
+
+void UringServer::OnRecv(Connection* connection, const io_uring_cqe& cqe) {
+  if (cqe.res == -ENOBUFS) {
+    // Every provided buffer was taken by reads completing at once.
+    return ArmRecv(connection);
+  }
+  if (cqe.res <= 0) {
+    // End of stream, an error, or -ECANCELED once the read timed out.
+    return Close(connection);
+  }
+  uint16_t id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+  connection->input.append(&buffers_[id * kBufferSize], cqe.res);
+  ReturnBuffer(id);
+  Process(connection);
+}
+
+void UringServer::Process(Connection* connection) {
+  boost::beast::error_code error_code;
+  while (!connection->input.empty() && !connection->parser->is_done()) {
+    size_t used = connection->parser->put(
+        boost::asio::buffer(connection->input), error_code);
+    connection->input.erase(0, used);
+    if (error_code == http::error::need_more) {
+      error_code = {};
+      break;
+    }
+    if (error_code) break;
+  }
+  if (!error_code && !connection->parser->is_done()) {
+    return ArmRecv(connection);
+  }
+
+  connection->trace.Start(connection->accepted, absl::Now());
+  auto& request = connection->parser->get();
+  auto& response = connection->response;
+  if (error_code) {
+    ErrorResponse(request, http::status::bad_request, &response);
+    response.keep_alive(false);
+  } else if (!connection->admitted) {
+    ServiceUnavailableResponse(request, admission_->retry_after_seconds(),
+                               &response);
+    response.keep_alive(false);
+  } else if (!admission_->AdmitRequest(loop_lag())) {
+    ServiceUnavailableResponse(request, admission_->retry_after_seconds(),
+                               &response);
+  } else {
+    connection->request_admitted = true;
+    ++connection->requests_served;
+    RequestTrace::Scope trace_scope(&connection->trace);
+    if (!HandleRequest(request, *creative_map_, cache_.get(), router_.get(),
+                       &response)) {
+      auto done = [routed = routed_, connection](
+                      absl::StatusOr<Response> result) {
+        routed->Post(connection, std::move(result));
+      };
+      // OnRouted() sends the response once the shards reply. Nothing is
+      // in flight for the connection meanwhile, so it stays open.
+      if (StartRoutedRequest(request, *router_, std::move(done),
+                             &response)) {
+        return;
+      }
+    }
+  }
+  Respond(connection);
+}
+
+void UringServer::Respond(Connection* connection) {
+  auto& response = connection->response;
+  if (connection->request_admitted) {
+    int max_requests = absl::GetFlag(FLAGS_max_requests_per_connection);
+    if (max_requests > 0 && connection->requests_served >= max_requests) {
+      response.keep_alive(false);
+    }
+  }
+  RecordHttpResponse(response.result_int());
+  connection->trace.Mark(RequestStage::kEncoded);
+  connection->serializer.emplace(response);
+  Send(connection);
+}
+
+void UringServer::OnRouted() {
+  std::vector<std::pair<Connection*, absl::StatusOr<Response>>> done;
+  {
+    absl::MutexLock lock(&routed_->mutex);
+    done.swap(routed_->done);
+  }
+  for (auto& [connection, result] : done) {
+    {
+      RequestTrace::Scope trace_scope(&connection->trace);
+      FinishRoutedRequest(connection->parser->get(), result,
+                          &connection->response);
+    }
+    Respond(connection);
+  }
+}
+
+void UringServer::Send(Connection* connection) {
+  boost::beast::error_code error_code;
+  int count = 0;
+  size_t bytes = 0;
+  connection->serializer->next(
+      error_code, [&](boost::beast::error_code&, const auto& buffers) {
+        for (auto it = boost::asio::buffer_sequence_begin(buffers);
+             it != boost::asio::buffer_sequence_end(buffers); ++it) {
+          boost::asio::const_buffer buffer = *it;
+          if (buffer.size() == 0) continue;
+          // The rest goes in the next sendmsg, once OnSend() consumed
+          // this one.
+          if (count == kMaxIovecs) break;
+          connection->iovecs[count++] = {const_cast<void*>(buffer.data()),
+                                         buffer.size()};
+          bytes += buffer.size();
+        }
+      });
+  if (error_code) return Close(connection);
+
+  // Every send, the last on a connection included, is bounded by
+  // --write_timeout_sec, so a client that stops reading cannot hold on
+  // to its connection. OnSend() closes the connection once the response
+  // is sent if it is not to be kept alive.
+  connection->sending = bytes;
+  connection->message = {};
+  connection->message.msg_iov = connection->iovecs;
+  connection->message.msg_iovlen = count;
+  ReserveSqes(2);
+  io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = connection->fd;
+  sqe->addr = reinterpret_cast<uint64_t>(&connection->message);
+  sqe->len = 1;
+  // MSG_WAITALL makes a short send fail, which breaks the link.
+  sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->user_data = reinterpret_cast<uint64_t>(connection) | kSend;
+  connection->timeout = ToKernelTimespec(
+      absl::Seconds(absl::GetFlag(FLAGS_write_timeout_sec)));
+  sqe = GetSqe();
+  sqe->opcode = IORING_OP_LINK_TIMEOUT;
+  sqe->addr = reinterpret_cast<uint64_t>(&connection->timeout);
+  sqe->len = 1;
+  sqe->user_data = kTimeout;
+}
+
+void UringServer::OnSend(Connection* connection, const io_uring_cqe& cqe) {
+  const bool complete =
+      cqe.res >= 0 && static_cast<size_t>(cqe.res) == connection->sending;
+  // A send that timed out completes with -ECANCELED.
+  if (!complete) return Close(connection);
+  connection->sent += cqe.res;
+  connection->serializer->consume(cqe.res);
+  if (!connection->serializer->is_done()) return Send(connection);
+  connection->trace.Finish(connection->response.result_int(),
+                           connection->sent, absl::Now());
+  if (connection->request_admitted) {
+    admission_->ReleaseRequest();
+    connection->request_admitted = false;
+  }
+  if (connection->response.need_eof()) return Close(connection);
+  StartRequest(connection,
+               absl::Seconds(absl::GetFlag(FLAGS_idle_timeout_sec)));
+}
+
+void UringServer::StartRequest(Connection* connection,
+                               absl::Duration read_timeout) {
+  // Release everything allocated from the arena before rewinding it.
+  // Clearing the body also unpins the snapshot it pointed into.
+  connection->serializer.reset();
+  connection->sent = 0;
+  connection->parser.reset();
+  connection->response.clear();
+  connection->response.body().Clear();
+  connection->arena.Reset();
+  connection->parser.emplace(
+      std::piecewise_construct, std::make_tuple(),
+      std::make_tuple(ArenaAllocator<char>(&connection->arena)));
+  connection->parser->eager(true);
+  connection->read_deadline = absl::Now() + read_timeout;
+  // Pipelined requests may already be buffered.
+  Process(connection);
+}
+
+void UringServer::Close(Connection* connection) {
+  if (connection->closing) return;
+  connection->closing = true;
+  io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = connection->fd;
+  sqe->user_data = reinterpret_cast<uint64_t>(connection) | kClose;
+}
+
+}  // namespace trusted_server
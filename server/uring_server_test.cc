@@ -0,0 +1,313 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server/uring_server.h"
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/flags/declare.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/reflection.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "boost/asio/connect.hpp"
+#include "boost/asio/io_context.hpp"
+#include "boost/asio/ip/tcp.hpp"
+#include "boost/asio/read.hpp"
+#include "boost/asio/write.hpp"
+#include "boost/beast/core.hpp"
+#include "boost/beast/http.hpp"
+#include "data/mock_creative_map.h"
+#include "data/synthetic_dataset.h"
+#include "grpcpp/grpcpp.h"
+#include "gtest/gtest.h"
+#include "server/admission_control.h"
+#include "server/key_value_service.h"
+#include "server/shard_router.h"
+
+ABSL_DECLARE_FLAG(int, write_timeout_sec);
+
+namespace trusted_server {
+
+namespace {
+
+namespace http = ::boost::beast::http;
+using ::boost::asio::ip::tcp;
+
+size_t Count(absl::string_view text, absl::string_view needle) {
+  size_t count = 0;
+  for (size_t pos = text.find(needle); pos != absl::string_view::npos;
+       pos = text.find(needle, pos + needle.size())) {
+    ++count;
+  }
+  return count;
+}
+
+class UringServerTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    AdmissionController::Options options;
+    options.max_connections = 2;
+    auto server = UringServer::Create(
+        tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), 0),
+        MockCreativeMap::CreateMockMap(), /*cache=*/nullptr,
+        /*router=*/nullptr, std::make_shared<AdmissionController>(options));
+    if (!server.ok()) {
+      GTEST_SKIP() << "io_uring unavailable: " << server.status();
+    }
+    server_ = *std::move(server);
+    runner_ = std::thread([this] { server_->Run(); });
+  }
+
+  void TearDown() override {
+    if (server_ == nullptr) return;
+    server_->Stop();
+    runner_.join();
+  }
+
+  tcp::socket Connect() {
+    tcp::socket socket(ioc_);
+    socket.connect(tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"),
+                                 server_->port()));
+    return socket;
+  }
+
+  static http::response<http::string_body> Get(tcp::socket& socket,
+                                               const std::string& target,
+                                               bool keep_alive = true) {
+    http::request<http::empty_body> request(http::verb::get, target, 11);
+    request.set(http::field::host, "localhost");
+    request.keep_alive(keep_alive);
+    http::write(socket, request);
+    boost::beast::flat_buffer buffer;
+    http::response<http::string_body> response;
+    http::read(socket, buffer, response);
+    return response;
+  }
+
+  boost::asio::io_context ioc_;
+  std::unique_ptr<UringServer> server_;
+  std::thread runner_;
+};
+
+TEST_F(UringServerTest, ServesKeepAliveConnection) {
+  tcp::socket socket = Connect();
+  for (int i = 0; i < 3; ++i) {
+    auto response = Get(socket, "/?keys=google.com/ad1");
+    EXPECT_EQ(response.result(), http::status::ok);
+    EXPECT_TRUE(absl::StrContains(response.body(), "google.com/ad1"));
+    EXPECT_TRUE(response.keep_alive());
+  }
+  EXPECT_EQ(Get(socket, "/").result(), http::status::bad_request);
+
+  // The last response is followed by the server closing the connection.
+  auto response = Get(socket, "/?keys=google.com/ad2", /*keep_alive=*/false);
+  EXPECT_EQ(response.result(), http::status::ok);
+  EXPECT_FALSE(response.keep_alive());
+  char byte;
+  boost::system::error_code error_code;
+  boost::asio::read(socket, boost::asio::buffer(&byte, 1), error_code);
+  EXPECT_EQ(error_code, boost::asio::error::eof);
+}
+
+TEST_F(UringServerTest, SendsResponsesLargerThanOneSendmsg) {
+  std::vector<std::string> keys(400, "google.com/ad1");
+  tcp::socket socket = Connect();
+  auto response =
+      Get(socket, absl::StrCat("/?keys=", absl::StrJoin(keys, ",")),
+          /*keep_alive=*/false);
+  EXPECT_EQ(response.result(), http::status::ok);
+  EXPECT_EQ(Count(response.body(), "google.com/ad1"), keys.size());
+}
+
+TEST_F(UringServerTest, AnswersPipelinedRequestsInOrder) {
+  tcp::socket socket = Connect();
+  boost::asio::write(
+      socket, boost::asio::buffer(std::string(
+                  "GET /?keys=google.com/ad1 HTTP/1.1\r\nHost: a\r\n\r\n"
+                  "GET /?keys=google.com/ad2 HTTP/1.1\r\nHost: a\r\n\r\n")));
+  boost::beast::flat_buffer buffer;
+  http::response<http::string_body> first, second;
+  http::read(socket, buffer, first);
+  http::read(socket, buffer, second);
+  EXPECT_TRUE(absl::StrContains(first.body(), "google.com/ad1"));
+  EXPECT_TRUE(absl::StrContains(second.body(), "google.com/ad2"));
+}
+
+TEST_F(UringServerTest, ShedsConnectionsOverLimit) {
+  tcp::socket first = Connect();
+  tcp::socket second = Connect();
+  EXPECT_EQ(Get(first, "/?keys=google.com/ad1").result(), http::status::ok);
+  EXPECT_EQ(Get(second, "/?keys=google.com/ad1").result(), http::status::ok);
+  tcp::socket third = Connect();
+  auto response = Get(third, "/?keys=google.com/ad1");
+  EXPECT_EQ(response.result(), http::status::service_unavailable);
+  EXPECT_EQ(response[http::field::retry_after], "1");
+  EXPECT_FALSE(response.keep_alive());
+}
+
+TEST_F(UringServerTest, RejectsMalformedRequests) {
+  tcp::socket socket = Connect();
+  boost::asio::write(socket,
+                     boost::asio::buffer(std::string("NOT HTTP\r\n\r\n")));
+  boost::beast::flat_buffer buffer;
+  http::response<http::string_body> response;
+  http::read(socket, buffer, response);
+  EXPECT_EQ(response.result(), http::status::bad_request);
+  EXPECT_FALSE(response.keep_alive());
+}
+
+TEST(UringServerTimeoutTest, BoundsLastSendByWriteTimeout) {
+  absl::FlagSaver flag_saver;
+  absl::SetFlag(&FLAGS_write_timeout_sec, 1);
+  SyntheticDataset::Options dataset_options;
+  dataset_options.num_keys = 1;
+  dataset_options.value_bytes = {SizeDistribution::Kind::kFixed, 1 << 20};
+  SyntheticDataset dataset(dataset_options);
+  AdmissionController::Options options;
+  options.max_connections = 1;
+  auto admission = std::make_shared<AdmissionController>(options);
+  auto server = UringServer::Create(
+      tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), 0),
+      MockCreativeMap::CreateSyntheticMap(dataset_options),
+      /*cache=*/nullptr, /*router=*/nullptr, admission);
+  if (!server.ok()) {
+    GTEST_SKIP() << "io_uring unavailable: " << server.status();
+  }
+  std::thread runner([&] { (*server)->Run(); });
+
+  // A client asking for a response far larger than the socket buffers,
+  // as the last on its connection, and never reading it.
+  boost::asio::io_context ioc;
+  tcp::socket socket(ioc);
+  socket.open(tcp::v4());
+  socket.set_option(boost::asio::socket_base::receive_buffer_size(1024));
+  socket.connect(tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"),
+                               (*server)->port()));
+  std::vector<std::string> keys(16, dataset.Key(0));
+  boost::asio::write(
+      socket, boost::asio::buffer(absl::StrCat(
+                  "GET /?keys=", absl::StrJoin(keys, ","),
+                  " HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n")));
+
+  // Wait for the response to start, so the connection has been admitted.
+  char status[12];
+  boost::asio::read(socket, boost::asio::buffer(status));
+  EXPECT_EQ(std::string(status, sizeof(status)), "HTTP/1.1 200");
+  // The send times out and the connection releases its admission slot.
+  const absl::Time deadline = absl::Now() + absl::Seconds(10);
+  while (admission->open_connections() > 0 && absl::Now() < deadline) {
+    absl::SleepFor(absl::Milliseconds(10));
+  }
+  EXPECT_EQ(admission->open_connections(), 0);
+  (*server)->Stop();
+  runner.join();
+}
+
+TEST(UringServerAdmissionTest, ShedsRequestsWhileLoopLags) {
+  SyntheticDataset::Options dataset_options;
+  dataset_options.num_keys = 1;
+  dataset_options.value_bytes = {SizeDistribution::Kind::kFixed, 1 << 20};
+  SyntheticDataset dataset(dataset_options);
+  AdmissionController::Options options;
+  options.max_queue_delay = absl::Milliseconds(20);
+  auto server = UringServer::Create(
+      tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), 0),
+      MockCreativeMap::CreateSyntheticMap(dataset_options),
+      /*cache=*/nullptr, /*router=*/nullptr,
+      std::make_shared<AdmissionController>(options));
+  if (!server.ok()) {
+    GTEST_SKIP() << "io_uring unavailable: " << server.status();
+  }
+  std::thread runner([&] { (*server)->Run(); });
+
+  // Compressing the first response stalls the loop well past the limit,
+  // so the request pipelined behind it finds the loop lagging.
+  boost::asio::io_context ioc;
+  tcp::socket socket(ioc);
+  socket.connect(tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"),
+                               (*server)->port()));
+  std::vector<std::string> keys(4, dataset.Key(0));
+  boost::asio::write(
+      socket,
+      boost::asio::buffer(absl::StrCat(
+          "GET /?keys=", absl::StrJoin(keys, ","),
+          " HTTP/1.1\r\nHost: a\r\nAccept-Encoding: gzip\r\n\r\n",
+          "GET /?keys=", dataset.Key(0), " HTTP/1.1\r\nHost: a\r\n\r\n")));
+  boost::beast::flat_buffer buffer;
+  http::response_parser<http::string_body> first;
+  first.body_limit(boost::none);
+  http::response<http::string_body> second;
+  http::read(socket, buffer, first);
+  http::read(socket, buffer, second);
+  EXPECT_EQ(first.get().result(), http::status::ok);
+  EXPECT_EQ(second.result(), http::status::service_unavailable);
+  (*server)->Stop();
+  runner.join();
+}
+
+TEST(UringServerRoutingTest, AnswersRoutedLookupsInOrder) {
+  // A single shard holding all of the mock creatives, served in process.
+  KeyValueServiceImpl service(MockCreativeMap::CreateMockMap());
+  grpc::ServerBuilder builder;
+  builder.RegisterService(&service);
+  std::unique_ptr<grpc::Server> shard = builder.BuildAndStart();
+  auto router = std::make_shared<const ShardRouter>(
+      std::vector<std::vector<std::shared_ptr<grpc::Channel>>>{
+          {shard->InProcessChannel(grpc::ChannelArguments())}},
+      absl::Seconds(10));
+  auto server = UringServer::Create(
+      tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), 0),
+      MockCreativeMap::CreateMockMap(), /*cache=*/nullptr, router,
+      std::make_shared<AdmissionController>(AdmissionController::Options()));
+  if (!server.ok()) {
+    GTEST_SKIP() << "io_uring unavailable: " << server.status();
+  }
+  std::thread runner([&] { (*server)->Run(); });
+
+  // Requests pipelined behind a routed lookup wait for its response.
+  boost::asio::io_context ioc;
+  tcp::socket socket(ioc);
+  socket.connect(tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"),
+                               (*server)->port()));
+  boost::asio::write(
+      socket, boost::asio::buffer(std::string(
+                  "GET /?keys=google.com/ad1 HTTP/1.1\r\nHost: a\r\n\r\n"
+                  "GET / HTTP/1.1\r\nHost: a\r\n\r\n"
+                  "GET /?keys=google.com/ad2 HTTP/1.1\r\nHost: a\r\n\r\n")));
+  boost::beast::flat_buffer buffer;
+  http::response<http::string_body> first, second, third;
+  http::read(socket, buffer, first);
+  http::read(socket, buffer, second);
+  http::read(socket, buffer, third);
+  EXPECT_EQ(first.result(), http::status::ok);
+  EXPECT_TRUE(absl::StrContains(first.body(), "google.com/ad1"));
+  EXPECT_EQ(second.result(), http::status::bad_request);
+  EXPECT_EQ(third.result(), http::status::ok);
+  EXPECT_TRUE(absl::StrContains(third.body(), "google.com/ad2"));
+  (*server)->Stop();
+  runner.join();
+  shard->Shutdown();
+}
+
+}  // namespace
+
+}  // namespace trusted_server
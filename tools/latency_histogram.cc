@@ -0,0 +1,86 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tools/latency_histogram.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "absl/numeric/bits.h"
+
+namespace trusted_server {
+
+LatencyHistogram::LatencyHistogram(int64_t max_value, int significant_digits)
+    : max_value_(std::max<int64_t>(max_value, 1)) {
+  // Two buckets' worth of exact values must reach 2 * 10^digits, so
+  // that every bucket width is at most 10^-digits of its values.
+  int64_t exact = 2 * static_cast<int64_t>(std::pow(10, significant_digits));
+  sub_bucket_bits_ = 64 - absl::countl_zero(static_cast<uint64_t>(exact - 1));
+  counts_.resize(IndexFor(max_value_) + 1);
+}
+
+size_t LatencyHistogram::IndexFor(int64_t value) const {
+  uint64_t v = static_cast<uint64_t>(value);
+  int half_bits = sub_bucket_bits_ - 1;
+  if (v < (uint64_t{1} << sub_bucket_bits_)) return v;
+  int shift = (63 - absl::countl_zero(v)) - half_bits;
+  return (static_cast<size_t>(shift) << half_bits) + (v >> shift);
+}
+
+int64_t LatencyHistogram::HighestValueAt(size_t index) const {
+  int half_bits = sub_bucket_bits_ - 1;
+  if (index < (size_t{1} << sub_bucket_bits_)) return index;
+  int shift = static_cast<int>(index >> half_bits) - 1;
+  int64_t sub_bucket = index - (static_cast<size_t>(shift) << half_bits);
+  return ((sub_bucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Record(int64_t value) {
+  value = std::min(std::max<int64_t>(value, 0), max_value_);
+  ++counts_[IndexFor(value)];
+  ++count_;
+  min_ = std::min(min_, value);
+  max_ = std::max(max_, value);
+  sum_ += value;
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other) {
+  for (size_t i = 0; i < counts_.size() && i < other.counts_.size(); ++i) {
+    counts_[i] += other.counts_[i];
+  }
+  count_ += other.count_;
+  min_ = std::min(min_, other.min_);
+  max_ = std::max(max_, other.max_);
+  sum_ += other.sum_;
+}
+
+int64_t LatencyHistogram::ValueAtPercentile(double percentile) const {
+  if (count_ == 0) return 0;
+  percentile = std::min(std::max(percentile, 0.0), 100.0);
+  int64_t target = std::max<int64_t>(
+      1, static_cast<int64_t>(std::ceil(percentile / 100 * count_)));
+  int64_t seen = 0;
+  for (size_t i = 0; i < counts_.size(); ++i) {
+    seen += counts_[i];
+    if (seen >= target) return std::min(HighestValueAt(i), max_);
+  }
+  return max_;
+}
+
+double LatencyHistogram::mean() const {
+  return count_ == 0 ? 0 : sum_ / count_;
+}
+
+}  // namespace trusted_server
@@ -0,0 +1,68 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef LATENCY_HISTOGRAM_H_
+#define LATENCY_HISTOGRAM_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace trusted_server {
+
+// LatencyHistogram records non-negative values with a fixed relative
+// precision, in the manner of HdrHistogram: values are exact below
+// 2 * 10^significant_digits and otherwise fall into buckets no wider
+// than 10^-significant_digits of their value. Recording is a few
+// arithmetic operations and never allocates.
+class LatencyHistogram {
+ public:
+  // Values above `max_value` are recorded as `max_value`.
+  explicit LatencyHistogram(int64_t max_value, int significant_digits = 3);
+
+  void Record(int64_t value);
+
+  // Adds the values recorded by `other`, which must have been created
+  // with the same parameters.
+  void Merge(const LatencyHistogram& other);
+
+  // Returns the smallest value that `percentile` percent of the
+  // recorded values are less than or equal to, up to the precision of
+  // the histogram. Returns 0 if nothing was recorded.
+  int64_t ValueAtPercentile(double percentile) const;
+
+  int64_t count() const { return count_; }
+  int64_t min() const { return count_ == 0 ? 0 : min_; }
+  int64_t max() const { return max_; }
+  double mean() const;
+
+ private:
+  size_t IndexFor(int64_t value) const;
+
+  // Returns the largest value recorded into bucket `index`.
+  int64_t HighestValueAt(size_t index) const;
+
+  int64_t max_value_;
+  // Buckets hold 2^sub_bucket_bits_ / 2 values each, from
+  // 2^(sub_bucket_bits_ - 1) on.
+  int sub_bucket_bits_;
+  std::vector<int64_t> counts_;
+  int64_t count_ = 0;
+  int64_t min_ = INT64_MAX;
+  int64_t max_ = 0;
+  double sum_ = 0;
+};
+
+}  // namespace trusted_server
+#endif  // LATENCY_HISTOGRAM_H_
@@ -0,0 +1,75 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tools/latency_histogram.h"
+
+#include <cstdint>
+
+#include "gtest/gtest.h"
+
+namespace trusted_server {
+
+namespace {
+
+TEST(LatencyHistogramTest, Empty) {
+  LatencyHistogram histogram(1000000);
+  EXPECT_EQ(histogram.count(), 0);
+  EXPECT_EQ(histogram.ValueAtPercentile(50), 0);
+  EXPECT_EQ(histogram.min(), 0);
+  EXPECT_EQ(histogram.max(), 0);
+}
+
+TEST(LatencyHistogramTest, SmallValuesAreExact) {
+  LatencyHistogram histogram(1000000);
+  for (int64_t value = 1; value <= 100; ++value) histogram.Record(value);
+  EXPECT_EQ(histogram.count(), 100);
+  EXPECT_EQ(histogram.ValueAtPercentile(0), 1);
+  EXPECT_EQ(histogram.ValueAtPercentile(50), 50);
+  EXPECT_EQ(histogram.ValueAtPercentile(99), 99);
+  EXPECT_EQ(histogram.ValueAtPercentile(100), 100);
+  EXPECT_EQ(histogram.min(), 1);
+  EXPECT_EQ(histogram.max(), 100);
+  EXPECT_DOUBLE_EQ(histogram.mean(), 50.5);
+}
+
+TEST(LatencyHistogramTest, LargeValuesKeepRelativePrecision) {
+  LatencyHistogram histogram(int64_t{1} << 40);
+  for (int64_t value : {int64_t{12345}, int64_t{1234567}, int64_t{123456789},
+                        int64_t{12345678901}}) {
+    LatencyHistogram single(int64_t{1} << 40);
+    single.Record(value);
+    single.Record(value + value / 2);
+    int64_t reported = single.ValueAtPercentile(50);
+    EXPECT_GE(reported, value);
+    EXPECT_LE(reported - value, value / 1000) << value;
+    histogram.Merge(single);
+  }
+  EXPECT_EQ(histogram.count(), 8);
+  EXPECT_EQ(histogram.min(), 12345);
+  EXPECT_EQ(histogram.max(), 12345678901 + 12345678901 / 2);
+  EXPECT_EQ(histogram.ValueAtPercentile(100), histogram.max());
+}
+
+TEST(LatencyHistogramTest, ClampsToRange) {
+  LatencyHistogram histogram(1000);
+  histogram.Record(-5);
+  histogram.Record(5000);
+  EXPECT_EQ(histogram.min(), 0);
+  EXPECT_EQ(histogram.max(), 1000);
+  EXPECT_EQ(histogram.ValueAtPercentile(100), 1000);
+}
+
+}  // namespace
+
+}  // namespace trusted_server
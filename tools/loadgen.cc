@@ -0,0 +1,459 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Load generator for the key/value server. Each connection sends one
+// request at a time. Without --qps the load is closed-loop: a
+// connection sends its next request as soon as the previous response
+// arrives. With --qps it is open-loop: requests are due on a fixed
+// schedule and their latency is measured from the time they were due,
+// not from the time they could be sent, so a stalled server is charged
+// for the requests it held up (no coordinated omission).
+//
+// Run against a local server started with --mock_spanner:
+//   bazel run //tools:loadgen -- --port=8080 --qps=5000 --connections=32
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/random/random.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_join.h"
+#include "absl/strings/str_split.h"
+#include "boost/asio/io_context.hpp"
+#include "boost/asio/ip/tcp.hpp"
+#include "boost/asio/steady_timer.hpp"
+#include "boost/asio/strand.hpp"
+#include "boost/beast/core.hpp"
+#include "boost/beast/http.hpp"
+#include "boost/beast/version.hpp"
+#include "google/protobuf/struct.pb.h"
+#include "google/protobuf/util/json_util.h"
+#include "tools/latency_histogram.h"
+
+ABSL_FLAG(std::string, address, "127.0.0.1", "Server address to connect to.");
+
+ABSL_FLAG(std::uint16_t, port, 8080, "Server port to connect to.");
+
+ABSL_FLAG(int, connections, 16, "Number of concurrent connections.");
+
+ABSL_FLAG(int, threads, 0,
+          "Number of threads driving the connections. Defaults to the "
+          "number of hardware threads when zero.");
+
+ABSL_FLAG(double, qps, 0,
+          "Target requests per second across all connections. Zero "
+          "drives the server closed-loop, as fast as it responds.");
+
+ABSL_FLAG(int, duration_sec, 30, "Seconds to send requests for.");
+
+ABSL_FLAG(int, warmup_sec, 5,
+          "Seconds at the start of the run excluded from the results.");
+
+ABSL_FLAG(int, keys_per_request, 1, "Number of keys looked up per request.");
+
+ABSL_FLAG(std::string, keys, "google.com/ad1,google.com/ad2",
+          "Comma-separated keys of the dataset. Defaults to the keys "
+          "served with --mock_spanner.");
+
+ABSL_FLAG(std::string, keys_file, "",
+          "File with one key of the dataset per line. Overrides --keys.");
+
+ABSL_FLAG(std::string, key_distribution, "uniform",
+          "Distribution keys are drawn from: uniform or zipf.");
+
+ABSL_FLAG(double, zipf_exponent, 1.1,
+          "Exponent of the Zipfian key distribution; must be above 1. "
+          "Keys earlier in the dataset are more popular.");
+
+ABSL_FLAG(std::string, key_param, "keys",
+          "Parameter name the server expects the keys in.");
+
+ABSL_FLAG(std::string, replay_file, "",
+          "JSONL file of requests to replay in order instead of drawing "
+          "keys. Each line is an object with either a \"target\" string "
+          "or a \"keys\" array of strings.");
+
+namespace trusted_server {
+
+namespace {
+
+namespace asio = ::boost::asio;
+namespace beast = ::boost::beast;
+namespace http = ::boost::beast::http;
+using ::boost::asio::ip::tcp;
+using Clock = std::chrono::steady_clock;
+
+// Latencies are recorded in microseconds, up to a minute.
+constexpr int64_t kMaxLatencyMicros = 60 * 1000 * 1000;
+
+absl::StatusOr<std::vector<std::string>> ReadLines(const std::string& path) {
+  std::ifstream file(path);
+  if (!file) {
+    return absl::Status(absl::StatusCode::kNotFound,
+                        absl::StrCat("Cannot open ", path));
+  }
+  std::vector<std::string> lines;
+  for (std::string line; std::getline(file, line);) {
+    if (!line.empty()) lines.push_back(std::move(line));
+  }
+  return lines;
+}
+
+// Produces the request targets. Either replays a fixed list of targets
+// or draws keys from the dataset.
+class TargetSource {
+ public:
+  static absl::StatusOr<std::unique_ptr<TargetSource>> Create();
+
+  // Returns the next target. Thread-safe; `bit_gen` is the caller's.
+  std::string Next(absl::BitGen& bit_gen);
+
+ private:
+  TargetSource() = default;
+
+  absl::Status LoadReplay(const std::string& path);
+
+  std::string key_param_;
+  int keys_per_request_;
+  bool zipf_;
+  double zipf_exponent_;
+  std::vector<std::string> keys_;
+  std::vector<std::string> replay_;
+  std::atomic<size_t> next_replay_{0};
+};
+
+absl::StatusOr<std::unique_ptr<TargetSource>> TargetSource::Create() {
+  std::unique_ptr<TargetSource> source(new TargetSource());
+  source->key_param_ = absl::GetFlag(FLAGS_key_param);
+  source->keys_per_request_ =
+      std::max(absl::GetFlag(FLAGS_keys_per_request), 1);
+  source->zipf_exponent_ = absl::GetFlag(FLAGS_zipf_exponent);
+
+  const std::string distribution = absl::GetFlag(FLAGS_key_distribution);
+  if (distribution != "uniform" && distribution != "zipf") {
+    return absl::Status(absl::StatusCode::kInvalidArgument,
+                        absl::StrCat("Unknown distribution ", distribution));
+  }
+  source->zipf_ = distribution == "zipf";
+  if (source->zipf_ && !(source->zipf_exponent_ > 1)) {
+    return absl::Status(absl::StatusCode::kInvalidArgument,
+                        "--zipf_exponent must be above 1.");
+  }
+
+  if (!absl::GetFlag(FLAGS_replay_file).empty()) {
+    absl::Status status = source->LoadReplay(absl::GetFlag(FLAGS_replay_file));
+    if (!status.ok()) return status;
+    return source;
+  }
+  if (!absl::GetFlag(FLAGS_keys_file).empty()) {
+    auto keys = ReadLines(absl::GetFlag(FLAGS_keys_file));
+    if (!keys.ok()) return keys.status();
+    source->keys_ = *std::move(keys);
+  } else {
+    source->keys_ = absl::StrSplit(absl::GetFlag(FLAGS_keys), ',',
+                                   absl::SkipEmpty());
+  }
+  if (source->keys_.empty()) {
+    return absl::Status(absl::StatusCode::kInvalidArgument, "No keys.");
+  }
+  return source;
+}
+
+absl::Status TargetSource::LoadReplay(const std::string& path) {
+  auto lines = ReadLines(path);
+  if (!lines.ok()) return lines.status();
+  for (size_t i = 0; i < lines->size(); ++i) {
+    google::protobuf::Struct request;
+    if (!google::protobuf::util::JsonStringToMessage((*lines)[i], &request)
+             .ok()) {
+      return absl::Status(absl::StatusCode::kInvalidArgument,
+                          absl::StrCat(path, ":", i + 1, ": invalid JSON"));
+    }
+    const auto& fields = request.fields();
+    if (auto it = fields.find("target");
+        it != fields.end() && it->second.has_string_value()) {
+      replay_.push_back(it->second.string_value());
+    } else if (auto it = fields.find("keys");
+               it != fields.end() && it->second.has_list_value()) {
+      std::vector<std::string> keys;
+      for (const auto& key : it->second.list_value().values()) {
+        keys.push_back(key.string_value());
+      }
+      replay_.push_back(
+          absl::StrCat("/?", key_param_, "=", absl::StrJoin(keys, ",")));
+    } else {
+      return absl::Status(
+          absl::StatusCode::kInvalidArgument,
+          absl::StrCat(path, ":", i + 1, ": no \"target\" or \"keys\""));
+    }
+  }
+  if (replay_.empty()) {
+    return absl::Status(absl::StatusCode::kInvalidArgument,
+                        absl::StrCat(path, " has no requests."));
+  }
+  return absl::OkStatus();
+}
+
+std::string TargetSource::Next(absl::BitGen& bit_gen) {
+  if (!replay_.empty()) return replay_[next_replay_++ % replay_.size()];
+  std::string target = absl::StrCat("/?", key_param_, "=");
+  for (int i = 0; i < keys_per_request_; ++i) {
+    size_t index =
+        zipf_ ? absl::Zipf<size_t>(bit_gen, keys_.size() - 1, zipf_exponent_)
+              : absl::Uniform<size_t>(bit_gen, 0, keys_.size());
+    if (i > 0) target.push_back(',');
+    target.append(keys_[index]);
+  }
+  return target;
+}
+
+// Results of one connection, merged once the run is over.
+struct Results {
+  Results() : latency_micros(kMaxLatencyMicros) {}
+
+  LatencyHistogram latency_micros;
+  int64_t ok = 0;
+  int64_t non_ok = 0;
+  int64_t errors = 0;
+  int64_t connects = 0;
+};
+
+struct RunConfig {
+  tcp::endpoint endpoint;
+  Clock::time_point start;
+  Clock::time_point measure_from;
+  Clock::time_point end;
+  // Time between the requests of one connection; zero for closed-loop.
+  Clock::duration interval;
+};
+
+// A client connection sending one request at a time. All of its
+// handlers run on its strand.
+class Connection : public std::enable_shared_from_this<Connection> {
+ public:
+  Connection(asio::io_context& ioc, const RunConfig& config,
+             TargetSource* targets, Clock::time_point first_due)
+      : stream_(asio::make_strand(ioc)),
+        timer_(stream_.get_executor()),
+        config_(config),
+        targets_(targets),
+        next_due_(first_due) {}
+
+  void Run() { DoConnect(); }
+
+  const Results& results() const { return results_; }
+
+ private:
+  void DoConnect() {
+    ++results_.connects;
+    stream_.expires_after(std::chrono::seconds(10));
+    stream_.async_connect(
+        config_.endpoint,
+        beast::bind_front_handler(&Connection::OnConnect, shared_from_this()));
+  }
+
+  void OnConnect(beast::error_code error_code) {
+    if (error_code) return OnError(error_code);
+    ScheduleNext();
+  }
+
+  void ScheduleNext() {
+    Clock::time_point now = Clock::now();
+    if (config_.interval == Clock::duration::zero()) {
+      due_ = now;
+    } else {
+      due_ = next_due_;
+      next_due_ += config_.interval;
+    }
+    if (due_ >= config_.end) return DoClose();
+    if (due_ <= now) return DoWrite();
+    timer_.expires_at(due_);
+    timer_.async_wait([self = shared_from_this()](beast::error_code) {
+      self->DoWrite();
+    });
+  }
+
+  void DoWrite() {
+    request_ = {};
+    request_.version(11);
+    request_.method(http::verb::get);
+    request_.target(targets_->Next(bit_gen_));
+    request_.set(http::field::host, config_.endpoint.address().to_string());
+    request_.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+    stream_.expires_after(std::chrono::seconds(30));
+    http::async_write(
+        stream_, request_,
+        beast::bind_front_handler(&Connection::OnWrite, shared_from_this()));
+  }
+
+  void OnWrite(beast::error_code error_code, std::size_t) {
+    if (error_code) return OnError(error_code);
+    response_ = {};
+    http::async_read(
+        stream_, buffer_, response_,
+        beast::bind_front_handler(&Connection::OnRead, shared_from_this()));
+  }
+
+  void OnRead(beast::error_code error_code, std::size_t) {
+    if (error_code) return OnError(error_code);
+    if (due_ >= config_.measure_from) {
+      if (response_.result() == http::status::ok) {
+        ++results_.ok;
+      } else {
+        ++results_.non_ok;
+      }
+      results_.latency_micros.Record(
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              Clock::now() - due_)
+              .count());
+    }
+    if (!response_.keep_alive()) return Reconnect();
+    ScheduleNext();
+  }
+
+  void OnError(beast::error_code error_code) {
+    if (Clock::now() >= config_.end) return DoClose();
+    if (due_ >= config_.measure_from) ++results_.errors;
+    // Back off briefly so a server that is down is not spun on.
+    timer_.expires_after(std::chrono::milliseconds(100));
+    timer_.async_wait(
+        [self = shared_from_this()](beast::error_code) { self->Reconnect(); });
+  }
+
+  void Reconnect() {
+    beast::error_code ignored;
+    stream_.socket().close(ignored);
+    buffer_.clear();
+    DoConnect();
+  }
+
+  void DoClose() {
+    beast::error_code ignored;
+    stream_.socket().shutdown(tcp::socket::shutdown_both, ignored);
+    stream_.socket().close(ignored);
+  }
+
+  beast::tcp_stream stream_;
+  asio::steady_timer timer_;
+  beast::flat_buffer buffer_;
+  http::request<http::empty_body> request_;
+  http::response<http::string_body> response_;
+  const RunConfig& config_;
+  TargetSource* targets_;
+  absl::BitGen bit_gen_;
+  // When the request in flight was due, and when the next one is.
+  Clock::time_point due_;
+  Clock::time_point next_due_;
+  Results results_;
+};
+
+void PrintResults(const Results& results, double seconds, double qps) {
+  const LatencyHistogram& latency = results.latency_micros;
+  int64_t completed = results.ok + results.non_ok;
+  std::cout << absl::StrFormat(
+      "Requests:   %d completed (%d ok, %d non-200), %d errors\n", completed,
+      results.ok, results.non_ok, results.errors);
+  std::cout << absl::StrFormat("Throughput: %.1f requests/s",
+                               completed / seconds);
+  if (qps > 0) std::cout << absl::StrFormat(" (target %.1f)", qps);
+  std::cout << "\nConnects:   " << results.connects << "\n";
+  std::cout << absl::StrFormat("Latency:    mean %.1f us, min %d us\n",
+                               latency.mean(), latency.min());
+  for (double percentile : {50.0, 90.0, 99.0, 99.9, 99.99, 100.0}) {
+    std::cout << absl::StrFormat("  p%-6g %10d us\n", percentile,
+                                 latency.ValueAtPercentile(percentile));
+  }
+}
+
+int Run() {
+  auto targets = TargetSource::Create();
+  if (!targets.ok()) {
+    std::cerr << targets.status() << "\n";
+    return 1;
+  }
+
+  const int num_connections = std::max(absl::GetFlag(FLAGS_connections), 1);
+  int num_threads = absl::GetFlag(FLAGS_threads);
+  if (num_threads <= 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  const double qps = absl::GetFlag(FLAGS_qps);
+
+  asio::io_context ioc{num_threads};
+  RunConfig config;
+  config.endpoint = tcp::endpoint(
+      asio::ip::make_address(absl::GetFlag(FLAGS_address)),
+      absl::GetFlag(FLAGS_port));
+  config.start = Clock::now();
+  config.measure_from =
+      config.start + std::chrono::seconds(absl::GetFlag(FLAGS_warmup_sec));
+  config.end = config.measure_from +
+               std::chrono::seconds(absl::GetFlag(FLAGS_duration_sec));
+  config.interval = Clock::duration::zero();
+  Clock::duration spacing = Clock::duration::zero();
+  if (qps > 0) {
+    // Connections take turns, so together they send at the target rate.
+    spacing = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(1 / qps));
+    config.interval = spacing * num_connections;
+  }
+
+  std::vector<std::shared_ptr<Connection>> connections;
+  for (int i = 0; i < num_connections; ++i) {
+    connections.push_back(std::make_shared<Connection>(
+        ioc, config, targets->get(), config.start + spacing * i));
+    connections.back()->Run();
+  }
+
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_threads; ++i) {
+    threads.emplace_back([&ioc] { ioc.run(); });
+  }
+  ioc.run();
+  for (std::thread& thread : threads) thread.join();
+
+  Results total;
+  for (const auto& connection : connections) {
+    const Results& results = connection->results();
+    total.latency_micros.Merge(results.latency_micros);
+    total.ok += results.ok;
+    total.non_ok += results.non_ok;
+    total.errors += results.errors;
+    total.connects += results.connects;
+  }
+  PrintResults(total, absl::GetFlag(FLAGS_duration_sec), qps);
+  return total.errors > 0 ? 1 : 0;
+}
+
+}  // namespace
+
+}  // namespace trusted_server
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  return trusted_server::Run();
+}